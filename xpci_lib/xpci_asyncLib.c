@@ -17,10 +17,14 @@
 
 #include "xpci_interface.h"
 #include "xpci_interface_expert.h"
+#include "xpci_shm.h"
+#include "xpci_geom.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 
 
 /**\brief  
@@ -316,12 +320,421 @@ int   xpci_getImgSeqAsync(enum IMG_TYPE type, int moduleMask, int nImg, int burs
 
 
 
+/**\brief
+ * Weight table of the geometrical corrections, loaded once and applied in process
+ */
+#define GEOM_CORR_TABLE     "/opt/imXPAD/geom_correction/geom_table.bin"
+#define GEOM_CORR_WIDTH     582     // images corrected by Interpolator.sh
+#define GEOM_CORR_HEIGHT    1157
+static pthread_mutex_t      async_geomLock = PTHREAD_MUTEX_INITIALIZER;
+static XPCI_GEOM           *async_geom = NULL;
+
 void xpci_PreProcessGeometricalCorrections(){
+    if (xpci_loadGeometricalCorrections(GEOM_CORR_TABLE)==0)
+        return;
+    // no weight table: the interpolator scripts of the geom_correction directory
+    printf("WARNING: %s() ---> no table %s, corrections made by Interpolator.sh\n", __func__, GEOM_CORR_TABLE);
     system ("sh /opt/imXPAD/geom_correction/Interpolator_init.sh");
 }
 
+/**
+ * \fn int xpci_loadGeometricalCorrections(const char *path)
+ * \brief Loads the weight table of the geometrical corrections (see xpci_geom.h), replacing the current one
+ * \return [0] success [-1] the table can not be read
+*///==============================================================================
+int xpci_loadGeometricalCorrections(const char *path){
+    XPCI_GEOM *geom = xpci_geomLoad(path);
+
+    if (geom==NULL)
+        return -1;
+    pthread_mutex_lock(&async_geomLock);
+    xpci_geomFree(async_geom);
+    async_geom = geom;
+    pthread_mutex_unlock(&async_geomLock);
+    return 0;
+}
+
+/**
+ * \fn int xpci_getGeometricalCorrectionSize(int *width, int *height)
+ * \brief Size of the corrected images
+ * \return [0] success [-1] no table loaded
+*///==============================================================================
+int xpci_getGeometricalCorrectionSize(int *width, int *height){
+    int ret = -1;
+
+    pthread_mutex_lock(&async_geomLock);
+    if (async_geom!=NULL){
+        *width  = xpci_geomHeader(async_geom)->outWidth;
+        *height = xpci_geomHeader(async_geom)->outHeight;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&async_geomLock);
+    return ret;
+}
+
+int xpci_setGeometricalCorrectionThreads(int nbThreads){
+    return xpci_geomSetThreads(nbThreads);
+}
+
+/* correction with the table loaded, 1 when there is none. With outWidth/outHeight
+   the table must give images of this size (the buffer of the caller) */
+static int xpci_asyncGeomApply(enum IMG_TYPE type, int modMask, const void *pImg, void *pImgCorr, int outFormat,
+                               unsigned outWidth, unsigned outHeight){
+    const XPCI_GEOM_HEADER *hdr;
+    int                     ret;
+
+    pthread_mutex_lock(&async_geomLock);
+    if (async_geom==NULL){
+        pthread_mutex_unlock(&async_geomLock);
+        return 1;
+    }
+    hdr = xpci_geomHeader(async_geom);
+    if (hdr->inWidth!=560 || hdr->inHeight!=120*(unsigned)xpci_getLastMod(modMask)){
+        pthread_mutex_unlock(&async_geomLock);
+        printf("ERROR: %s() ---> table made for %ux%u images, not for the modules 0x%x\n", __func__,
+               hdr->inWidth, hdr->inHeight, modMask);
+        return -1;
+    }
+    if (outWidth && (hdr->outWidth!=outWidth || hdr->outHeight!=outHeight)){
+        pthread_mutex_unlock(&async_geomLock);
+        printf("ERROR: %s() ---> table giving %ux%u images, %ux%u expected\n", __func__,
+               hdr->outWidth, hdr->outHeight, outWidth, outHeight);
+        return -1;
+    }
+    ret = xpci_geomApply(async_geom, pImg, (type==B2) ? XPCI_GEOM_IN_UINT16 : XPCI_GEOM_IN_UINT32,
+                         pImgCorr, outFormat);
+    pthread_mutex_unlock(&async_geomLock);
+    return ret;
+}
+
+/**
+ * \fn int xpci_applyGeometricalCorrections(enum IMG_TYPE type, int modMask, const void *pImg, void *pImgCorr, int outFormat)
+ * \brief Corrects a decoded image with the weight table, by the threads of the correction
+ * \param void * pImgCorr           Corrected image (see xpci_getGeometricalCorrectionSize())
+ * \param int outFormat             IMG_GEOM_UINT16, IMG_GEOM_UINT32 or IMG_GEOM_FLOAT
+ * \return [0] success [-1] no table loaded for this detector
+*///==============================================================================
+int xpci_applyGeometricalCorrections(enum IMG_TYPE type, int modMask, const void *pImg, void *pImgCorr, int outFormat){
+    int ret = xpci_asyncGeomApply(type, modMask, pImg, pImgCorr, outFormat, 0, 0);
+
+    if (ret==1){
+        printf("ERROR: %s() ---> no geometrical correction table loaded\n", __func__);
+        return -1;
+    }
+    return ret;
+}
+
+
+
+
+/**
+ * \brief Reader of the images published in shared memory by xpci_getImgSeq_imxpad()
+ *
+ *   The /images segment is mapped once by xpci_asyncReaderOpen() and opened again
+ * only when a new sequence replaces it. A handle is used by one thread at a time.
+ */
+struct XPCI_ASYNC_READER {
+    XPCI_SHM *shm;
+    // consumer registered with xpci_asyncReaderSubscribe(), -1 none
+    int       consumer;
+    int       policy;
+    uint64_t  token;
+    char      name[32];
+    int64_t   image;     // image returned by xpci_asyncReaderNext(), -1 none
+};
+
+/* attached to the current /images segment, 0 or -1 when there is none */
+static int xpci_asyncReaderAttach(XPCI_ASYNC_READER *rd){
+    if (rd->shm!=NULL && !xpci_shmReplaced(rd->shm))
+        return 0;
+    xpci_shmClose(rd->shm);
+    rd->image = -1;
+    rd->shm = xpci_shmOpen(XPCI_SHM_IMAGES);
+    if (rd->shm==NULL)
+        return -1;
+    // the consumer follows the new sequence (its entry was carried by the writer, demotion included)
+    if (rd->consumer>=0){
+        rd->consumer = xpci_shmReattach(rd->shm, rd->token);
+        if (rd->consumer<0)
+            rd->consumer = xpci_shmSubscribe(rd->shm, rd->name, rd->policy, rd->token);
+    }
+    return 0;
+}
+
+/**
+ * \fn XPCI_ASYNC_READER *xpci_asyncReaderOpen()
+ * \brief Opens a reader of the shared memory images, the segment may be created later
+ * \return the handle, NULL when it can not be allocated
+*///==============================================================================
+XPCI_ASYNC_READER *xpci_asyncReaderOpen(){
+    XPCI_ASYNC_READER *rd = calloc(1, sizeof(*rd));
+
+    if (rd==NULL){
+        printf("ERROR: %s() ---> can not allocate the reader\n", __func__);
+        return NULL;
+    }
+    rd->consumer = -1;
+    rd->image = -1;
+    xpci_asyncReaderAttach(rd);
+    return rd;
+}
+
+/**
+ * \fn int xpci_asyncReaderInfo(XPCI_ASYNC_READER *rd, enum IMG_TYPE *type, int *width, int *height, int *nbSlots)
+ * \brief Geometry of the images of the current sequence
+ * \return [0] success [-1] no sequence in shared memory
+*///==============================================================================
+int xpci_asyncReaderInfo(XPCI_ASYNC_READER *rd, enum IMG_TYPE *type, int *width, int *height, int *nbSlots){
+    const XPCI_SHM_HEADER *hdr;
+
+    if (xpci_asyncReaderAttach(rd))
+        return -1;
+    hdr = xpci_shmHeader(rd->shm);
+    if (type!=NULL)
+        *type = (enum IMG_TYPE)hdr->imgType;
+    if (width!=NULL)
+        *width = hdr->width;
+    if (height!=NULL)
+        *height = hdr->height;
+    if (nbSlots!=NULL)
+        *nbSlots = hdr->nbSlots;
+    return 0;
+}
+
+/**
+ * \fn int xpci_asyncReaderLastImage(XPCI_ASYNC_READER *rd)
+ * \brief Number of images published by the current sequence (no system call)
+ * \return images 0..n-1 are available, [-1] no sequence in shared memory
+*///==============================================================================
+int xpci_asyncReaderLastImage(XPCI_ASYNC_READER *rd){
+    if (xpci_asyncReaderAttach(rd))
+        return -1;
+    return (int)xpci_shmPublished(rd->shm);
+}
+
+/**
+ * \fn int xpci_asyncReaderPeek(XPCI_ASYNC_READER *rd, int imageToGet, const void **pImg)
+ * \brief Read only pointer to an image in shared memory, without copy
+ *
+ *   The pointer stays mapped until the next call on the handle other than
+ * xpci_asyncReaderRelease(). The slot can be reused by the acquisition while the
+ * image is used: xpci_asyncReaderRelease() tells whether it was.
+ * \return XPCI_ASYNC_OK, XPCI_ASYNC_NOT_YET, XPCI_ASYNC_OVERWRITTEN, [-1] no sequence
+*///==============================================================================
+int xpci_asyncReaderPeek(XPCI_ASYNC_READER *rd, int imageToGet, const void **pImg){
+    int status;
+
+    *pImg = NULL;
+    if (imageToGet<0 || xpci_asyncReaderAttach(rd))
+        return -1;
+    *pImg = xpci_shmPeek(rd->shm, imageToGet, &status);
+    return status;
+}
+
+/**
+ * \fn int xpci_asyncReaderRelease(XPCI_ASYNC_READER *rd, int imageToGet)
+ * \brief End of the use of an image returned by xpci_asyncReaderPeek()
+ * \return XPCI_ASYNC_OK the image was intact all along, XPCI_ASYNC_OVERWRITTEN it was not
+*///==============================================================================
+int xpci_asyncReaderRelease(XPCI_ASYNC_READER *rd, int imageToGet){
+    if (rd->shm==NULL || imageToGet<0)
+        return -1;
+    return xpci_shmCheck(rd->shm, imageToGet);
+}
+
+/**
+ * \fn int xpci_asyncReaderCopy(XPCI_ASYNC_READER *rd, int imageToGet, void *pImg)
+ * \brief Copies an image from shared memory into a private buffer (width*height pixels)
+ * \return XPCI_ASYNC_OK, XPCI_ASYNC_NOT_YET, XPCI_ASYNC_OVERWRITTEN, [-1] no sequence
+*///==============================================================================
+int xpci_asyncReaderCopy(XPCI_ASYNC_READER *rd, int imageToGet, void *pImg){
+    if (imageToGet<0 || xpci_asyncReaderAttach(rd))
+        return -1;
+    return xpci_shmRead(rd->shm, imageToGet, pImg, NULL);
+}
+
+/**
+ * \fn int xpci_asyncReaderWait(XPCI_ASYNC_READER *rd, int imageToGet, int timeoutMs)
+ * \brief Sleeps until an image is published in shared memory, instead of polling
+ *
+ *   The acquisition wakes the readers at each image. Before the first sequence the
+ * segment is looked for every 10 ms; a sequence replaced while waiting is followed.
+ * \param int timeoutMs             Maximum wait in ms, <0 without limit
+ * \return XPCI_ASYNC_OK, XPCI_ASYNC_TIMEOUT, XPCI_ASYNC_ENDED the sequence finished
+ *  before the image, [-1] error
+*///==============================================================================
+int xpci_asyncReaderWait(XPCI_ASYNC_READER *rd, int imageToGet, int timeoutMs){
+    struct timespec  start, now;
+    int              left = timeoutMs, ret;
+
+    if (imageToGet<0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;){
+        if (xpci_asyncReaderAttach(rd)==0){
+            ret = xpci_shmWait(rd->shm, imageToGet, left);
+            if (ret!=XPCI_SHM_ENDED || !xpci_shmReplaced(rd->shm))
+                return ret;
+        }
+        else if (left!=0)
+            usleep((left<0 || left>10) ? 10000 : left*1000);
+        if (timeoutMs>=0){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = timeoutMs - (int)((now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000);
+            if (left<=0)
+                return XPCI_ASYNC_TIMEOUT;
+        }
+    }
+}
+
+/**
+ * \fn int xpci_asyncReaderSubscribe(XPCI_ASYNC_READER *rd, const char *name, int policy)
+ * \brief Registers the handle as a consumer of the image stream, from the next image
+ *
+ *   Each consumer has its own cursor and statistics and follows its policy:
+ *   XPCI_ASYNC_BLOCK   every image, the acquisition waits before overwriting an image
+ *                      the consumer did not read (at most the block timeout, see
+ *                      xpci_setSharedImageBlockTimeout(), then it is turned to DROP
+ *                      for the next sequences too, until it subscribes again)
+ *   XPCI_ASYNC_LATEST  the last image published, the older ones are skipped
+ *   XPCI_ASYNC_DROP    every image still in the ring, the overwritten ones are lost
+ *   The registration is kept by the next sequences.
+ * \return [0] success [-1] error
+*///==============================================================================
+int xpci_asyncReaderSubscribe(XPCI_ASYNC_READER *rd, const char *name, int policy){
+    struct timespec ts;
+
+    if (policy<XPCI_ASYNC_BLOCK || policy>XPCI_ASYNC_DROP){
+        printf("ERROR: %s() ---> unknown policy %d\n", __func__, policy);
+        return -1;
+    }
+    if (rd->consumer>=0 && rd->shm!=NULL)
+        xpci_shmUnsubscribe(rd->shm, rd->consumer);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rd->token  = ((uint64_t)getpid()<<32) ^ (uint64_t)(uintptr_t)rd ^ (uint64_t)ts.tv_nsec;
+    rd->policy = policy;
+    memset(rd->name, 0, sizeof(rd->name));
+    strncpy(rd->name, name!=NULL ? name : "", sizeof(rd->name) - 1);
+    rd->consumer = 0;   // registered at the attachment
+    rd->image = -1;
+    if (rd->shm!=NULL && !xpci_shmReplaced(rd->shm)){
+        rd->consumer = xpci_shmSubscribe(rd->shm, rd->name, rd->policy, rd->token);
+        return (rd->consumer<0) ? -1 : 0;
+    }
+    xpci_shmClose(rd->shm);
+    rd->shm = NULL;
+    xpci_asyncReaderAttach(rd);
+    return 0;
+}
+
+/**
+ * \fn int xpci_asyncReaderNext(XPCI_ASYNC_READER *rd, int timeoutMs, const void **pImg, int *imageNb)
+ * \brief Next image of the consumer, without copy, to give back with xpci_asyncReaderDone()
+ * \param int timeoutMs             Maximum wait in ms, <0 without limit
+ * \return XPCI_ASYNC_OK, XPCI_ASYNC_TIMEOUT, XPCI_ASYNC_ENDED, [-1] not a consumer
+*///==============================================================================
+int xpci_asyncReaderNext(XPCI_ASYNC_READER *rd, int timeoutMs, const void **pImg, int *imageNb){
+    struct timespec  start, now;
+    uint64_t         image;
+    int              left = timeoutMs, ret;
+
+    *pImg = NULL;
+    if (rd->consumer<0){
+        printf("ERROR: %s() ---> the reader is not a consumer\n", __func__);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;){
+        if (rd->shm==NULL)
+            xpci_asyncReaderAttach(rd);
+        if (rd->shm!=NULL && rd->consumer>=0){
+            // the images of a replaced sequence are consumed before following the new one
+            ret = xpci_shmNext(rd->shm, rd->consumer, left, pImg, &image);
+            if (ret==XPCI_SHM_OK){
+                rd->image = image;
+                *imageNb = (int)image;
+                return XPCI_ASYNC_OK;
+            }
+            if (ret!=XPCI_SHM_ENDED || !xpci_shmReplaced(rd->shm))
+                return ret;
+            xpci_asyncReaderAttach(rd);
+            continue;
+        }
+        else if (left!=0)
+            usleep((left<0 || left>10) ? 10000 : left*1000);
+        if (timeoutMs>=0){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = timeoutMs - (int)((now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000);
+            if (left<=0)
+                return XPCI_ASYNC_TIMEOUT;
+        }
+    }
+}
+
+/**
+ * \fn int xpci_asyncReaderDone(XPCI_ASYNC_READER *rd)
+ * \brief Gives back the image of xpci_asyncReaderNext() and moves the cursor of the consumer
+ * \return XPCI_ASYNC_OK, XPCI_ASYNC_OVERWRITTEN the image was overwritten while in use
+*///==============================================================================
+int xpci_asyncReaderDone(XPCI_ASYNC_READER *rd){
+    int ret;
+
+    if (rd->image<0 || rd->consumer<0 || rd->shm==NULL)
+        return -1;
+    ret = xpci_shmDone(rd->shm, rd->consumer, rd->image);
+    rd->image = -1;
+    return ret;
+}
+
+/**
+ * \fn int xpci_asyncReaderConsumers(XPCI_ASYNC_READER *rd, XPCI_ASYNC_CONSUMER_STATS *stats, int maxStats)
+ * \brief Cursor, lag and statistics of the consumers of the current sequence
+ * \return number of consumers filled in stats, [-1] no sequence in shared memory
+*///==============================================================================
+int xpci_asyncReaderConsumers(XPCI_ASYNC_READER *rd, XPCI_ASYNC_CONSUMER_STATS *stats, int maxStats){
+    const XPCI_SHM_CONSUMER *c;
+    uint64_t                 published;
+    int                      i, n = 0;
 
+    if (xpci_asyncReaderAttach(rd))
+        return -1;
+    published = xpci_shmPublished(rd->shm);
+    for (i=0; i<XPCI_SHM_MAX_CONSUMERS && n<maxStats; i++){
+        c = xpci_shmConsumer(rd->shm, i);
+        if (c==NULL)
+            break;
+        if (c->active!=1)
+            continue;
+        memcpy(stats[n].name, c->name, sizeof(stats[n].name));
+        stats[n].name[sizeof(stats[n].name) - 1] = 0;
+        stats[n].pid      = c->pid;
+        stats[n].policy   = c->policy;
+        stats[n].demoted  = c->demoted;
+        stats[n].cursor   = c->cursor;
+        stats[n].lag      = (published>c->cursor) ? published - c->cursor : 0;
+        stats[n].maxLag   = c->maxLag;
+        stats[n].consumed = c->consumed;
+        stats[n].skipped  = c->skipped;
+        stats[n].dropped  = c->dropped;
+        stats[n].stalls   = c->stalls;
+        stats[n].stallMs  = c->stallNs/1000000;
+        n++;
+    }
+    return n;
+}
 
+void xpci_asyncReaderClose(XPCI_ASYNC_READER *rd){
+    if (rd==NULL)
+        return;
+    if (rd->consumer>=0 && rd->shm!=NULL)
+        xpci_shmUnsubscribe(rd->shm, rd->consumer);
+    xpci_shmClose(rd->shm);
+    free(rd);
+}
+
+// reader of the calls without handle, kept from one call to the next
+static pthread_mutex_t     async_readerLock = PTHREAD_MUTEX_INITIALIZER;
+static XPCI_ASYNC_READER   async_reader;
 
 /**
  * \fn int xpci_getAsyncImage(enum IMG_TYPE type, int modMask, int nChips,int nImg, void *pImg, int imageToGet)
@@ -329,7 +742,7 @@ void xpci_PreProcessGeometricalCorrections(){
  * \param enum IMG_TYPE type        Type of image to read 2B or 4B
  * \param int modMask               Modules to read
  * \param int nChips                Number of chips per module
- * \param int nImg                  Total number of images requested in exposure parameters
+ * \param int nImg                  Total number of images requested in exposure parameters, bounds imageToGet (0 for no bound)
  * \param void * pImg               Pointer to the buffer where data should be received
  * \param int imageToGet            Number of the image to be read
  * \param void * pImgCorr			Pointer to the buffer where data geometrical corrected should be received
@@ -342,11 +755,11 @@ int xpci_getAsyncImageFromSharedMemory(enum IMG_TYPE type, int modMask, int nChi
     int             modNb = xpci_getModNb(modMask);
 
     // Variables for Async Reading
-    int             fd;
-    unsigned int    *imageNumber;
+    enum IMG_TYPE   shmType;
+    int             width, height, nbSlots;
+    int             published;
     int             numPixels;
-    unsigned short  *image16;
-    unsigned int    *image32;
+    int             ret;
 
 
     numPixels = 120*560*modNb;
@@ -356,148 +769,78 @@ int xpci_getAsyncImageFromSharedMemory(enum IMG_TYPE type, int modMask, int nChi
     printf("type = %d ",nChips);
     printf("type = %d\n",imageToGet);
 
-    //**************** Start of async variable set ****************
-    //**************** imageNumber ****************                 //Last image acquired
-    // Create a new memory object
-    fd = shm_open( "/imageNumber", O_RDWR | O_CREAT, 0777 );
-    if( fd == -1 ) {
-        fprintf( stderr, "Open failed [imageNumber %s()]:%s\n",__func__,
-                 strerror( errno ) );
+    if (imageToGet < 0){
+        printf("\nNegative numbers doesn't make sense\n");
         return -1;
     }
-
-    // Set the memory object's size
-    if( ftruncate( fd, sizeof( *imageNumber ) ) == -1 ) {
-        fprintf( stderr, "ftruncate [imageNumber %s()]:%s\n",__func__,
-                 strerror( errno ) );
+    if (nImg > 0 && imageToGet >= nImg){
+        printf("ERROR: %s() ---> image %d is out of the sequence of %d images\n", __func__, imageToGet, nImg);
         return -1;
     }
 
-    // Map the memory object
-    imageNumber = (unsigned int *) mmap( NULL, sizeof( *imageNumber ),
-                                         PROT_READ,
-                                         MAP_SHARED, fd, 0 );
-    if( imageNumber == MAP_FAILED ) {
-        fprintf( stderr, "imageNumber mmap failed [imageNumber %s()]:%s\n",__func__,
-                 strerror( errno ) );
+    //**************** images ****************                     //Ring of the last images acquired
+    pthread_mutex_lock(&async_readerLock);
+    if (xpci_asyncReaderInfo(&async_reader, &shmType, &width, &height, &nbSlots)){
+        pthread_mutex_unlock(&async_readerLock);
+        printf("ERROR: %s() ---> no image sequence in shared memory\n", __func__);
         return -1;
     }
-
-    close(fd);
-
-    //**************** images ****************                     //Shared memory where images will be stored
-    // Create a new memory object
-    fd = shm_open( "/images", O_RDWR | O_CREAT, 0777 );
-    if( fd == -1 ) {
-        fprintf( stderr, "Open failed [images %s()]:%s\n",__func__,
-                 strerror( errno ) );
+    if (shmType != type || width*height != numPixels){
+        pthread_mutex_unlock(&async_readerLock);
+        printf("ERROR: %s() ---> the images in shared memory are not %s images of %d modules\n",
+               __func__, (type==B2) ? "B2" : "B4", modNb);
         return -1;
     }
 
-    // Map the memory object
-    if(type==B2){
-        // Set the memory object's size
-        if( ftruncate( fd, sizeof( *image16 )*nImg*numPixels ) == -1 ) {
-            fprintf( stderr, "ftruncate: [images %s()]:%s\n",__func__,
-                     strerror( errno ) );
-            return -1;
-        }
-        image16 = (unsigned short *) mmap( NULL, sizeof( *image16 )*nImg*numPixels,
-                                           PROT_READ,
-                                           MAP_SHARED, fd, 0 );
-        if( image16 == MAP_FAILED ) {
-            fprintf( stderr, "image mmap failed: [images %s()]:%s\n",__func__,
-                     strerror( errno ) );
-            return -1;
-        }
+    //Returning the requested image after reading the shared memory.
+    published = xpci_asyncReaderLastImage(&async_reader);
+    ret = xpci_asyncReaderCopy(&async_reader, imageToGet, pImg);
+    pthread_mutex_unlock(&async_readerLock);
+    if (ret == XPCI_ASYNC_NOT_YET || imageToGet >= published){
+        printf("\nCurrent acquired image = %d\n", published);
+        return -1;
     }
-    else{
-        // Set the memory object's size
-        if( ftruncate( fd, sizeof( *image32 )*nImg*numPixels ) == -1 ) {
-            fprintf( stderr, "ftruncate: %s\n",
-                     strerror( errno ) );
-            return -1;
-        }
-        image32 = (unsigned int *) mmap( NULL, sizeof( *image32 )*nImg*numPixels,
-                                         PROT_READ,
-                                         MAP_SHARED, fd, 0 );
-        if( image32 == MAP_FAILED ) {
-            fprintf( stderr, "image mmap failed: %s\n",
-                     strerror( errno ) );
-            return -1;
-        }
+    if (ret == XPCI_ASYNC_OVERWRITTEN){
+        printf("ERROR: %s() ---> image %d overwritten, the ring keeps the last %d images (current %d)\n",
+               __func__, imageToGet, nbSlots, published);
+        return -1;
     }
 
-    close(fd);
-
-    //**************** End of async variable set ****************
-
-    //Returning the requested image after reading the shared memory.
-    if (imageToGet >= 0){
-
-        if (imageToGet < imageNumber[0]){
-            if(type==B2){
-                for(int i=0; i<numPixels; i++)
-                    ((uint16_t *)pImg)[i] = image16[imageToGet*numPixels + i];
-                if(geomCorr){
-                    unsigned int buf[numPixels];
-                    FILE *fileBin=fopen("/opt/imXPAD/geom_correction/matrix.raw","wb");
-                    if(fileBin == NULL) {
-                        printf("\nFile for geometrical correction could not be created\n");
-                        return -1;
-                    }
-                    for(int i=0; i<numPixels; i++){
-                        buf[i] = (unsigned int) image16[imageToGet*numPixels + i];
-                        fwrite(&buf[i], sizeof(unsigned int), 1, fileBin);
-                    }
-                    fclose(fileBin);
-                }
-                munmap(image16,sizeof( *image16 )*nImg*numPixels);
+    // pImgCorr holds GEOM_CORR_WIDTH*GEOM_CORR_HEIGHT floats
+    if(geomCorr)
+        ret = xpci_asyncGeomApply(type, modMask, pImg, pImgCorr, IMG_GEOM_FLOAT, GEOM_CORR_WIDTH, GEOM_CORR_HEIGHT);
+    if(geomCorr && ret!=1)
+        return ret;
+    if(geomCorr){
+        FILE *fileBin=fopen("/opt/imXPAD/geom_correction/matrix.raw","wb");
+        if(fileBin == NULL) {
+            printf("\nFile for geometrical correction could not be created\n");
+            return -1;
+        }
+        if(type==B2){
+            for(int i=0; i<numPixels; i++){
+                unsigned int val = ((uint16_t *)pImg)[i];
+                fwrite(&val, sizeof(unsigned int), 1, fileBin);
             }
-            else{
-                for(int i=0; i<numPixels; i++)
-                    ((uint32_t *)pImg)[i] = image32[imageToGet*numPixels + i];
-                if(geomCorr){
-                    FILE *fileBin=fopen("/opt/imXPAD/geom_correction/matrix.raw","wb");
-                    if(fileBin == NULL) {
-                        printf("\nFile for geometrical correction could not be created\n");
-                        return -1;
-                    }
-                    for(int i=0; i<numPixels; i++)
-                        fwrite(&image32[imageToGet*numPixels + i], sizeof(unsigned int), 1, fileBin);
-                    fclose(fileBin);
-                }
-                munmap(image32,sizeof( *image32 )*nImg*numPixels);
+        }
+        else
+            fwrite(pImg, sizeof(unsigned int), numPixels, fileBin);
+        fclose(fileBin);
 
-            }
-            if (geomCorr){
-                system ("sh /opt/imXPAD/geom_correction/Interpolator.sh");
-                FILE *fileBin=fopen("/opt/imXPAD/geom_correction/image_corrected.raw","rb");
-                if(fileBin == NULL) {
-                    printf("\nFile for geometrical correction could not be readed\n");
-                    return -1;
-                }
-                float var;
-                for(int i=0; i<(582*1157); i++){
-                    fread(&var, sizeof(float), 1, fileBin);
-                    ((float *)pImgCorr)[i]=var;
-                }
-                //printf ("\nInside library \n");
-                fclose(fileBin);
-            }
-            munmap(imageNumber,sizeof( *imageNumber ));
-            return 0;
+        system ("sh /opt/imXPAD/geom_correction/Interpolator.sh");
+        fileBin=fopen("/opt/imXPAD/geom_correction/image_corrected.raw","rb");
+        if(fileBin == NULL) {
+            printf("\nFile for geometrical correction could not be readed\n");
+            return -1;
         }
-        else{
-            printf("\nCurrent acquired image = %u\n",imageNumber[0]);
-            munmap(imageNumber,sizeof( *imageNumber ));
+        if (fread(pImgCorr, sizeof(float), GEOM_CORR_WIDTH*GEOM_CORR_HEIGHT, fileBin) != GEOM_CORR_WIDTH*GEOM_CORR_HEIGHT){
+            printf("\nFile for geometrical correction could not be readed\n");
+            fclose(fileBin);
             return -1;
         }
+        fclose(fileBin);
     }
-    else{
-        printf("\nNegative numbers doesn't make sense\n");
-        return -1;
-    }
+    return 0;
 }
 
 /**
@@ -511,106 +854,92 @@ int xpci_getAsyncImageFromSharedMemory(enum IMG_TYPE type, int modMask, int nChi
 *///==============================================================================
 
 int xpci_getAsyncImageFromDisk(enum IMG_TYPE type, int modMask, void *pImg, int imageToGet, int numBurst){
-    imxpad_raw_file_to_buffer(type, modMask, pImg, imageToGet, numBurst);
+    return imxpad_raw_file_to_buffer(type, modMask, pImg, imageToGet, numBurst);
 }
 
-/**
- * \fn int xpci_getNumberLastAcquiredAsyncImage()
- * \brief Returns the number of the last acquired asynchronous image
- * \return number of the last acquired asynchronous image
-*///==============================================================================
-int xpci_getNumberLastAcquiredAsyncImage(){
+//**************** imageNumber ****************                 //Last image acquired
+// mapped at the first call and kept, async_readerLock held
+static unsigned int *async_imageNumber = NULL;
 
-    // Variables for Async Reading
+static unsigned int *xpci_asyncImageNumber(){
     int             fd;
     unsigned int    *imageNumber;
-    int             ret;
 
-    //**************** Start of async variable set ****************
-    //**************** imageNumber ****************                 //Last image acquired
+    if (async_imageNumber != NULL)
+        return async_imageNumber;
     // Create a new memory object
     fd = shm_open( "/imageNumber", O_RDWR | O_CREAT, 0777 );
     if( fd == -1 ) {
         fprintf( stderr, "Open failed [imageNumber %s()]:%s\n",__func__,
                  strerror( errno ) );
-        return -1;
+        return NULL;
     }
 
     // Set the memory object's size
     if( ftruncate( fd, sizeof( *imageNumber ) ) == -1 ) {
         fprintf( stderr, "ftruncate [imageNumber %s()]:%s\n",__func__,
                  strerror( errno ) );
-        return -1;
+        close(fd);
+        return NULL;
     }
 
     // Map the memory object
     imageNumber = (unsigned int *) mmap( NULL, sizeof( *imageNumber ),
-                                         PROT_WRITE,
+                                         PROT_READ | PROT_WRITE,
                                          MAP_SHARED, fd, 0 );
+    close(fd);
     if( imageNumber == MAP_FAILED ) {
         fprintf( stderr, "imageNumber mmap failed [imageNumber %s()]:%s\n",__func__,
                  strerror( errno ) );
-        return -1;
+        return NULL;
     }
+    async_imageNumber = imageNumber;
+    return async_imageNumber;
+}
 
-    close(fd);
-    ret = imageNumber[0];
-    munmap(imageNumber,sizeof( *imageNumber ));
+/**
+ * \fn int xpci_getNumberLastAcquiredAsyncImage()
+ * \brief Returns the number of the last acquired asynchronous image
+ * \return number of the last acquired asynchronous image
+*///==============================================================================
+int xpci_getNumberLastAcquiredAsyncImage(){
+    unsigned int    *imageNumber;
+    int             ret;
 
+    pthread_mutex_lock(&async_readerLock);
+    imageNumber = xpci_asyncImageNumber();
+    ret = (imageNumber == NULL) ? -1 : (int)imageNumber[0];
+    pthread_mutex_unlock(&async_readerLock);
     return ret;
-
 }
 
 void xpci_clearNumberLastAcquiredAsyncImage(){
-	// Variables for Async Reading
-    int             fd;
     unsigned int    *imageNumber;
-    int             ret;
-
-    //**************** Start of async variable set ****************
-    //**************** imageNumber ****************                 //Last image acquired
-    // Create a new memory object
-    fd = shm_open( "/imageNumber", O_RDWR | O_CREAT, 0777 );
-    if( fd == -1 ) {
-        fprintf( stderr, "Open failed [imageNumber %s()]:%s\n",__func__,
-                 strerror( errno ) );
-        return -1;
-    }
-
-    // Set the memory object's size
-    if( ftruncate( fd, sizeof( *imageNumber ) ) == -1 ) {
-        fprintf( stderr, "ftruncate [imageNumber %s()]:%s\n",__func__,
-                 strerror( errno ) );
-        return -1;
-    }
-
-    // Map the memory object
-    imageNumber = (unsigned int *) mmap( NULL, sizeof( *imageNumber ),
-                                         PROT_WRITE,
-                                         MAP_SHARED, fd, 0 );
-    if( imageNumber == MAP_FAILED ) {
-        fprintf( stderr, "imageNumber mmap failed [imageNumber %s()]:%s\n",__func__,
-                 strerror( errno ) );
-        return -1;
-    }
 
-    close(fd);
-    imageNumber[0] = -1;
+    pthread_mutex_lock(&async_readerLock);
+    imageNumber = xpci_asyncImageNumber();
+    if (imageNumber != NULL)
+        imageNumber[0] = -1;
     //printf("Shared image number resetted.\n");
-    munmap(imageNumber,sizeof( *imageNumber ));
+    pthread_mutex_unlock(&async_readerLock);
 }
 
 void xpci_cleanSharedMemory(){
 
+    pthread_mutex_lock(&async_readerLock);
+    if (async_imageNumber != NULL)
+        munmap(async_imageNumber, sizeof( *async_imageNumber ));
+    async_imageNumber = NULL;
+    pthread_mutex_unlock(&async_readerLock);
     shm_unlink( "/imageNumber" );
     printf("Share memory unlinked\n");
-    shm_unlink( "/images" );
+    xpci_shmUnlink( XPCI_SHM_IMAGES );
     printf("Share memory unlinked\n");
     return 0;
 }
 
 void xpci_cleanSSDImages(unsigned int burstNumber, unsigned int imagesNumber){
-	char str[200];
-	sprintf(str,"rm /opt/imXPAD/tmp/burst_%d_img_*.bin",burstNumber);
-    system(str);
-}
\ No newline at end of file
+    // deleted in the background, the call returns at once
+    xpci_burstRemoveImages(burstNumber);
+    xpci_burstRemove(burstNumber);  // container, or stripes and their manifest
+}
@@ -0,0 +1,1691 @@
+/*******************************************************
+                       xpci_burst.c
+
+ Burst container file used by the SSD (film) mode,
+ see xpci_burst.h for the layout.
+ The file is preallocated when the burst is armed so
+ that no filesystem metadata work is left in the frame
+ loop, and it is opened with O_DIRECT when the
+ filesystem supports it (buffered writes otherwise).
+ Frames are written through io_uring, several frames
+ in flight, when the kernel provides it and with a
+ blocking pwrite() per frame otherwise.
+ The frames of an encoded burst (xpci_burstSetCodec())
+ keep their preallocated slot but only their encoded
+ bytes are written, the reader decodes them.
+ A reader can map its containers (xpci_burstMap()): the
+ frames and the index, updated by a writer still
+ running, are then read in place.
+ Removed containers are renamed at once, then either kept
+ as spare files that the next bursts of the directory
+ reuse (already allocated) or deleted by a background
+ thread, so that no unlink of a large file is left on
+ the arming path.
+*******************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup)
+#define XPCI_HAVE_URING
+#endif
+#endif
+#endif
+
+#include "xpci_burst.h"
+#include "xpci_codec.h"
+#include "xpci_time.h"
+
+#define XPCI_BURST_IDX_PER_BLOCK  (XPCI_BURST_ALIGN/sizeof(XPCI_BURST_INDEX))
+
+#ifdef XPCI_HAVE_URING
+/* rings shared with the kernel (no liburing on the acquisition PCs) */
+typedef struct {
+    int                  fd;
+    unsigned             entries;
+    unsigned            *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned            *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    void                *sqRing, *cqRing;
+    size_t               sqRingSize, cqRingSize, sqesSize;
+    unsigned             pending;    // sqes queued and not yet given to the kernel
+} XPCI_URING;
+#endif
+
+/* frame in flight */
+typedef struct {
+    unsigned      frame;
+    unsigned      size;       // bytes written (whole blocks with O_DIRECT)
+    unsigned      stored;     // bytes of the frame
+    const void   *data;
+    struct iovec  iov;
+    int           done;
+    int           res;
+} XPCI_BURST_IO;
+
+struct XPCI_BURST {
+    int                fd;
+    int                writer;     // file created by xpci_burstCreate()
+    int                direct;     // opened with O_DIRECT
+    XPCI_BURST_HEADER  hdr;
+    XPCI_BURST_INDEX  *index;
+    unsigned           indexSize;  // bytes reserved for the index
+    void              *bounce;     // aligned copy of unaligned frames (O_DIRECT only)
+    char               fname[200];
+    char              *map;        // whole container mapped by xpci_burstMap()
+    size_t             mapSize;
+
+    // asynchronous writer
+    int                ioMode;
+#ifdef XPCI_HAVE_URING
+    XPCI_URING         ring;
+#endif
+    XPCI_BURST_IO     *io;         // queueDepth frames, used in submission order
+    unsigned           queueDepth;
+    unsigned           submitted;
+    unsigned           retired;
+    int                ioError;
+    void             **regFrames;  // buffers registered in the ring
+    unsigned           nbRegFrames;
+
+    pthread_mutex_t    statLock;
+    XPCI_BURST_STATS   stats;
+    unsigned long long startNs;
+    double             inFlightSum;
+    unsigned long long nbSubmits;
+
+    // striped burst: the handle only dispatches to the stripe containers
+    int                nbStripes;
+    struct XPCI_BURST *stripes[XPCI_BURST_MAX_STRIPES];
+};
+
+static int      burst_ioMode = XPCI_BURST_IO_BEST;
+static unsigned burst_queueDepth = 8;
+static int      burst_nbDirs = 0;
+static int      burst_codec = XPCI_CODEC_NONE;
+static char     burst_dirs[XPCI_BURST_MAX_STRIPES][200];
+
+static unsigned xpci_burstRoundUp(unsigned long long size){
+    return (unsigned)((size + XPCI_BURST_ALIGN - 1) / XPCI_BURST_ALIGN * XPCI_BURST_ALIGN);
+}
+
+void xpci_burstFileName(int burstNumber, char *fname){
+    sprintf(fname,"%s/burst_%d.bin",XPCI_BURST_DIR,burstNumber);
+}
+
+static void xpci_burstManifestName(int burstNumber, char *fname){
+    sprintf(fname,"%s/burst_%d.stripes",XPCI_BURST_DIR,burstNumber);
+}
+
+int xpci_burstSetStripeDirs(int nbDirs, const char **dirs){
+    int i;
+
+    if (nbDirs<0 || nbDirs>XPCI_BURST_MAX_STRIPES){
+        printf("ERROR: %s() ---> 0 to %d directories.\n", __func__, XPCI_BURST_MAX_STRIPES);
+        return -1;
+    }
+    for (i=0; i<nbDirs; i++)
+        if (dirs[i]==NULL || strlen(dirs[i])>=sizeof(burst_dirs[i])-32){
+            printf("ERROR: %s() ---> invalid directory %d.\n", __func__, i);
+            return -1;
+        }
+    for (i=0; i<nbDirs; i++)
+        strcpy(burst_dirs[i], dirs[i]);
+    burst_nbDirs = nbDirs;
+    return 0;
+}
+
+/* container position of a frame of the burst */
+static unsigned xpci_burstLocal(XPCI_BURST *burst, unsigned frame){
+    return frame / burst->hdr.nbStripes;
+}
+
+unsigned xpci_burstFrameStride(unsigned frameSize){
+    return xpci_burstRoundUp(frameSize);
+}
+
+/* room of a frame in a container, an encoded frame may be a little larger than the raw one */
+static unsigned xpci_burstSlotSize(unsigned frameSize, int codec){
+    return xpci_burstFrameStride(codec==XPCI_CODEC_NONE ? frameSize : xpci_codecBound(frameSize));
+}
+
+/* frame buffer usable with xpci_burstWriteFrame() without bounce copy, free() it */
+void *xpci_burstAllocFrame(unsigned frameSize){
+    void *p = NULL;
+
+    if (posix_memalign(&p, XPCI_BURST_ALIGN, xpci_burstFrameStride(frameSize))!=0)
+        return NULL;
+    return p;
+}
+
+static int xpci_burstPwrite(int fd, const void *data, size_t size, off_t offset){
+    const char *p = data;
+    ssize_t     n;
+
+    while(size){
+        n = pwrite(fd, p, size, offset);
+        if (n<0){
+            if (errno==EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int xpci_burstPread(int fd, void *data, size_t size, off_t offset){
+    char    *p = data;
+    ssize_t  n;
+
+    while(size){
+        n = pread(fd, p, size, offset);
+        if (n<0){
+            if (errno==EINTR)
+                continue;
+            return -1;
+        }
+        if (n==0)
+            return -1;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int xpci_burstWriteHeader(XPCI_BURST *burst){
+    void *block;
+    int   ret;
+
+    if (posix_memalign(&block, XPCI_BURST_ALIGN, XPCI_BURST_ALIGN)!=0)
+        return -1;
+    memset(block, 0, XPCI_BURST_ALIGN);
+    memcpy(block, &burst->hdr, sizeof(burst->hdr));
+    ret = xpci_burstPwrite(burst->fd, block, XPCI_BURST_ALIGN, 0);
+    free(block);
+    return ret;
+}
+
+/* index entries are flushed by XPCI_BURST_ALIGN blocks to keep O_DIRECT happy */
+static int xpci_burstWriteIndex(XPCI_BURST *burst, unsigned first, unsigned size){
+    return xpci_burstPwrite(burst->fd, (char*)burst->index + first, size,
+                            burst->hdr.indexOffset + first);
+}
+
+#ifdef XPCI_HAVE_URING
+static int xpci_uringSetup(XPCI_URING *ring, unsigned entries){
+    struct io_uring_params p;
+    int                    single = 0;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd<0)
+        return -1;
+
+    ring->entries    = p.sq_entries;
+    ring->sqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    ring->cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    ring->sqesSize   = p.sq_entries*sizeof(struct io_uring_sqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        single = 1;
+        if (ring->cqRingSize>ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+#endif
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = MAP_FAILED;
+    ring->sqes   = MAP_FAILED;
+    if (ring->sqRing!=MAP_FAILED){
+        if (single)
+            ring->cqRing = ring->sqRing;
+        else
+            ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ring->fd, IORING_OFF_CQ_RING);
+        ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQES);
+    }
+    if (ring->sqRing==MAP_FAILED || ring->cqRing==MAP_FAILED || ring->sqes==MAP_FAILED){
+        if (ring->sqes!=MAP_FAILED)
+            munmap(ring->sqes, ring->sqesSize);
+        if (ring->cqRing!=MAP_FAILED && ring->cqRing!=ring->sqRing)
+            munmap(ring->cqRing, ring->cqRingSize);
+        if (ring->sqRing!=MAP_FAILED)
+            munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+
+    ring->sqHead  = (unsigned*)((char*)ring->sqRing + p.sq_off.head);
+    ring->sqTail  = (unsigned*)((char*)ring->sqRing + p.sq_off.tail);
+    ring->sqMask  = (unsigned*)((char*)ring->sqRing + p.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)((char*)ring->sqRing + p.sq_off.array);
+    ring->cqHead  = (unsigned*)((char*)ring->cqRing + p.cq_off.head);
+    ring->cqTail  = (unsigned*)((char*)ring->cqRing + p.cq_off.tail);
+    ring->cqMask  = (unsigned*)((char*)ring->cqRing + p.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe*)((char*)ring->cqRing + p.cq_off.cqes);
+    ring->pending = 0;
+    return 0;
+}
+
+static void xpci_uringClose(XPCI_URING *ring){
+    if (ring->fd<0)
+        return;
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing!=ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/* free sqe, made visible to the kernel by xpci_uringQueue() */
+static struct io_uring_sqe *xpci_uringGetSqe(XPCI_URING *ring){
+    unsigned             tail = *ring->sqTail;
+    unsigned             head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (tail-head>=ring->entries)
+        return NULL;
+    sqe = &ring->sqes[tail & *ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void xpci_uringQueue(XPCI_URING *ring){
+    unsigned tail = *ring->sqTail;
+
+    ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+    __atomic_store_n(ring->sqTail, tail+1, __ATOMIC_RELEASE);
+    ring->pending++;
+}
+
+/* hand the queued sqes to the kernel in one call, optionally wait for a completion */
+static int xpci_uringEnter(XPCI_URING *ring, unsigned minComplete){
+    int ret;
+
+    if (ring->pending==0 && minComplete==0)
+        return 0;
+    do
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->pending, minComplete,
+                      minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (ret<0 && errno==EINTR);
+    if (ret<0)
+        return -1;
+    ring->pending -= ret;
+    return 0;
+}
+#endif
+
+static void xpci_burstFree(XPCI_BURST *burst){
+    int i;
+
+    for (i=0; i<burst->nbStripes; i++)
+        if (burst->stripes[i]!=NULL)
+            xpci_burstFree(burst->stripes[i]);
+#ifdef XPCI_HAVE_URING
+    if (burst->ioMode==XPCI_BURST_IO_URING)
+        xpci_uringClose(&burst->ring);
+#endif
+    if (burst->map!=NULL)
+        munmap(burst->map, burst->mapSize);
+    if (burst->fd>=0)
+        close(burst->fd);
+    if (burst->writer)
+        pthread_mutex_destroy(&burst->statLock);
+    free(burst->index);
+    free(burst->bounce);
+    free(burst->io);
+    free(burst->regFrames);
+    free(burst);
+}
+
+int xpci_burstSetIoMode(int mode){
+    if (mode<XPCI_BURST_IO_BEST || mode>XPCI_BURST_IO_URING){
+        printf("ERROR: %s() ---> unknown writer mode %d.\n", __func__, mode);
+        return -1;
+    }
+#ifndef XPCI_HAVE_URING
+    if (mode==XPCI_BURST_IO_URING){
+        printf("ERROR: %s() ---> io_uring is not available in this build.\n", __func__);
+        return -1;
+    }
+#endif
+    burst_ioMode = mode;
+    return 0;
+}
+
+int xpci_burstSetQueueDepth(int depth){
+    if (depth<1 || depth>XPCI_BURST_MAX_DEPTH){
+        printf("ERROR: %s() ---> queue depth must be in 1..%d.\n", __func__, XPCI_BURST_MAX_DEPTH);
+        return -1;
+    }
+    burst_queueDepth = depth;
+    return 0;
+}
+
+int xpci_burstSetCodec(int codec){
+    if (codec<XPCI_CODEC_NONE || codec>XPCI_CODEC_BITPLANE){
+        printf("ERROR: %s() ---> unknown codec %d.\n", __func__, codec);
+        return -1;
+    }
+    burst_codec = codec;
+    return 0;
+}
+
+const char *xpci_burstIoModeName(int mode){
+    switch(mode){
+    case XPCI_BURST_IO_SYNC:  return "pwrite";
+    case XPCI_BURST_IO_URING: return "io_uring";
+    default:                  return "best";
+    }
+}
+
+// *******************************************************************************
+// storage: spare files, deletions in the background, quota
+// *******************************************************************************
+#define XPCI_BURST_SPARE  "burst_spare_"
+#define XPCI_BURST_TRASH  "burst_trash_"
+
+typedef struct XPCI_BURST_TRASH_FILE {
+    struct XPCI_BURST_TRASH_FILE *next;
+    char                          fname[200];
+} XPCI_BURST_TRASH_FILE;
+
+/* files of a directory, sizes in allocated bytes */
+typedef struct {
+    unsigned long long  used;         // all the burst files
+    unsigned long long  spareBytes;
+    unsigned            nbSpares;
+    unsigned long long  burstBytes;   // containers of the burst being replaced
+} XPCI_BURST_DIRSTAT;
+
+static pthread_mutex_t        store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t         store_cond = PTHREAD_COND_INITIALIZER;
+static XPCI_BURST_TRASH_FILE *store_head = NULL;    // files waiting for the deleter
+static XPCI_BURST_TRASH_FILE *store_tail = NULL;
+static int                    store_started = 0;
+static int                    store_busy = 0;       // deleter unlinking a file
+static unsigned long long     store_quota = 0;      // 0: no quota
+static int                    store_maxSpares = 1;  // spare files kept per directory
+static unsigned               store_seq = 0;
+static XPCI_BURST_STORAGE     store_stats;
+
+static const char *xpci_burstDir(int stripe){
+    return burst_nbDirs ? burst_dirs[stripe] : XPCI_BURST_DIR;
+}
+
+static void *xpci_burstDeleter(void *arg){
+    XPCI_BURST_TRASH_FILE *file;
+
+    (void)arg;
+    pthread_mutex_lock(&store_lock);
+    for (;;){
+        while (store_head==NULL)
+            pthread_cond_wait(&store_cond, &store_lock);
+        file = store_head;
+        store_head = file->next;
+        if (store_head==NULL)
+            store_tail = NULL;
+        store_busy = 1;
+        pthread_mutex_unlock(&store_lock);
+
+        if (unlink(file->fname) && errno!=ENOENT)
+            printf("ERROR: %s() ---> can not remove < %s > : %s\n", __func__, file->fname, strerror(errno));
+        free(file);
+
+        pthread_mutex_lock(&store_lock);
+        store_busy = 0;
+        store_stats.pendingRemovals--;
+        store_stats.removedFiles++;
+        pthread_cond_broadcast(&store_cond);
+    }
+    return NULL;
+}
+
+/* queues a file for the deleter, store_lock held */
+static int xpci_burstQueueRemoval(const char *fname){
+    XPCI_BURST_TRASH_FILE *file;
+    pthread_attr_t         attr;
+    pthread_t              thread;
+
+    if (!store_started){
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        store_started = (pthread_create(&thread, &attr, xpci_burstDeleter, NULL)==0);
+        pthread_attr_destroy(&attr);
+    }
+    file = malloc(sizeof(*file));
+    if (!store_started || file==NULL){
+        // no deleter: removed here
+        free(file);
+        unlink(fname);
+        store_stats.removedFiles++;
+        return 0;
+    }
+    snprintf(file->fname, sizeof(file->fname), "%s", fname);
+    file->next = NULL;
+    if (store_tail!=NULL)
+        store_tail->next = file;
+    else
+        store_head = file;
+    store_tail = file;
+    store_stats.pendingRemovals++;
+    pthread_cond_broadcast(&store_cond);
+    return 0;
+}
+
+/* burst files of dir; burstNumber>=0 sums its containers, each spare is given to spare() */
+static void xpci_burstScanDir(const char *dir, int burstNumber, XPCI_BURST_DIRSTAT *info,
+                              void (*spare)(const char *fname, unsigned long long size, void *arg), void *arg){
+    DIR            *d;
+    struct dirent  *e;
+    struct stat     st;
+    char            fname[512];
+    char            prefix[64], stripe[64];
+    size_t          len;
+
+    memset(info, 0, sizeof(*info));
+    sprintf(prefix, "burst_%d.bin", burstNumber);
+    sprintf(stripe, "burst_%d_stripe_", burstNumber);
+    d = opendir(dir);
+    if (d==NULL)
+        return;
+    while ((e = readdir(d))!=NULL){
+        len = strlen(e->d_name);
+        if (strncmp(e->d_name, "burst_", 6) || len<4 || strcmp(e->d_name + len - 4, ".bin"))
+            continue;
+        snprintf(fname, sizeof(fname), "%s/%s", dir, e->d_name);
+        if (lstat(fname, &st) || !S_ISREG(st.st_mode))
+            continue;
+        info->used += (unsigned long long)st.st_blocks*512;
+        if (!strncmp(e->d_name, XPCI_BURST_SPARE, strlen(XPCI_BURST_SPARE))){
+            info->nbSpares++;
+            info->spareBytes += (unsigned long long)st.st_blocks*512;
+            if (spare!=NULL)
+                spare(fname, st.st_size, arg);
+        }
+        else if (burstNumber>=0 && (!strcmp(e->d_name, prefix) || !strncmp(e->d_name, stripe, strlen(stripe))))
+            info->burstBytes += (unsigned long long)st.st_blocks*512;
+    }
+    closedir(d);
+}
+
+/* container removed: kept as a spare of its directory or deleted in the background */
+static void xpci_burstDiscard(const char *fname){
+    XPCI_BURST_DIRSTAT  info;
+    char                dir[200], trash[300];
+    char               *slash;
+    int                 spare;
+
+    if (access(fname, F_OK))
+        return;
+    snprintf(dir, sizeof(dir), "%s", fname);
+    slash = strrchr(dir, '/');
+    if (slash==NULL)
+        strcpy(dir, ".");
+    else
+        *slash = '\0';
+
+    pthread_mutex_lock(&store_lock);
+    spare = 0;
+    if (store_maxSpares>0){
+        xpci_burstScanDir(dir, -1, &info, NULL, NULL);
+        spare = ((int)info.nbSpares<store_maxSpares)
+                && (store_quota==0 || info.used<=store_quota);
+    }
+    snprintf(trash, sizeof(trash), "%s/%s%d_%u.bin", dir, spare ? XPCI_BURST_SPARE : XPCI_BURST_TRASH,
+             (int)getpid(), store_seq++);
+    if (rename(fname, trash)){
+        // renaming never fails on a sane directory, fall back to a plain unlink
+        unlink(fname);
+        store_stats.removedFiles++;
+    }
+    else if (!spare)
+        xpci_burstQueueRemoval(trash);
+    pthread_mutex_unlock(&store_lock);
+}
+
+typedef struct {
+    unsigned long long  need;
+    unsigned long long  size;
+    char                fname[512];
+} XPCI_BURST_SPARE_PICK;
+
+/* smallest spare holding the container, the largest one otherwise */
+static void xpci_burstPickSpare(const char *fname, unsigned long long size, void *arg){
+    XPCI_BURST_SPARE_PICK *pick = arg;
+    int                    better;
+
+    if (pick->fname[0]=='\0')
+        better = 1;
+    else if (pick->size>=pick->need)
+        better = (size>=pick->need && size<pick->size);
+    else
+        better = (size>pick->size);
+    if (better){
+        snprintf(pick->fname, sizeof(pick->fname), "%s", fname);
+        pick->size = size;
+    }
+}
+
+/* renames a spare of the directory of fname to fname, 0 if one was taken */
+static int xpci_burstTakeSpare(const char *fname, unsigned long long fileSize){
+    XPCI_BURST_DIRSTAT     info;
+    XPCI_BURST_SPARE_PICK  pick;
+    char                   dir[200];
+    char                  *slash;
+    int                    ret = -1;
+
+    snprintf(dir, sizeof(dir), "%s", fname);
+    slash = strrchr(dir, '/');
+    if (slash==NULL)
+        strcpy(dir, ".");
+    else
+        *slash = '\0';
+
+    memset(&pick, 0, sizeof(pick));
+    pick.need = fileSize;
+    pthread_mutex_lock(&store_lock);
+    xpci_burstScanDir(dir, -1, &info, xpci_burstPickSpare, &pick);
+    if (pick.fname[0]!='\0' && rename(pick.fname, fname)==0){
+        store_stats.recycledFiles++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&store_lock);
+    return ret;
+}
+
+int xpci_burstSetQuota(unsigned long long bytes){
+    pthread_mutex_lock(&store_lock);
+    store_quota = bytes;
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
+
+int xpci_burstSetSpareFiles(int nbFiles){
+    if (nbFiles<0){
+        printf("ERROR: %s() ---> invalid nb of spare files %d.\n", __func__, nbFiles);
+        return -1;
+    }
+    pthread_mutex_lock(&store_lock);
+    store_maxSpares = nbFiles;
+    pthread_mutex_unlock(&store_lock);
+    if (nbFiles==0)
+        xpci_burstDropSpares();
+    return 0;
+}
+
+/* spares (spare!=0) or trash files left by a process stopped before its deleter, store_lock held */
+static void xpci_burstQueueDir(const char *dir, int spare){
+    DIR            *d;
+    struct dirent  *e;
+    const char     *prefix = spare ? XPCI_BURST_SPARE : XPCI_BURST_TRASH;
+    char            fname[512], trash[512], own[64];
+
+    sprintf(own, "%s%d_", XPCI_BURST_TRASH, (int)getpid());
+
+    d = opendir(dir);
+    if (d==NULL)
+        return;
+    while ((e = readdir(d))!=NULL){
+        if (strncmp(e->d_name, prefix, strlen(prefix)))
+            continue;
+        snprintf(fname, sizeof(fname), "%s/%s", dir, e->d_name);
+        if (!spare){
+            // the files of this process are already queued
+            if (strncmp(e->d_name, own, strlen(own)))
+                xpci_burstQueueRemoval(fname);
+        }
+        else{
+            // renamed first so that no burst takes it meanwhile
+            snprintf(trash, sizeof(trash), "%s/%s%d_%u.bin", dir, XPCI_BURST_TRASH, (int)getpid(), store_seq++);
+            if (rename(fname, trash)==0)
+                xpci_burstQueueRemoval(trash);
+        }
+    }
+    closedir(d);
+}
+
+int xpci_burstDropSpares(void){
+    int i;
+
+    pthread_mutex_lock(&store_lock);
+    for (i=0; i<(burst_nbDirs ? burst_nbDirs : 1); i++)
+        xpci_burstQueueDir(xpci_burstDir(i), 1);
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
+
+int xpci_burstWaitRemovals(void){
+    pthread_mutex_lock(&store_lock);
+    while (store_head!=NULL || store_busy)
+        pthread_cond_wait(&store_cond, &store_lock);
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
+
+void xpci_burstGetStorage(XPCI_BURST_STORAGE *storage){
+    XPCI_BURST_DIRSTAT info;
+    int                i;
+
+    pthread_mutex_lock(&store_lock);
+    *storage = store_stats;
+    storage->quota = store_quota;
+    storage->used = storage->spareBytes = 0;
+    storage->nbSpares = 0;
+    for (i=0; i<(burst_nbDirs ? burst_nbDirs : 1); i++){
+        xpci_burstScanDir(xpci_burstDir(i), -1, &info, NULL, NULL);
+        storage->used       += info.used;
+        storage->spareBytes += info.spareBytes;
+        storage->nbSpares   += info.nbSpares;
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+static XPCI_BURST *xpci_burstNewWriter(){
+    XPCI_BURST *burst;
+
+    burst = calloc(1, sizeof(XPCI_BURST));
+    if (burst==NULL){
+        printf("ERROR: %s() ---> can not allocate the burst handle.\n", __func__);
+        return NULL;
+    }
+    burst->fd = -1;
+    burst->writer = 1;
+    burst->ioMode = XPCI_BURST_IO_SYNC;
+    pthread_mutex_init(&burst->statLock, NULL);
+    return burst;
+}
+
+/* one container holding nbFrames frames: stripe, stripe+nbStripes... of the burst */
+static XPCI_BURST *xpci_burstCreateFile(const char *fname, int type, unsigned modMask, unsigned frameSize,
+                                        unsigned nbFrames, unsigned stripe, unsigned nbStripes){
+    XPCI_BURST          *burst;
+    unsigned long long   fileSize;
+    int                  ret, flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    burst = xpci_burstNewWriter();
+    if (burst==NULL)
+        return NULL;
+    strcpy(burst->fname, fname);
+
+    memcpy(burst->hdr.magic, XPCI_BURST_MAGIC, sizeof(burst->hdr.magic));
+    burst->hdr.version     = XPCI_BURST_VERSION;
+    burst->hdr.headerSize  = XPCI_BURST_ALIGN;
+    burst->hdr.imgType     = type;
+    burst->hdr.modMask     = modMask;
+    burst->hdr.frameSize   = frameSize;
+    burst->hdr.frameStride = xpci_burstSlotSize(frameSize, burst_codec);
+    burst->hdr.nbFrames    = nbFrames;
+    burst->hdr.nbWritten   = 0;
+    burst->hdr.indexOffset = XPCI_BURST_ALIGN;
+    burst->indexSize       = xpci_burstRoundUp((unsigned long long)nbFrames*sizeof(XPCI_BURST_INDEX));
+    burst->hdr.dataOffset  = burst->hdr.indexOffset + burst->indexSize;
+    burst->hdr.stripe      = stripe;
+    burst->hdr.nbStripes   = nbStripes;
+    burst->hdr.codec       = burst_codec;
+    fileSize = burst->hdr.dataOffset + (unsigned long long)nbFrames*burst->hdr.frameStride;
+
+    if (posix_memalign((void**)&burst->index, XPCI_BURST_ALIGN, burst->indexSize)!=0){
+        burst->index = NULL;
+        printf("ERROR: %s() ---> can not allocate the frame index.\n", __func__);
+        xpci_burstFree(burst);
+        return NULL;
+    }
+    memset(burst->index, 0, burst->indexSize);
+
+    // a spare file of the directory keeps its blocks, the frames beyond the index are ignored
+    if (xpci_burstTakeSpare(burst->fname, fileSize)==0)
+        flags &= ~O_TRUNC;
+    burst->fd = open(burst->fname, flags | O_DIRECT, 0666);
+    if (burst->fd>=0)
+        burst->direct = 1;
+    else if (errno==EINVAL)   // filesystem without O_DIRECT support (tmpfs...)
+        burst->fd = open(burst->fname, flags, 0666);
+    if (burst->fd<0){
+        printf("ERROR: %s() ---> can not create < %s > : %s\n", __func__, burst->fname, strerror(errno));
+        xpci_burstFree(burst);
+        return NULL;
+    }
+
+    // reserve the whole burst now, nothing is allocated in the frame loop
+    ret = fallocate(burst->fd, 0, 0, (off_t)fileSize);
+    if (ret!=0 && (errno==EOPNOTSUPP || errno==ENOSYS))
+        ret = ftruncate(burst->fd, (off_t)fileSize);
+    if (ret!=0){
+        printf("ERROR: %s() ---> can not allocate %llu bytes for < %s > : %s\n", __func__, fileSize, burst->fname, strerror(errno));
+        unlink(burst->fname);
+        xpci_burstFree(burst);
+        return NULL;
+    }
+
+    if (xpci_burstWriteHeader(burst) || xpci_burstWriteIndex(burst, 0, burst->indexSize)){
+        printf("ERROR: %s() ---> can not write the header of < %s > : %s\n", __func__, burst->fname, strerror(errno));
+        unlink(burst->fname);
+        xpci_burstFree(burst);
+        return NULL;
+    }
+
+    burst->queueDepth = 1;
+#ifdef XPCI_HAVE_URING
+    if (burst_ioMode!=XPCI_BURST_IO_SYNC){
+        if (xpci_uringSetup(&burst->ring, burst_queueDepth)==0){
+            burst->ioMode = XPCI_BURST_IO_URING;
+            burst->queueDepth = burst_queueDepth;
+        }
+        else if (burst_ioMode==XPCI_BURST_IO_URING)
+            printf("WARNING: %s() ---> io_uring unavailable (%s), frames written with pwrite.\n", __func__, strerror(errno));
+    }
+#endif
+    burst->io = calloc(burst->queueDepth, sizeof(XPCI_BURST_IO));
+    if (burst->io==NULL){
+        printf("ERROR: %s() ---> can not allocate the write queue.\n", __func__);
+        unlink(burst->fname);
+        xpci_burstFree(burst);
+        return NULL;
+    }
+    burst->stats.ioMode = burst->ioMode;
+    burst->stats.queueDepth = burst->queueDepth;
+
+    return burst;
+}
+
+static int xpci_burstWriteManifest(XPCI_BURST *burst, int burstNumber){
+    char  fname[200];
+    FILE *fd;
+    int   i;
+
+    xpci_burstManifestName(burstNumber, fname);
+    fd = fopen(fname, "w");
+    if (fd==NULL){
+        printf("ERROR: %s() ---> can not create < %s > : %s\n", __func__, fname, strerror(errno));
+        return -1;
+    }
+    fprintf(fd, "%s %d\n", XPCI_BURST_MAGIC, XPCI_BURST_VERSION);
+    fprintf(fd, "frames %u\n", burst->hdr.nbFrames);
+    fprintf(fd, "stripes %d\n", burst->nbStripes);
+    for (i=0; i<burst->nbStripes; i++)
+        fprintf(fd, "%s\n", burst->stripes[i]->fname);
+    if (fclose(fd)){
+        printf("ERROR: %s() ---> can not write < %s > : %s\n", __func__, fname, strerror(errno));
+        unlink(fname);
+        return -1;
+    }
+    return 0;
+}
+
+/* stripe containers listed by the manifest, NULL when the burst is not striped */
+static int xpci_burstReadManifest(int burstNumber, unsigned *nbFrames, int *nbStripes,
+                                  char fnames[XPCI_BURST_MAX_STRIPES][200]){
+    char  fname[200];
+    char  magic[16];
+    int   version, i;
+    FILE *fd;
+
+    xpci_burstManifestName(burstNumber, fname);
+    fd = fopen(fname, "r");
+    if (fd==NULL)
+        return -1;
+    if (fscanf(fd, "%15s %d frames %u stripes %d", magic, &version, nbFrames, nbStripes)!=4
+        || strcmp(magic, XPCI_BURST_MAGIC) || *nbStripes<1 || *nbStripes>XPCI_BURST_MAX_STRIPES){
+        printf("ERROR: %s() ---> < %s > is not a stripe manifest.\n", __func__, fname);
+        fclose(fd);
+        return -1;
+    }
+    for (i=0; i<*nbStripes; i++)
+        if (fscanf(fd, " %199[^\n]", fnames[i])!=1){
+            printf("ERROR: %s() ---> < %s > truncated.\n", __func__, fname);
+            fclose(fd);
+            return -1;
+        }
+    fclose(fd);
+    return 0;
+}
+
+int xpci_burstRemove(int burstNumber){
+    char     fname[200];
+    char     fnames[XPCI_BURST_MAX_STRIPES][200];
+    unsigned nbFrames;
+    int      nbStripes, i;
+
+    xpci_burstFileName(burstNumber, fname);
+    xpci_burstDiscard(fname);
+    if (xpci_burstReadManifest(burstNumber, &nbFrames, &nbStripes, fnames)==0)
+        for (i=0; i<nbStripes; i++)
+            xpci_burstDiscard(fnames[i]);
+    xpci_burstManifestName(burstNumber, fname);
+    unlink(fname);
+    return 0;
+}
+
+int xpci_burstRemoveImages(int burstNumber){
+    DIR            *d;
+    struct dirent  *e;
+    char            prefix[64];
+    char            fname[512];
+    size_t          len;
+
+    sprintf(prefix, "burst_%d_img_", burstNumber);
+    d = opendir(XPCI_BURST_DIR);
+    if (d==NULL)
+        return 0;
+    pthread_mutex_lock(&store_lock);
+    while ((e = readdir(d))!=NULL){
+        len = strlen(e->d_name);
+        if (strncmp(e->d_name, prefix, strlen(prefix)) || len<4 || strcmp(e->d_name + len - 4, ".bin"))
+            continue;
+        snprintf(fname, sizeof(fname), "%s/%s", XPCI_BURST_DIR, e->d_name);
+        xpci_burstQueueRemoval(fname);
+    }
+    pthread_mutex_unlock(&store_lock);
+    closedir(d);
+    return 0;
+}
+
+/* bytes of the container of nbFrames frames */
+static unsigned long long xpci_burstFileSize(unsigned frameSize, unsigned nbFrames){
+    return XPCI_BURST_ALIGN + xpci_burstRoundUp((unsigned long long)nbFrames*sizeof(XPCI_BURST_INDEX))
+           + (unsigned long long)nbFrames*xpci_burstSlotSize(frameSize, burst_codec);
+}
+
+int xpci_burstCheckSpace(int burstNumber, unsigned frameSize, unsigned nbFrames,
+                         unsigned long long *needed, unsigned long long *available){
+    XPCI_BURST_DIRSTAT  info;
+    struct statvfs      vfs;
+    struct stat         st;
+    int                 nbDirs = burst_nbDirs ? burst_nbDirs : 1;
+    dev_t               dev[XPCI_BURST_MAX_STRIPES];
+    unsigned long long  need[XPCI_BURST_MAX_STRIPES], avail[XPCI_BURST_MAX_STRIPES];
+    unsigned long long  used = 0, reclaim = 0, needTotal = 0, availTotal = 0, quotaLeft;
+    unsigned            pending = 0;
+    int                 nbDev = 0, i, k, ret = 0, retry;
+
+    if (frameSize==0 || nbFrames==0){
+        printf("ERROR: %s() ---> invalid burst geometry (%u frames of %u bytes).\n", __func__, nbFrames, frameSize);
+        return -1;
+    }
+    for (retry=0; retry<2; retry++){
+        nbDev = 0;
+        used = reclaim = needTotal = availTotal = 0;
+        pthread_mutex_lock(&store_lock);
+        for (i=0; i<nbDirs; i++){
+            if (stat(xpci_burstDir(i), &st) || statvfs(xpci_burstDir(i), &vfs)){
+                pthread_mutex_unlock(&store_lock);
+                printf("ERROR: %s() ---> can not stat < %s > : %s\n", __func__, xpci_burstDir(i), strerror(errno));
+                return -1;
+            }
+            // directories on the same filesystem share its free space
+            for (k=0; k<nbDev && dev[k]!=st.st_dev; k++)
+                ;
+            if (k==nbDev){
+                dev[nbDev] = st.st_dev;
+                need[nbDev] = 0;
+                avail[nbDev++] = (unsigned long long)vfs.f_bavail*vfs.f_frsize;
+                xpci_burstQueueDir(xpci_burstDir(i), 0);
+            }
+            // the spares and the burst replaced are given back to the new one
+            xpci_burstScanDir(xpci_burstDir(i), burstNumber, &info, NULL, NULL);
+            need[k]  += xpci_burstFileSize(frameSize, (nbFrames - i + nbDirs - 1)/nbDirs);
+            avail[k] += info.spareBytes + info.burstBytes;
+            used     += info.used;
+            reclaim  += info.spareBytes + info.burstBytes;
+        }
+        pending = store_stats.pendingRemovals;
+        pthread_mutex_unlock(&store_lock);
+
+        ret = 0;
+        for (k=0; k<nbDev; k++){
+            needTotal  += need[k];
+            availTotal += avail[k];
+            if (need[k]>avail[k])
+                ret = -1;
+        }
+        if (store_quota){
+            quotaLeft = (used - reclaim<store_quota) ? store_quota - (used - reclaim) : 0;
+            if (availTotal>quotaLeft)
+                availTotal = quotaLeft;
+            if (needTotal>quotaLeft)
+                ret = -1;
+        }
+        // files still being deleted free their space a little later
+        if (ret==0 || pending==0)
+            break;
+        xpci_burstWaitRemovals();
+    }
+
+    if (needed!=NULL)
+        *needed = needTotal;
+    if (available!=NULL)
+        *available = availTotal;
+    if (ret)
+        printf("ERROR: %s() ---> burst %d needs %llu MB, %llu MB available%s.\n", __func__, burstNumber,
+               needTotal>>20, availTotal>>20, store_quota ? " within the quota" : "");
+    return ret;
+}
+
+XPCI_BURST *xpci_burstCreate(int burstNumber, int type, unsigned modMask,
+                             unsigned frameSize, unsigned nbFrames){
+    XPCI_BURST *burst;
+    char        fname[200];
+    int         i;
+
+    if (frameSize==0 || nbFrames==0){
+        printf("ERROR: %s() ---> invalid burst geometry (%u frames of %u bytes).\n", __func__, nbFrames, frameSize);
+        return NULL;
+    }
+
+    // a new burst replaces the previous one with the same number
+    xpci_burstRemove(burstNumber);
+
+    if (burst_nbDirs==0){
+        xpci_burstFileName(burstNumber, fname);
+        return xpci_burstCreateFile(fname, type, modMask, frameSize, nbFrames, 0, 1);
+    }
+
+    // striped: frame f goes to the container of directory f%nbDirs
+    burst = xpci_burstNewWriter();
+    if (burst==NULL)
+        return NULL;
+    burst->nbStripes       = burst_nbDirs;
+    burst->hdr.imgType     = type;
+    burst->hdr.modMask     = modMask;
+    burst->hdr.frameSize   = frameSize;
+    burst->hdr.frameStride = xpci_burstSlotSize(frameSize, burst_codec);
+    burst->hdr.nbFrames    = nbFrames;
+    burst->hdr.nbStripes   = burst_nbDirs;
+    burst->hdr.codec       = burst_codec;
+    for (i=0; i<burst->nbStripes; i++){
+        if (snprintf(fname, sizeof(fname), "%s/burst_%d_stripe_%d.bin", burst_dirs[i], burstNumber, i)
+            >=(int)sizeof(fname)){
+            printf("ERROR: %s() ---> path too long in %s.\n", __func__, burst_dirs[i]);
+            break;
+        }
+        burst->stripes[i] = xpci_burstCreateFile(fname, type, modMask, frameSize,
+                                                 (nbFrames - i + burst->nbStripes - 1)/burst->nbStripes,
+                                                 i, burst->nbStripes);
+        if (burst->stripes[i]==NULL)
+            break;
+        burst->stats.queueDepth += burst->stripes[i]->queueDepth;
+        burst->stats.ioMode = burst->stripes[i]->ioMode;
+    }
+    if (i<burst->nbStripes || xpci_burstWriteManifest(burst, burstNumber)){
+        xpci_burstFree(burst);
+        xpci_burstRemove(burstNumber);
+        return NULL;
+    }
+    return burst;
+}
+
+int xpci_burstStripeCount(XPCI_BURST *burst){
+    return burst->nbStripes ? burst->nbStripes : 1;
+}
+
+XPCI_BURST *xpci_burstStripe(XPCI_BURST *burst, int stripe){
+    if (burst->nbStripes)
+        return (stripe>=0 && stripe<burst->nbStripes) ? burst->stripes[stripe] : NULL;
+    return stripe==0 ? burst : NULL;
+}
+
+int xpci_burstRegisterFrames(XPCI_BURST *burst, void **frames, unsigned nbFrames){
+#ifdef XPCI_HAVE_URING
+    struct iovec *iov;
+    unsigned      i;
+    int           ret;
+
+    if (burst!=NULL && burst->nbStripes){
+        for (ret=0, i=0; i<(unsigned)burst->nbStripes; i++)
+            ret |= xpci_burstRegisterFrames(burst->stripes[i], frames, nbFrames);
+        return ret;
+    }
+    if (burst==NULL || burst->ioMode!=XPCI_BURST_IO_URING || nbFrames==0)
+        return 0;
+
+    iov = malloc(nbFrames*sizeof(struct iovec));
+    burst->regFrames = malloc(nbFrames*sizeof(void*));
+    if (iov==NULL || burst->regFrames==NULL){
+        free(iov);
+        free(burst->regFrames);
+        burst->regFrames = NULL;
+        return -1;
+    }
+    for (i=0; i<nbFrames; i++){
+        iov[i].iov_base = frames[i];
+        iov[i].iov_len  = burst->hdr.frameStride;
+        burst->regFrames[i] = frames[i];
+    }
+    ret = syscall(__NR_io_uring_register, burst->ring.fd, IORING_REGISTER_BUFFERS, iov, nbFrames);
+    free(iov);
+    if (ret<0){
+        // usually RLIMIT_MEMLOCK, the frames are then mapped at each write
+        printf("WARNING: %s() ---> frame buffers not registered : %s\n", __func__, strerror(errno));
+        free(burst->regFrames);
+        burst->regFrames = NULL;
+        return -1;
+    }
+    burst->nbRegFrames = nbFrames;
+#endif
+    return 0;
+}
+
+/* frame on disk: index it and flush its index block, a reader only trusts the indexed
+   frames (a recycled spare file still holds the frames of a previous burst) */
+static int xpci_burstFrameDone(XPCI_BURST *burst, unsigned frame, unsigned stored){
+    unsigned            local = xpci_burstLocal(burst, frame);
+    XPCI_BURST_INDEX   *entry = &burst->index[local];
+    unsigned            block;
+    unsigned long long  now = xpci_timeNs();
+
+    entry->offset = burst->hdr.dataOffset + (unsigned long long)local*burst->hdr.frameStride;
+    entry->size   = stored;
+    if (!(entry->flags & XPCI_BURST_WRITTEN)){
+        entry->flags |= XPCI_BURST_WRITTEN;
+        burst->hdr.nbWritten++;
+    }
+
+    pthread_mutex_lock(&burst->statLock);
+    burst->stats.nbFrames++;
+    burst->stats.bytes += stored;
+    burst->stats.elapsedNs = now - burst->startNs;
+    if (burst->stats.elapsedNs)
+        burst->stats.mbPerSec = burst->stats.bytes*1000.0/burst->stats.elapsedNs;
+    pthread_mutex_unlock(&burst->statLock);
+
+    block = local/XPCI_BURST_IDX_PER_BLOCK*XPCI_BURST_ALIGN;
+    if (xpci_burstWriteIndex(burst, block, XPCI_BURST_ALIGN)){
+        printf("ERROR: %s() ---> index write FAILED : %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void xpci_burstStatSubmit(XPCI_BURST *burst){
+    unsigned inFlight = burst->submitted - burst->retired;
+
+    pthread_mutex_lock(&burst->statLock);
+    if (burst->nbSubmits++==0)
+        burst->startNs = xpci_timeNs();
+    burst->inFlightSum += inFlight;
+    burst->stats.inFlight = inFlight;
+    if (inFlight>burst->stats.maxInFlight)
+        burst->stats.maxInFlight = inFlight;
+    burst->stats.avgInFlight = burst->inFlightSum/burst->nbSubmits;
+    pthread_mutex_unlock(&burst->statLock);
+}
+
+static int xpci_burstWriteSync(XPCI_BURST *burst, unsigned frame, const void *data, unsigned stored){
+    const void         *src = data;
+    unsigned            size;
+    unsigned long long  offset = burst->hdr.dataOffset + (unsigned long long)xpci_burstLocal(burst, frame)*burst->hdr.frameStride;
+
+    if (burst->direct){
+        // O_DIRECT needs aligned memory and whole blocks
+        size = xpci_burstRoundUp(stored);
+        if ((uintptr_t)data % XPCI_BURST_ALIGN){
+            if (burst->bounce==NULL && (burst->bounce = xpci_burstAllocFrame(burst->hdr.frameStride))==NULL){
+                printf("ERROR: %s() ---> can not allocate the bounce buffer.\n", __func__);
+                return -1;
+            }
+            memcpy(burst->bounce, data, stored);
+            src = burst->bounce;
+        }
+    }
+    else
+        size = stored;
+
+    if (xpci_burstPwrite(burst->fd, src, size, (off_t)offset)){
+        printf("ERROR: %s() ---> frame %u write FAILED : %s\n", __func__, frame, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int xpci_burstCheckFrame(XPCI_BURST *burst, unsigned frame, const char *func){
+    if (burst==NULL || !burst->writer || frame%burst->hdr.nbStripes!=burst->hdr.stripe
+        || xpci_burstLocal(burst, frame)>=burst->hdr.nbFrames){
+        printf("ERROR: %s() ---> invalid frame %u.\n", func, frame);
+        return -1;
+    }
+    return 0;
+}
+
+/* the frame holds raw data (codec 0) or a frame encoded by xpci_codecEncode() */
+static int xpci_burstCheckData(XPCI_BURST *burst, int encoded, unsigned stored, const char *func){
+    if ((burst->hdr.codec!=XPCI_CODEC_NONE)!=encoded){
+        printf("ERROR: %s() ---> the frames of this burst are %s.\n", func, encoded ? "raw" : "encoded");
+        return -1;
+    }
+    if (stored>burst->hdr.frameStride){
+        printf("ERROR: %s() ---> %u bytes do not fit in a frame.\n", func, stored);
+        return -1;
+    }
+    return 0;
+}
+
+static int xpci_burstWrite(XPCI_BURST *burst, unsigned frame, const void *data, unsigned stored){
+    if (xpci_burstCheckFrame(burst, frame, __func__))
+        return -1;
+    // keep the submission order of the frames already in flight
+    while (burst->retired<burst->submitted)
+        if (xpci_burstCompleteFrames(burst, 1)<0)
+            return -1;
+
+    burst->submitted++;
+    xpci_burstStatSubmit(burst);
+    if (xpci_burstWriteSync(burst, frame, data, stored) || xpci_burstFrameDone(burst, frame, stored)){
+        burst->ioError = 1;
+        return -1;
+    }
+    burst->retired++;
+
+    pthread_mutex_lock(&burst->statLock);
+    burst->stats.inFlight = burst->submitted - burst->retired;
+    pthread_mutex_unlock(&burst->statLock);
+    return 0;
+}
+
+int xpci_burstWriteFrame(XPCI_BURST *burst, unsigned frame, const void *data){
+    if (burst!=NULL && burst->nbStripes)
+        burst = burst->stripes[frame % burst->nbStripes];
+    if (burst==NULL || xpci_burstCheckData(burst, 0, burst->hdr.frameSize, __func__))
+        return -1;
+    return xpci_burstWrite(burst, frame, data, burst->hdr.frameSize);
+}
+
+int xpci_burstWriteEncoded(XPCI_BURST *burst, unsigned frame, const void *data, unsigned size){
+    if (burst!=NULL && burst->nbStripes)
+        burst = burst->stripes[frame % burst->nbStripes];
+    if (burst==NULL || xpci_burstCheckData(burst, 1, size, __func__))
+        return -1;
+    return xpci_burstWrite(burst, frame, data, size);
+}
+
+static int xpci_burstSubmit(XPCI_BURST *burst, unsigned frame, const void *data, unsigned stored){
+#ifdef XPCI_HAVE_URING
+    XPCI_BURST_IO       *io;
+    struct io_uring_sqe *sqe;
+    unsigned             slot;
+    int                  reg = -1;
+    unsigned             i;
+#endif
+
+    if (xpci_burstCheckFrame(burst, frame, __func__))
+        return -1;
+    if (burst->ioError)
+        return -1;
+
+#ifdef XPCI_HAVE_URING
+    // O_DIRECT can not have an unaligned frame in flight, it goes through the bounce copy
+    if (burst->ioMode==XPCI_BURST_IO_URING && !(burst->direct && (uintptr_t)data % XPCI_BURST_ALIGN)){
+        while (burst->submitted-burst->retired>=burst->queueDepth)
+            if (xpci_burstCompleteFrames(burst, 1)<0)
+                return -1;
+
+        sqe = xpci_uringGetSqe(&burst->ring);
+        if (sqe==NULL){
+            printf("ERROR: %s() ---> submission queue full.\n", __func__);
+            return -1;
+        }
+
+        slot = burst->submitted % burst->queueDepth;
+        io = &burst->io[slot];
+        io->frame = frame;
+        io->data  = data;
+        io->size  = burst->direct ? xpci_burstRoundUp(stored) : stored;
+        io->stored = stored;
+        io->done  = 0;
+        io->res   = 0;
+
+        for (i=0; i<burst->nbRegFrames; i++)
+            if (burst->regFrames[i]==data){
+                reg = i;
+                break;
+            }
+        if (reg>=0){
+            sqe->opcode    = IORING_OP_WRITE_FIXED;
+            sqe->addr      = (uintptr_t)data;
+            sqe->len       = io->size;
+            sqe->buf_index = reg;
+        }
+        else{
+            io->iov.iov_base = (void*)data;
+            io->iov.iov_len  = io->size;
+            sqe->opcode      = IORING_OP_WRITEV;
+            sqe->addr        = (uintptr_t)&io->iov;
+            sqe->len         = 1;
+        }
+        sqe->fd        = burst->fd;
+        sqe->off       = burst->hdr.dataOffset + (unsigned long long)xpci_burstLocal(burst, frame)*burst->hdr.frameStride;
+        sqe->user_data = slot;
+        xpci_uringQueue(&burst->ring);
+
+        burst->submitted++;
+        xpci_burstStatSubmit(burst);
+        // the queued frames go to the kernel together in xpci_burstCompleteFrames()
+        return 0;
+    }
+#endif
+    return xpci_burstWrite(burst, frame, data, stored);
+}
+
+int xpci_burstSubmitFrame(XPCI_BURST *burst, unsigned frame, const void *data){
+    if (burst!=NULL && burst->nbStripes)
+        burst = burst->stripes[frame % burst->nbStripes];
+    if (burst==NULL || xpci_burstCheckData(burst, 0, burst->hdr.frameSize, __func__))
+        return -1;
+    return xpci_burstSubmit(burst, frame, data, burst->hdr.frameSize);
+}
+
+int xpci_burstSubmitEncoded(XPCI_BURST *burst, unsigned frame, const void *data, unsigned size){
+    if (burst!=NULL && burst->nbStripes)
+        burst = burst->stripes[frame % burst->nbStripes];
+    if (burst==NULL || xpci_burstCheckData(burst, 1, size, __func__))
+        return -1;
+    return xpci_burstSubmit(burst, frame, data, size);
+}
+
+#ifdef XPCI_HAVE_URING
+/* marks done the frames of the completions posted by the kernel */
+static void xpci_burstReap(XPCI_BURST *burst){
+    XPCI_BURST_IO       *io;
+    struct io_uring_cqe *cqe;
+    unsigned             head, tail;
+
+    head = *burst->ring.cqHead;
+    tail = __atomic_load_n(burst->ring.cqTail, __ATOMIC_ACQUIRE);
+    while (head!=tail){
+        cqe = &burst->ring.cqes[head & *burst->ring.cqMask];
+        io = &burst->io[cqe->user_data];
+        io->res  = cqe->res;
+        io->done = 1;
+        head++;
+    }
+    __atomic_store_n(burst->ring.cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* after an error: waits until the kernel no longer writes from the buffers of the frames in flight */
+static void xpci_burstDrain(XPCI_BURST *burst){
+    unsigned i, busy;
+
+    if (burst->ioMode!=XPCI_BURST_IO_URING)
+        return;
+    for (;;){
+        busy = 0;
+        for (i=burst->retired; i!=burst->submitted; i++)
+            if (!burst->io[i % burst->queueDepth].done)
+                busy++;
+        if (busy==0)
+            return;
+        if (xpci_uringEnter(&burst->ring, 1)){
+            printf("ERROR: %s() ---> io_uring_enter FAILED : %s\n", __func__, strerror(errno));
+            return;
+        }
+        xpci_burstReap(burst);
+    }
+}
+#endif
+
+int xpci_burstCompleteFrames(XPCI_BURST *burst, int wait){
+#ifdef XPCI_HAVE_URING
+    XPCI_BURST_IO       *io;
+    unsigned long long   offset;
+#endif
+
+    if (burst==NULL || burst->ioError)
+        return -1;
+    if (burst->nbStripes){
+        printf("ERROR: %s() ---> the frames of a striped burst are completed by stripe.\n", __func__);
+        return -1;
+    }
+    if (burst->ioMode!=XPCI_BURST_IO_URING)
+        return burst->retired;
+
+#ifdef XPCI_HAVE_URING
+    if (xpci_uringEnter(&burst->ring, (wait && burst->submitted>burst->retired) ? 1 : 0)){
+        printf("ERROR: %s() ---> io_uring_enter FAILED : %s\n", __func__, strerror(errno));
+        burst->ioError = 1;
+        return -1;
+    }
+
+    xpci_burstReap(burst);
+
+    // frames are retired in submission order so that the caller can recycle its buffers
+    while (burst->retired<burst->submitted){
+        io = &burst->io[burst->retired % burst->queueDepth];
+        if (!io->done)
+            break;
+        offset = burst->hdr.dataOffset + (unsigned long long)xpci_burstLocal(burst, io->frame)*burst->hdr.frameStride;
+        if (io->res<0){
+            printf("ERROR: %s() ---> frame %u write FAILED : %s\n", __func__, io->frame, strerror(-io->res));
+            burst->ioError = 1;
+            return -1;
+        }
+        if ((unsigned)io->res<io->size
+            && xpci_burstPwrite(burst->fd, (const char*)io->data + io->res, io->size - io->res, (off_t)(offset + io->res))){
+            printf("ERROR: %s() ---> frame %u write FAILED : %s\n", __func__, io->frame, strerror(errno));
+            burst->ioError = 1;
+            return -1;
+        }
+        io->done = 0;
+        burst->retired++;
+        if (xpci_burstFrameDone(burst, io->frame, io->stored)){
+            burst->ioError = 1;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&burst->statLock);
+    burst->stats.inFlight = burst->submitted - burst->retired;
+    pthread_mutex_unlock(&burst->statLock);
+#endif
+    return burst->retired;
+}
+
+void xpci_burstGetStats(XPCI_BURST *burst, XPCI_BURST_STATS *stats){
+    XPCI_BURST_STATS stripe;
+    double           inFlightSum = 0;
+    int              i;
+
+    if (burst==NULL || !burst->writer){
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    if (burst->nbStripes){
+        // stripes run in parallel: the burst rate is the sum of the stripe rates
+        *stats = burst->stats;
+        for (i=0; i<burst->nbStripes; i++){
+            xpci_burstGetStats(burst->stripes[i], &stripe);
+            stats->inFlight    += stripe.inFlight;
+            stats->maxInFlight += stripe.maxInFlight;
+            stats->nbFrames    += stripe.nbFrames;
+            stats->bytes       += stripe.bytes;
+            stats->mbPerSec    += stripe.mbPerSec;
+            inFlightSum        += stripe.avgInFlight;
+            if (stripe.elapsedNs>stats->elapsedNs)
+                stats->elapsedNs = stripe.elapsedNs;
+        }
+        stats->avgInFlight = inFlightSum;
+        return;
+    }
+    pthread_mutex_lock(&burst->statLock);
+    *stats = burst->stats;
+    pthread_mutex_unlock(&burst->statLock);
+}
+
+static XPCI_BURST *xpci_burstOpenFile(const char *fname){
+    XPCI_BURST *burst;
+
+    burst = calloc(1, sizeof(XPCI_BURST));
+    if (burst==NULL){
+        printf("ERROR: %s() ---> can not allocate the burst handle.\n", __func__);
+        return NULL;
+    }
+    strcpy(burst->fname, fname);
+
+    burst->fd = open(burst->fname, O_RDONLY);
+    if (burst->fd<0){
+        xpci_burstFree(burst);
+        return NULL;
+    }
+
+    if (xpci_burstPread(burst->fd, &burst->hdr, sizeof(burst->hdr), 0)
+        || memcmp(burst->hdr.magic, XPCI_BURST_MAGIC, sizeof(burst->hdr.magic))
+        || burst->hdr.version>XPCI_BURST_VERSION){
+        printf("ERROR: %s() ---> < %s > is not a burst file.\n", __func__, burst->fname);
+        xpci_burstFree(burst);
+        return NULL;
+    }
+    if (burst->hdr.version<2){
+        burst->hdr.stripe = 0;
+        burst->hdr.nbStripes = 1;
+    }
+    if (burst->hdr.version<3)
+        burst->hdr.codec = XPCI_CODEC_NONE;
+
+    burst->indexSize = burst->hdr.dataOffset - burst->hdr.indexOffset;
+    burst->index = malloc(burst->indexSize);
+    if (burst->index==NULL
+        || xpci_burstPread(burst->fd, burst->index, burst->indexSize, burst->hdr.indexOffset)){
+        printf("ERROR: %s() ---> can not read the index of < %s >.\n", __func__, burst->fname);
+        xpci_burstFree(burst);
+        return NULL;
+    }
+
+    return burst;
+}
+
+XPCI_BURST *xpci_burstOpen(int burstNumber){
+    XPCI_BURST *burst;
+    char        fname[200];
+    char        fnames[XPCI_BURST_MAX_STRIPES][200];
+    unsigned    nbFrames;
+    int         nbStripes, i;
+
+    if (xpci_burstReadManifest(burstNumber, &nbFrames, &nbStripes, fnames)){
+        xpci_burstFileName(burstNumber, fname);
+        return xpci_burstOpenFile(fname);
+    }
+
+    burst = calloc(1, sizeof(XPCI_BURST));
+    if (burst==NULL){
+        printf("ERROR: %s() ---> can not allocate the burst handle.\n", __func__);
+        return NULL;
+    }
+    burst->fd = -1;
+    burst->nbStripes = nbStripes;
+    for (i=0; i<nbStripes; i++){
+        burst->stripes[i] = xpci_burstOpenFile(fnames[i]);
+        if (burst->stripes[i]==NULL || burst->stripes[i]->hdr.nbStripes!=(unsigned)nbStripes
+            || burst->stripes[i]->hdr.stripe!=(unsigned)i){
+            printf("ERROR: %s() ---> stripe %d of burst %d missing or invalid.\n", __func__, i, burstNumber);
+            xpci_burstFree(burst);
+            return NULL;
+        }
+    }
+    burst->hdr = burst->stripes[0]->hdr;
+    burst->hdr.stripe   = 0;
+    burst->hdr.nbFrames = nbFrames;
+    return burst;
+}
+
+int xpci_burstMap(XPCI_BURST *burst){
+    struct stat  st;
+    void        *map;
+    int          i;
+
+    if (burst==NULL || burst->writer)
+        return -1;
+    for (i=0; i<burst->nbStripes; i++)
+        if (xpci_burstMap(burst->stripes[i]))
+            return -1;
+    if (burst->nbStripes || burst->map!=NULL)
+        return 0;
+
+    if (fstat(burst->fd, &st)
+        || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, burst->fd, 0))==MAP_FAILED){
+        printf("ERROR: %s() ---> can not map < %s > : %s\n", __func__, burst->fname, strerror(errno));
+        return -1;
+    }
+    burst->map = map;
+    burst->mapSize = st.st_size;
+    return 0;
+}
+
+/* container of the frame, NULL if it is not in the burst */
+static XPCI_BURST *xpci_burstContainer(XPCI_BURST *burst, unsigned frame, const char *func){
+    if (burst!=NULL && burst->nbStripes)
+        burst = frame<burst->hdr.nbFrames ? burst->stripes[frame % burst->nbStripes] : NULL;
+    if (burst==NULL || frame%burst->hdr.nbStripes!=burst->hdr.stripe
+        || xpci_burstLocal(burst, frame)>=burst->hdr.nbFrames){
+        printf("ERROR: %s() ---> invalid frame %u.\n", func, frame);
+        return NULL;
+    }
+    return burst;
+}
+
+/* position and size of the stored frame: the index is flushed at each frame, a frame
+   not indexed yet (burst still being written) is read again from the file */
+static int xpci_burstFind(XPCI_BURST *burst, unsigned frame, unsigned long long *offset, unsigned *stored){
+    unsigned            local = xpci_burstLocal(burst, frame);
+    off_t               pos = (off_t)(burst->hdr.indexOffset + local*sizeof(XPCI_BURST_INDEX));
+    XPCI_BURST_INDEX    entry;
+
+    if (burst->map!=NULL)
+        memcpy(&entry, burst->map + pos, sizeof(entry));
+    else{
+        entry = burst->index[local];
+        if (!(entry.flags & XPCI_BURST_WRITTEN) && xpci_burstPread(burst->fd, &entry, sizeof(entry), pos))
+            entry.flags = 0;
+    }
+
+    if (!(entry.flags & XPCI_BURST_WRITTEN)){
+        printf("ERROR: %s() ---> frame %u not written.\n", __func__, frame);
+        return -1;
+    }
+    *offset = entry.offset;
+    *stored = entry.size;
+    if (*stored>burst->hdr.frameStride || (burst->map!=NULL && *offset + *stored>burst->mapSize)){
+        printf("ERROR: %s() ---> frame %u corrupted.\n", __func__, frame);
+        return -1;
+    }
+    return 0;
+}
+
+const void *xpci_burstFrameData(XPCI_BURST *burst, unsigned frame, unsigned *size){
+    unsigned long long offset;
+
+    burst = xpci_burstContainer(burst, frame, __func__);
+    if (burst==NULL || burst->map==NULL || xpci_burstFind(burst, frame, &offset, size))
+        return NULL;
+    return burst->map + offset;
+}
+
+void xpci_burstReadAhead(XPCI_BURST *burst, unsigned first, unsigned nb){
+    unsigned long long  start, len;
+    unsigned            local, last;
+    long                page = sysconf(_SC_PAGESIZE);
+    int                 i;
+
+    if (burst==NULL || nb==0)
+        return;
+    for (i=0; i<burst->nbStripes; i++)
+        xpci_burstReadAhead(burst->stripes[i], first, nb);
+    if (burst->nbStripes || burst->writer || first>=burst->hdr.nbFrames*burst->hdr.nbStripes)
+        return;
+
+    // slots [local, last] of this container hold the frames of [first, first+nb[
+    local = (first + burst->hdr.nbStripes - 1 - burst->hdr.stripe)/burst->hdr.nbStripes;
+    last  = (first + nb - 1 >= burst->hdr.stripe) ? (first + nb - 1 - burst->hdr.stripe)/burst->hdr.nbStripes : 0;
+    if (first + nb - 1 < burst->hdr.stripe || local>last || local>=burst->hdr.nbFrames)
+        return;
+    if (last>=burst->hdr.nbFrames)
+        last = burst->hdr.nbFrames - 1;
+    start = burst->hdr.dataOffset + (unsigned long long)local*burst->hdr.frameStride;
+    len   = (unsigned long long)(last - local + 1)*burst->hdr.frameStride;
+    if (burst->map!=NULL){
+        start = start/page*page;
+        if (start + len>burst->mapSize)
+            len = burst->mapSize - start;
+        madvise(burst->map + start, len, MADV_WILLNEED);
+    }
+    else
+        posix_fadvise(burst->fd, (off_t)start, (off_t)len, POSIX_FADV_WILLNEED);
+}
+
+int xpci_burstReadFrame(XPCI_BURST *burst, unsigned frame, void *data, unsigned size){
+    unsigned long long  offset;
+    unsigned            stored;
+    const char         *src;
+
+    burst = xpci_burstContainer(burst, frame, __func__);
+    if (burst==NULL || xpci_burstFind(burst, frame, &offset, &stored))
+        return -1;
+    if (size>burst->hdr.frameSize)
+        size = burst->hdr.frameSize;
+
+    if (burst->map!=NULL)
+        src = burst->map + offset;
+    else if (burst->hdr.codec==XPCI_CODEC_NONE)
+        src = NULL;     // read in place
+    else if ((burst->bounce==NULL && (burst->bounce = malloc(burst->hdr.frameStride))==NULL)
+             || xpci_burstPread(burst->fd, burst->bounce, stored, (off_t)offset)){
+        printf("ERROR: %s() ---> frame %u read FAILED.\n", __func__, frame);
+        return -1;
+    }
+    else
+        src = burst->bounce;
+
+    if (burst->hdr.codec!=XPCI_CODEC_NONE)
+        return xpci_codecDecode(src, stored, data, size);
+    if (src!=NULL)
+        memcpy(data, src, size);
+    else if (xpci_burstPread(burst->fd, data, size, (off_t)offset)){
+        printf("ERROR: %s() ---> frame %u read FAILED.\n", __func__, frame);
+        return -1;
+    }
+    return 0;
+}
+
+const XPCI_BURST_HEADER *xpci_burstHeader(XPCI_BURST *burst){
+    int i;
+
+    if (burst->nbStripes)
+        for (burst->hdr.nbWritten=0, i=0; i<burst->nbStripes; i++)
+            burst->hdr.nbWritten += burst->stripes[i]->hdr.nbWritten;
+    return &burst->hdr;
+}
+
+int xpci_burstClose(XPCI_BURST *burst){
+    int ret = 0;
+    int i;
+
+    if (burst==NULL)
+        return 0;
+
+    for (i=0; i<burst->nbStripes; i++){
+        if (xpci_burstClose(burst->stripes[i]))
+            ret = -1;
+        burst->stripes[i] = NULL;
+    }
+    if (burst->writer && !burst->nbStripes){
+        // the frames still in flight must be on disk before the index is
+        while (burst->retired<burst->submitted && !burst->ioError)
+            xpci_burstCompleteFrames(burst, 1);
+        if (burst->ioError){
+            // the buffers are given back to the caller once the kernel is done with them
+#ifdef XPCI_HAVE_URING
+            xpci_burstDrain(burst);
+#endif
+            ret = -1;
+        }
+        if (xpci_burstWriteIndex(burst, 0, burst->indexSize) || xpci_burstWriteHeader(burst)){
+            printf("ERROR: %s() ---> can not update the index of < %s > : %s\n", __func__, burst->fname, strerror(errno));
+            ret = -1;
+        }
+    }
+    xpci_burstFree(burst);
+    return ret;
+}
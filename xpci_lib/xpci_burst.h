@@ -0,0 +1,163 @@
+/*******************************************************
+                       xpci_burst.h
+
+ Burst container file used by the SSD (film) mode.
+ All the raw frames of a burst are stored in one
+ preallocated file:
+
+   [header][frame index][frame 0][frame 1]...
+
+ The header, the index and every frame start on a
+ XPCI_BURST_ALIGN boundary so that the file can be
+ written with O_DIRECT.
+ The frames of an encoded burst (xpci_burstSetCodec())
+ are XPCI_CODEC_FRAME frames of variable size, the index
+ keeps the size of each one, their slot stays the same.
+ A burst can also be striped round-robin over several
+ directories (one container per directory, frame f in
+ stripe f%nbStripes); the stripe manifest
+ XPCI_BURST_DIR/burst_<n>.stripes lists the containers.
+ Removed containers become spare files, reused by the
+ next bursts of their directory, or are deleted by a
+ background thread; a quota bounds the space taken by
+ the burst files.
+*******************************************************/
+#ifndef XPCI_BURST_FILE
+#define XPCI_BURST_FILE
+
+#include <stdint.h>
+
+#define XPCI_BURST_DIR       "/opt/imXPAD/tmp"
+#define XPCI_BURST_MAGIC     "XPADBRST"
+#define XPCI_BURST_VERSION   3
+#define XPCI_BURST_MAX_STRIPES 8
+#define XPCI_BURST_ALIGN     4096
+
+/* index entry flags, a frame is only read once it is indexed */
+#define XPCI_BURST_WRITTEN   0x1
+
+/* writer backends */
+#define XPCI_BURST_IO_BEST   -1  // io_uring when the kernel provides it
+#define XPCI_BURST_IO_SYNC    0  // one blocking pwrite() per frame
+#define XPCI_BURST_IO_URING   1  // several frames in flight through io_uring
+#define XPCI_BURST_MAX_DEPTH 64
+
+typedef struct {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  headerSize;   // bytes reserved for the header
+    uint32_t  imgType;      // enum IMG_TYPE of the raw frames
+    uint32_t  modMask;
+    uint32_t  frameSize;    // raw frame size in bytes
+    uint32_t  frameStride;  // room of a frame in the file (multiple of XPCI_BURST_ALIGN)
+    uint32_t  nbFrames;     // frames allocated in the file
+    uint32_t  nbWritten;    // frames written (updated when the file is closed)
+    uint64_t  indexOffset;
+    uint64_t  dataOffset;
+    uint32_t  stripe;       // frames stripe, stripe+nbStripes... of the burst (version 2)
+    uint32_t  nbStripes;
+    uint32_t  codec;        // XPCI_CODEC_xxx of the frames (version 3)
+} XPCI_BURST_HEADER;
+
+typedef struct {
+    uint64_t  offset;       // position of the frame in the file
+    uint32_t  size;         // bytes stored (encoded size for an encoded burst)
+    uint32_t  flags;
+} XPCI_BURST_INDEX;
+
+/* burst files of the directories in use */
+typedef struct {
+    unsigned long long  quota;            // bytes, 0: no quota
+    unsigned long long  used;             // bytes allocated to the burst files (spares included)
+    unsigned long long  spareBytes;
+    unsigned            nbSpares;
+    unsigned            pendingRemovals;  // files waiting for the deleter
+    unsigned long long  removedFiles;
+    unsigned long long  recycledFiles;    // containers created from a spare
+} XPCI_BURST_STORAGE;
+
+/* writer throughput, readable while the burst is written */
+typedef struct {
+    int                 ioMode;       // backend in use
+    unsigned            queueDepth;   // frames allowed in flight
+    unsigned            inFlight;     // frames in flight now
+    unsigned            maxInFlight;
+    double              avgInFlight;  // mean frames in flight after a submission
+    unsigned            nbFrames;     // frames on disk
+    unsigned long long  bytes;        // bytes of the frames stored
+    unsigned long long  elapsedNs;    // first submission to last completion
+    double              mbPerSec;
+} XPCI_BURST_STATS;
+
+typedef struct XPCI_BURST XPCI_BURST;
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+void        xpci_burstFileName(int burstNumber, char *fname);
+/* stripe the next bursts over these directories (nbDirs=0: XPCI_BURST_DIR only) */
+int         xpci_burstSetStripeDirs(int nbDirs, const char **dirs);
+/* the containers are renamed at once and kept as spares or deleted in the background */
+int         xpci_burstRemove(int burstNumber);
+/* per image files burst_<n>_img_<i>.bin of the former film mode, deleted in the background */
+int         xpci_burstRemoveImages(int burstNumber);
+int         xpci_burstWaitRemovals(void);
+
+/* storage */
+int         xpci_burstSetQuota(unsigned long long bytes);
+/* spare files kept per directory (1 by default), 0 deletes the spares */
+int         xpci_burstSetSpareFiles(int nbFiles);
+int         xpci_burstDropSpares(void);
+/* 0 if the directories and the quota can hold a burst of nbFrames frames (current
+   codec and stripes), counting the spares and the burst replaced as free */
+int         xpci_burstCheckSpace(int burstNumber, unsigned frameSize, unsigned nbFrames,
+                                 unsigned long long *needed, unsigned long long *available);
+void        xpci_burstGetStorage(XPCI_BURST_STORAGE *storage);
+unsigned    xpci_burstFrameStride(unsigned frameSize);
+void       *xpci_burstAllocFrame(unsigned frameSize);
+
+/* writer */
+int         xpci_burstSetIoMode(int mode);
+int         xpci_burstSetQueueDepth(int depth);
+/* frames of the next bursts stored as given by xpci_codecEncode() with this codec
+   (XPCI_CODEC_NONE: raw frames) */
+int         xpci_burstSetCodec(int codec);
+const char *xpci_burstIoModeName(int mode);
+XPCI_BURST *xpci_burstCreate(int burstNumber, int type, unsigned modMask,
+                             unsigned frameSize, unsigned nbFrames);
+/* frames from xpci_burstAllocFrame() written with no extra mapping (io_uring fixed buffers) */
+int         xpci_burstRegisterFrames(XPCI_BURST *burst, void **frames, unsigned nbFrames);
+/* container of each stripe, written by its own thread (the burst itself when not striped) */
+int         xpci_burstStripeCount(XPCI_BURST *burst);
+XPCI_BURST *xpci_burstStripe(XPCI_BURST *burst, int stripe);
+/* data aligned on XPCI_BURST_ALIGN must come from xpci_burstAllocFrame() (whole
+   frame stride readable), other buffers go through an internal bounce copy */
+int         xpci_burstWriteFrame(XPCI_BURST *burst, unsigned frame, const void *data);
+/* asynchronous writes: data must stay untouched until the frame is completed.
+   xpci_burstCompleteFrames() returns the number of submitted frames that are on
+   disk, in submission order (-1 on write error), wait!=0 blocks for one completion */
+int         xpci_burstSubmitFrame(XPCI_BURST *burst, unsigned frame, const void *data);
+/* same for the encoded bursts: data holds size bytes, from a buffer of
+   xpci_burstAllocFrame(xpci_codecBound(frameSize)) to avoid the bounce copy */
+int         xpci_burstWriteEncoded(XPCI_BURST *burst, unsigned frame, const void *data, unsigned size);
+int         xpci_burstSubmitEncoded(XPCI_BURST *burst, unsigned frame, const void *data, unsigned size);
+int         xpci_burstCompleteFrames(XPCI_BURST *burst, int wait);
+void        xpci_burstGetStats(XPCI_BURST *burst, XPCI_BURST_STATS *stats);
+
+/* reader, the frames of an encoded burst are decoded */
+XPCI_BURST *xpci_burstOpen(int burstNumber);
+int         xpci_burstReadFrame(XPCI_BURST *burst, unsigned frame, void *data, unsigned size);
+/* maps the containers: frames are then read in place and xpci_burstReadFrame()
+   can be called from several threads */
+int         xpci_burstMap(XPCI_BURST *burst);
+/* stored bytes of a frame in the mapping (raw frame or XPCI_CODEC_FRAME), NULL if not mapped */
+const void *xpci_burstFrameData(XPCI_BURST *burst, unsigned frame, unsigned *size);
+/* asks the kernel to read frames [first, first+nb[ in advance */
+void        xpci_burstReadAhead(XPCI_BURST *burst, unsigned first, unsigned nb);
+const XPCI_BURST_HEADER *xpci_burstHeader(XPCI_BURST *burst);
+
+int         xpci_burstClose(XPCI_BURST *burst);
+#ifdef __cplusplus
+}
+#endif
+#endif
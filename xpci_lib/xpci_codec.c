@@ -0,0 +1,394 @@
+/*******************************************************
+                       xpci_codec.c
+
+ Lossless codecs of the raw frames, see xpci_codec.h.
+ XPCI_CODEC_SPARSE payload, over the 16 bits words:
+   [zeros][n][n literal words] ... until rawSize
+ XPCI_CODEC_BITPLANE payload, by blocks of 64 words
+ (the last one padded with zeros):
+   [16 bits mask of the planes kept][64 bits plane]...
+ plane b holding bit b of the 64 words of the block.
+ Words and planes are stored in the host byte order.
+*******************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "xpci_codec.h"
+#include "xpci_time.h"
+
+#define XPCI_CODEC_BLOCK    64        // words per bit plane block
+#define XPCI_CODEC_MAX_RUN  0xffff
+
+/* frame being encoded by the pool */
+typedef struct {
+    const void  *src;
+    unsigned     rawSize;
+    void        *dst;
+    unsigned     cap;
+    int          done;
+    int          result;
+} XPCI_CODEC_JOB;
+
+struct XPCI_CODEC_POOL {
+    int                codec;
+    int                nbThreads;
+    pthread_t          threads[XPCI_CODEC_MAX_THREADS];
+    XPCI_CODEC_JOB    *jobs;
+    unsigned           nbJobs;
+    unsigned           head;       // jobs submitted
+    unsigned           take;       // jobs started by the threads
+    unsigned           tail;       // results collected
+    int                stop;
+    pthread_mutex_t    lock;
+    pthread_cond_t     work;
+    pthread_cond_t     done;
+    XPCI_CODEC_STATS   stats;
+};
+
+const char *xpci_codecName(int codec){
+    switch(codec){
+    case XPCI_CODEC_NONE:     return "none";
+    case XPCI_CODEC_SPARSE:   return "sparse";
+    case XPCI_CODEC_BITPLANE: return "bitplane";
+    default:                  return "unknown";
+    }
+}
+
+unsigned xpci_codecBound(unsigned rawSize){
+    return sizeof(XPCI_CODEC_FRAME) + rawSize;
+}
+
+static unsigned xpci_codecGetWord(const uint8_t *src, unsigned k){
+    uint16_t w;
+
+    memcpy(&w, src + 2*k, sizeof(w));
+    return w;
+}
+
+/* payload size, 0 when it would not be smaller than the raw frame */
+static unsigned xpci_codecSparse(const uint8_t *src, unsigned nbWords, uint8_t *dst, unsigned limit){
+    unsigned  k = 0, zeros, n, out = 0;
+    uint16_t  hdr[2];
+
+    while (k<nbWords){
+        for (zeros=0; k<nbWords && zeros<XPCI_CODEC_MAX_RUN && xpci_codecGetWord(src, k)==0; k++)
+            zeros++;
+        // a literal run stops at 2 zero words, a single zero costs less than a new run
+        for (n=0; k+n<nbWords && n<XPCI_CODEC_MAX_RUN; n++)
+            if (xpci_codecGetWord(src, k+n)==0 && (k+n+1==nbWords || xpci_codecGetWord(src, k+n+1)==0))
+                break;
+        if (out + sizeof(hdr) + 2*n >= limit)
+            return 0;
+        hdr[0] = zeros;
+        hdr[1] = n;
+        memcpy(dst + out, hdr, sizeof(hdr));
+        memcpy(dst + out + sizeof(hdr), src + 2*k, 2*n);
+        out += sizeof(hdr) + 2*n;
+        k += n;
+    }
+    return out;
+}
+
+static unsigned xpci_codecBitplane(const uint8_t *src, unsigned nbWords, uint8_t *dst, unsigned limit){
+    uint64_t  planes[16], plane;
+    uint16_t  mask, words[XPCI_CODEC_BLOCK];
+    unsigned  first, i, n, b, w, any, nz, out = 0;
+
+    for (first=0; first<nbWords; first+=XPCI_CODEC_BLOCK){
+        n = nbWords - first < XPCI_CODEC_BLOCK ? nbWords - first : XPCI_CODEC_BLOCK;
+        for (any=0, nz=0, i=0; i<n; i++){
+            words[i] = xpci_codecGetWord(src, first+i);
+            any |= words[i];
+            nz += words[i]!=0;
+        }
+        memset(planes, 0, sizeof(planes));
+        if (nz<=XPCI_CODEC_BLOCK/4){
+            // few photons: only the bits set are visited
+            for (i=0; i<n; i++)
+                for (w=words[i]; w; w &= w - 1)
+                    planes[__builtin_ctz(w)] |= (uint64_t)1 << i;
+        }
+        else{
+            // the planes above the highest bit set are not scanned
+            for (b=0; b<16 && (any>>b); b++){
+                for (plane=0, i=0; i<n; i++)
+                    plane |= (uint64_t)((words[i]>>b) & 1) << i;
+                planes[b] = plane;
+            }
+        }
+        for (mask=0, b=0; b<16; b++)
+            if (planes[b])
+                mask |= 1 << b;
+        if (out + sizeof(mask) + __builtin_popcount(mask)*sizeof(uint64_t) >= limit)
+            return 0;
+        memcpy(dst + out, &mask, sizeof(mask));
+        out += sizeof(mask);
+        for (b=0; b<16; b++)
+            if (planes[b]){
+                memcpy(dst + out, &planes[b], sizeof(uint64_t));
+                out += sizeof(uint64_t);
+            }
+    }
+    return out;
+}
+
+int xpci_codecEncode(int codec, const void *src, unsigned rawSize, void *dst, unsigned cap){
+    XPCI_CODEC_FRAME  hdr;
+    uint8_t          *payload = (uint8_t*)dst + sizeof(hdr);
+    unsigned          size = 0;
+
+    if (cap<xpci_codecBound(rawSize)){
+        printf("ERROR: %s() ---> %u bytes can not hold an encoded frame of %u bytes.\n", __func__, cap, rawSize);
+        return -1;
+    }
+    if (rawSize%2==0){
+        if (codec==XPCI_CODEC_SPARSE)
+            size = xpci_codecSparse(src, rawSize/2, payload, rawSize);
+        else if (codec==XPCI_CODEC_BITPLANE)
+            size = xpci_codecBitplane(src, rawSize/2, payload, rawSize);
+    }
+    if (size==0){
+        // no gain: the frame is kept as is
+        codec = XPCI_CODEC_NONE;
+        size = rawSize;
+        memcpy(payload, src, rawSize);
+    }
+
+    hdr.magic    = XPCI_CODEC_MAGIC;
+    hdr.codec    = codec;
+    hdr.reserved = 0;
+    hdr.rawSize  = rawSize;
+    hdr.size     = size;
+    memcpy(dst, &hdr, sizeof(hdr));
+    return sizeof(hdr) + size;
+}
+
+/* words [k, k+n[ of the frame, clipped to the size bytes wanted */
+static void xpci_codecPut(uint8_t *dst, unsigned size, unsigned k, const void *words, unsigned n){
+    unsigned long long  first = 2ULL*k, len = 2ULL*n;
+
+    if (first>=size)
+        return;
+    if (first+len>size)
+        len = size - first;
+    if (words!=NULL)
+        memcpy(dst + first, words, len);
+    else
+        memset(dst + first, 0, len);
+}
+
+int xpci_codecDecode(const void *src, unsigned srcSize, void *dst, unsigned size){
+    XPCI_CODEC_FRAME  hdr;
+    const uint8_t    *p = (const uint8_t*)src + sizeof(hdr), *end;
+    uint16_t          run[2], mask, words[XPCI_CODEC_BLOCK];
+    uint64_t          plane, bits;
+    unsigned          nbWords, k, b;
+
+    if (srcSize<sizeof(hdr))
+        goto corrupted;
+    memcpy(&hdr, src, sizeof(hdr));
+    if (hdr.magic!=XPCI_CODEC_MAGIC || size>hdr.rawSize || hdr.size>srcSize - sizeof(hdr))
+        goto corrupted;
+    end = p + hdr.size;
+    nbWords = (hdr.rawSize + 1)/2;
+
+    switch(hdr.codec){
+    case XPCI_CODEC_NONE:
+        if (hdr.size!=hdr.rawSize)
+            goto corrupted;
+        memcpy(dst, p, size);
+        return 0;
+
+    case XPCI_CODEC_SPARSE:
+        for (k=0; k<nbWords && 2ULL*k<size; ){
+            if (end - p < (long)sizeof(run))
+                goto corrupted;
+            memcpy(run, p, sizeof(run));
+            p += sizeof(run);
+            if (k + run[0] + run[1] > nbWords || end - p < 2L*run[1])
+                goto corrupted;
+            xpci_codecPut(dst, size, k, NULL, run[0]);
+            k += run[0];
+            xpci_codecPut(dst, size, k, p, run[1]);
+            k += run[1];
+            p += 2*run[1];
+        }
+        return 0;
+
+    case XPCI_CODEC_BITPLANE:
+        for (k=0; k<nbWords && 2ULL*k<size; k+=XPCI_CODEC_BLOCK){
+            if (end - p < (long)sizeof(mask))
+                goto corrupted;
+            memcpy(&mask, p, sizeof(mask));
+            p += sizeof(mask);
+            if (end - p < (long)(__builtin_popcount(mask)*sizeof(uint64_t)))
+                goto corrupted;
+            memset(words, 0, sizeof(words));
+            for (b=0; b<16; b++)
+                if (mask & (1 << b)){
+                    memcpy(&plane, p, sizeof(plane));
+                    p += sizeof(plane);
+                    for (bits=plane; bits; bits &= bits - 1)
+                        words[__builtin_ctzll(bits)] |= 1 << b;
+                }
+            xpci_codecPut(dst, size, k, words,
+                          nbWords - k < XPCI_CODEC_BLOCK ? nbWords - k : XPCI_CODEC_BLOCK);
+        }
+        return 0;
+    }
+
+corrupted:
+    printf("ERROR: %s() ---> corrupted encoded frame.\n", __func__);
+    return -1;
+}
+
+static void *xpci_codecThread(void *arg){
+    XPCI_CODEC_POOL     *pool = arg;
+    XPCI_CODEC_JOB      *job;
+    unsigned long long   t0, dt;
+    int                  ret;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;){
+        while (!pool->stop && pool->take==pool->head)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->take==pool->head)
+            break;
+        job = &pool->jobs[pool->take++ % pool->nbJobs];
+        pthread_mutex_unlock(&pool->lock);
+
+        t0 = xpci_timeNs();
+        ret = xpci_codecEncode(pool->codec, job->src, job->rawSize, job->dst, job->cap);
+        dt = xpci_timeNs() - t0;
+
+        pthread_mutex_lock(&pool->lock);
+        job->result = ret;
+        job->done = 1;
+        if (ret>0){
+            pool->stats.nbFrames++;
+            pool->stats.rawBytes += job->rawSize;
+            pool->stats.codedBytes += ret;
+            if (((XPCI_CODEC_FRAME*)job->dst)->codec==XPCI_CODEC_NONE)
+                pool->stats.nbStored++;
+        }
+        pool->stats.encodeNs += dt;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+XPCI_CODEC_POOL *xpci_codecPoolCreate(int codec, int nbThreads, unsigned nbJobs){
+    XPCI_CODEC_POOL *pool;
+
+    if (codec<XPCI_CODEC_NONE || codec>XPCI_CODEC_BITPLANE
+        || nbThreads<1 || nbThreads>XPCI_CODEC_MAX_THREADS || nbJobs==0){
+        printf("ERROR: %s() ---> invalid codec %d / %d threads / %u jobs.\n", __func__, codec, nbThreads, nbJobs);
+        return NULL;
+    }
+    pool = calloc(1, sizeof(XPCI_CODEC_POOL));
+    if (pool==NULL || (pool->jobs = calloc(nbJobs, sizeof(XPCI_CODEC_JOB)))==NULL){
+        printf("ERROR: %s() ---> can not allocate the pool.\n", __func__);
+        free(pool);
+        return NULL;
+    }
+    pool->codec = codec;
+    pool->nbJobs = nbJobs;
+    pool->stats.codec = codec;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (pool->nbThreads=0; pool->nbThreads<nbThreads; pool->nbThreads++)
+        if (pthread_create(&pool->threads[pool->nbThreads], NULL, xpci_codecThread, pool)!=0)
+            break;
+    pool->stats.nbThreads = pool->nbThreads;
+    if (pool->nbThreads==0){
+        printf("ERROR: %s() ---> can not start the encoding threads.\n", __func__);
+        xpci_codecPoolDestroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int xpci_codecPoolSubmit(XPCI_CODEC_POOL *pool, const void *src, unsigned rawSize, void *dst, unsigned cap){
+    XPCI_CODEC_JOB *job;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->head - pool->tail>=pool->nbJobs){
+        pthread_mutex_unlock(&pool->lock);
+        printf("ERROR: %s() ---> %u frames already being encoded.\n", __func__, pool->nbJobs);
+        return -1;
+    }
+    job = &pool->jobs[pool->head++ % pool->nbJobs];
+    job->src     = src;
+    job->rawSize = rawSize;
+    job->dst     = dst;
+    job->cap     = cap;
+    job->done    = 0;
+    job->result  = -1;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int xpci_codecPoolResult(XPCI_CODEC_POOL *pool, int wait){
+    XPCI_CODEC_JOB *job;
+    int             ret;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail==pool->head){
+        pthread_mutex_unlock(&pool->lock);
+        printf("ERROR: %s() ---> no frame submitted.\n", __func__);
+        return -1;
+    }
+    job = &pool->jobs[pool->tail % pool->nbJobs];
+    while (!job->done){
+        if (!wait){
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    ret = job->result;
+    pool->tail++;
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+unsigned xpci_codecPoolPending(XPCI_CODEC_POOL *pool){
+    unsigned n;
+
+    pthread_mutex_lock(&pool->lock);
+    n = pool->head - pool->tail;
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+void xpci_codecPoolGetStats(XPCI_CODEC_POOL *pool, XPCI_CODEC_STATS *stats){
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+    stats->ratio = stats->codedBytes ? (double)stats->rawBytes/stats->codedBytes : 0;
+    stats->mbPerSec = stats->encodeNs ? stats->rawBytes*1000.0/stats->encodeNs : 0;
+}
+
+void xpci_codecPoolDestroy(XPCI_CODEC_POOL *pool){
+    int i;
+
+    if (pool==NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=0; i<pool->nbThreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->jobs);
+    free(pool);
+}
@@ -0,0 +1,77 @@
+/*******************************************************
+                       xpci_codec.h
+
+ Lossless codecs of the raw frames written by the film
+ mode. Photon counting frames are mostly zeros and
+ small counts:
+   XPCI_CODEC_SPARSE    runs of zero words are replaced
+                        by their length
+   XPCI_CODEC_BITPLANE  blocks of 64 words are bit
+                        shuffled and only the bit planes
+                        holding a 1 are kept
+ An encoded frame starts with a XPCI_CODEC_FRAME header
+ so that it can be decoded alone; a frame that does not
+ shrink is stored as is (XPCI_CODEC_NONE).
+ A pool of threads encodes the frames of a stream and
+ gives them back in submission order.
+*******************************************************/
+#ifndef XPCI_CODEC_UNIT
+#define XPCI_CODEC_UNIT
+
+#include <stdint.h>
+
+#define XPCI_CODEC_NONE       0
+#define XPCI_CODEC_SPARSE     1
+#define XPCI_CODEC_BITPLANE   2
+
+#define XPCI_CODEC_MAGIC      0x5a435058   // "XPCZ"
+#define XPCI_CODEC_MAX_THREADS 16
+
+typedef struct {
+    uint32_t  magic;
+    uint16_t  codec;
+    uint16_t  reserved;
+    uint32_t  rawSize;      // bytes once decoded
+    uint32_t  size;         // bytes following the header
+} XPCI_CODEC_FRAME;
+
+/* encoding of a stream, readable while it runs */
+typedef struct {
+    int                 codec;
+    unsigned            nbThreads;
+    unsigned long long  nbFrames;
+    unsigned long long  nbStored;     // frames kept as is
+    unsigned long long  rawBytes;
+    unsigned long long  codedBytes;   // headers included
+    unsigned long long  encodeNs;     // summed over the threads
+    double              ratio;        // rawBytes/codedBytes
+    double              mbPerSec;     // raw MB encoded per second of one thread
+} XPCI_CODEC_STATS;
+
+typedef struct XPCI_CODEC_POOL XPCI_CODEC_POOL;
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+const char *xpci_codecName(int codec);
+/* room for the encoded frame of rawSize bytes, header included */
+unsigned    xpci_codecBound(unsigned rawSize);
+/* returns the encoded size (header included), -1 if it does not fit in cap */
+int         xpci_codecEncode(int codec, const void *src, unsigned rawSize, void *dst, unsigned cap);
+/* decodes the first size bytes of the frame (size<=rawSize) */
+int         xpci_codecDecode(const void *src, unsigned srcSize, void *dst, unsigned size);
+
+/* nbJobs frames at most between xpci_codecPoolSubmit() and xpci_codecPoolResult() */
+XPCI_CODEC_POOL *xpci_codecPoolCreate(int codec, int nbThreads, unsigned nbJobs);
+int         xpci_codecPoolSubmit(XPCI_CODEC_POOL *pool, const void *src, unsigned rawSize,
+                                 void *dst, unsigned cap);
+/* encoded size of the oldest frame submitted, 0 if not ready (wait=0), -1 on error */
+int         xpci_codecPoolResult(XPCI_CODEC_POOL *pool, int wait);
+unsigned    xpci_codecPoolPending(XPCI_CODEC_POOL *pool);
+void        xpci_codecPoolGetStats(XPCI_CODEC_POOL *pool, XPCI_CODEC_STATS *stats);
+/* waits for the frames being encoded */
+void        xpci_codecPoolDestroy(XPCI_CODEC_POOL *pool);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,356 @@
+/*******************************************************
+                       xpci_geom.c
+
+ Geometrical correction, see xpci_geom.h.
+ The output image is cut in as many parts as threads
+ (the caller computes the first one). Each part is done
+ by blocks of XPCI_GEOM_BLOCK pixels accumulated in
+ float over the taps with the gather kernel of
+ xpci_simd.c, then converted to the output format.
+ The threads are started at the first correction and
+ kept: a frame only costs a wake up and a wait.
+*******************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "xpci_geom.h"
+#include "xpci_simd.h"
+
+#define XPCI_GEOM_BLOCK  1024   // output pixels accumulated at once (4 KB of float)
+
+struct XPCI_GEOM {
+    XPCI_GEOM_HEADER  hdr;
+    size_t            outPixels;
+    uint32_t         *index;      // nbTaps*outPixels
+    float            *weight;     // nbTaps*outPixels
+};
+
+/* correction shared by the threads */
+typedef struct {
+    const XPCI_GEOM  *geom;
+    const void       *in;
+    int               inBytes;
+    void             *out;
+    int               outFormat;
+    int               nbParts;
+} XPCI_GEOM_JOB;
+
+static pthread_mutex_t  geom_applyLock = PTHREAD_MUTEX_INITIALIZER;  // one correction at a time
+static pthread_mutex_t  geom_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   geom_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   geom_done = PTHREAD_COND_INITIALIZER;
+static pthread_t        geom_threads[XPCI_GEOM_MAX_THREADS];
+static int              geom_nbStarted = 0;    // threads running, the caller not included
+static int              geom_wanted = 0;       // xpci_geomSetThreads()
+static unsigned         geom_gen = 0;          // incremented for each correction
+static unsigned         geom_startGen = 0;     // geom_gen when the threads were started
+static int              geom_pending = 0;      // parts not done yet
+static int              geom_stop = 0;
+static XPCI_GEOM_JOB    geom_job;
+
+// *******************************************************************************
+// weight table
+// *******************************************************************************
+static XPCI_GEOM *xpci_geomAlloc(const XPCI_GEOM_HEADER *hdr){
+    XPCI_GEOM *geom;
+    size_t     n;
+
+    if (hdr->nbTaps==0 || hdr->nbTaps>XPCI_GEOM_MAX_TAPS || hdr->inWidth==0 || hdr->inHeight==0
+        || hdr->outWidth==0 || hdr->outHeight==0){
+        printf("ERROR: %s() ---> %ux%u to %ux%u with %u taps.\n", __func__, hdr->inWidth, hdr->inHeight,
+               hdr->outWidth, hdr->outHeight, hdr->nbTaps);
+        return NULL;
+    }
+    geom = calloc(1, sizeof(*geom));
+    if (geom==NULL){
+        printf("ERROR: %s() ---> can not allocate the table.\n", __func__);
+        return NULL;
+    }
+    geom->hdr = *hdr;
+    geom->outPixels = (size_t)hdr->outWidth*hdr->outHeight;
+    n = geom->outPixels*hdr->nbTaps;
+    geom->index  = calloc(n, sizeof(uint32_t));
+    geom->weight = calloc(n, sizeof(float));
+    if (geom->index==NULL || geom->weight==NULL){
+        printf("ERROR: %s() ---> can not allocate %zu taps.\n", __func__, n);
+        xpci_geomFree(geom);
+        return NULL;
+    }
+    return geom;
+}
+
+XPCI_GEOM *xpci_geomCreate(unsigned inWidth, unsigned inHeight, unsigned outWidth, unsigned outHeight,
+                           unsigned nbTaps){
+    XPCI_GEOM_HEADER hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, XPCI_GEOM_MAGIC, sizeof(hdr.magic));
+    hdr.version   = XPCI_GEOM_VERSION;
+    hdr.inWidth   = inWidth;
+    hdr.inHeight  = inHeight;
+    hdr.outWidth  = outWidth;
+    hdr.outHeight = outHeight;
+    hdr.nbTaps    = nbTaps;
+    return xpci_geomAlloc(&hdr);
+}
+
+int xpci_geomSetTap(XPCI_GEOM *geom, unsigned outPixel, unsigned tap, unsigned inPixel, float weight){
+    size_t k;
+
+    if (outPixel>=geom->outPixels || tap>=geom->hdr.nbTaps
+        || inPixel>=geom->hdr.inWidth*geom->hdr.inHeight){
+        printf("ERROR: %s() ---> tap %u of pixel %u on pixel %u out of the images.\n", __func__,
+               tap, outPixel, inPixel);
+        return -1;
+    }
+    k = tap*geom->outPixels + outPixel;
+    geom->index[k]  = inPixel;
+    geom->weight[k] = weight;
+    return 0;
+}
+
+int xpci_geomSave(const XPCI_GEOM *geom, const char *path){
+    size_t  n = geom->outPixels*geom->hdr.nbTaps;
+    FILE   *fd;
+    int     ret = 0;
+
+    fd = fopen(path, "wb");
+    if (fd==NULL){
+        printf("ERROR: %s() ---> can not create %s: %s\n", __func__, path, strerror(errno));
+        return -1;
+    }
+    if (fwrite(&geom->hdr, sizeof(geom->hdr), 1, fd)!=1
+        || fwrite(geom->index, sizeof(uint32_t), n, fd)!=n
+        || fwrite(geom->weight, sizeof(float), n, fd)!=n){
+        printf("ERROR: %s() ---> can not write %s: %s\n", __func__, path, strerror(errno));
+        ret = -1;
+    }
+    if (fclose(fd) && ret==0){
+        printf("ERROR: %s() ---> can not write %s: %s\n", __func__, path, strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
+
+XPCI_GEOM *xpci_geomLoad(const char *path){
+    XPCI_GEOM_HEADER  hdr;
+    XPCI_GEOM        *geom;
+    size_t            n, k, inPixels;
+    FILE             *fd;
+
+    fd = fopen(path, "rb");
+    if (fd==NULL){
+        printf("ERROR: %s() ---> can not open %s: %s\n", __func__, path, strerror(errno));
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fd)!=1 || memcmp(hdr.magic, XPCI_GEOM_MAGIC, sizeof(hdr.magic))
+        || hdr.version!=XPCI_GEOM_VERSION){
+        printf("ERROR: %s() ---> %s is not a geometrical correction table.\n", __func__, path);
+        fclose(fd);
+        return NULL;
+    }
+    geom = xpci_geomAlloc(&hdr);
+    if (geom==NULL){
+        fclose(fd);
+        return NULL;
+    }
+    n = geom->outPixels*hdr.nbTaps;
+    if (fread(geom->index, sizeof(uint32_t), n, fd)!=n || fread(geom->weight, sizeof(float), n, fd)!=n){
+        printf("ERROR: %s() ---> %s is truncated.\n", __func__, path);
+        fclose(fd);
+        xpci_geomFree(geom);
+        return NULL;
+    }
+    fclose(fd);
+    // the kernel does not check the indexes
+    inPixels = (size_t)hdr.inWidth*hdr.inHeight;
+    for (k=0; k<n; k++)
+        if (geom->index[k]>=inPixels){
+            printf("ERROR: %s() ---> %s: tap %zu on pixel %u out of the %zu detector pixels.\n", __func__,
+                   path, k, geom->index[k], inPixels);
+            xpci_geomFree(geom);
+            return NULL;
+        }
+    return geom;
+}
+
+const XPCI_GEOM_HEADER *xpci_geomHeader(const XPCI_GEOM *geom){
+    return &geom->hdr;
+}
+
+void xpci_geomFree(XPCI_GEOM *geom){
+    if (geom==NULL)
+        return;
+    free(geom->index);
+    free(geom->weight);
+    free(geom);
+}
+
+// *******************************************************************************
+// kernel
+// *******************************************************************************
+static void xpci_geomStore(const float *acc, void *out, int outFormat, size_t first, int n){
+    uint16_t *out16 = (uint16_t*)out + first;
+    uint32_t *out32 = (uint32_t*)out + first;
+    float     v;
+    int       k;
+
+    switch(outFormat){
+    case XPCI_GEOM_FLOAT:
+        memcpy((float*)out + first, acc, n*sizeof(float));
+        break;
+    case XPCI_GEOM_UINT16:
+        for (k=0; k<n; k++){
+            v = acc[k] + 0.5f;
+            out16[k] = (v<=0.0f) ? 0 : (v>=65535.0f) ? 65535 : (uint16_t)v;
+        }
+        break;
+    default:
+        for (k=0; k<n; k++){
+            v = acc[k] + 0.5f;
+            out32[k] = (v<=0.0f) ? 0 : (v>=4294967040.0f) ? 4294967295U : (uint32_t)v;
+        }
+        break;
+    }
+}
+
+static void xpci_geomPart(const XPCI_GEOM_JOB *job, int part){
+    const XPCI_GEOM  *geom = job->geom;
+    size_t            P = geom->outPixels;
+    size_t            first, last, b;
+    float             acc[XPCI_GEOM_BLOCK];
+    unsigned          t;
+    int               n;
+
+    // parts of whole blocks
+    first = (P + XPCI_GEOM_BLOCK - 1)/XPCI_GEOM_BLOCK*part/job->nbParts*XPCI_GEOM_BLOCK;
+    last  = (P + XPCI_GEOM_BLOCK - 1)/XPCI_GEOM_BLOCK*(part + 1)/job->nbParts*XPCI_GEOM_BLOCK;
+    if (last>P)
+        last = P;
+    for (b=first; b<last; b+=XPCI_GEOM_BLOCK){
+        n = (last - b<XPCI_GEOM_BLOCK) ? (int)(last - b) : XPCI_GEOM_BLOCK;
+        memset(acc, 0, n*sizeof(float));
+        for (t=0; t<geom->hdr.nbTaps; t++){
+            if (job->inBytes==XPCI_GEOM_IN_UINT16)
+                xpci_gatherMac16(acc, geom->weight + t*P + b, geom->index + t*P + b, job->in, n);
+            else
+                xpci_gatherMac32(acc, geom->weight + t*P + b, geom->index + t*P + b, job->in, n);
+        }
+        xpci_geomStore(acc, job->out, job->outFormat, b, n);
+    }
+}
+
+static void *xpci_geomThread(void *arg){
+    int       part = (int)(intptr_t)arg;
+    unsigned  gen;
+
+    pthread_mutex_lock(&geom_lock);
+    // the first correction may be posted before the thread runs
+    gen = geom_startGen;
+    for (;;){
+        while (!geom_stop && geom_gen==gen)
+            pthread_cond_wait(&geom_work, &geom_lock);
+        if (geom_stop)
+            break;
+        gen = geom_gen;
+        pthread_mutex_unlock(&geom_lock);
+        if (part<geom_job.nbParts)
+            xpci_geomPart(&geom_job, part);
+        pthread_mutex_lock(&geom_lock);
+        if (part<geom_job.nbParts && --geom_pending==0)
+            pthread_cond_signal(&geom_done);
+    }
+    pthread_mutex_unlock(&geom_lock);
+    return NULL;
+}
+
+/* geom_applyLock held */
+static void xpci_geomStopThreads(void){
+    int i;
+
+    pthread_mutex_lock(&geom_lock);
+    geom_stop = 1;
+    pthread_cond_broadcast(&geom_work);
+    pthread_mutex_unlock(&geom_lock);
+    for (i=0; i<geom_nbStarted; i++)
+        pthread_join(geom_threads[i], NULL);
+    geom_nbStarted = 0;
+    geom_stop = 0;
+}
+
+/* geom_applyLock held, returns the parts of a correction */
+static int xpci_geomStartThreads(void){
+    long  nbCpu;
+    int   wanted = geom_wanted;
+
+    if (wanted==0){
+        nbCpu = sysconf(_SC_NPROCESSORS_ONLN);
+        wanted = (nbCpu<1) ? 1 : (nbCpu>XPCI_GEOM_MAX_THREADS) ? XPCI_GEOM_MAX_THREADS : (int)nbCpu;
+    }
+    if (geom_nbStarted==wanted - 1)
+        return wanted;
+    xpci_geomStopThreads();
+    geom_startGen = geom_gen;
+    while (geom_nbStarted<wanted - 1){
+        if (pthread_create(&geom_threads[geom_nbStarted], NULL, xpci_geomThread,
+                           (void*)(intptr_t)(geom_nbStarted + 1))!=0){
+            printf("WARNING: %s() ---> only %d threads started.\n", __func__, geom_nbStarted + 1);
+            break;
+        }
+        geom_nbStarted++;
+    }
+    return geom_nbStarted + 1;
+}
+
+int xpci_geomSetThreads(int nbThreads){
+    if (nbThreads<0 || nbThreads>XPCI_GEOM_MAX_THREADS){
+        printf("ERROR: %s() ---> nb of threads should be in [0,%d]\n", __func__, XPCI_GEOM_MAX_THREADS);
+        return -1;
+    }
+    pthread_mutex_lock(&geom_applyLock);
+    geom_wanted = nbThreads;
+    pthread_mutex_unlock(&geom_applyLock);
+    return 0;
+}
+
+int xpci_geomApply(const XPCI_GEOM *geom, const void *in, int inBytes, void *out, int outFormat){
+    size_t  inPixels = (size_t)geom->hdr.inWidth*geom->hdr.inHeight;
+
+    if ((inBytes!=XPCI_GEOM_IN_UINT16 && inBytes!=XPCI_GEOM_IN_UINT32)
+        || outFormat<XPCI_GEOM_UINT16 || outFormat>XPCI_GEOM_FLOAT){
+        printf("ERROR: %s() ---> %d bytes pixels to format %d.\n", __func__, inBytes, outFormat);
+        return -1;
+    }
+    // the 16 bits gather reads the 32 bits word holding the pixel
+    if (inBytes==XPCI_GEOM_IN_UINT16 && (inPixels & 1)){
+        printf("ERROR: %s() ---> odd number of detector pixels (%zu).\n", __func__, inPixels);
+        return -1;
+    }
+    pthread_mutex_lock(&geom_applyLock);
+    geom_job.geom      = geom;
+    geom_job.in        = in;
+    geom_job.inBytes   = inBytes;
+    geom_job.out       = out;
+    geom_job.outFormat = outFormat;
+    geom_job.nbParts   = xpci_geomStartThreads();
+
+    pthread_mutex_lock(&geom_lock);
+    geom_pending = geom_job.nbParts - 1;
+    geom_gen++;
+    pthread_cond_broadcast(&geom_work);
+    pthread_mutex_unlock(&geom_lock);
+
+    xpci_geomPart(&geom_job, 0);
+
+    pthread_mutex_lock(&geom_lock);
+    while (geom_pending>0)
+        pthread_cond_wait(&geom_done, &geom_lock);
+    pthread_mutex_unlock(&geom_lock);
+    pthread_mutex_unlock(&geom_applyLock);
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*******************************************************
+                       xpci_geom.h
+
+ Geometrical correction of the decoded images.
+ Each pixel of the corrected image is a weighted sum of
+ nbTaps pixels of the detector image; the weight table
+ is computed once (calibration) and stored in a file:
+
+   [XPCI_GEOM_HEADER][index tap 0][index tap 1]...
+                     [weight tap 0][weight tap 1]...
+
+ index: outWidth*outHeight uint32_t (detector pixel)
+ weight: outWidth*outHeight float (0 for an unused tap)
+ The taps are stored one after the other so that the
+ kernel runs along contiguous output pixels.
+*******************************************************/
+#ifndef XPCI_GEOM_CORR
+#define XPCI_GEOM_CORR
+
+#include <stdint.h>
+
+#define XPCI_GEOM_MAGIC       "XPADGEO1"
+#define XPCI_GEOM_VERSION     1
+#define XPCI_GEOM_MAX_TAPS    16
+#define XPCI_GEOM_MAX_THREADS 16
+
+/* input pixels */
+#define XPCI_GEOM_IN_UINT16   2
+#define XPCI_GEOM_IN_UINT32   4
+
+/* output pixels */
+#define XPCI_GEOM_UINT16      0   // rounded, saturated
+#define XPCI_GEOM_UINT32      1   // rounded, saturated
+#define XPCI_GEOM_FLOAT       2
+
+typedef struct {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  inWidth;
+    uint32_t  inHeight;
+    uint32_t  outWidth;
+    uint32_t  outHeight;
+    uint32_t  nbTaps;
+    uint32_t  pad[2];
+} XPCI_GEOM_HEADER;
+
+typedef struct XPCI_GEOM XPCI_GEOM;
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+/* empty table (all weights 0) to fill with xpci_geomSetTap() */
+XPCI_GEOM  *xpci_geomCreate(unsigned inWidth, unsigned inHeight, unsigned outWidth, unsigned outHeight,
+                            unsigned nbTaps);
+int         xpci_geomSetTap(XPCI_GEOM *geom, unsigned outPixel, unsigned tap, unsigned inPixel, float weight);
+int         xpci_geomSave(const XPCI_GEOM *geom, const char *path);
+XPCI_GEOM  *xpci_geomLoad(const char *path);
+const XPCI_GEOM_HEADER *xpci_geomHeader(const XPCI_GEOM *geom);
+void        xpci_geomFree(XPCI_GEOM *geom);
+
+/* threads of the kernel (the caller included), 0: one per CPU */
+int         xpci_geomSetThreads(int nbThreads);
+/* out = correction of in (inWidth*inHeight pixels of inBytes) in outFormat */
+int         xpci_geomApply(const XPCI_GEOM *geom, const void *in, int inBytes, void *out, int outFormat);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -5,12 +5,18 @@
 // *****************************************************
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "xpci_interface.h"
 #include "xpci_interface_expert.h"
 
 #include "xpci_imxpad.h"
+#include "xpci_simd.h"
+#include "xpci_burst.h"
+#include "xpci_time.h"
 
 extern int xpci_systemType;
 extern unsigned imxpad_postProc;
@@ -21,97 +27,221 @@ extern enum IMG_TYPE img_type;
 // function to verify formatting of one image line
 //
 // *******************************************************************************
-// 16 bits
-int imxpad_checkImgLine_16bits(uint16_t *line){
-
-    // check header
-    if (*(line)!=0xaa55)
-        return -1;
-    // check trailer
-    if (*(line+565)!=0xf0f0)
-        return -1;
-    // check line numbers
-    if ((*(line+4)<1)||(*(line+4)>120))
-        return -1;
-    // check line length word
-    if (*(line+2)!=0x0236)
+// The header word (0xaa55) and the line length word are tested with a single
+// masked 64 bits compare, the line number range with a single unsigned compare.
+static int imxpad_checkImgLine(uint16_t *line, int imgWidthOld, uint16_t lengthWord){
+    uint16_t ref[4]  = {0xaa55, 0, 0, 0};
+    uint16_t mask[4] = {0xffff, 0, 0xffff, 0};
+    uint64_t head, refHead, maskHead;
+
+    ref[2] = lengthWord;
+    memcpy(&head, line, sizeof(head));
+    memcpy(&refHead, ref, sizeof(refHead));
+    memcpy(&maskHead, mask, sizeof(maskHead));
+
+    // check header and line length word | trailer | line numbers
+    if (((head & maskHead) != refHead) |
+        (line[imgWidthOld-1] != 0xf0f0) |
+        ((unsigned)(line[4]-1) >= 120))
         return -1;
 
     return 0;
 }
+
+// 16 bits
+int imxpad_checkImgLine_16bits(uint16_t *line){
+    return imxpad_checkImgLine(line, 566, 0x0236);
+}
 // 32 bits
 int imxpad_checkImgLine_32bits(uint16_t *line){
-
-    // check header
-    if (*(line)!=0xaa55)
-        return -1;
-    // check trailer
-    if (*(line+1125)!=0xf0f0)
-        return -1;
-    // check line numbers
-    if ((*(line+4)<1)||(*(line+4)>120))
-        return -1;
-    // check line length word
-    if (*(line+2)!=0x0466)
-        return -1;
-
-    return 0;
+    return imxpad_checkImgLine(line, 1126, 0x0466);
 }
 
 // *******************************************************************************
-// functions to convert raw images into organized matrices 
+// geometry lookup tables
 //
+// The destination row of a raw line only depends on the module id and the line
+// number it carries, on the geometry of the detector and on the module mask
+// (S420 first module offset, number of rows). For each geometry the mapping is
+// built once in a table (index [module id][line number-1], -1 for a line that
+// can not be placed) and only rebuilt when the module mask or the system type
+// changes, so the decoders do no arithmetic per line:
+//   IMXPAD_GEO_LINEAR     row = (id-1)*120 + line-1              S70 S540 S700 S1400
+//   IMXPAD_GEO_MIRROR2    second module mirrored                 S140
+//   IMXPAD_GEO_SWAP       odd <-> even modules                   S340 (S540 decoder)
+//   IMXPAD_GEO_SWAP_FIRST odd <-> even modules from first module S420
 // *******************************************************************************
-// 16 bits
-int imxpad_raw2data_16bits(int modMask, uint16_t* oldImg, uint16_t* newImg){
-    int ret = 0;
+enum IMXPAD_GEO {IMXPAD_GEO_LINEAR, IMXPAD_GEO_MIRROR2, IMXPAD_GEO_SWAP, IMXPAD_GEO_SWAP_FIRST, IMXPAD_GEO_NB};
+#define IMXPAD_GEO_MAX_MOD  32  // module ids read in the lines are checked against this size
+
+typedef struct {
+    int           valid;
+    int           sysType, modMask;
+    int           nbLines;                              // raw lines per image
+    int16_t       row[IMXPAD_GEO_MAX_MOD][120];
+    unsigned char mirror[IMXPAD_GEO_MAX_MOD];           // pixels mirrored inside the chips
+} IMXPAD_GEOMETRY;
+
+static IMXPAD_GEOMETRY  imxpad_geo[IMXPAD_GEO_NB];
+static pthread_mutex_t  imxpad_geoMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void imxpad_buildGeometry(IMXPAD_GEOMETRY *geo, int kind, int modMask){
+    int nbRows = 120*xpci_getLastMod(modMask);
+    int firstMod = xpci_getFirstMod(modMask);
+    int id, line, mod, newRow;
+
+    for(id=0; id<IMXPAD_GEO_MAX_MOD; id++){
+        geo->mirror[id] = (kind==IMXPAD_GEO_MIRROR2) && (id!=1);
+        for(line=1; line<=120; line++){
+            switch(kind){
+            case IMXPAD_GEO_MIRROR2:
+                newRow = (id==1) ? line-1 : 240-line;
+                break;
+            case IMXPAD_GEO_SWAP:
+                newRow = (id-1)*120+line-1 + ((id%2) ? 120 : -120);
+                break;
+            case IMXPAD_GEO_SWAP_FIRST:
+                mod = id-firstMod;
+                newRow = (mod-1)*120+line-1 + ((mod%2) ? 120 : -120);
+                break;
+            default:
+                newRow = (id-1)*120+line-1;
+                break;
+            }
+            geo->row[id][line-1] = ((id<1)||(newRow<0)||(newRow>=nbRows)) ? -1 : newRow;
+        }
+    }
+    geo->nbLines = 120*xpci_getModNb(modMask);
+    geo->sysType = xpci_systemType;
+    geo->modMask = modMask;
+    geo->valid   = 1;
+}
+
+// returns the table of a geometry for the module mask (built if necessary)
+static const IMXPAD_GEOMETRY *imxpad_getGeometry(int kind, int modMask){
+    IMXPAD_GEOMETRY *geo = &imxpad_geo[kind];
+
+    pthread_mutex_lock(&imxpad_geoMutex);
+    if (!geo->valid || (geo->modMask!=modMask) || (geo->sysType!=xpci_systemType))
+        imxpad_buildGeometry(geo, kind, modMask);
+    pthread_mutex_unlock(&imxpad_geoMutex);
+    return geo;
+}
 
+// geometry used by the detector type (-1 unknown)
+static int imxpad_sysGeometry(){
     switch(xpci_systemType){
-    case IMXPAD_S70:
-        ret = imxpad_extract2BImgData_S70(modMask, oldImg, newImg);
-        break;
-    case IMXPAD_S420:
-        imxpad_extract2BImgData_S420(modMask, oldImg, newImg);
-        break;
-//    case IMXPAD_S340:
-//    case IMXPAD_S540:
-//       ret = imxpad_extract2BImgData_S540(modMask, oldImg, newImg);
-//        break;
     case IMXPAD_S140:
-        ret = imxpad_extract2BImgData_S140(modMask, oldImg, newImg);
-        break;
+        return IMXPAD_GEO_MIRROR2;
+    case IMXPAD_S420:
+        return IMXPAD_GEO_SWAP_FIRST;
+    case IMXPAD_S340:
+        return IMXPAD_GEO_SWAP;
+    case IMXPAD_S70:
     case IMXPAD_S540:
     case IMXPAD_S700:
     case IMXPAD_S1400:
-        imxpad_extract2BImgData_S1400(modMask, oldImg, newImg);
-        break;
+        return IMXPAD_GEO_LINEAR;
     }
+    return -1;
+}
+
+// Builds the tables of the detector for the module mask, to be called when the
+// acquisition is prepared so that the first image does not pay for it.
+void imxpad_initGeometry(int modMask){
+    int kind = imxpad_sysGeometry();
+    if (kind>=0)
+        imxpad_getGeometry(kind, modMask);
+}
+
+// *******************************************************************************
+// decodes raw lines with a geometry table
+// stopOnError  1 returns at the first rejected line (as the original decoders)
+//              0 skips the rejected lines
+// returns: 0 success -1 if at least one line has been rejected
+// *******************************************************************************
+static int imxpad_decodeGeo(const IMXPAD_GEOMETRY *geo, enum IMG_TYPE type, uint16_t *lines, int nbLines,
+                            void *newImg, int stopOnError){
+    int imgWidthNew = 560;
+    int imgWidthOld = (type==B2) ? 566 : 1126;
+    int headerOffset = 5;
+    int row, chip, newRow, module_id;
+    int ret = 0;
+    uint16_t *line, *pix;
+    uint16_t *dst16;
+    uint32_t *dst32;
+
+    for(row=0; row<nbLines; row++){
+        line = lines+row*imgWidthOld;
+        pix  = line+headerOffset;
+
+        // check line format (line number in [1,120]) and place
+        if (((type==B2) ? imxpad_checkImgLine_16bits(line) : imxpad_checkImgLine_32bits(line))!=0)
+            newRow = -1;
+        else {
+            module_id = line[1];
+            newRow = (module_id<IMXPAD_GEO_MAX_MOD) ? geo->row[module_id][line[4]-1] : -1;
+        }
+        if (newRow<0){
+            ret = -1;
+            if (stopOnError)
+                return -1;
+            continue;
+        }
+
+        if (type==B2){
+            dst16 = (uint16_t *)newImg + newRow*imgWidthNew;
+            if (!geo->mirror[module_id])
+                xpci_copyPix16(dst16, pix, imgWidthNew);
+            else
+                for(chip=0; chip<7; chip++)
+                    xpci_mirrorPix16(dst16+chip*80, pix+chip*80, 80);
+        }
+        else {
+            dst32 = (uint32_t *)newImg + newRow*imgWidthNew;
+            if (!geo->mirror[module_id])
+                xpci_mergePix32(dst32, pix, imgWidthNew);
+            else
+                for(chip=0; chip<7; chip++)
+                    xpci_mirrorPix32(dst32+chip*80, pix+chip*160, 80);
+        }
+    } // for(row ...
 
     return ret;
 }
 
+// decodes a complete raw image with one of the geometries
+static int imxpad_decodeImage(int kind, enum IMG_TYPE type, int modMask, uint16_t *oldImg, void *newImg){
+    const IMXPAD_GEOMETRY *geo = imxpad_getGeometry(kind, modMask);
+    return imxpad_decodeGeo(geo, type, oldImg, geo->nbLines, newImg, 1);
+}
+
+// *******************************************************************************
+// functions to convert raw images into organized matrices 
+//
+// *******************************************************************************
+// 16 bits
+int imxpad_raw2data_16bits(int modMask, uint16_t* oldImg, uint16_t* newImg){
+    int kind = imxpad_sysGeometry();
+
+    if (kind<0)
+        return 0;
+    return imxpad_decodeImage(kind, B2, modMask, oldImg, newImg);
+}
+
 
 int imxpad_raw2data_16bits_v2(int modMask, uint16_t* oldImg, uint16_t** newImg,int imgNumber){
     int ret = 0;
 
     switch(xpci_systemType){
-    case IMXPAD_S70:
-        ret = imxpad_extract2BImgData_S70(modMask, oldImg, newImg[imgNumber]);
-        break;
-    case IMXPAD_S420:
-        imxpad_extract2BImgData_S420(modMask, oldImg, newImg[imgNumber]);
-        break;
-    case IMXPAD_S340:    
-        ret = imxpad_extract2BImgData_S540(modMask, oldImg, newImg[imgNumber]);
-        break;
-    case IMXPAD_S140:
-        ret = imxpad_extract2BImgData_S140(modMask, oldImg, newImg[imgNumber]);
-        break;
     case IMXPAD_S540:
     case IMXPAD_S700:
     case IMXPAD_S1400:
         imxpad_extract2BImgData_S1400_v2(modMask, oldImg, newImg);
         break;
+    default:
+        ret = imxpad_raw2data_16bits(modMask, oldImg, newImg[imgNumber]);
+        break;
     }
 
     return ret;
@@ -122,25 +252,27 @@ int imxpad_raw2data_16bits_v2(int modMask, uint16_t* oldImg, uint16_t** newImg,i
 
 // 32 bits
 int imxpad_raw2data_32bits(int modMask, uint16_t *oldImg, uint32_t *newImg){
-    int ret = 0;
+    int kind = imxpad_sysGeometry();
 
-    switch(xpci_systemType){
-    case IMXPAD_S70:
-        ret = imxpad_extract4BImgData_S70(modMask, oldImg, newImg);
-        break;
-    case IMXPAD_S340:
-        ret = imxpad_extract4BImgData_S540(modMask, oldImg, newImg);
-        break;
-    case IMXPAD_S140:
-        ret = imxpad_extract4BImgData_S140(modMask, oldImg, newImg);
-        break;
-    case IMXPAD_S540:
-    case IMXPAD_S700:
-    case IMXPAD_S1400:
-        imxpad_extract4BImgData_S1400(modMask, oldImg, newImg);
-    }
+    if (kind<0)
+        return 0;
+    return imxpad_decodeImage(kind, B4, modMask, oldImg, newImg);
+}
 
-    return ret;
+// *******************************************************************************
+// functions to decode raw lines straight at their final place in the image
+//
+// The lines can be taken anywhere (i.e. directly in the DMA buffer of a channel
+// during the readout) and in any order because the destination row is taken
+// from the module id and line number carried by each line.
+// returns 0 success -1 if at least one line has been rejected
+// *******************************************************************************
+int imxpad_decodeLines(enum IMG_TYPE type, int modMask, uint16_t *lines, int nbLines, void *newImg){
+    int kind = imxpad_sysGeometry();
+
+    if (kind<0)
+        return -1;
+    return imxpad_decodeGeo(imxpad_getGeometry(kind, modMask), type, lines, nbLines, newImg, 0);
 }
 
 // *******************************************************************************
@@ -150,81 +282,12 @@ int imxpad_raw2data_32bits(int modMask, uint16_t *oldImg, uint32_t *newImg){
 // *******************************************************************************
 // 16 bits
 int imxpad_extract2BImgData_S140(int modMask, uint16_t *oldImg, uint16_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 566;
-    int row, col, chip = 0;
-    int newRow = 0;
-    int headerOffset = 5;
-    int module_id = 0;
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_16bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
-
-        module_id = oldImg[row*imgWidthOld+1];
-        // assing new row id (mirror horizontaly the second module)
-        if (module_id==1)
-            newRow = oldImg[row*imgWidthOld+4]-1;
-        else
-            newRow = 240-oldImg[row*imgWidthOld+4];
-
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                if (module_id==1)
-                    newImg[newRow*imgWidthNew+chip*80+col]=oldImg[row*imgWidthOld+chip*80+col+headerOffset];
-                else
-                    // mirror verticaly in the chips on the second module
-                    newImg[newRow*imgWidthNew+chip*80+(79-col)]=oldImg[row*imgWidthOld+chip*80+col+headerOffset];
-            }// for(col ...
-        } // for(chip ...
-    } // for(row ...
-
-    return 0;
+    return imxpad_decodeImage(IMXPAD_GEO_MIRROR2, B2, modMask, oldImg, newImg);
 }
 
 // 32 bits
 int imxpad_extract4BImgData_S140(int modMask, uint16_t *oldImg, uint32_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 1126;
-    int row, col, chip = 0;
-    int newRow = 0;
-    int headerOffset = 5;
-    int module_id = 0;
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_32bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
-
-        module_id = oldImg[row*imgWidthOld+1];
-        // assing new row id (mirror horizontaly the second module)
-        /*if (module_id==1)
-            newRow = (module_id-1)*120+oldImg[row*imgWidthOld+4]-1;
-        else
-            newRow = 360-(module_id-1)*120-oldImg[row*imgWidthOld+4]-1;*/
-        if (module_id==1)
-            newRow = oldImg[row*imgWidthOld+4]-1;
-        else
-            newRow = 240-oldImg[row*imgWidthOld+4];
-
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                if (module_id==1)
-                    newImg[newRow*imgWidthNew+chip*80+col]=(oldImg[row*imgWidthOld+(chip*80+col)*2+1+headerOffset]<<16)+oldImg[row*imgWidthOld+(chip*80+col)*2+headerOffset];
-                else
-                    // mirror verticaly in the chips on the second module
-                    newImg[newRow*imgWidthNew+chip*80+(79-col)]=(oldImg[row*imgWidthOld+(chip*80+col)*2+1+headerOffset]<<16)+oldImg[row*imgWidthOld+(chip*80+col)*2+headerOffset];
-
-            } // for(col ...
-        } // for(chip ...
-    } // for(row ...
-
-    return 0;
+    return imxpad_decodeImage(IMXPAD_GEO_MIRROR2, B4, modMask, oldImg, newImg);
 }
 
 // *******************************************************************************
@@ -233,31 +296,12 @@ int imxpad_extract4BImgData_S140(int modMask, uint16_t *oldImg, uint32_t *newImg
 // *******************************************************************************
 // 16 bits
 int imxpad_extract2BImgData_S70(int modMask, uint16_t *oldImg, uint16_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 566;
-    int row, col, chip = 0;
-    int headerOffset = 5;
-    int i=0;
-
-    // for(i=0; i<570; i++)
-    //  printf("%d\n", oldImg[i]);
-
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_16bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
-
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                newImg[row*imgWidthNew+chip*80+col]=oldImg[row*imgWidthOld+chip*80+col+headerOffset];
-            } // for(col ...
-        } // for(chip ...
-    } // for(row ...
+    return imxpad_decodeImage(IMXPAD_GEO_LINEAR, B2, modMask, oldImg, newImg);
+}
 
-    return 0;
+// 32 bits
+int imxpad_extract4BImgData_S70(int modMask, uint16_t *oldImg, uint32_t *newImg){
+    return imxpad_decodeImage(IMXPAD_GEO_LINEAR, B4, modMask, oldImg, newImg);
 }
 
 // *******************************************************************************
@@ -266,154 +310,26 @@ int imxpad_extract2BImgData_S70(int modMask, uint16_t *oldImg, uint16_t *newImg)
 // *******************************************************************************
 
 int imxpad_extract2BImgData_S1400(int modMask, uint16_t *oldImg, uint16_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 566;
-    int row, col, chip = 0;
-    int headerOffset = 5;
-    int i=0;
-
-    int newRow = 0;
-    int rowOffset = 0;
-    int module_id = 0;
-
-
-    // for(i=0; i<570; i++)
-    //  printf("%d\n", oldImg[i]);
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_16bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
-
-        module_id = oldImg[row*imgWidthOld+1];
-        rowOffset = (module_id-1)*120;
-        newRow = oldImg[row*imgWidthOld+4]-1 + rowOffset;
-
-
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                newImg[newRow*imgWidthNew+chip*80+col]=oldImg[row*imgWidthOld+chip*80+col+headerOffset];
-            } // for(col ...
-        } // for(chip ...
-    } // for(row ...
-    return 0;
+    return imxpad_decodeImage(IMXPAD_GEO_LINEAR, B2, modMask, oldImg, newImg);
 }
 
-
+// the lines are decoded in the image of the number they carry
 int imxpad_extract2BImgData_S1400_v2(int modMask, uint16_t *oldImg, uint16_t **newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
+    const IMXPAD_GEOMETRY *geo = imxpad_getGeometry(IMXPAD_GEO_LINEAR, modMask);
     int imgWidthOld = 566;
-    int row, col, chip = 0;
-    int headerOffset = 5;
-    int i=0;
-    int imageNumber = 0;
-
-    int newRow = 0;
-    int rowOffset = 0;
-    int module_id = 0;
-
-
-    // for(i=0; i<570; i++)
-    //  printf("%d\n", oldImg[i]);
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_16bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
-
-        module_id = oldImg[row*imgWidthOld+1];
-        rowOffset = (module_id-1)*120;
-        imageNumber = oldImg[row*imgWidthOld+3];
-        newRow = oldImg[row*imgWidthOld+4]-1 + rowOffset;
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                newImg[imageNumber][newRow*imgWidthNew+chip*80+col]=oldImg[row*imgWidthOld+chip*80+col+headerOffset];
-            } // for(col ...
-        } // for(chip ...
-    } // for(row ...
-    return 0;
-}
+    int row;
 
-
-// 32 bits
-int imxpad_extract4BImgData_S70(int modMask, uint16_t *oldImg, uint32_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 1126;
-    int row, col, chip = 0;
-    int headerOffset = 5;
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_32bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
+    for(row=0; row<geo->nbLines; row++){
+        if (imxpad_decodeGeo(geo, B2, oldImg+row*imgWidthOld, 1, newImg[oldImg[row*imgWidthOld+3]], 1)!=0)
             return -1;
-
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                newImg[row*imgWidthNew+chip*80+col]=(oldImg[row*imgWidthOld+(chip*80+col)*2+1+headerOffset]<<16)+oldImg[row*imgWidthOld+(chip*80+col)*2+headerOffset];
-            } // for(col ...
-        } // for(chip ...
     } // for(row ...
-
     return 0;
 }
 
-
-
 int imxpad_extract4BImgData_S1400(int modMask, uint16_t *oldImg, uint32_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 1126;
-    int row, col, chip = 0;
-    int newRow = 0;
-    int headerOffset = 5;
-    int rowOffset = 0;
-    int module_id = 0;
-    int i=0;
-    int newcol=0;
-    int imageNumber;
-    /*
-  FILE *fd=NULL;
-  
-  fd=fopen("/home/imxpad/raw_B4_S1400.dat","w+");
-  
-  for(int i = 0; i<(120*20) ; i++ ){
-    for(int j = 0; j<(560*2+6);j++)
-        fprintf(fd,"0x%x ",oldImg[i*(560*2+6) + j]);
-    fprintf(fd,"\n");
-  }
-  fclose (fd);
-*/
-
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_32bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
-
-        module_id = oldImg[row*imgWidthOld+1];
-        rowOffset = (module_id-1)*120;
-        imageNumber = oldImg[row*imgWidthOld+3];
-        newRow = oldImg[row*imgWidthOld+4]-1 + rowOffset;
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                newImg[newRow*imgWidthNew+chip*80+col]=(oldImg[row*imgWidthOld+(chip*80+col)*2+1+headerOffset] << 16) + oldImg[row*imgWidthOld+(chip*80+col)*2+headerOffset];
-            } // for(col ...
-        } // for(chip ...
-    } // for(row ...
-
-    return 0;
+    return imxpad_decodeImage(IMXPAD_GEO_LINEAR, B4, modMask, oldImg, newImg);
 }
 
-
-
-
 // *******************************************************************************
 // S540 detector
 //
@@ -421,135 +337,130 @@ int imxpad_extract4BImgData_S1400(int modMask, uint16_t *oldImg, uint32_t *newIm
 // *******************************************************************************
 // 16 bits
 int imxpad_extract2BImgData_S540(int modMask, uint16_t *oldImg, uint16_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 566;
-    int row, col, chip = 0;
-    int newRow = 0;
-    int headerOffset = 5;
-    int rowOffset = 0;
-    int module_id = 0;
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_16bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
-
-        module_id = oldImg[row*imgWidthOld+1];
-        rowOffset = (module_id%2) ? (120) : -120;
-        newRow = (module_id-1)*120+oldImg[row*imgWidthOld+4]-1 + rowOffset;
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                newImg[newRow*imgWidthNew+chip*80+col]=oldImg[row*imgWidthOld+chip*80+col+headerOffset];
-            } // for(col ...
-        } // for(chip ...
-    } // for(row ...
-
-    return 0;
+    return imxpad_decodeImage(IMXPAD_GEO_SWAP, B2, modMask, oldImg, newImg);
 }
 
 // 32 bits
 int imxpad_extract4BImgData_S540(int modMask, uint16_t *oldImg, uint32_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 1126;
-    int row, col, chip = 0;
-    int newRow = 0;
-    int headerOffset = 5;
-    int rowOffset = 0;
-    int module_id = 0;
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_32bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
-
-        module_id = oldImg[row*imgWidthOld+1];
-        rowOffset = (module_id%2) ? (120) : -120;
-        newRow = (module_id-1)*120+oldImg[row*imgWidthOld+4]-1 + rowOffset;
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                newImg[newRow*imgWidthNew+chip*80+col]=(oldImg[row*imgWidthOld+(chip*80+col)*2+1+headerOffset]<<16)+oldImg[row*imgWidthOld+(chip*80+col)*2+headerOffset];
-            } // for(col ...
-        } // for(chip ...
-    } // for(row ...
-
-    return 0;
+    return imxpad_decodeImage(IMXPAD_GEO_SWAP, B4, modMask, oldImg, newImg);
 }
 
 // *******************************************************************************
-
-// *******************************************************************************
-// S540 detector
+// S420 detector
 //
 // required swap between odd and even modules (i.e. mod 1 <-> mod2; mod3 <-> mod4)
+// counted from the first module of the mask
 // *******************************************************************************
 // 16 bits
 int imxpad_extract2BImgData_S420(int modMask, uint16_t *oldImg, uint16_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 566;
-    int firstMod = xpci_getFirstMod(modMask);
-    int row, col, chip = 0;
-    int newRow = 0;
-    int headerOffset = 5;
-    int rowOffset = 0;
-    int module_id = 0;
-
-    for(row=0; row<imgHeigth; row++){
-
-        // check line format
-        if(imxpad_checkImgLine_16bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
-        module_id = oldImg[row*imgWidthOld+1]-firstMod;
-        rowOffset = (module_id%2) ? (120) : -120;
-        newRow = (module_id-1)*120+oldImg[row*imgWidthOld+4]-1 + rowOffset;
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                newImg[newRow*imgWidthNew+chip*80+col]=oldImg[row*imgWidthOld+chip*80+col+headerOffset];
-            } // for(col ...
-        } // for(chip ...
-    } // for(row ...
-
-    return 0;
+    return imxpad_decodeImage(IMXPAD_GEO_SWAP_FIRST, B2, modMask, oldImg, newImg);
 }
 
 // 32 bits
 int imxpad_extract4BImgData_S420(int modMask, uint16_t *oldImg, uint32_t *newImg){
-    int imgHeigth = 120*xpci_getModNb(modMask);
-    int imgWidthNew = 560;
-    int imgWidthOld = 1126;
-    int firstMod = xpci_getFirstMod(modMask);
-    int row, col, chip = 0;
-    int newRow = 0;
-    int headerOffset = 5;
-    int rowOffset = 0;
-    int module_id = 0;
+    return imxpad_decodeImage(IMXPAD_GEO_SWAP_FIRST, B4, modMask, oldImg, newImg);
+}
 
-    for(row=0; row<imgHeigth; row++){
 
-        // check line format
-        if(imxpad_checkImgLine_32bits((uint16_t *)(oldImg+row*imgWidthOld))!=0)
-            return -1;
+// *******************************************************************************
+// benchmark of the line decoders
+//
+// A raw image with valid lines is built for nbMod modules and decoded nbLoops
+// times with the decoder of the given detector type and kernel set. It runs on
+// the calling thread so the result is the decode throughput of one core.
+// ATTENTION: the system type is changed during the test, do not run it during
+// an acquisition.
+// returns: 0 success -1 error
+// out    : mbPerSec  raw data decoded per second in MB
+// *******************************************************************************
+int imxpad_benchDecode(int sysType, enum IMG_TYPE type, int nbMod, int simdLevel, int nbLoops, double *mbPerSec){
+    int imgWidthOld = (type==B2) ? 566 : 1126;
+    int nbLines = 120*nbMod;
+    int modMask = (1<<nbMod)-1;
+    int oldSysType = xpci_systemType;
+    int oldLevel = xpci_simdGetLevel();
+    int row, i, ret = 0;
+    uint16_t *raw, *line;
+    void *newImg;
+    unsigned long long t0, t;
+
+    if ((nbMod<1)||(nbMod>20)||(nbLoops<1))
+        return -1;
+    raw    = malloc(nbLines*imgWidthOld*sizeof(uint16_t));
+    newImg = malloc(nbLines*560*((type==B2) ? sizeof(uint16_t) : sizeof(uint32_t)));
+    if ((raw==NULL)||(newImg==NULL)){
+        free(raw);
+        free(newImg);
+        return -1;
+    }
+    for(row=0; row<nbLines; row++){
+        line = raw+row*imgWidthOld;
+        for(i=5; i<imgWidthOld-1; i++)
+            line[i] = (uint16_t)(row*31+i*7);
+        line[0] = 0xaa55;
+        line[1] = row/120+1;                        // module id
+        line[2] = (type==B2) ? 0x0236 : 0x0466;     // line length
+        line[3] = 0;                                // image number
+        line[4] = row%120+1;                        // line number
+        line[imgWidthOld-1] = 0xf0f0;
+    }
 
-        module_id = oldImg[row*imgWidthOld+1]-firstMod;
-        rowOffset = (module_id%2) ? (120) : -120;
-        newRow = (module_id-1)*120+oldImg[row*imgWidthOld+4]-1 + rowOffset;
-        for(chip=0; chip<7; chip++){
-            for(col=0; col<80; col++){
-                newImg[newRow*imgWidthNew+chip*80+col]=(oldImg[row*imgWidthOld+(chip*80+col)*2+1+headerOffset]<<16)+oldImg[row*imgWidthOld+(chip*80+col)*2+headerOffset];
-            } // for(col ...
-        } // for(chip ...
-    } // for(row ...
+    if (xpci_simdSetLevel(simdLevel)==-1){
+        ret = -1;
+        goto benchEnd;
+    }
+    xpci_systemType = sysType;
+    t0 = xpci_timeNs();
+    for(i=0; i<nbLoops; i++){
+        if (type==B2)
+            ret = imxpad_raw2data_16bits(modMask, raw, (uint16_t *)newImg);
+        else
+            ret = imxpad_raw2data_32bits(modMask, raw, (uint32_t *)newImg);
+        if (ret)
+            break;
+    }
+    t = xpci_timeNs() - t0;
+    xpci_systemType = oldSysType;
+    if (mbPerSec)
+        *mbPerSec = t ? ((double)nbLines*imgWidthOld*sizeof(uint16_t)*nbLoops*1000.0)/t : 0.0;
+
+benchEnd:
+    xpci_simdSetLevel(oldLevel);
+    free(raw);
+    free(newImg);
+    return ret;
+}
 
+// runs imxpad_benchDecode() for all the detector types, image types and kernel sets
+// supported by the CPU and prints the results
+int imxpad_benchDecodeAll(int nbLoops){
+    int sysTypes[] = {IMXPAD_S70, IMXPAD_S140, IMXPAD_S420, IMXPAD_S540, IMXPAD_S700, IMXPAD_S1400};
+    char *sysNames[] = {"S70", "S140", "S420", "S540", "S700", "S1400"};
+    int nbMods[]   = {1, 2, 4, 5, 10, 20};
+    int levels[]   = {XPCI_SIMD_SCALAR, XPCI_SIMD_SSE4, XPCI_SIMD_AVX2, XPCI_SIMD_NEON};
+    int sys, t, l;
+    double mbPerSec;
+
+    printf("%-6s %-3s %-7s %10s %12s\n", "system", "img", "kernels", "MB/s", "images/s");
+    for (sys=0; sys<6; sys++){
+        for (t=0; t<2; t++){
+            for (l=0; l<4; l++){
+                if (!xpci_simdSupported(levels[l]))
+                    continue;
+                if (imxpad_benchDecode(sysTypes[sys], t ? B4 : B2, nbMods[sys], levels[l], nbLoops, &mbPerSec)!=0){
+                    printf("ERROR: %s() decode failed for %s\n", __func__, sysNames[sys]);
+                    return -1;
+                }
+                printf("%-6s %-3s %-7s %10.1f %12.1f\n", sysNames[sys], t ? "B4" : "B2",
+                       xpci_simdLevelName(levels[l]), mbPerSec,
+                       mbPerSec*1e6/(120.0*nbMods[sys]*(t ? 1126 : 566)*sizeof(uint16_t)));
+            }
+        }
+    }
+    xpci_simdSetLevel(XPCI_SIMD_BEST);
     return 0;
 }
 
-
-
-
 // function to increment ITHL values in a detector
 int imxpad_incrITHL(unsigned modMask){
 
@@ -700,20 +611,13 @@ int imxpad_uploadExpWaitTimes(unsigned modMask, unsigned *pWaitTime, unsigned si
 // ALBA S1400 detector
 // *******************************************************************************
 
-int imxpad_writeFile2B_ALBA_S1400(unsigned modMask,char *fileName , uint16_t *newImg)
+// modules are 2 per row of the 1200x1120 matrix, missing modules give 0 pixels
+static int imxpad_writeFileText_ALBA_S1400(unsigned modMask, char *fileName, const void *newImg, int pixSize)
 {
     FILE *fd=NULL;
     int col,row,mod;
-
-    unsigned image[1200][1120];
-
-    for(row=0;row<1200;row++)
-    {
-        for(col=0;col<1120;col++)
-        {
-            image[row][col] = 0;
-        }
-    }
+    unsigned value;
+    size_t pix;
 
     fd = fopen(fileName,"w+");
     if(fd == NULL)
@@ -721,23 +625,17 @@ int imxpad_writeFile2B_ALBA_S1400(unsigned modMask,char *fileName , uint16_t *ne
         printf("ERROR : Can not open file < %s >\n",fileName);
         return -1;
     }
-    for(mod=0;mod<20;mod++)
-    {
-        if(((1<<mod) & modMask)==0) continue;
-        for(row=0;row<120;row++)
-        {
-            for(col=0;col<560;col++)
-            {
-                image[((mod/2)*120) + row][(mod%2)*560 + col] = newImg[mod*560*120+col+row*560];
-            }
-        }
-    }
-
     for(row=0;row<1200;row++)
     {
         for(col=0;col<1120;col++)
         {
-            fprintf(fd,"%d ",image[row][col]);
+            mod = (row/120)*2 + col/560;
+            value = 0;
+            if((1<<mod) & modMask){
+                pix = (size_t)mod*560*120 + (row%120)*560 + col%560;
+                value = (pixSize==2) ? ((const uint16_t*)newImg)[pix] : ((const uint32_t*)newImg)[pix];
+            }
+            fprintf(fd,"%u ",value);
         }
         fprintf(fd,"\n");
     }
@@ -746,159 +644,508 @@ int imxpad_writeFile2B_ALBA_S1400(unsigned modMask,char *fileName , uint16_t *ne
     return 0;
 }
 
-
-
+int imxpad_writeFile2B_ALBA_S1400(unsigned modMask,char *fileName , uint16_t *newImg)
+{
+    return imxpad_writeFileText_ALBA_S1400(modMask, fileName, newImg, sizeof(uint16_t));
+}
 
 int imxpad_writeFile4B_ALBA_S1400(unsigned modMask,char *fileName , uint32_t *newImg)
 {
-    FILE *fd=NULL;
-    int col,row,mod;
+    return imxpad_writeFileText_ALBA_S1400(modMask, fileName, newImg, sizeof(uint32_t));
+}
 
-    unsigned image[1200][1120];
+/* raw frame imgNb of a SSD burst: from the burst container when there is one,
+   from the per image files written by the previous versions otherwise */
+static int imxpad_readBurstFrame(XPCI_BURST *burstFile, int burstNumber, int imgNb, void *pRaw, unsigned size){
+    char  fnameIn[100];
+    FILE *imgIn;
+    int   ret = 0;
 
-    for(row=0;row<1200;row++)
-        for(col=0;col<1120;col++)
-            image[row][col]=0;
+    if (burstFile!=NULL)
+        return xpci_burstReadFrame(burstFile, imgNb, pRaw, size);
 
-    fd = fopen(fileName,"w+");
-    if(fd == NULL)
-    {
-        printf("ERROR : Can not open file < %s >\n",fileName);
+    sprintf(fnameIn,"/opt/imXPAD/tmp/burst_%d_img_%d.bin",burstNumber,imgNb);
+    imgIn = fopen(fnameIn,"rb");
+    if(imgIn==NULL){
+        printf("ERROR => Can not open file < %s >\n",fnameIn);
         return -1;
     }
-    for(mod=0;mod<20;mod++)
-    {
-        if(((1<<mod) & modMask)==0) continue;
-        for(row=0;row<120;row++)
-        {
-            for(col=0;col<560;col++)
-            {
-                //image[(mod%2)*560 + col][((mod/2)*120) + row] = newImg[mod*560*120+col+row*120];
-                image[((mod/2)*120) + row][(mod%2)*560 + col] = newImg[mod*560*120+col+row*560];
-            }
-        }
-    }
-
-    for(row=0;row<1200;row++)
-    {
-        for(col=0;col<1120;col++)
-        {
-            fprintf(fd,"%d ",image[row][col]);
-        }
-        fprintf(fd,"\n");
-    }
-    fflush(fd);
-    fclose(fd);
-    return 0;
+    if (fread(pRaw,size,1,imgIn)!=1)
+        ret = -1;
+    fclose(imgIn);
+    return ret;
 }
 
+// images [startImg, stopImg[ of the burst written as text matrices <fpathOut>img_<n>.dat
 int imxpad_raw_file_to_images(enum IMG_TYPE type, unsigned modMask, char *fpathOut, int startImg, int stopImg, int burstNumber){
+    return imxpad_exportBurst(type, modMask, burstNumber, startImg, stopImg, fpathOut,
+                              IMXPAD_EXPORT_TEXT, 0, NULL, NULL);
+}
 
-    uint16_t *pRawBuffIn;
-    uint16_t *pRawBuffOut;
 
-    char fnameIn[100];
-    char fnameOut[1000];
+int imxpad_raw_file_to_buffer(enum IMG_TYPE type, unsigned modMask, void *pRawBuffOut , int numImageToAcquire, int burstNumber){
+
+    uint16_t *pRawBuffIn = NULL;
+    XPCI_BURST *burstFile;
+    int   ret;
 
     int   lastMod = xpci_getLastMod(modMask);
 
     unsigned int imgSizeIn;
-    unsigned int imgSizeOut;
 
     // determine size of the image
-    if (type == B2){
+    if (type == B2)
         imgSizeIn = 120*566*lastMod*sizeof(uint16_t);
-        imgSizeOut = 120*560*lastMod*sizeof(uint16_t);
-    }
-    else{
+    else
         imgSizeIn = 120*1126*lastMod*sizeof(uint16_t);
-        imgSizeIn = 120*1120*lastMod*sizeof(uint16_t);
-    }
-
 
     pRawBuffIn = malloc(imgSizeIn);
-    pRawBuffOut = malloc(imgSizeOut);
 
-    for (int i=startImg; i<stopImg; i++){
+    if (pRawBuffIn == NULL)
+        return -1;
 
+    // the frame is located by its offset in the burst file
+    burstFile = xpci_burstOpen(burstNumber);
+    ret = imxpad_readBurstFrame(burstFile,burstNumber,numImageToAcquire,pRawBuffIn,imgSizeIn);
+    xpci_burstClose(burstFile);
 
-        sprintf(fnameIn,"/opt/imXPAD/tmp/burst_%d_img_%d.bin",burstNumber,i);
-        FILE *imgIn = fopen(fnameIn,"rb");
-        if(imgIn==-1){
-            printf("ERROR => Can not open file < %s >\n",fnameIn);
-            return -1;
-        }
+    if (ret==0){
+        if (type == B2)
+            imxpad_raw2data_16bits(modMask, pRawBuffIn, pRawBuffOut);
+        else
+            imxpad_raw2data_32bits(modMask, pRawBuffIn, pRawBuffOut);
+    }
+
+    free(pRawBuffIn);
+    return ret;
+}
 
-        //sprintf(fnameOut,"%s/img_%d.bin",fpath, i);
-        sprintf(fnameOut,"%simg_%d.dat",fpathOut, i);
-        FILE *imgOut = fopen(fnameOut,"wb");
-        if(imgOut==-1){
-            printf("ERROR => Can not open file < %s >\n",fnameOut);
+
+// *******************************************************************************
+// burst reader: random access to the images of a recorded burst
+//
+// The burst containers are mapped once when the reader is opened. Raw frames are
+// decoded straight from the mapping, encoded frames are decoded through a raw
+// buffer per thread. A range of images is decoded by the caller and nbThreads
+// helpers. Images are read ahead in the scrolling direction.
+// Bursts of the previous versions (one file per image) are read file by file.
+// *******************************************************************************
+#define IMXPAD_READER_MAX_THREADS 16
+
+struct IMXPAD_BURST_READER {
+    XPCI_BURST      *burst;         // NULL: per image files of the previous versions
+    int             burstNumber;
+    enum IMG_TYPE   type;
+    unsigned        modMask;
+    unsigned        rawSize;
+    int             nbImages;
+    int             mapped;         // frames can be read by several threads
+    int             inPlace;        // raw frames decoded from the mapping
+    int             readAhead;
+    int             lastImg;
+    uint16_t        *raw[IMXPAD_READER_MAX_THREADS+1];   // one per helper, the caller's last
+
+    // range being decoded
+    int             nbThreads;
+    int             started;
+    pthread_t       threads[IMXPAD_READER_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  done;
+    int             first, nb, next, finished, status, stop;
+    void            **dest;
+};
+
+static int imxpad_readerDecode(IMXPAD_BURST_READER *reader, int img, void *pImg, uint16_t *raw){
+    const void *data = NULL;
+    unsigned    stored;
+
+    if (reader->inPlace)
+        data = xpci_burstFrameData(reader->burst, img, &stored);
+    if (data==NULL){
+        if (imxpad_readBurstFrame(reader->burst, reader->burstNumber, img, raw, reader->rawSize))
             return -1;
-        }
+        data = raw;
+    }
+    // the decoders only read the raw frame
+    if (reader->type==B2)
+        return imxpad_raw2data_16bits(reader->modMask, (uint16_t *)data, pImg);
+    return imxpad_raw2data_32bits(reader->modMask, (uint16_t *)data, pImg);
+}
+
+// takes the images of the current range until there is none left, called with the lock
+static void imxpad_readerWork(IMXPAD_BURST_READER *reader, uint16_t *raw){
+    int i, ret;
+
+    while (reader->next<reader->nb){
+        i = reader->next++;
+        pthread_mutex_unlock(&reader->lock);
+        ret = imxpad_readerDecode(reader, reader->first+i, reader->dest[i], raw);
+        pthread_mutex_lock(&reader->lock);
+        if (ret)
+            reader->status = -1;
+        if (++reader->finished==reader->nb)
+            pthread_cond_broadcast(&reader->done);
+    }
+}
+
+static void *imxpad_readerThread(void *arg){
+    IMXPAD_BURST_READER *reader = arg;
+    int id;
+
+    pthread_mutex_lock(&reader->lock);
+    id = reader->started++;
+    for (;;){
+        while (!reader->stop && reader->next>=reader->nb)
+            pthread_cond_wait(&reader->work, &reader->lock);
+        if (reader->stop)
+            break;
+        imxpad_readerWork(reader, reader->raw[id]);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return NULL;
+}
 
-        fread(pRawBuffIn,imgSizeIn,1,imgIn);
+IMXPAD_BURST_READER *imxpad_burstReaderOpen(enum IMG_TYPE type, unsigned modMask, int burstNumber, int nbThreads){
+    IMXPAD_BURST_READER *reader;
+    char                 fname[100];
+    int                  i;
 
-        if (type == B2){
-            imxpad_raw2data_16bits(modMask,pRawBuffIn,pRawBuffOut);
-            printf("image number %d created\n",i);
-            imxpad_writeFile2B_ALBA_S1400(modMask,fnameOut ,pRawBuffOut);
+    if ((nbThreads<0)||(nbThreads>IMXPAD_READER_MAX_THREADS)){
+        printf("ERROR: %s() nb of decoding threads should be in [0,%d]\n", __func__, IMXPAD_READER_MAX_THREADS);
+        return NULL;
+    }
+    reader = calloc(1, sizeof(IMXPAD_BURST_READER));
+    if (reader==NULL)
+        return NULL;
+    reader->type        = type;
+    reader->modMask     = modMask;
+    reader->burstNumber = burstNumber;
+    reader->rawSize     = 120*((type==B2) ? 566 : 1126)*xpci_getLastMod(modMask)*sizeof(uint16_t);
+    reader->nbImages    = -1;
+    reader->lastImg     = -1;
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->work, NULL);
+    pthread_cond_init(&reader->done, NULL);
+
+    reader->burst = xpci_burstOpen(burstNumber);
+    if (reader->burst!=NULL){
+        reader->nbImages = xpci_burstHeader(reader->burst)->nbFrames;
+        if (xpci_burstMap(reader->burst)==0){
+            reader->mapped = 1;
+            reader->inPlace = (xpci_burstHeader(reader->burst)->codec==XPCI_CODEC_NONE);
         }
-        else{
-            imxpad_raw2data_32bits(modMask,pRawBuffIn,pRawBuffOut);
+        else
+            nbThreads = 0;  // the file handle can only be read by one thread
+    }
+    else {
+        sprintf(fname,"/opt/imXPAD/tmp/burst_%d_img_0.bin",burstNumber);
+        if (access(fname, R_OK)){
+            printf("ERROR: %s() ---> no burst %d recorded.\n", __func__, burstNumber);
+            imxpad_burstReaderClose(reader);
+            return NULL;
         }
-
-        fclose(imgIn);
-
     }
 
-    free(pRawBuffIn);
-    free(pRawBuffOut);
+    for (i=0; i<=nbThreads; i++)
+        if ((reader->raw[i] = malloc(reader->rawSize))==NULL){
+            printf("ERROR: %s() ---> can not allocate the raw buffers.\n", __func__);
+            imxpad_burstReaderClose(reader);
+            return NULL;
+        }
 
-    return 0;
+    // the geometry tables are built before the threads share them
+    imxpad_initGeometry(modMask);
+    for (reader->nbThreads=0; reader->nbThreads<nbThreads; reader->nbThreads++)
+        if (pthread_create(&reader->threads[reader->nbThreads], NULL, imxpad_readerThread, reader)!=0)
+            break;
+    return reader;
 }
 
+// images recorded in the burst (-1 unknown for the bursts of the previous versions)
+int imxpad_burstReaderNbImages(IMXPAD_BURST_READER *reader){
+    return reader->nbImages;
+}
 
-int imxpad_raw_file_to_buffer(enum IMG_TYPE type, unsigned modMask, void *pRawBuffOut , int numImageToAcquire, int burstNumber){
+// the nbImg images following the last ones read (preceding when scrolling back)
+// are read in advance
+int imxpad_burstReaderSetReadAhead(IMXPAD_BURST_READER *reader, int nbImg){
+    if (nbImg<0)
+        return -1;
+    reader->readAhead = nbImg;
+    return 0;
+}
 
-    uint16_t *pRawBuffIn = NULL;
+// decodes images [first, first+nb[ in pImgs[0..nb-1] (one caller at a time)
+int imxpad_burstReaderGetImages(IMXPAD_BURST_READER *reader, int first, int nb, void **pImgs){
+    int ret;
 
+    if ((first<0)||(nb<=0)||((reader->nbImages>=0)&&(first+nb>reader->nbImages))){
+        printf("ERROR: %s() ---> images %d to %d not in the burst.\n", __func__, first, first+nb-1);
+        return -1;
+    }
 
-    char fnameIn[100];
+    pthread_mutex_lock(&reader->lock);
+    reader->first    = first;
+    reader->dest     = pImgs;
+    reader->next     = 0;
+    reader->finished = 0;
+    reader->status   = 0;
+    reader->nb       = nb;
+    if (nb>1)
+        pthread_cond_broadcast(&reader->work);
+    imxpad_readerWork(reader, reader->raw[reader->nbThreads]);
+    while (reader->finished<reader->nb)
+        pthread_cond_wait(&reader->done, &reader->lock);
+    ret = reader->status;
+    reader->nb = reader->next = 0;
+    pthread_mutex_unlock(&reader->lock);
+
+    if (reader->readAhead && reader->burst!=NULL){
+        if (first<reader->lastImg)
+            xpci_burstReadAhead(reader->burst, (first>reader->readAhead) ? first-reader->readAhead : 0,
+                                (first>reader->readAhead) ? reader->readAhead : first);
+        else
+            xpci_burstReadAhead(reader->burst, first+nb, reader->readAhead);
+    }
+    reader->lastImg = first;
+    return ret;
+}
 
-    int   lastMod = xpci_getLastMod(modMask);
+int imxpad_burstReaderGetImage(IMXPAD_BURST_READER *reader, int img, void *pImg){
+    return imxpad_burstReaderGetImages(reader, img, 1, &pImg);
+}
 
-    unsigned int imgSizeIn;
+void imxpad_burstReaderClose(IMXPAD_BURST_READER *reader){
+    int i;
+
+    if (reader==NULL)
+        return;
+    if (reader->nbThreads){
+        pthread_mutex_lock(&reader->lock);
+        reader->stop = 1;
+        pthread_cond_broadcast(&reader->work);
+        pthread_mutex_unlock(&reader->lock);
+        for (i=0; i<reader->nbThreads; i++)
+            pthread_join(reader->threads[i], NULL);
+    }
+    pthread_cond_destroy(&reader->done);
+    pthread_cond_destroy(&reader->work);
+    pthread_mutex_destroy(&reader->lock);
+    for (i=0; i<=IMXPAD_READER_MAX_THREADS; i++)
+        free(reader->raw[i]);
+    xpci_burstClose(reader->burst);
+    free(reader);
+}
 
-    // determine size of the image
-    if (type == B2)
-        imgSizeIn = 120*566*lastMod*sizeof(uint16_t);
-    else
-        imgSizeIn = 120*1126*lastMod*sizeof(uint16_t);
 
-    pRawBuffIn = malloc(imgSizeIn);
+// *******************************************************************************
+// batch export of the images of a recorded burst
+//
+// nbThreads threads (one per CPU for 0) each take the next image of the range,
+// decode it from the burst reader and write it in its own file:
+//   IMXPAD_EXPORT_BIN   <fpathOut>img_<n>.bin  decoded image, 560 pixels per row
+//   IMXPAD_EXPORT_XPAD  <fpathOut>img_<n>.xpad IMXPAD_EXPORT_HEADER + decoded image
+//   IMXPAD_EXPORT_TEXT  <fpathOut>img_<n>.dat  text matrix of the ALBA S1400
+// or all the images in the frame stack <fpathOut>burst_<burstNumber>.xstk
+// (IMXPAD_EXPORT_STACK, appended in order by one thread, chunks encoded with
+// the codec of the burst).
+// progress (if not NULL) is called after each image, from one thread at a time,
+// a line is printed every 100 images otherwise.
+// returns: 0 success -1 if at least one image has not been exported
+// *******************************************************************************
+#define IMXPAD_EXPORT_MAX_THREADS IMXPAD_READER_MAX_THREADS
+#define IMXPAD_STACK_CHUNK        16    // images per chunk of an exported stack
+
+typedef struct {
+    IMXPAD_BURST_READER    *reader;
+    const char             *fpathOut;
+    int                    format;
+    int                    first, last;
+    int                    next, done, status;
+    unsigned               imgSize;
+    IMXPAD_EXPORT_PROGRESS progress;
+    void                   *arg;
+    pthread_mutex_t        lock;
+} IMXPAD_EXPORT;
+
+static int imxpad_exportImage(IMXPAD_EXPORT *exp, int img, void *pImg){
+    IMXPAD_BURST_READER  *reader = exp->reader;
+    IMXPAD_EXPORT_HEADER hdr;
+    char                 fname[1000];
+    FILE                 *fd;
+    int                  ret = 0;
+
+    switch(exp->format){
+    case IMXPAD_EXPORT_TEXT:
+        snprintf(fname, sizeof(fname), "%simg_%d.dat", exp->fpathOut, img);
+        return imxpad_writeFileText_ALBA_S1400(reader->modMask, fname, pImg, (reader->type==B2) ? 2 : 4);
+    case IMXPAD_EXPORT_XPAD:
+        snprintf(fname, sizeof(fname), "%simg_%d.xpad", exp->fpathOut, img);
+        break;
+    default:
+        snprintf(fname, sizeof(fname), "%simg_%d.bin", exp->fpathOut, img);
+        break;
+    }
 
-    if (pRawBuffIn == NULL)
+    fd = fopen(fname,"wb");
+    if(fd == NULL){
+        printf("ERROR : Can not open file < %s >\n",fname);
         return -1;
+    }
+    if (exp->format==IMXPAD_EXPORT_XPAD){
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, IMXPAD_EXPORT_MAGIC, sizeof(hdr.magic));
+        hdr.headerSize    = sizeof(hdr);
+        hdr.width         = 560;
+        hdr.height        = 120*xpci_getLastMod(reader->modMask);
+        hdr.bytesPerPixel = (reader->type==B2) ? 2 : 4;
+        hdr.modMask       = reader->modMask;
+        hdr.burstNumber   = reader->burstNumber;
+        hdr.imageNumber   = img;
+        if (fwrite(&hdr, sizeof(hdr), 1, fd)!=1)
+            ret = -1;
+    }
+    if (fwrite(pImg, exp->imgSize, 1, fd)!=1)
+        ret = -1;
+    if (fclose(fd) || ret){
+        printf("ERROR : Can not write file < %s >\n",fname);
+        return -1;
+    }
+    return 0;
+}
 
-    sprintf(fnameIn,"/opt/imXPAD/tmp/burst_%d_img_%d.bin",burstNumber,numImageToAcquire);
-    FILE *imgIn = fopen(fnameIn,"rb");
-    if(imgIn==NULL){
-        printf("ERROR => Can not open file < %s >\n",fnameIn);
+static void imxpad_exportProgress(IMXPAD_EXPORT *exp){
+    exp->done++;
+    if (exp->progress!=NULL)
+        exp->progress(exp->done, exp->last - exp->first, exp->arg);
+    else if ((exp->done%100==0) || (exp->done==exp->last - exp->first))
+        printf("imxpad_exportBurst() ---> %d/%d images exported\n", exp->done, exp->last - exp->first);
+}
+
+static int imxpad_exportStack(IMXPAD_EXPORT *exp){
+    IMXPAD_BURST_READER  *reader = exp->reader;
+    XPCI_STACK_HEADER    hdr;
+    XPCI_STACK           *stack;
+    char                 fname[1000];
+    void                 *pImg = malloc(exp->imgSize);
+    uint16_t             *raw = malloc(reader->rawSize);
+    int                  img, ret = 0;
+
+    if (pImg==NULL || raw==NULL || xpci_getStackHeader(reader->type, reader->modMask, XPCI_STACK_IMAGE, &hdr)){
+        printf("ERROR: %s() ---> can not prepare the stack.\n", __func__);
+        free(pImg);
+        free(raw);
         return -1;
     }
-    else{
-        fread(pRawBuffIn,imgSizeIn,1,imgIn);
+    hdr.framesPerChunk = IMXPAD_STACK_CHUNK;
+    hdr.codec = (reader->burst!=NULL) ? xpci_burstHeader(reader->burst)->codec : XPCI_CODEC_NONE;
+    snprintf(fname, sizeof(fname), "%sburst_%d.xstk", exp->fpathOut, reader->burstNumber);
+    stack = xpci_stackCreate(fname, &hdr);
+    if (stack==NULL)
+        ret = -1;
+
+    for (img=exp->first; img<exp->last && ret==0; img++){
+        ret = imxpad_readerDecode(reader, img, pImg, raw);
+        if (ret)
+            printf("ERROR: %s() ---> image %d can not be read.\n", __func__, img);
+        else
+            ret = xpci_stackAppend(stack, pImg, 0);
+        imxpad_exportProgress(exp);
+    }
+    if (stack!=NULL && xpci_stackClose(stack))
+        ret = -1;
+    free(pImg);
+    free(raw);
+    return ret;
+}
 
-        if (type == B2)
-            imxpad_raw2data_16bits(modMask, pRawBuffIn, pRawBuffOut);
+static void *imxpad_exportThread(void *arg){
+    IMXPAD_EXPORT *exp = arg;
+    void          *pImg = malloc(exp->imgSize);
+    uint16_t      *raw = malloc(exp->reader->rawSize);
+    int           img, ret;
+
+    pthread_mutex_lock(&exp->lock);
+    if (pImg==NULL || raw==NULL){
+        printf("ERROR: %s() ---> can not allocate the image buffers.\n", __func__);
+        exp->status = -1;
+        exp->next = exp->last;
+    }
+    while (exp->next<exp->last){
+        img = exp->next++;
+        pthread_mutex_unlock(&exp->lock);
+        ret = imxpad_readerDecode(exp->reader, img, pImg, raw);
+        if (ret)
+            printf("ERROR: %s() ---> image %d can not be read.\n", __func__, img);
         else
-            imxpad_raw2data_32bits(modMask, pRawBuffIn, pRawBuffOut);
+            ret = imxpad_exportImage(exp, img, pImg);
+        pthread_mutex_lock(&exp->lock);
+        if (ret)
+            exp->status = -1;
+        imxpad_exportProgress(exp);
+    }
+    pthread_mutex_unlock(&exp->lock);
+    free(pImg);
+    free(raw);
+    return NULL;
+}
 
-        fclose(imgIn);
-        free(pRawBuffIn);
-        return 0;
+int imxpad_exportBurst(enum IMG_TYPE type, unsigned modMask, int burstNumber, int startImg, int stopImg,
+                       const char *fpathOut, int format, int nbThreads,
+                       IMXPAD_EXPORT_PROGRESS progress, void *arg){
+    IMXPAD_EXPORT  exp;
+    pthread_t      threads[IMXPAD_EXPORT_MAX_THREADS];
+    int            i, nb, nbImages;
+
+    if ((format<IMXPAD_EXPORT_BIN)||(format>IMXPAD_EXPORT_STACK)||(nbThreads<0)){
+        printf("ERROR: %s() ---> invalid format %d or nb of threads %d.\n", __func__, format, nbThreads);
+        return -1;
+    }
+    memset(&exp, 0, sizeof(exp));
+    exp.reader = imxpad_burstReaderOpen(type, modMask, burstNumber, 0);
+    if (exp.reader==NULL)
+        return -1;
+    nbImages = imxpad_burstReaderNbImages(exp.reader);
+    if ((startImg<0)||(stopImg<=startImg)||((nbImages>=0)&&(stopImg>nbImages))){
+        printf("ERROR: %s() ---> images %d to %d not in the burst.\n", __func__, startImg, stopImg-1);
+        imxpad_burstReaderClose(exp.reader);
+        return -1;
     }
 
-    return -1;
+    exp.fpathOut = fpathOut;
+    exp.format   = format;
+    exp.first    = exp.next = startImg;
+    exp.last     = stopImg;
+    exp.imgSize  = 120*560*xpci_getLastMod(modMask)*((type==B2) ? sizeof(uint16_t) : sizeof(uint32_t));
+    exp.progress = progress;
+    exp.arg      = arg;
+    pthread_mutex_init(&exp.lock, NULL);
+
+    if (nbThreads==0)
+        nbThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nbThreads>IMXPAD_EXPORT_MAX_THREADS)
+        nbThreads = IMXPAD_EXPORT_MAX_THREADS;
+    if ((nbThreads<1)||(exp.reader->burst!=NULL && !exp.reader->mapped))
+        nbThreads = 1;      // an unmapped burst is read by one thread
+    if (nbThreads>stopImg-startImg)
+        nbThreads = stopImg-startImg;
+
+    if (format==IMXPAD_EXPORT_STACK){
+        exp.status = imxpad_exportStack(&exp);
+        pthread_mutex_destroy(&exp.lock);
+        imxpad_burstReaderClose(exp.reader);
+        return exp.status;
+    }
+
+    for (nb=0; nb<nbThreads-1; nb++)
+        if (pthread_create(&threads[nb], NULL, imxpad_exportThread, &exp)!=0)
+            break;
+    imxpad_exportThread(&exp);
+    for (i=0; i<nb; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&exp.lock);
+    imxpad_burstReaderClose(exp.reader);
+    return exp.status;
 }
@@ -10,6 +10,10 @@ extern "C"
 int imxpad_raw2data(int modMask, void *pOldData, void *pNewData);
 int imxpad_raw2data_16bits(int modMask, uint16_t *pOldData, uint16_t *pNewData);
 int imxpad_raw2data_32bits(int modMask, uint16_t *pOldData, uint32_t *pNewData);
+void imxpad_initGeometry(int modMask);
+int imxpad_decodeLines(enum IMG_TYPE type, int modMask, uint16_t *lines, int nbLines, void *newImg);
+int imxpad_benchDecode(int sysType, enum IMG_TYPE type, int nbMod, int simdLevel, int nbLoops, double *mbPerSec);
+int imxpad_benchDecodeAll(int nbLoops);
 int imxpad_extract2BImgData(int modMask, uint16_t *oldImg, uint16_t *newImg);
 int imxpad_extract4BImgData(int modMask, uint16_t *oldImg, uint32_t *newImg);
 int imxpad_extract2BImgData_S140(int modMask, uint16_t *oldImg, uint16_t *newImg);
@@ -37,6 +41,39 @@ int imxpad_writeFile4B_ALBA_S1400(unsigned modMask,char *fileName , uint32_t *ne
 int imxpad_raw_file_to_images(enum IMG_TYPE type, unsigned modMask, char *fpathOut, int startImg, int stopImg, int burstNumber);
 int imxpad_raw_file_to_buffer(enum IMG_TYPE type, unsigned modMask, void *pRawBuffOut , int numImageToAcquire, int burstNumber);
 
+// burst opened once for repeated accesses to its images (viewers...)
+typedef struct IMXPAD_BURST_READER IMXPAD_BURST_READER;
+IMXPAD_BURST_READER *imxpad_burstReaderOpen(enum IMG_TYPE type, unsigned modMask, int burstNumber, int nbThreads);
+int  imxpad_burstReaderNbImages(IMXPAD_BURST_READER *reader);
+int  imxpad_burstReaderSetReadAhead(IMXPAD_BURST_READER *reader, int nbImg);
+int  imxpad_burstReaderGetImage(IMXPAD_BURST_READER *reader, int img, void *pImg);
+int  imxpad_burstReaderGetImages(IMXPAD_BURST_READER *reader, int first, int nb, void **pImgs);
+void imxpad_burstReaderClose(IMXPAD_BURST_READER *reader);
+
+// batch export of the images of a burst, one file per image
+#define IMXPAD_EXPORT_BIN   0   // decoded image only
+#define IMXPAD_EXPORT_XPAD  1   // IMXPAD_EXPORT_HEADER followed by the decoded image
+#define IMXPAD_EXPORT_TEXT  2   // text matrix of the ALBA S1400 (format of imxpad_raw_file_to_images)
+#define IMXPAD_EXPORT_STACK 3   // all the images in one frame stack file (xpci_stack.h)
+#define IMXPAD_EXPORT_MAGIC "XPADIMG1"
+
+typedef struct {
+    char      magic[8];
+    uint32_t  headerSize;
+    uint32_t  width;            // pixels per row
+    uint32_t  height;           // rows
+    uint32_t  bytesPerPixel;    // 2 (B2) or 4 (B4), host byte order
+    uint32_t  modMask;
+    uint32_t  burstNumber;
+    uint32_t  imageNumber;
+    uint32_t  reserved[7];
+} IMXPAD_EXPORT_HEADER;
+
+typedef void (*IMXPAD_EXPORT_PROGRESS)(int nbDone, int nbImages, void *arg);
+int imxpad_exportBurst(enum IMG_TYPE type, unsigned modMask, int burstNumber, int startImg, int stopImg,
+                       const char *fpathOut, int format, int nbThreads,
+                       IMXPAD_EXPORT_PROGRESS progress, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -50,6 +50,11 @@
 
 // imxpad functions 
 #include "xpci_imxpad.h"
+#include "xpci_burst.h"
+#include "xpci_spsc.h"
+#include "xpci_codec.h"
+#include "xpci_pool.h"
+#include "xpci_shm.h"
 
 /***********************************************************************************
 // Constants definition
@@ -759,6 +764,14 @@ volatile sig_atomic_t           it_cnt   = 0;
 int                             it_total = 0;
 pthread_mutex_t	                mutex_dma = PTHREAD_MUTEX_INITIALIZER;
 static int                      xpci_it_pos  = 0;
+// IT wait policy (see waitIT()) and latency from the IT to the wake up of the waiter
+static pthread_mutex_t          it_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           it_cond  = PTHREAD_COND_INITIALIZER;
+static int                      itWaitMode  = XPCI_ITWAIT_SPIN;
+static int                      itSpinUsec  = 0;
+static volatile int             itCancel    = 0; // waitIT() gives up (read ahead stopped)
+static volatile unsigned long long itStampNs = 0;
+static unsigned long            itLatencyHist[XPCI_ITLAT_BINS];
 static unsigned                 spy_mem_add;
 static char                     *error_msg_channel[NB_CHANNELS];
 static enum DetectorStatus      detStatus[MAX_DETECTOR_NB];
@@ -773,6 +786,9 @@ char                            dum; // to prompt user to go on
 // bit [1] dead pixels correction
 unsigned                        imxpad_postProc = 0; 
 
+// last exposure parameters sent to the modules (frame stack headers)
+static XPCI_STACK_EXPOSURE      exp_lastParam;
+
 
 //********************************************************************************
 //                        GLOBALS FOR IMAGE READING
@@ -791,9 +807,21 @@ unsigned DMA0_SVC_BUF_LOCK; //2
 unsigned DMA1_TX_BUF_LOCK ; //3
 unsigned DMA1_RX_BUF_LOCK ; //4
 unsigned DMA1_SVC_BUF_LOCK; //5
+unsigned DMA0_TXCMD_BUF_LOCK; // persistent TX buffers for commands
+unsigned DMA1_TXCMD_BUF_LOCK;
+
+static int                      txPersistent = 0; // img_txBuffer0/1 allocated at xpci_init()
+static XPCI_TX_STATS            txStats;
+// persistent per channel buffers for the commands replies read by xpci_read()
+#define RX_REPLY_BUF_SIZE        4096
+static SBufferDescription       rxReplyBuffer[NB_CHANNELS];
+static unsigned                 rxReplyLock[NB_CHANNELS];
+static int                      rxPersistent = 0;
+static int                      dmaBufReuse  = 1; // 0 forces the per command buffers locking
 
 static int                      img_nbMod0, img_nbMod1;        // nb modules to read per channel
 static int                      img_nbParallelTrans, img_nbSeqTrans;
+static int                      img_lineWords;                 // raw line size in words
 static int                      img_moduleMask;
 //static enum IMG_TYPE           img_type; // 2 or 4 Bytes
 enum IMG_TYPE                    img_type; // 2 or 4 Bytes
@@ -807,6 +835,43 @@ static int                      detectorBusy   = 0;
 
 static int                      mode12bits = 0; // use for S1400 ALBA
 
+// Zero-copy DMA ring: each slot is a pinned buffer holding one complete raw image.
+// The DMA engine writes straight into the slot and the filled slot is lent to the
+// consumer until it is given back with xpci_releaseImgRing().
+#define IMG_RING_MAX_SLOTS       64
+static int                      img_ringDepth   = 0; // requested nb of slots (0 = ring disabled)
+static int                      img_ringNbSlots = 0; // nb of slots really allocated
+static int                      img_ringNext    = 0; // next slot to lend to the consumer
+static int                      img_ringFill    = 0; // next slot to fill by the read ahead thread
+static SBufferDescription       img_ringBuffer[IMG_RING_MAX_SLOTS];
+static unsigned                 img_ringLock[IMG_RING_MAX_SLOTS];
+static int                      img_ringState[IMG_RING_MAX_SLOTS];
+static int                      img_ringStatus[IMG_RING_MAX_SLOTS]; // readout status of a READY slot
+static pthread_mutex_t          img_ringMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           img_ringCond  = PTHREAD_COND_INITIALIZER;
+enum IMG_SLOT_STATE {IMG_SLOT_FREE, IMG_SLOT_FILLING, IMG_SLOT_READY, IMG_SLOT_LENT};
+// read ahead: a thread keeps the channels busy filling the free slots across images
+static pthread_t                img_raThread;
+static int                      img_raStarted = 0; // thread created and not yet joined
+static int                      img_raActive  = 0; // thread still filling slots
+static int                      img_raStop    = 0;
+static int                      img_raNbImg, img_raTimeout;
+// decoding pool: the raw images of the ring are decoded in parallel and delivered in order
+#define IMG_DEC_MAX_THREADS      16
+static int                      img_decNbThreads = 0; // 0 or 1: decoding done by the caller
+static pthread_mutex_t          img_decMutex     = PTHREAD_MUTEX_INITIALIZER; // claims the next image
+static pthread_mutex_t          img_decDoneMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           img_decDoneCond  = PTHREAD_COND_INITIALIZER;
+static int                      img_decNext, img_decStop, img_decActive, img_decStatus;
+static unsigned char            *img_decDone;          // decoded flag per image
+static enum IMG_TYPE            img_decType;
+static int                      img_decModMask, img_decNbImg;
+static void                     **img_decDest;         // destination per image
+static XPCI_SHM                 *img_decShm;           // or slot of the shared memory ring
+// slots of the shared memory ring of the images (/images)
+static int                      img_shmSlots = 32;
+static int                      img_shmBlockMs = 5000; // longest wait for a BLOCK consumer
+
 unsigned int 					 img_Format_Acq;
 unsigned int 					 flag_startExpose = 0;
 
@@ -818,9 +883,31 @@ int                             acquisition_type;                   //Used to in
 //    1-Burst Mode ( 16 bits 900 images max )
 //    2-Film Mode ( 16 bits )
 // 	  Used for GetImgSeq_SSD_imxpad
-uint16_t                 **pRawBuff_ssd;  // used for img seq film
-int                         read_pRawBuff_ssd=0;
-int                         write_pRawBuff_ssd=0;
+uint16_t                 **pRawBuff_ssd;  // used for img seq film, ssd_stripeBuff buffers per stripe
+XPCI_SPSC                   ssd_ring[XPCI_BURST_MAX_STRIPES]; // pRawBuff_ssd handoff from the readout to the disk writers
+int                         ssd_nbStripes=1;
+pthread_t                   ssd_writer[XPCI_BURST_MAX_STRIPES];   // one disk writer per stripe
+int                         ssd_stripeBuff=0;
+int                         ssd_ringFlags=XPCI_SPSC_SLEEP;
+int                         *ssd_frameNb=NULL; // image held by each pRawBuff_ssd buffer
+int                         ssd_stripeLast[XPCI_BURST_MAX_STRIPES]; // last image on disk per stripe
+int                         ssd_stripeEnd[XPCI_BURST_MAX_STRIPES];  // writer of the stripe finished
+unsigned                    ssd_imageCount=0;  // images on disk, published in /imageNumber
+int                         ssd_imageAborted=0;
+int                         ssd_codec=XPCI_CODEC_NONE;  // frames encoded before being written
+int                         ssd_codecThreads=2;
+void                        **ssd_coded=NULL;  // encoded frame of each pRawBuff_ssd buffer
+XPCI_CODEC_POOL             *ssd_pool[XPCI_BURST_MAX_STRIPES];
+XPCI_CODEC_STATS            ssd_lastCodecStats;
+unsigned                    ssd_bufBytes=0;   // pool bytes of one image (raw and encoded buffers)
+XPCI_FILM_POOL_STATS        ssd_lastPoolStats;
+pthread_mutex_t             ssd_imageLock = PTHREAD_MUTEX_INITIALIZER;
+uint16_t                    *ssd_scratch=NULL; // images dropped by a full ring are read out here
+XPCI_SPSC_STATS             ssd_lastRingStats;
+int                         ssd_running=0;
+XPCI_BURST                  *ssd_burst=NULL; // container file of the film
+XPCI_BURST_STATS            ssd_lastStats;   // writer stats of the last film
+pthread_mutex_t             ssd_burstLock = PTHREAD_MUTEX_INITIALIZER;
 int						    AbortProccess = 0;
 int 						ResetProcess  = 0;
 
@@ -1034,6 +1121,10 @@ void xpci_clearAbortProcess(){
 void xpci_setResetProcess(){
    // printf("=>>>>\t%s\n",__func__);
     ResetProcess = 1;
+    // wake up a readout waiting for a ring slot
+    pthread_mutex_lock(&img_ringMutex);
+    pthread_cond_broadcast(&img_ringCond);
+    pthread_mutex_unlock(&img_ringMutex);
 }
 
 void xpci_clearResetProcess(){
@@ -1282,14 +1373,21 @@ static void interruptHandler(SPCIInterruptData*  pData)
     //it_cnt++;
   // printf("Interrupt status = 0x%x\n", pData->data);
    
+    itStampNs = xpci_timeNs();
     xpci_setItCount();
+    // wake up the waiter if it sleeps (the counter is tested under the mutex by the waiter)
+    if (itWaitMode != XPCI_ITWAIT_SPIN){
+        pthread_mutex_lock(&it_mutex);
+        pthread_cond_signal(&it_cond);
+        pthread_mutex_unlock(&it_mutex);
+    }
     // printf(     " **          interrupt received        **\n");
     // it_total++;
 }
 
 void xpci_setItCount()
 {
-    it_cnt++;
+    __sync_fetch_and_add(&it_cnt, 1);
 }
 
 void xpci_clearItCount()
@@ -1302,6 +1400,60 @@ int xpci_getItCount()
     return it_cnt;
 }
 
+/****************************************************************
+ * Selects how waitIT() waits for the end of a DMA. To be set
+ * before an acquisition depending on the expected exposure:
+ * XPCI_ITWAIT_SPIN    busy loop on the IT counter (lowest latency,
+ *                     burns a core during the whole wait)
+ * XPCI_ITWAIT_SLEEP   sleep on a condition signalled by the IT handler
+ * XPCI_ITWAIT_HYBRID  spin during spinUsec then sleep
+ * returns 0 success, -1 unknown mode
+ ****************************************************************/
+int xpci_setItWaitMode(int mode, int spinUsec){
+    if ((mode!=XPCI_ITWAIT_SPIN)&&(mode!=XPCI_ITWAIT_SLEEP)&&(mode!=XPCI_ITWAIT_HYBRID)){
+        printf("ERROR: %s() unknown IT wait mode %d\n", __func__, mode);
+        return -1;
+    }
+    itWaitMode = mode;
+    itSpinUsec = (spinUsec>0) ? spinUsec : 0;
+    return 0;
+}
+
+int xpci_getItWaitMode(){
+    return itWaitMode;
+}
+
+/****************************************************************
+ * Histogram of the delay between the IT handler and the wake up
+ * of waitIT(). Bin 0 counts delays below 1us and bin k the delays
+ * in [2^(k-1), 2^k[ usec, the last bin gets all the longer ones.
+ * returns the number of bins copied
+ ****************************************************************/
+int xpci_getItLatencyHistogram(unsigned long *hist, int nbBins){
+    int i;
+    if (nbBins>XPCI_ITLAT_BINS)
+        nbBins = XPCI_ITLAT_BINS;
+    for (i=0; i<nbBins; i++)
+        hist[i] = itLatencyHist[i];
+    return nbBins;
+}
+
+void xpci_clearItLatencyHistogram(){
+    memset(itLatencyHist, 0, sizeof(itLatencyHist));
+}
+
+static void xpci_recordItLatency(){
+    unsigned long long usec;
+    int bin = 0;
+
+    usec = (xpci_timeNs() - itStampNs)/1000;
+    while (usec && (bin<XPCI_ITLAT_BINS-1)){
+        usec >>= 1;
+        bin++;
+    }
+    itLatencyHist[bin]++;
+}
+
 /****************************************************************
                   Design for semaphore use
 
@@ -1536,7 +1688,26 @@ static int waitIT(){
    */ // Notice: another way to wait for the IT occurence would have been to use
     // polling on the IT status
     // while (xpci_getInterruptStatus()==1);
-    while(xpci_getItCount() == 0);
+    if (itWaitMode == XPCI_ITWAIT_SPIN){
+        while((xpci_getItCount() == 0) && !itCancel);
+    }
+    else {
+        if (itWaitMode == XPCI_ITWAIT_HYBRID){
+            // spin first to keep the latency of short transfers
+            unsigned long long limit = xpci_timeNs() + (unsigned long long)itSpinUsec*1000;
+            while((xpci_getItCount() == 0) && !itCancel && (xpci_timeNs() < limit));
+        }
+        if (xpci_getItCount() == 0){
+            pthread_mutex_lock(&it_mutex);
+            while((xpci_getItCount() == 0) && !itCancel)
+                pthread_cond_wait(&it_cond, &it_mutex);
+            pthread_mutex_unlock(&it_mutex);
+        }
+    }
+    // the read ahead is stopped while waiting for an IT which may never come (abort)
+    if (xpci_getItCount() == 0)
+        return -1;
+    xpci_recordItLatency();
     
     initIt(); //prepare for next dma
     return error;
@@ -1648,7 +1819,7 @@ static int xpci_waitOnChannel(int channel, int softTimeout){
 
 static int xpci_allocateDmaMemory(unsigned int *lockNb, SBufferDescription *bufDesc, int size){
     memset(bufDesc, 0, sizeof(SBufferDescription));
-    bufDesc->ByteCount = SERV_BUFFER_SIZE;
+    bufDesc->ByteCount = size;
     //printf("Alloc Phy on %d\n", lockNb);
     if ( PldaLockPhysicalAddress(nIndex, lockNb , bufDesc) == FALSE ){
         printf("ERROR: PldaLockPhysicalAddress() fails on %d\n", lockNb);
@@ -1785,6 +1956,28 @@ int xpci_init(int det, int sysType)
         return -1;
     }
     error_msg_channel[1] = (char*)svcDma1.UserAddr;
+
+    /* allocate the 2 channels TX buffers reused by all the commands */
+    txPersistent = 0;
+    if ( xpci_allocateDmaMemory(&DMA0_TXCMD_BUF_LOCK, &img_txBuffer0, MAX_TX_FIFO_SIZE)==0){
+        if ( xpci_allocateDmaMemory(&DMA1_TXCMD_BUF_LOCK, &img_txBuffer1, MAX_TX_FIFO_SIZE)==0)
+            txPersistent = 1;
+        else
+            PldaReleasePhysicalAddress(nIndex, DMA0_TXCMD_BUF_LOCK);
+    }
+    if (!txPersistent)
+        printf("WARNING: %s() no persistent TX buffers, commands will lock their own buffers\n", __func__);
+    /* and the 2 channels buffers for the replies */
+    rxPersistent = 0;
+    if ( xpci_allocateDmaMemory(&rxReplyLock[0], &rxReplyBuffer[0], RX_REPLY_BUF_SIZE)==0){
+        if ( xpci_allocateDmaMemory(&rxReplyLock[1], &rxReplyBuffer[1], RX_REPLY_BUF_SIZE)==0)
+            rxPersistent = 1;
+        else
+            PldaReleasePhysicalAddress(nIndex, rxReplyLock[0]);
+    }
+    if (!rxPersistent)
+        printf("WARNING: %s() no persistent RX buffers, replies will lock their own buffers\n", __func__);
+    xpci_clearTxStats();
     detStatus[det] = UP;// should be set here to deallocate svc mem when xpci_close() is called
 
     xpci_resetBoard(det);    // checks that the board status is UP, reset board and init service FIFOs DMA memory  and hardware timeout
@@ -1859,6 +2052,16 @@ void xpci_close(int det){
     PldaReleasePhysicalAddress(nIndex, DMA0_SVC_BUF_LOCK);
     printf("Dealloc Phys on %d\n", DMA1_SVC_BUF_LOCK);
     PldaReleasePhysicalAddress(nIndex, DMA1_SVC_BUF_LOCK);
+    if (txPersistent){
+        PldaReleasePhysicalAddress(nIndex, DMA0_TXCMD_BUF_LOCK);
+        PldaReleasePhysicalAddress(nIndex, DMA1_TXCMD_BUF_LOCK);
+        txPersistent = 0;
+    }
+    if (rxPersistent){
+        PldaReleasePhysicalAddress(nIndex, rxReplyLock[0]);
+        PldaReleasePhysicalAddress(nIndex, rxReplyLock[1]);
+        rxPersistent = 0;
+    }
     /* relesae boerd resources */
     //printf("Clearing resources ...\n");
     PldaClearResources(nIndex);
@@ -1885,63 +2088,85 @@ static int roundSizeToXBytes(int size, int nbBytes){
  * Current out TX buffer size is 2K. this function only
  * accepts a block of data up to 2K.
  *
+ * The message is copied in the persistent TX buffers allocated
+ * once at xpci_init(). Only when they are not available a
+ * physical buffer is locked and released for this command.
+ *
  * If more data have to be sent use xpci_write() with
  * channel >=2 to send on both channels
  *
- * size : the size in bytes of the data to send. They are
- * strored in an array of 16 bits words.
+ * size      : the size in bytes of the data to send. They are
+ *             strored in an array of 16 bits words.
+ * splitMask : S1400 module mask word is split on the 2 channels
  ***************************************************************/
-int xpci_writeCommon(uint16_t *data, int size){
+static int xpci_writeCommonExec(uint16_t *data, int size, unsigned modMask, int splitMask){
     SBufferDescription	tx0_buffer;
     SBufferDescription 	tx1_buffer;
+    SBufferDescription  *tx0, *tx1;
     DWORD			dma_conf[10];
     uint16_t      	*ptx0, *ptx1;
     int                   j;
     UINT32         command;
     int                   dmaStatus;
+    int                   locked = 0;
+    unsigned long long    tStart, tDma;
 
+    tStart = xpci_timeNs();
     xpci_resetChannels(3); // reset the 2 channels
     xpci_eraseSvcMsg(3);// applied to both channels
-    // ATTENTION: this init is necessary otherwise the allocation fails
-    // memset (&tx0_buffer, 0, sizeof(SBufferDescription) );
-    // memset (&tx1_buffer, 0, sizeof(SBufferDescription) );
 
-    // Allocation  to send commands
-
-    tx0_buffer.ByteCount = size;
-    if ( !PldaLockPhysicalAddress(nIndex, &DMA0_TX_BUF_LOCK, &tx0_buffer) )
-    {
-        printf("..%s() failed to allocate memory (TX0 buffer).Exit\n", __func__);
-        exit(0);
+    if (txPersistent && dmaBufReuse && size<=MAX_TX_FIFO_SIZE){
+        tx0 = &img_txBuffer0;
+        tx1 = &img_txBuffer1;
     }
-    tx1_buffer.ByteCount = size;
-    if ( !PldaLockPhysicalAddress(nIndex, &DMA1_TX_BUF_LOCK, &tx1_buffer))
-    {
-        PldaReleasePhysicalAddress(nIndex, DMA0_TX_BUF_LOCK);
-        printf("..%s failed to allocate memory (TX1 buffer).Exit\n", __func__);
-        exit(0);
+    else {
+        // ATTENTION: this init is necessary otherwise the allocation fails
+        memset (&tx0_buffer, 0, sizeof(SBufferDescription) );
+        memset (&tx1_buffer, 0, sizeof(SBufferDescription) );
+
+        // Allocation  to send commands
+        tx0_buffer.ByteCount = size;
+        if ( PldaLockPhysicalAddress(nIndex, &DMA0_TX_BUF_LOCK, &tx0_buffer) == FALSE )
+        {
+            printf("..%s() failed to allocate memory (TX0 buffer).Exit\n", __func__);
+            exit(0);
+        }
+        tx1_buffer.ByteCount = size;
+        if ( PldaLockPhysicalAddress(nIndex, &DMA1_TX_BUF_LOCK, &tx1_buffer) == FALSE )
+        {
+            PldaReleasePhysicalAddress(nIndex, DMA0_TX_BUF_LOCK);
+            printf("..%s failed to allocate memory (TX1 buffer).Exit\n", __func__);
+            exit(0);
+        }
+        tx0 = &tx0_buffer;
+        tx1 = &tx1_buffer;
+        locked = 1;
+        txStats.nbLocks++;
     }
-    dma_conf[0] = tx0_buffer.PhysicalAddr & 0xFFFFFFFC;
-    dma_conf[1] = tx1_buffer.PhysicalAddr & 0xFFFFFFFC;
+    dma_conf[0] = tx0->PhysicalAddr & 0xFFFFFFFC;
+    dma_conf[1] = tx1->PhysicalAddr & 0xFFFFFFFC;
     dma_conf[2] = size;
     dma_conf[3] = size;
     PldaMemoryWrite32 (nIndex, BAR_0, 0, 4, dma_conf);
     
-    ptx0 = (uint16_t*) tx0_buffer.UserAddr;
-    ptx1 = (uint16_t*) tx1_buffer.UserAddr;
-    if (debugMsg) printf("DEBUG: %s() sending on the 2 channels\n", __func__);
-
-    for(j = 0; j<size/sizeof(uint16_t); j++)
-    {
-        *ptx0 = data[j]; if (debugMsg) printf(" 0x%04x ",*ptx0);
-        *ptx1 = data[j];
-        ptx0++;
-        ptx1++;
+    ptx0 = (uint16_t*) tx0->UserAddr;
+    ptx1 = (uint16_t*) tx1->UserAddr;
+    memcpy(ptx0, data, size);
+    memcpy(ptx1, data, size);
+    // the mask word is only there in a module message (locked buffers are just size bytes)
+    if (splitMask && (size >= 4*(int)sizeof(uint16_t)) && (data[1] == MOD_MESSAGE)){
+        // channel 1 drives modules 0..9 and channel 0 modules 10..19
+        ptx1[3] = (modMask & 0x03FF);
+        ptx0[3] = (((modMask >> 10) & 0x3FF) | 0x400);
     }
-
-    if (debugMsg) printf("\n");
-    ptx0 = (uint16_t*) tx0_buffer.UserAddr;
-    ptx1 = (uint16_t*) tx1_buffer.UserAddr;
+    if (debugMsg){
+        printf("DEBUG: %s() sending on the 2 channels\n", __func__);
+        for(j = 0; j<size/sizeof(uint16_t); j++)
+            printf(" 0x%04x/0x%04x ", ptx0[j], ptx1[j]);
+        printf("\n");
+    }
+    tDma = xpci_timeNs();
+    txStats.setupNs += tDma - tStart;
 
     command=START_TXDMA;
     //=========  send on the first channel
@@ -1950,7 +2175,7 @@ int xpci_writeCommon(uint16_t *data, int size){
     dmaStatus = waitIT();//make IT loss !! dmaStatus = xpci_waitOnChannel(0,0);
     if (dmaStatus==-1){
         printf("ERROR in %s() on channel 0\n", __func__);
-        goto endError;
+        goto endFunc;
     }
 
     //=========  send on the second channel
@@ -1959,145 +2184,97 @@ int xpci_writeCommon(uint16_t *data, int size){
     dmaStatus = waitIT();//make IT loss !!dmaStatus = xpci_waitOnChannel(0,0);
     if (dmaStatus==-1){
         printf("ERROR in %s on channel 1\n", __func__);
-        goto endError;
+        goto endFunc;
     }
-    PldaReleasePhysicalAddress(nIndex, DMA0_TX_BUF_LOCK);
-    PldaReleasePhysicalAddress(nIndex, DMA1_TX_BUF_LOCK);
-    return 0;
-endError:
-    PldaReleasePhysicalAddress(nIndex, DMA0_TX_BUF_LOCK);
-    PldaReleasePhysicalAddress(nIndex, DMA1_TX_BUF_LOCK);
-    return -1;
+endFunc:
+    txStats.dmaNs += xpci_timeNs() - tDma;
+    txStats.nbCommands++;
+    if (locked){
+        PldaReleasePhysicalAddress(nIndex, DMA0_TX_BUF_LOCK);
+        PldaReleasePhysicalAddress(nIndex, DMA1_TX_BUF_LOCK);
+    }
+    return dmaStatus;
 }
 
-
-
+int xpci_writeCommon(uint16_t *data, int size){
+    return xpci_writeCommonExec(data, size, 0, 0);
+}
 
 /**************************************************************
  * Function to diffuse the same message on the two channels
  * Add mask parameter beaucause the data transfer are 16 bits and the S1400 detector used 20 bits
- * This function receives the number of bytes to write.
- * Current out TX buffer size is 2K. this function only
- * accepts a block of data up to 2K.
- *
- * If more data have to be sent use xpci_write() with
-
- * channel >=2 to send on both channels
- *
- * size : the size in bytes of the data to send. They are
- * strored in an array of 16 bits words.
+ * See xpci_writeCommon()
  ***************************************************************/
 int xpci_writeCommon_S1400(uint16_t *data, int size,unsigned modMask){
-    SBufferDescription	tx0_buffer;
-    SBufferDescription 	tx1_buffer;
-    DWORD			dma_conf[10];
-    uint16_t      	*ptx0, *ptx1;
-    int                   j;
-    UINT32         command;
-    int                   dmaStatus;
-
-    xpci_resetChannels(3); // reset the 2 channels
-    xpci_eraseSvcMsg(3);// applied to both channels
-    // ATTENTION: this init is necessary otherwise the allocation fails
-    memset (&tx0_buffer, 0, sizeof(SBufferDescription) );
-    memset (&tx1_buffer, 0, sizeof(SBufferDescription) );
-
-    // Allocation  to send commands
-    tx0_buffer.ByteCount = size;
-    if ( PldaLockPhysicalAddress(nIndex, &DMA0_TX_BUF_LOCK, &tx0_buffer) == FALSE )
-    {
-        printf("..%s() failed to allocate memory (TX0 buffer).Exit\n", __func__);
-        exit(0);
-    }
-    tx1_buffer.ByteCount = size;
-    if ( PldaLockPhysicalAddress(nIndex, &DMA1_TX_BUF_LOCK, &tx1_buffer) == FALSE )
-    {
-        PldaReleasePhysicalAddress(nIndex, DMA0_TX_BUF_LOCK);
-        printf("..%s failed to allocate memory (TX0 buffer).Exit\n", __func__);
-        exit(0);;
-    }
-    dma_conf[0] = tx0_buffer.PhysicalAddr & 0xFFFFFFFC;
-    dma_conf[1] = tx1_buffer.PhysicalAddr & 0xFFFFFFFC;
-    dma_conf[2] = size;
-    dma_conf[3] = size;
-    PldaMemoryWrite32 (nIndex, BAR_0, 0, 4, dma_conf);
-    
-    ptx0 = (uint16_t*) tx0_buffer.UserAddr;
-    ptx1 = (uint16_t*) tx1_buffer.UserAddr;
-    if (debugMsg) printf("DEBUG: %s() sending on the 2 channels\n", __func__);
-    if(xpci_systemType==IMXPAD_S1400)
-    {
-        for(j = 0; j<size/sizeof(uint16_t); j++)
-        {
-            if((data[1] == MOD_MESSAGE) && (j == 3)){
-                *ptx1 = (modMask & 0x03FF); if (debugMsg) printf("0x%04x ",*ptx1);
-                *ptx0 =(((modMask >> 10) & 0x3FF) | 0x400);
-                ptx0++;
-                ptx1++;
-
-            }
-            else{
-                *ptx0 = data[j]; if (debugMsg) printf("  0x%04x ",*ptx0);
-                *ptx1 = data[j];
-                ptx0++;
-                ptx1++;
-            }
-        }
-    }
-    else
-    {
-        for(j = 0; j<size/sizeof(uint16_t); j++)
-        {
-            *ptx0 = data[j]; if (debugMsg) printf(" 0x%04x ",*ptx0);
-            *ptx1 = data[j]; if (debugMsg) printf(" 0x%04x ",*ptx1);
-            ptx0++;
-            ptx1++;
-        }
-    }
-    if (debugMsg) printf("\n");
-    ptx0 = (uint16_t*) tx0_buffer.UserAddr;
-    ptx1 = (uint16_t*) tx1_buffer.UserAddr;
-
-    command=START_TXDMA;
-    //=========  send on the first channel
-    initIt();//it_cnt = 0;
-    PldaMemoryWrite32 (nIndex,BAR_0, 10, 1 , &command);
-    dmaStatus = waitIT();//make IT loss !! dmaStatus = xpci_waitOnChannel(0,0);
-    if (dmaStatus==-1){
-        printf("ERROR in %s() on channel 0\n", __func__);
-        goto endError;
-    }
-    //=========  send on the second channel
-    initIt();//it_cnt=0;
-    PldaMemoryWrite32 (nIndex,BAR_0, 11, 1 , &command);
-    dmaStatus = waitIT();//make IT loss !!dmaStatus = xpci_waitOnChannel(0,0);
-    if (dmaStatus==-1){
-        printf("ERROR in %s on channel 1\n", __func__);
-        goto endError;
-    }
-    PldaReleasePhysicalAddress(nIndex, DMA0_TX_BUF_LOCK);
-    PldaReleasePhysicalAddress(nIndex, DMA1_TX_BUF_LOCK);
-    return 0;
-endError:
-    PldaReleasePhysicalAddress(nIndex, DMA0_TX_BUF_LOCK);
-    PldaReleasePhysicalAddress(nIndex, DMA1_TX_BUF_LOCK);
-    return -1;
+    return xpci_writeCommonExec(data, size, modMask, xpci_systemType==IMXPAD_S1400);
 }
 
+/**************************************************************
+ * Counters of the commands sent by xpci_writeCommon() to compare
+ * the time spent preparing the TX buffers with the DMA itself.
+ ***************************************************************/
+void xpci_getTxStats(XPCI_TX_STATS *stats){
+    *stats = txStats;
+}
 
+void xpci_clearTxStats(){
+    memset(&txStats, 0, sizeof(txStats));
+}
 
+/**************************************************************
+ * Selects if the commands and replies use the persistent DMA
+ * buffers allocated at xpci_init() (1 default) or lock their own
+ * buffers for each transfer as it was done before (0).
+ ***************************************************************/
+void xpci_setDmaBufferReuse(int flag){
+    dmaBufReuse = flag ? 1 : 0;
+}
 
-
-
-
-
-
-
+/**************************************************************
+ * Microbenchmark of the command round trip (AskReady + replies)
+ * measured first with a physical buffer locked per transfer then
+ * with the persistent buffers.
+ * returns    : 0 success    -1 a command failed
+ * out        : usecLocked   mean round trip with locked buffers
+ *              usecReused   mean round trip with persistent buffers
+ ***************************************************************/
+int xpci_benchCommandRoundTrip(unsigned modMask, int nbLoops, double *usecLocked, double *usecReused){
+    int                   pass, i;
+    int                   ret = 0;
+    int                   oldReuse = dmaBufReuse;
+    unsigned long long    t0, total;
+    double                mean[2];
+    XPCI_TX_STATS         st;
+
+    if (nbLoops<=0)
+        return -1;
+    for (pass=0; pass<2; pass++){
+        xpci_setDmaBufferReuse(pass);
+        xpci_clearTxStats();
+        total = 0;
+        for (i=0; i<nbLoops; i++){
+            t0 = xpci_timeNs();
+            if (xpci_modGlobalAskReady(modMask)!=0)
+                ret = -1;
+            total += xpci_timeNs() - t0;
+        }
+        mean[pass] = (double)total/nbLoops/1000.0;
+        xpci_getTxStats(&st);
+        printf("%s() %s buffers: round trip %.1f usec, TX setup %.1f usec, TX DMA %.1f usec per command\n",
+               __func__, pass ? "persistent" : "locked", mean[pass],
+               st.nbCommands ? (double)st.setupNs/st.nbCommands/1000.0 : 0.0,
+               st.nbCommands ? (double)st.dmaNs/st.nbCommands/1000.0 : 0.0);
+    }
+    xpci_setDmaBufferReuse(oldReuse);
+    if (usecLocked) *usecLocked = mean[0];
+    if (usecReused) *usecReused = mean[1];
+    return ret;
+}
 
 /**************************************************************
  * This is a special version of the writeCommon() function for
  * speed optimization in readNextImage().
- * It uses preallocated transmit buffers (done in readImageInit()
+ * It uses preallocated transmit buffers (done in xpci_init())
  * to send image request messages.
  *
  * Function to diffuse the same message on the two channels
@@ -2505,11 +2682,12 @@ static int xpci_writeExec(int channel, uint16_t *data, int size, int noReset){
 * the function will crash.
 *******************************************************/
 
-/* Allocates the physical memory for transfer 
+/* Takes the persistent reply buffer of the channel (or allocates
+   the physical memory for transfer if the reply is too large)
    Starts the transfer
    Waits transfer end
    Copys the received data in the passed buffer
-   Frees the physical memory
+   Frees the physical memory if it was allocated
    timeout = 0 use the hardware timeout
    timeout !=0 use the software timeout value is in ms
 *******************************************************/ 
@@ -2517,13 +2695,14 @@ int xpci_read(int channel, uint16_t *data, int size, int timeout){ // dma transf
     unsigned int long     addOffset, sizeOffset, cmdOffset;
 
     SBufferDescription 	rdBuffer;
+    SBufferDescription  *rxBuf;
     int                   i, dmaStatus;
-    unsigned            lockNb[2];
     uint16_t              *pval;
     UINT32         dmaAddr;
     UINT32         command = START_RXDMA;
     
     unsigned DMA_SELECT;
+    int      locked = 0;
 
     if (size%8 != 0){
         printf("ERROR: %s() read size should be multiple of 8bytes\n", __func__);
@@ -2547,34 +2726,29 @@ int xpci_read(int channel, uint16_t *data, int size, int timeout){ // dma transf
     dmaStatus = 0;
     xpci_eraseSvcMsg(channel);
     // NO usually when this function is called when data are already waiting in FIFOs xpci_resetChannels(3);
-    //memset (&rdBuffer, 0, sizeof(SBufferDescription) );
     /*
     The message granularity on the FIFO internal bus is 64 bits OR 4 uint16_t OR 8 bytes.
     If too short can be padded with zeroes to round up
   */
-
-    rdBuffer.ByteCount = size;
-    /* Allocate contiguous memory
-     allocates a system memory buffer and returns its physical address
-    */
-    // printf("Alloc Phy on lock %d\n", lockNb);
-    // if(channel == 0){
-    if ( PldaLockPhysicalAddress(nIndex, &DMA_SELECT , &rdBuffer) == FALSE ) {
-        printf("ERROR: PldaLockPhysicalAddress() fails on %d\n", DMA0_RX_BUF_LOCK);
-        return -1;
+    if (rxPersistent && dmaBufReuse && size<=RX_REPLY_BUF_SIZE){
+        rxBuf = &rxReplyBuffer[channel];
     }
-    /*  }
-    else{
-        if ( PldaLockPhysicalAddress(nIndex, &DMA1_RX_BUF_LOCK , &rdBuffer) == FALSE ) {
-            printf("ERROR: PldaLockPhysicalAddress() fails on %d\n", DMA1_RX_BUF_LOCK);
+    else {
+        memset (&rdBuffer, 0, sizeof(SBufferDescription) );
+        rdBuffer.ByteCount = size;
+        /* Allocate contiguous memory
+         allocates a system memory buffer and returns its physical address
+        */
+        if ( PldaLockPhysicalAddress(nIndex, &DMA_SELECT , &rdBuffer) == FALSE ) {
+            printf("ERROR: PldaLockPhysicalAddress() fails on %d\n", DMA_SELECT);
             return -1;
         }
+        rxBuf  = &rdBuffer;
+        locked = 1;
     }
-    */
-    // memset ((void*)(rdBuffer.UserAddr), 0xde, size );// just scramble to be sure not to read old mem data from tx buff
-    dmaAddr = rdBuffer.PhysicalAddr & 0xFFFFFFFC;  /* Set low read physical address */
+    // memset ((void*)(rxBuf->UserAddr), 0xde, size );// just scramble to be sure not to read old mem data from tx buff
+    dmaAddr = rxBuf->PhysicalAddr & 0xFFFFFFFC;  /* Set low read physical address */
     PldaMemoryWrite32 (nIndex, BAR_0, addOffset,  1, &dmaAddr);
-    //PldaMemoryWrite32 (nIndex, BAR_0, sizeOffset, 1, &msglen);
     PldaMemoryWrite32 (nIndex, BAR_0, sizeOffset, 1, (unsigned long*)&size);
 
     // WAIT IN SOFT FOr DATA AVAILABLE
@@ -2598,17 +2772,10 @@ int xpci_read(int channel, uint16_t *data, int size, int timeout){ // dma transf
 
     /* copy back the data for the user */
     /* The message granularity on the FIFO internal bus is 64 bits OR 4 uint16_t OR 8 bytes.
-     So we know that we are aligned on a 32 bits boubdary */
-    /* copy word by word but if a multiple of 4 bytes is not aligned on word
-     add the necesary 0 */
-    //msglen =  roundSizeToXBytes(size,4);
-    //memset (data, 0, msglen ); /* will crash the program if the user as not allocated enough */
-    memset (data, 0, size );/* will crash the program if the user as not allocated enough */
-    pval =  (uint16_t*)(rdBuffer.UserAddr);
-    for(int i = 0; i<size/(sizeof(uint16_t)); i++)
-    {
-        data[i] = pval[i];
-    }
+     So we know that we are aligned on a 64 bits boundary and the whole reply is copied
+     in one bulk copy (will crash the program if the user as not allocated enough) */
+    pval =  (uint16_t*)(rxBuf->UserAddr);
+    memcpy(data, pval, size);
     if (debugMsg)
     {
         printf("DEBUG: %s(%d) received dump the target memory\n",  __func__,channel);
@@ -2621,10 +2788,8 @@ int xpci_read(int channel, uint16_t *data, int size, int timeout){ // dma transf
     }
 
 endFunc:
-    //if(channel == 0)
-    PldaReleasePhysicalAddress(nIndex, DMA_SELECT);
-    //	else
-    //		PldaReleasePhysicalAddress(nIndex, DMA1_RX_BUF_LOCK);
+    if (locked)
+        PldaReleasePhysicalAddress(nIndex, DMA_SELECT);
     return dmaStatus;
 }
 
@@ -2865,6 +3030,86 @@ int  xpci_getModNbOnChnl(unsigned modMask, int channel){
    To close the image acquisition sequence and relesae the ressources call:
    int xpci_readImageClose()
 ****************************************************************************************/
+/***************************************************************************************
+                            ZERO-COPY DMA RING
+
+   When a ring depth has been set with xpci_setImgRingDepth() the xpci_readImageInit()
+   also allocates this number of pinned buffers, each one large enough for a complete
+   raw image. The transfers of one image are then programmed directly at their final
+   offset in a slot (same layout as the buffer filled by xpci_readImgBuff()) so no byte
+   is copied between the DMA engine and the first consumer.
+
+   xpci_readImgRing()    fills the next slot in order and lends it to the caller
+   xpci_releaseImgRing() gives the slot back to the ring (can be called from any thread)
+
+   The hardware has a single RX address register per channel so only one transfer per
+   channel can be programmed at a time. To keep the link busy across image boundaries
+   xpci_startImgReadAhead() runs the readout in a thread that fills every free slot as
+   soon as it is given back: up to nbSlots-1 images are queued while the consumer is
+   still decoding. xpci_readImgRing() then only waits for the next READY slot.
+   xpci_stopImgReadAhead() should be called before xpci_getImageClose().
+
+   If the pinned memory can not be obtained for at least 2 slots the ring is disabled
+   and xpci_getImgRingSlots() returns 0: the caller should use xpci_readImgBuff().
+****************************************************************************************/
+int xpci_setImgRingDepth(int nbSlots){
+    if ((nbSlots<0)||(nbSlots>IMG_RING_MAX_SLOTS)){
+        printf("ERROR: %s() ring depth should be in [0,%d]\n", __func__, IMG_RING_MAX_SLOTS);
+        return -1;
+    }
+    img_ringDepth = nbSlots;
+    return 0;
+}
+
+int xpci_getImgRingSlots(){
+    return img_ringNbSlots;
+}
+
+static void xpci_freeImgRing(){
+    int i;
+    for (i=0; i<img_ringNbSlots; i++)
+        PldaReleasePhysicalAddress(nIndex, img_ringLock[i]);
+    img_ringNbSlots = 0;
+}
+
+static int xpci_allocImgRing(int slotSize){
+    int i;
+
+    xpci_freeImgRing();
+    img_ringNext = 0;
+    img_ringFill = 0;
+    for (i=0; i<img_ringDepth; i++){
+        memset (&img_ringBuffer[i], 0, sizeof(SBufferDescription) );
+        img_ringBuffer[i].ByteCount = slotSize;
+        if ( PldaLockPhysicalAddress(nIndex, &img_ringLock[i], &img_ringBuffer[i]) == FALSE )
+            break;
+        img_ringState[i] = IMG_SLOT_FREE;
+        img_ringNbSlots++;
+    }
+    if ((img_ringDepth>0)&&(img_ringNbSlots<2)){
+        printf("WARNING: %s() only %d pinned slots of %d bytes available, zero-copy ring disabled\n",
+               __func__, img_ringNbSlots, slotSize);
+        xpci_freeImgRing();
+        return -1;
+    }
+    if (debugMsg && img_ringNbSlots) printf("%d ring slots of %d bytes\n", img_ringNbSlots, slotSize);
+    return 0;
+}
+
+// Starts the DMA on one channel. When a ring slot is passed the DMA is first pointed
+// at the place of 'dst' inside the slot instead of the channel bounce buffer.
+static void xpci_startImgDmaRead(int channel, uint16_t *dst, SBufferDescription *slot){
+    UINT32 dmaAddr;
+    if (slot != NULL){
+        dmaAddr = (slot->PhysicalAddr + ((char*)dst - (char*)slot->UserAddr)) & 0xFFFFFFFC;
+        if (channel==0)
+            PldaMemoryWrite32 (nIndex, BAR_0, DMA0_RX_PHYADD_OFFSET, 1, &dmaAddr);
+        else
+            PldaMemoryWrite32 (nIndex, BAR_0, DMA1_RX_PHYADD_OFFSET, 1, &dmaAddr);
+    }
+    startDMARead(channel);
+}
+
 /***************************************************************************************
    Function to compute ressources necessary for the image acquisition and allocate them
    in globals variables.
@@ -2907,7 +3152,7 @@ int  xpci_getModNbOnChnl(unsigned modMask, int channel){
 
    The data will be copied in the passed data buffer in sequence in increasing order
    of the module id: 1, 2 etc ... 8 (for the present modules)
-****************************************************************************************/ 
+****************************************************************************************/
 int xpci_readImageInit(enum IMG_TYPE type, int moduleMask, int nbChips){ // dma transfer size in bytes
     UINT32         dmaAddr;
     int                   totalSizeToTransfer;
@@ -2940,6 +3185,9 @@ int xpci_readImageInit(enum IMG_TYPE type, int moduleMask, int nbChips){ // dma
     }
     // compute the data volumes per module
     xpci_getImgDataParameters(img_type, nbChips, &lineSize, &img_transferSize, &img_sizeImage);
+    img_lineWords = lineSize;
+    // the line to image mapping is computed once for the whole acquisition
+    imxpad_initGeometry(moduleMask);
     if (debugMsg)
         printf("Image size is %d\n", img_sizeImage);
 
@@ -2992,6 +3240,9 @@ int xpci_readImageInit(enum IMG_TYPE type, int moduleMask, int nbChips){ // dma
     PldaMemoryWrite32 (nIndex, BAR_0, DMA1_RX_PHYADD_OFFSET,  1, &dmaAddr);
     PldaMemoryWrite32 (nIndex, BAR_0, DMA1_RX_SIZE_OFFSET,    1, (unsigned long*)&img_transferSize);
 
+    // ============= zero-copy ring of complete raw images ===============
+    xpci_allocImgRing(img_sizeImage*(img_nbMod0+img_nbMod1));
+
     // RESET PCI FIFOs reset dmas and fifos
     xpci_resetChannels(3);
     // set proper timeout
@@ -3276,13 +3527,33 @@ int xpci_startImgSequence(unsigned nloop){
     }
     return ret;
 }
+// Stores one transfer received in a channel buffer. Nothing to do if the DMA has been
+// done in place in a ring slot. When a decoded image is passed the lines are decoded
+// straight from the channel buffer, else they are copied at 'dst' in the raw image.
+static void xpci_storeImgTransfer(uint16_t *dst, SBufferDescription *rdBuffer,
+                                  SBufferDescription *slot, void *decoded){
+    if (slot != NULL)
+        return;
+    if (decoded != NULL){
+        if (imxpad_decodeLines(img_type, img_moduleMask, (uint16_t*)rdBuffer->UserAddr,
+                               img_transferSize/(img_lineWords*sizeof(uint16_t)), decoded)!=0)
+            if (debugMsg) printf("DEBUG: %s() bad lines in the transfer\n", __func__);
+        return;
+    }
+    memcpy(dst, (uint32_t*)rdBuffer->UserAddr ,img_transferSize);
+}
+
 /****************************************************************************************
   Function to read the PCIe buffers containing an image.
   returns: 0 success  else error
   input  : data      pointer to the data receiveing buffer
+           slot      ring slot containing 'data' (DMA done in place) or NULL to copy
+                     from the channel buffers
+           decoded   if not NULL the lines are decoded straight from the channel buffers
+                     in this image (uint16_t for B2, uint32_t for B4) and 'data' is unused
            timeout   maximum time in usec to wait on the IT
 *****************************************************************************************/
-int xpci_readImgBuff(void *data, int timeout){ // dma transfer size in bytes
+static int xpci_readImgTransfers(void *data, SBufferDescription *slot, void *decoded, int timeout){ // dma transfer size in bytes
     int                   dmaStatus = 0;
     int                   i,j;
     int                   pline = 5;
@@ -3328,7 +3599,7 @@ int xpci_readImgBuff(void *data, int timeout){ // dma transfer size in bytes
             // channel. We always start sith channel 0.
             if (debugMsg)
                 printf("alternate DMA 0 ...\n");
-            startDMARead(0);
+            xpci_startImgDmaRead(0, img_data0, slot);
             xpci_it_pos  =3;
         }//first loop
 
@@ -3349,11 +3620,11 @@ int xpci_readImgBuff(void *data, int timeout){ // dma transfer size in bytes
             printUserBuffer((unsigned*)img_rdBuffer0.UserAddr, pline );
             printf("alternate DMA 1 ...\n");
         }
-        startDMARead(1);
+        xpci_startImgDmaRead(1, img_data1, slot);
         xpci_it_pos  =4;
         // copy previous buffer 0
 
-        memcpy(img_data0, (uint32_t*)img_rdBuffer0.UserAddr ,img_transferSize);
+        xpci_storeImgTransfer(img_data0, &img_rdBuffer0, slot, decoded);
         // for(memPtr=0;memPtr<copySize;memPtr++)
         // *(img_data0+memPtr) = *((uint16_t*)(img_rdBuffer0.UserAddr)+memPtr);
 
@@ -3376,12 +3647,12 @@ int xpci_readImgBuff(void *data, int timeout){ // dma transfer size in bytes
 
         if (i<img_nbParallelTrans){// not in lastloop - 1
             if (debugMsg) printf("alternate DMA 0 ...\n");
-            startDMARead(0);
+            xpci_startImgDmaRead(0, img_data0, slot);
             xpci_it_pos  =5;
         }
         // copy previous buffer 1
 
-        memcpy(img_data1,(uint32_t*)img_rdBuffer1.UserAddr ,img_transferSize);
+        xpci_storeImgTransfer(img_data1, &img_rdBuffer1, slot, decoded);
         //for(memPtr=0;memPtr<copySize;memPtr++)
         //    *(img_data1+memPtr) = *((uint16_t*)(img_rdBuffer1.UserAddr)+memPtr);
 
@@ -3402,7 +3673,7 @@ int xpci_readImgBuff(void *data, int timeout){ // dma transfer size in bytes
         if (img_nbMod1<img_nbMod0){
             if (debugMsg)
                 printf("sequencial DMA 0 ...\n");
-            startDMARead(0);
+            xpci_startImgDmaRead(0, img_data0, slot);
 
             do{
                 WAIT_IT(dmaStatus,timeout);
@@ -3422,7 +3693,7 @@ int xpci_readImgBuff(void *data, int timeout){ // dma transfer size in bytes
             // Bug seen at SOLEIL the 20-09-2011 with monomodule. Half images are skipped or overwritten
             // Changing the memory copy by a slower way to do it apparently solves the problem. To be
             // investigate in firmware.
-            memcpy(img_data0, (uint32_t*)img_rdBuffer0.UserAddr ,img_transferSize);
+            xpci_storeImgTransfer(img_data0, &img_rdBuffer0, slot, decoded);
             //for(memPtr=0;memPtr<(img_transferSize/sizeof(uint16_t));memPtr++)
             //    *(img_data0+memPtr) = *((uint16_t*)(img_rdBuffer0.UserAddr)+memPtr);
 
@@ -3431,7 +3702,7 @@ int xpci_readImgBuff(void *data, int timeout){ // dma transfer size in bytes
         else {
             if (debugMsg)
                 printf("sequential DMA 1 ...\n");
-            startDMARead(1);
+            xpci_startImgDmaRead(1, img_data1, slot);
             
             do{
                 WAIT_IT(dmaStatus,timeout);
@@ -3451,7 +3722,7 @@ int xpci_readImgBuff(void *data, int timeout){ // dma transfer size in bytes
             // Bug seen at SOLEIL the 20-09-2011 with monomodule. Half images are skipped or overwritten
             // Changing the memory copy by a slower way to do it apparently solves the problem. To be
             // investigate in firmware.
-            memcpy(img_data1, (uint32_t*)img_rdBuffer1.UserAddr ,img_transferSize);
+            xpci_storeImgTransfer(img_data1, &img_rdBuffer1, slot, decoded);
             //for(memPtr=0;memPtr<(img_transferSize/sizeof(uint16_t));memPtr++)
             //    *(img_data1+memPtr) = *((uint16_t*)(img_rdBuffer1.UserAddr)+memPtr);
 
@@ -3465,48 +3736,418 @@ image_end:
     return dmaStatus;
 }
 
-/***************************************************************************************
-   Function to do fast reading of images without overflow (detector faster and only
-   12 usefull bits). Nonetheless even if only 12 bits are usefull the data are received
-   on 16 bits. Makes only sense if overflow not usefull expose <100ms.
-   Function to acquire nloop images with the passed parameters and have them copied in
-   the provided buffers.
-   The nloop reception buffers should have been allocated before by the caller and their
-   start addresses are passed as an array of addresses.
+int xpci_readImgBuff(void *data, int timeout){
+    return xpci_readImgTransfers(data, NULL, NULL, timeout);
+}
 
-   IN  : type          type of image to get // only 2B is allowed
-         moduleMask    mask of the module to read
-         nbChips       nb of chips per modules
-         nloop         nb of image to get
-         pBuff         an array of pointers to each image reception buffer
-         firstTimeout  maximum delay to wait for the first image reception
-   OUT : the nloop image buffers contains the acquired images
-   RET : 0 success  -1 error
-**************************************************************************************/
-int xpci_getImgSeq_CPPM(enum IMG_TYPE type, int moduleMask, int nbChips,
-                        int gateMode, int gateLength, int timeUnit,
-                        int nloop, void **pBuff, int firstTimeout){
-    int i;
+/****************************************************************************************
+  Function to read an image and decode it in the same pass: each transfer is decoded
+  from the DMA buffer of its channel straight at its final place in the image while the
+  next transfer is in progress. No raw image is stored.
+  returns: 0 success  else error (same status as xpci_readImgBuff())
+  input  : img       decoded image (uint16_t for B2, uint32_t for B4) of 120*560*lastMod pixels
+           timeout   maximum time in usec to wait on the IT
+*****************************************************************************************/
+int xpci_readImgBuffDecoded(void *img, int timeout){
+    return xpci_readImgTransfers(NULL, NULL, img, timeout);
+}
 
-    //if (xpci_takeDetector()==-1){return -1;}
+// points back the channels on their own buffers for the copy path
+static void xpci_restoreImgDmaAddr(){
+    UINT32       dmaAddr;
+    dmaAddr = img_rdBuffer0.PhysicalAddr & 0xFFFFFFFC;
+    PldaMemoryWrite32 (nIndex, BAR_0, DMA0_RX_PHYADD_OFFSET, 1, &dmaAddr);
+    dmaAddr = img_rdBuffer1.PhysicalAddr & 0xFFFFFFFC;
+    PldaMemoryWrite32 (nIndex, BAR_0, DMA1_RX_PHYADD_OFFSET, 1, &dmaAddr);
+}
 
-    img_gotImages = 0;
-    // Checks parameters are compatible for 12 bits reading
-    //  and initilizes the images reading process
-    if(xpci_getImageInit(type, moduleMask, nbChips, gateMode, gateLength, timeUnit)==-1){
-        printf("\t%s(): Fast reading (12bits) image acquisition init FAILED\n", __func__);
-        goto failed;
+static void *xpci_imgReadAheadThread(void *arg){
+    int          i, cur, ret;
+
+    (void)arg;
+    for (i=0; i<img_raNbImg; i++){
+        pthread_mutex_lock(&img_ringMutex);
+        cur = img_ringFill;
+        while (img_ringState[cur]!=IMG_SLOT_FREE && !img_raStop && !xpci_getResetProcess())
+            pthread_cond_wait(&img_ringCond, &img_ringMutex);
+        if (img_ringState[cur]!=IMG_SLOT_FREE){
+            pthread_mutex_unlock(&img_ringMutex);
+            break;
+        }
+        img_ringState[cur] = IMG_SLOT_FILLING;
+        img_ringFill = (cur+1)%img_ringNbSlots;
+        pthread_mutex_unlock(&img_ringMutex);
+
+        ret = xpci_readImgTransfers((void *)img_ringBuffer[cur].UserAddr, &img_ringBuffer[cur], NULL, img_raTimeout);
+        if (xpci_getResetProcess())
+            ret = -1; // the image has not been completely read
+
+        pthread_mutex_lock(&img_ringMutex);
+        img_ringStatus[cur] = ret;
+        img_ringState[cur]  = IMG_SLOT_READY;
+        pthread_cond_broadcast(&img_ringCond);
+        pthread_mutex_unlock(&img_ringMutex);
+        if (ret || xpci_getAbortProcess())
+            break;
     }
+    xpci_restoreImgDmaAddr();
+    pthread_mutex_lock(&img_ringMutex);
+    img_raActive = 0;
+    pthread_cond_broadcast(&img_ringCond);
+    pthread_mutex_unlock(&img_ringMutex);
+    return NULL;
+}
 
-    // send command of
-    xpci_hubReset();
-    usleep(10);
-    if(xpci_startImgSequence(nloop)==-1){
-        printf("\t%s(): Fast reading (12bits) image acquisition request FAILED\n", __func__);
-        goto failed;
+/****************************************************************************************
+  Function to start reading nbImg images in the zero-copy ring in a background thread.
+  The images are then got in order with xpci_readImgRing().
+  returns: 0 success  -1 error (ring not allocated or thread creation failed)
+  input  : nbImg     nb of images to read
+           timeout   maximum time in usec to wait on the IT
+*****************************************************************************************/
+int xpci_startImgReadAhead(int nbImg, int timeout){
+    if (img_ringNbSlots==0){
+        printf("ERROR: %s() zero-copy ring is not allocated\n", __func__);
+        return -1;
+    }
+    if (img_raStarted){
+        printf("ERROR: %s() read ahead already started\n", __func__);
+        return -1;
+    }
+    img_raNbImg   = nbImg;
+    img_raTimeout = timeout;
+    img_raStop    = 0;
+    img_raActive  = 1;
+    if (pthread_create(&img_raThread, NULL, xpci_imgReadAheadThread, NULL)!=0){
+        printf("ERROR: %s() failed to create the read ahead thread\n", __func__);
+        img_raActive = 0;
+        return -1;
     }
+    img_raStarted = 1;
+    return 0;
+}
 
-    for (i=0; i<nloop; i++){
+// asks the read ahead thread to end without waiting for it
+static void xpci_requestStopImgReadAhead(){
+    if (!img_raStarted)
+        return;
+    pthread_mutex_lock(&img_ringMutex);
+    img_raStop = 1;
+    pthread_cond_broadcast(&img_ringCond);
+    pthread_mutex_unlock(&img_ringMutex);
+    // a transfer waiting on its IT is given up
+    pthread_mutex_lock(&it_mutex);
+    itCancel = 1;
+    pthread_cond_broadcast(&it_cond);
+    pthread_mutex_unlock(&it_mutex);
+}
+
+/****************************************************************************************
+  Function to stop the read ahead thread. The transfer in progress (if any) is given up
+  if it still waits for its IT. All the slots are given back to the ring.
+*****************************************************************************************/
+void xpci_stopImgReadAhead(){
+    int          i;
+
+    if (!img_raStarted)
+        return;
+    xpci_requestStopImgReadAhead();
+    pthread_join(img_raThread, NULL);
+    img_raStarted = 0;
+    itCancel = 0;
+    for (i=0; i<img_ringNbSlots; i++)
+        img_ringState[i] = IMG_SLOT_FREE;
+    img_ringNext = 0;
+    img_ringFill = 0;
+}
+
+/****************************************************************************************
+  Function to read the next image in the zero-copy ring.
+  The slot is lent to the caller until xpci_releaseImgRing() is called, it should be
+  released whatever the returned status is.
+  returns: 0 success  else error (same status as xpci_readImgBuff())
+  output : slot      slot id to give back (-1 if the ring is not allocated)
+           raw       pointer to the raw image in the pinned slot
+  input  : timeout   maximum time in usec to wait on the IT
+*****************************************************************************************/
+int xpci_readImgRing(int *slot, uint16_t **raw, int timeout){
+    int          ret;
+    int          cur;
+
+    *slot = -1;
+    *raw  = NULL;
+    if (img_ringNbSlots==0){
+        printf("ERROR: %s() zero-copy ring is not allocated\n", __func__);
+        return -1;
+    }
+    pthread_mutex_lock(&img_ringMutex);
+    cur = img_ringNext;
+    if (img_raStarted){
+        // the read ahead thread fills the slots, just wait for the next one
+        while (img_ringState[cur]!=IMG_SLOT_READY && img_raActive && !xpci_getResetProcess())
+            pthread_cond_wait(&img_ringCond, &img_ringMutex);
+        if (img_ringState[cur]!=IMG_SLOT_READY){
+            pthread_mutex_unlock(&img_ringMutex);
+            return -1;
+        }
+        img_ringState[cur] = IMG_SLOT_LENT;
+        img_ringNext = (cur+1)%img_ringNbSlots;
+        ret = img_ringStatus[cur];
+        pthread_mutex_unlock(&img_ringMutex);
+        *slot = cur;
+        *raw  = (uint16_t *)img_ringBuffer[cur].UserAddr;
+        return ret;
+    }
+    // slots are filled in order, wait for the consumer to give back the next one
+    while (img_ringState[cur]!=IMG_SLOT_FREE && !xpci_getResetProcess())
+        pthread_cond_wait(&img_ringCond, &img_ringMutex);
+    if (img_ringState[cur]!=IMG_SLOT_FREE){
+        pthread_mutex_unlock(&img_ringMutex);
+        return -1;
+    }
+    img_ringState[cur] = IMG_SLOT_LENT;
+    img_ringNext = (cur+1)%img_ringNbSlots;
+    pthread_mutex_unlock(&img_ringMutex);
+
+    *slot = cur;
+    *raw  = (uint16_t *)img_ringBuffer[cur].UserAddr;
+    ret = xpci_readImgTransfers(*raw, &img_ringBuffer[cur], NULL, timeout);
+
+    xpci_restoreImgDmaAddr();
+    return ret;
+}
+
+void xpci_releaseImgRing(int slot){
+    if ((slot<0)||(slot>=img_ringNbSlots))
+        return;
+    pthread_mutex_lock(&img_ringMutex);
+    img_ringState[slot] = IMG_SLOT_FREE;
+    pthread_cond_broadcast(&img_ringCond);
+    pthread_mutex_unlock(&img_ringMutex);
+}
+
+/****************************************************************************************
+                            PARALLEL DECODING POOL
+
+   With xpci_setDecodeThreads(n>1) the sequences read in the zero-copy ring are decoded
+   by n threads: the read ahead thread only drives the DMA, each decoding thread takes
+   the next READY slot, decodes it at the final place of the image and gives the slot
+   back. The calling thread only waits for the images in acquisition order to publish
+   them (image counters, shared memory image number).
+****************************************************************************************/
+int xpci_setDecodeThreads(int nbThreads){
+    if ((nbThreads<0)||(nbThreads>IMG_DEC_MAX_THREADS)){
+        printf("ERROR: %s() nb of decoding threads should be in [0,%d]\n", __func__, IMG_DEC_MAX_THREADS);
+        return -1;
+    }
+    img_decNbThreads = nbThreads;
+    return 0;
+}
+
+int xpci_getDecodeThreads(){
+    return img_decNbThreads;
+}
+
+// images kept in the /images shared memory ring by xpci_getImgSeq_imxpad(pBuff==NULL):
+// a reader later than nbSlots images gets an error instead of a newer image
+int xpci_setSharedImageSlots(int nbSlots){
+    if (nbSlots<2){
+        printf("ERROR: %s() the shared memory ring needs at least 2 slots\n", __func__);
+        return -1;
+    }
+    img_shmSlots = nbSlots;
+    return 0;
+}
+
+// longest wait of the acquisition for a BLOCK consumer of the /images ring (see
+// xpci_asyncReaderSubscribe()) before the consumer is turned to DROP
+int xpci_setSharedImageBlockTimeout(int timeoutMs){
+    if (timeoutMs<0){
+        printf("ERROR: %s() the timeout should be positive\n", __func__);
+        return -1;
+    }
+    img_shmBlockMs = timeoutMs;
+    return 0;
+}
+
+static void *xpci_decodeThread(void *arg){
+    int          i, slot, ret;
+    uint16_t     *pRaw;
+    void         *pImg;
+
+    (void)arg;
+    for(;;){
+        // the slots are lent in order so claiming the image and its slot is atomic
+        pthread_mutex_lock(&img_decMutex);
+        if (img_decStop || (img_decNext>=img_decNbImg)){
+            pthread_mutex_unlock(&img_decMutex);
+            break;
+        }
+        i = img_decNext++;
+        ret = xpci_readImgRing(&slot, &pRaw, 0);
+        if (pRaw == NULL)
+            img_decStop = 1;
+        pthread_mutex_unlock(&img_decMutex);
+        if (pRaw == NULL)
+            break;
+
+        if (img_decDest != NULL)
+            pImg = img_decDest[i];
+        else
+            pImg = xpci_shmBegin(img_decShm, i);
+        if(img_decType==B2)
+            imxpad_raw2data_16bits(img_decModMask, pRaw, (uint16_t *)pImg);
+        else
+            imxpad_raw2data_32bits(img_decModMask, pRaw, (uint32_t *)pImg);
+        if (img_decDest == NULL)
+            xpci_shmCommit(img_decShm, i);
+        xpci_releaseImgRing(slot);
+
+        pthread_mutex_lock(&img_decDoneMutex);
+        if (ret)
+            img_decStatus = -1;
+        img_decDone[i] = 1;
+        pthread_cond_broadcast(&img_decDoneCond);
+        pthread_mutex_unlock(&img_decDoneMutex);
+    }
+    pthread_mutex_lock(&img_decDoneMutex);
+    img_decActive--;
+    pthread_cond_broadcast(&img_decDoneCond);
+    pthread_mutex_unlock(&img_decDoneMutex);
+    return NULL;
+}
+
+/****************************************************************************************
+  Function to decode the nImg images of the ring with the decoding pool.
+  The images are decoded in pBuff[i] or, if pBuff is NULL, in the shared memory ring shm
+  (the ring has at least as many slots as the DMA ring, which bounds the images in
+  flight). The image number is published in order in the ring and in *imageNumber
+  (if not NULL).
+  returns: 0 success  1 stopped by abort/reset  -1 error
+*****************************************************************************************/
+static int xpci_decodeSeqParallel(enum IMG_TYPE type, int modMask, int nImg, void **pBuff,
+                                  XPCI_SHM *shm, unsigned int *imageNumber){
+    pthread_t    threads[IMG_DEC_MAX_THREADS];
+    int          i, nbThreads = 0;
+    int          ret = 0;
+
+    img_decDone = calloc(nImg, sizeof(unsigned char));
+    if (img_decDone == NULL){
+        printf("ERROR: %s() failed to allocate the decoding flags\n", __func__);
+        return -1;
+    }
+    img_decType      = type;
+    img_decModMask   = modMask;
+    img_decNbImg     = nImg;
+    img_decDest      = pBuff;
+    img_decShm       = shm;
+    img_decNext      = 0;
+    img_decStop      = 0;
+    img_decStatus    = 0;
+    img_decActive    = 0;
+    for (i=0; i<img_decNbThreads; i++){
+        pthread_mutex_lock(&img_decDoneMutex);
+        img_decActive++;
+        pthread_mutex_unlock(&img_decDoneMutex);
+        if (pthread_create(&threads[nbThreads], NULL, xpci_decodeThread, NULL)!=0){
+            pthread_mutex_lock(&img_decDoneMutex);
+            img_decActive--;
+            pthread_mutex_unlock(&img_decDoneMutex);
+            break;
+        }
+        nbThreads++;
+    }
+    if (nbThreads == 0){
+        printf("ERROR: %s() failed to create the decoding threads\n", __func__);
+        free(img_decDone);
+        return -1;
+    }
+
+    // deliver the images in acquisition order
+    for (i=0; i<nImg; i++){
+        pthread_mutex_lock(&img_decDoneMutex);
+        while (!img_decDone[i] && (img_decActive>0))
+            pthread_cond_wait(&img_decDoneCond, &img_decDoneMutex);
+        pthread_mutex_unlock(&img_decDoneMutex);
+        if (!img_decDone[i]){
+            if(xpci_getAbortProcess() || xpci_getResetProcess()){
+                ret = 1;
+                break;
+            }
+            printf("ERROR: %s() ---> image %d reading FAILED\n", __func__, i);
+            ret = -1;
+            break;
+        }
+        if (pBuff == NULL)
+            xpci_shmPublish(shm, i+1);
+        if (imageNumber != NULL)
+            imageNumber[0] = i+1;
+        img_gotImages++;
+        if(xpci_getAbortProcess() || xpci_getResetProcess()){
+            printf("%s() ---> Last Acquired Image = %d\n",__func__, i);
+            ret = 1;
+            break;
+        }
+    }
+
+    // a thread waiting for a slot holds the claim lock, it is woken up when the read
+    // ahead ends so this one is stopped first
+    xpci_requestStopImgReadAhead();
+    pthread_mutex_lock(&img_decMutex);
+    img_decStop = 1;
+    pthread_mutex_unlock(&img_decMutex);
+    for (i=0; i<nbThreads; i++)
+        pthread_join(threads[i], NULL);
+    xpci_stopImgReadAhead();
+    free(img_decDone);
+    img_decDone = NULL;
+    if ((ret==0) && img_decStatus)
+        ret = -1;
+    return ret;
+}
+
+/***************************************************************************************
+   Function to do fast reading of images without overflow (detector faster and only
+   12 usefull bits). Nonetheless even if only 12 bits are usefull the data are received
+   on 16 bits. Makes only sense if overflow not usefull expose <100ms.
+   Function to acquire nloop images with the passed parameters and have them copied in
+   the provided buffers.
+   The nloop reception buffers should have been allocated before by the caller and their
+   start addresses are passed as an array of addresses.
+
+   IN  : type          type of image to get // only 2B is allowed
+         moduleMask    mask of the module to read
+         nbChips       nb of chips per modules
+         nloop         nb of image to get
+         pBuff         an array of pointers to each image reception buffer
+         firstTimeout  maximum delay to wait for the first image reception
+   OUT : the nloop image buffers contains the acquired images
+   RET : 0 success  -1 error
+**************************************************************************************/
+int xpci_getImgSeq_CPPM(enum IMG_TYPE type, int moduleMask, int nbChips,
+                        int gateMode, int gateLength, int timeUnit,
+                        int nloop, void **pBuff, int firstTimeout){
+    int i;
+
+    //if (xpci_takeDetector()==-1){return -1;}
+
+    img_gotImages = 0;
+    // Checks parameters are compatible for 12 bits reading
+    //  and initilizes the images reading process
+    if(xpci_getImageInit(type, moduleMask, nbChips, gateMode, gateLength, timeUnit)==-1){
+        printf("\t%s(): Fast reading (12bits) image acquisition init FAILED\n", __func__);
+        goto failed;
+    }
+
+    // send command of
+    xpci_hubReset();
+    usleep(10);
+    if(xpci_startImgSequence(nloop)==-1){
+        printf("\t%s(): Fast reading (12bits) image acquisition request FAILED\n", __func__);
+        goto failed;
+    }
+
+    for (i=0; i<nloop; i++){
         // sleep a bit to wait for long expose not to go in hardware timeout at the next reading
         // normally useless in fast reading where period should be far less than 8 img/sec
         xpci_delayWaitReply(gateLength, timeUnit);// normally useless in fast reading
@@ -3558,6 +4199,9 @@ int   xpci_getGotImages(){
 
 void xpci_readImageClose(){
     img_expose     =0; // set back to default which is read without expose
+    // the read ahead thread may still transfer in the buffers: stopped first
+    xpci_stopImgReadAhead();
+    xpci_freeImgRing();
     PldaReleasePhysicalAddress(nIndex, DMA0_RX_BUF_LOCK);
     PldaReleasePhysicalAddress(nIndex, DMA1_RX_BUF_LOCK);
 }
@@ -5512,6 +6156,39 @@ unsigned int xpci_getImageFormat(void)
 		return img_Format_Acq;
 }
 
+// frame stack header describing the images of the detector
+// layout XPCI_STACK_RAW: frames as read out, XPCI_STACK_IMAGE: decoded images
+// the caller sets framesPerChunk and codec
+//===========================================================================
+int xpci_getStackHeader(enum IMG_TYPE type, unsigned modMask, int layout, XPCI_STACK_HEADER *hdr)
+{
+    int lastMod = xpci_getLastMod(modMask);
+
+    if(lastMod<=0 || (layout!=XPCI_STACK_RAW && layout!=XPCI_STACK_IMAGE)){
+        printf("ERROR: %s() ---> bad modMask 0x%x or layout %d\n", __func__, modMask, layout);
+        return -1;
+    }
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->detectorType  = xpci_systemType;
+    hdr->modMask       = modMask;
+    hdr->imgType       = type;
+    hdr->layout        = layout;
+    hdr->height        = 120*lastMod;
+    if(layout == XPCI_STACK_RAW){
+        hdr->width         = (type==B2) ? 566 : 1126;
+        hdr->bytesPerPixel = sizeof(uint16_t);
+    }
+    else{
+        hdr->width         = 560;
+        hdr->bytesPerPixel = (type==B2) ? sizeof(uint16_t) : sizeof(uint32_t);
+    }
+    hdr->frameSize      = hdr->width*hdr->height*hdr->bytesPerPixel;
+    hdr->framesPerChunk = 1;
+    hdr->codec          = XPCI_CODEC_NONE;
+    hdr->exposure       = exp_lastParam;
+    return 0;
+}
+
 //============================================================================== 
 // Functions deticated for IMXPAD systems
 //==============================================================================
@@ -5545,6 +6222,14 @@ int xpci_modExposureParam( unsigned modMask,
 
     acquisition_type = AcqMode;
     Aqc_mod_param = AcqMode;
+    exp_lastParam.Texp     = Texp;
+    exp_lastParam.Twait    = Twait;
+    exp_lastParam.Tinit    = Tinit;
+    exp_lastParam.Tshutter = Tshutter;
+    exp_lastParam.Tovf     = Tovf;
+    exp_lastParam.mode     = mode;
+    exp_lastParam.nbImages = nbImages;
+    exp_lastParam.acqMode  = AcqMode;
     usleep(5000);
 
 	if(modMask == 0){
@@ -5685,6 +6370,14 @@ int xpci_modExposureParam_internal( unsigned modMask,
 
     acquisition_type = AcqMode;
     Aqc_mod_param = AcqMode;
+    exp_lastParam.Texp     = Texp;
+    exp_lastParam.Twait    = Twait;
+    exp_lastParam.Tinit    = Tinit;
+    exp_lastParam.Tshutter = Tshutter;
+    exp_lastParam.Tovf     = Tovf;
+    exp_lastParam.mode     = mode;
+    exp_lastParam.nbImages = nbImages;
+    exp_lastParam.acqMode  = AcqMode;
     usleep(5000);
  /*   
     if(AcqMode == 1 || AcqMode == 2)
@@ -5829,10 +6522,12 @@ int xpci_getImgSeq_imxpad(enum IMG_TYPE type, int modMask, int nChips, int nImg,
     int             ret = 0;
     int             i = 0;
     uint16_t        *msg;
-    int             imgSize = 0;
     int             modNb = xpci_getModNb(modMask);
     int             lastMod = xpci_getLastMod(modMask);
-    uint16_t        **pRawBuff;
+    uint16_t        *pRaw;
+    void            *pImg;
+    int             ringSlots, slot = -1;
+    int             pooled = 0; // images decoded by the decoding pool
     
     /*
     printf("type = %d",type);
@@ -5844,9 +6539,8 @@ int xpci_getImgSeq_imxpad(enum IMG_TYPE type, int modMask, int nChips, int nImg,
     // Variables for Async Reading
     int              fd;
     unsigned int     *imageNumber;
-    unsigned int     numPixels;
-    unsigned short   *image16;
-    unsigned int     *image32;
+    XPCI_SHM         *shm = NULL;
+    int              shmSlots;
 
     img_gotImages = 0;
 
@@ -5861,34 +6555,22 @@ int xpci_getImgSeq_imxpad(enum IMG_TYPE type, int modMask, int nChips, int nImg,
         return -1;
     }
 
-    // determine size of the image
-    if(type==B2){
-        imgSize = 120*566*lastMod*sizeof(uint16_t);
-    }
-    else{
-        imgSize = 120*1126*lastMod*sizeof(uint16_t);
-    }
-
-    numPixels = 120*560*lastMod;
-
     // configure subchannel registers
     if(type==B2)
         xpix_imxpadWriteSubchnlReg(modMask, 1, nImg);
     else
         xpix_imxpadWriteSubchnlReg(modMask, 2, nImg);
 
-    pRawBuff = malloc(nImg*sizeof(uint16_t *));
-    for(i=0; i<nImg; i++){
-        pRawBuff[i] = malloc(imgSize);
-        // memset(pRawBuff[i],0,imgSize);
-    }
-
     // initialize image structure
     if(xpci_readImageInit(type, modMask, nChips)==-1){
         printf("ERROR: %s() ---> image acquisition init FAILED\n", __func__);
         return -1;
     }
 
+    // raw images are decoded in place in the DMA ring when it is available
+    // else each transfer is decoded straight from the channel buffers
+    ringSlots = xpci_getImgRingSlots();
+
     // disable timeout hardware (wait forever for the data to arrive)
     xpci_setHardTimeout(HWTIMEOUT_DSBL);
 
@@ -5941,100 +6623,87 @@ int xpci_getImgSeq_imxpad(enum IMG_TYPE type, int modMask, int nChips, int nImg,
         close(fd);
 
         //**************** images ****************                      //Shared memory where images will be stored
-        // Create a new memory object
-        fd = shm_open( "/images", O_RDWR | O_CREAT, 0777 );
-        if( fd == -1 ) {
-            fprintf( stderr, "ERROR: %s() ---> Open failed [images]:%s\n",__func__,
-                     strerror( errno ) );
+        // ring of img_shmSlots images whatever nImg. The decoding pool can have as many
+        // images in flight as the DMA ring has slots (a slot is given back once its image
+        // is decoded and the slots are lent in order), so two images decoded at the same
+        // time never share a slot of the shared memory ring
+        shmSlots = img_shmSlots;
+        if(shmSlots < ringSlots)
+            shmSlots = ringSlots;
+        if(shmSlots <= img_decNbThreads)
+            shmSlots = img_decNbThreads + 1;
+        if(shmSlots > nImg)
+            shmSlots = nImg;
+        shm = xpci_shmCreate(XPCI_SHM_IMAGES, type, modMask, 560, 120*lastMod,
+                             (type==B2) ? sizeof(uint16_t) : sizeof(uint32_t), shmSlots, nImg);
+        if(shm == NULL){
+            fprintf( stderr, "ERROR: %s() ---> can not create the image ring [images]\n",__func__);
+            munmap(imageNumber,sizeof( *imageNumber ));
             return -1;
         }
-
-
-
-
-        // Map the memory object
-        if(type==B2){
-            // Set the memory object's size
-            if( ftruncate( fd, sizeof( *image16 )*nImg*numPixels ) == -1 ) {
-                fprintf( stderr, "ERROR: %s() ---> ftruncate [images]:%s\n",__func__,
-                         strerror( errno ) );
-                return -1;
-            }
-            image16 = (unsigned short *) mmap( NULL, sizeof( *image16 )*nImg*numPixels,
-                                               PROT_WRITE,
-                                               MAP_SHARED, fd, 0 );
-            if( image16 == MAP_FAILED ) {
-                fprintf( stderr, "ERROR: %s() ---> image mmap failed [images]:%s\n",__func__,
-                         strerror( errno ) );
-                return -1;
-            }
-        }
-        else{
-            // Set the memory object's size
-            if( ftruncate( fd, sizeof( *image32 )*nImg*numPixels ) == -1 ) {
-                fprintf( stderr, "ERROR: %s() ---> ftruncate [images]:%s\n",__func__,
-                         strerror( errno ) );
-                return -1;
-            }
-            image32 = (unsigned int *) mmap( NULL, sizeof( *image32 )*nImg*numPixels,
-                                             PROT_WRITE,
-                                             MAP_SHARED, fd, 0 );
-            if( image32 == MAP_FAILED ) {
-                fprintf( stderr, "ERROR: %s() ---> image mmap failed [images]:%s\n",__func__,
-                         strerror( errno ) );
-                return -1;
-            }
-        }
-
-        close(fd);
+        xpci_shmSetBlockTimeout(shm, img_shmBlockMs);
     }
     //**************** End of async variable set ****************
 
         if(xpci_getAbortProcess()){
             printf("%s() ---> Last Acquired Image = %d\n",__func__, i);
+            if(pBuff == NULL){
+                // the readers waiting for images are woken up
+                xpci_shmFinish(shm);
+                xpci_shmClose(shm);
+                munmap(imageNumber,sizeof( *imageNumber ));
+            }
             return 1;
         }
     // Reading images and copying to shared memory
     printf("\n");
-    for (i=0; i<nImg; i++){
-        if(xpci_readImgBuff( *(pRawBuff+i), 0)==-1 ){
-            printf("ERROR: %s() ---> image %d reading FAILED\n", __func__, i);
-            ret =-1;
-        }  
-        
+    // keep the channels busy on the next images while the current one is decoded
+    // (if the thread can not be started xpci_readImgRing() reads the slots itself)
+    if (ringSlots)
+        xpci_startImgReadAhead(nImg, 0);
+    if (ringSlots && (img_decNbThreads>1)){
+        // decoding pool: this thread only publishes the images in order
+        ret = xpci_decodeSeqParallel(type, modMask, nImg, pBuff, shm,
+                                     (pBuff == NULL) ? imageNumber : NULL);
+        if (ret == 1)
+            ret = 0; // stopped by abort/reset as the inline loop
+        pooled = 1;
+    }
+    for (i=0; !pooled && (i<nImg); i++){
+        // final place of the image (user buffer or slot of the shared memory ring)
         if(pBuff != NULL)
-        {
-            // extract and organize data from the raw image(s)
-            if(type==B2){
-               // imxpad_raw2data_16bits_v2(modMask, pRawBuff[i], (uint16_t **)pBuff,i);
-                imxpad_raw2data_16bits(modMask, pRawBuff[i], (uint16_t *)pBuff[i]);
-                if(i > 5 ) // delete only the images n - 5 because the data tranfert
-                    free(pRawBuff[i - 5]); //__fred__
-            }
-            else{
-                imxpad_raw2data_32bits(modMask, pRawBuff[i], (uint32_t *)pBuff[i]);
-                free(pRawBuff[i]);
-            }
-        }
+            pImg = pBuff[i];
         else
-        {
-            // extract and organize data from the raw image(s)
-            if(type==B2){
-                uint16_t table[numPixels];
-                imxpad_raw2data_16bits(modMask, pRawBuff[i], table);
-                free(pRawBuff[i]);
-                for(int j=0; j<numPixels; j++)
-                    image16[i*numPixels+j] = table[j];
+            pImg = xpci_shmBegin(shm, i);
+
+        if (ringSlots){
+            if(xpci_readImgRing(&slot, &pRaw, 0)==-1 ){
+                printf("ERROR: %s() ---> image %d reading FAILED\n", __func__, i);
+                ret =-1;
             }
-            else{
-                uint32_t table[numPixels];
-                imxpad_raw2data_32bits(modMask, pRawBuff[i], table);
-                free(pRawBuff[i]);
-                for(int j=0; j<numPixels; j++)
-                    image32[i*numPixels+j] = table[j];
+            if (pRaw == NULL)
+                break;
+            // extract and organize data from the raw image
+            if(type==B2)
+                imxpad_raw2data_16bits(modMask, pRaw, (uint16_t *)pImg);
+            else
+                imxpad_raw2data_32bits(modMask, pRaw, (uint32_t *)pImg);
+        }
+        else{
+            // decode the transfers during the readout
+            if(xpci_readImgBuffDecoded(pImg, 0)==-1 ){
+                printf("ERROR: %s() ---> image %d reading FAILED\n", __func__, i);
+                ret =-1;
             }
+        }
+        if(pBuff == NULL){
+            xpci_shmCommit(shm, i);
+            xpci_shmPublish(shm, i+1);
             imageNumber[0] = i+1;
         }
+        // the raw image has been consumed, give the slot back to the DMA ring
+        xpci_releaseImgRing(slot);
+        slot = -1;
         img_gotImages++;
         if(xpci_getAbortProcess()){
             printf("%s() ---> Last Acquired Image = %d\n",__func__, i);
@@ -6046,29 +6715,16 @@ int xpci_getImgSeq_imxpad(enum IMG_TYPE type, int modMask, int nChips, int nImg,
         }
     } // end of loop for nImg
 
+    xpci_stopImgReadAhead();
     // restore short hw timeout
     xpci_setHardTimeout(HWTIMEOUT_1SEC);
     xpci_getImageClose();
     
     if(pBuff == NULL){
-        if(type==B2)
-            munmap(image16,sizeof( *image16 )*nImg*numPixels);
-        else
-            munmap(image32,sizeof( *image32 )*nImg*numPixels);
-
+        xpci_shmFinish(shm);
+        xpci_shmClose(shm);
         munmap(imageNumber,sizeof( *imageNumber ));
     }// pBuff == NULL
-    else if(type==B2){//__fred__
-        if ( nImg > 5 ){
-            for(i=nImg-5; i<nImg; i++)
-                free(pRawBuff[i]);
-        }
-        else{
-            for(i=0; i<nImg; i++)
-                free(pRawBuff[i]);
-        }
-        free(pRawBuff);
-    } // type == B2
     
     if(!xpci_getAbortProcess()){
         xpci_modAbortExposure();
@@ -6081,11 +6737,262 @@ int xpci_getImgSeq_imxpad(enum IMG_TYPE type, int modMask, int nChips, int nImg,
     return ret;
 }
 
+/***************************************************************************************
+   Streaming version of xpci_getImgSeq_imxpad(): the memory used does not depend on nImg.
+   The raw images are read in a pool of poolSize pinned slots of the zero-copy ring
+   (read ahead, see xpci_startImgReadAhead()) or, if the ring can not be allocated,
+   decoded during the readout straight from the channel buffers.
+   Each image is decoded in a single frame buffer and handed to the callback:
+       cbFunc(imgNb, frame, userPara)
+   frame is an uint16_t (B2) or uint32_t (B4) image of 120*560*lastMod pixels which is
+   only valid during the call. The callback should return 0 to go on or any other
+   value to stop the sequence.
+   returns: 0 success  1 stopped by abort or by the callback  -1 error
+****************************************************************************************/
+int xpci_getImgSeqStream_imxpad(enum IMG_TYPE type, int modMask, int nChips, int nImg, int poolSize,
+                                int (*cbFunc)(int imgNb, void *frame, void *userPara), void *userPara){
+    int             ret = 0;
+    int             i;
+    uint16_t        *msg;
+    int             lastMod = xpci_getLastMod(modMask);
+    int             oldDepth = img_ringDepth;
+    int             ringSlots, slot = -1;
+    uint16_t        *pRaw;
+    void            *frame;
+    unsigned int    numPixels;
+
+    img_gotImages = 0;
+    if ( modMask==0)
+        return 0;
+    if (cbFunc==NULL){
+        printf("ERROR: %s() ---> no callback function\n", __func__);
+        return -1;
+    }
+    if ((poolSize<2)||(poolSize>IMG_RING_MAX_SLOTS)){
+        printf("ERROR: %s() ---> pool size should be in [2,%d]\n", __func__, IMG_RING_MAX_SLOTS);
+        return -1;
+    }
+    xpci_clearAbortProcess();
+    xpci_clearResetProcess();
+    if (xpci_modGlobalAskReady(modMask)!=0){
+        printf("ERROR: %s() ---> failed sending AskReady\n", __func__);
+        return -1;
+    }
+    numPixels = 120*560*lastMod;
+    if(type==B2){
+        frame   = malloc(numPixels*sizeof(uint16_t));
+        xpix_imxpadWriteSubchnlReg(modMask, 1, nImg);
+    }
+    else{
+        frame   = malloc(numPixels*sizeof(uint32_t));
+        xpix_imxpadWriteSubchnlReg(modMask, 2, nImg);
+    }
+    if (frame==NULL){
+        printf("ERROR: %s() ---> failed to allocate the frame buffer\n", __func__);
+        return -1;
+    }
+
+    // the ring is allocated by xpci_readImageInit() with the pool size
+    img_ringDepth = poolSize;
+    if(xpci_readImageInit(type, modMask, nChips)==-1){
+        printf("ERROR: %s() ---> image acquisition init FAILED\n", __func__);
+        img_ringDepth = oldDepth;
+        free(frame);
+        return -1;
+    }
+    img_ringDepth = oldDepth;
+    ringSlots = xpci_getImgRingSlots();
+
+    xpci_setHardTimeout(HWTIMEOUT_DSBL);
+
+    // send expose message (do not wait for a reply)
+    msg = malloc(sizeof(MOD_expose));
+    memcpy(msg,MOD_expose,sizeof(MOD_expose));
+    msg[3]  =  (uint16_t)modMask;
+    if(xpci_systemType == IMXPAD_S1400)
+        ret = xpci_writeCommon_S1400(msg, sizeof(MOD_expose),modMask);
+    else
+        ret = xpci_writeCommon(msg, sizeof(MOD_expose));
+    free(msg);
+    if (ret){
+        printf("ERROR: %s() ---> failed sending the request\n", __func__);
+        ret = -1;
+        goto streamEnd;
+    }
+    flag_startExpose = 1;
+    if (ringSlots)
+        xpci_startImgReadAhead(nImg, 0);
+
+    for (i=0; i<nImg; i++){
+        if (ringSlots){
+            if(xpci_readImgRing(&slot, &pRaw, 0)==-1 ){
+                printf("ERROR: %s() ---> image %d reading FAILED\n", __func__, i);
+                ret = -1;
+            }
+            if (pRaw == NULL)
+                break;
+            if(type==B2)
+                imxpad_raw2data_16bits(modMask, pRaw, (uint16_t *)frame);
+            else
+                imxpad_raw2data_32bits(modMask, pRaw, (uint32_t *)frame);
+        }
+        else if(xpci_readImgBuffDecoded(frame, 0)==-1 ){
+            printf("ERROR: %s() ---> image %d reading FAILED\n", __func__, i);
+            ret = -1;
+        }
+        // the raw image has been decoded, the slot can be filled again during the callback
+        xpci_releaseImgRing(slot);
+        slot = -1;
+        img_gotImages++;
+        if (cbFunc(i, frame, userPara)!=0){
+            // the exposure is aborted once, at the end
+            printf("%s() ---> stopped by the consumer at image %d\n",__func__, i);
+            ret = 1;
+            break;
+        }
+        if(xpci_getAbortProcess() || xpci_getResetProcess()){
+            printf("%s() ---> Last Acquired Image = %d\n",__func__, i);
+            ret = 1;
+            break;
+        }
+    }
+    flag_startExpose = 0;
+
+streamEnd:
+    xpci_stopImgReadAhead();
+    xpci_setHardTimeout(HWTIMEOUT_1SEC);
+    xpci_getImageClose();
+    free(frame);
+
+    if(!xpci_getAbortProcess()){
+        xpci_modAbortExposure();
+        xpci_clearAbortProcess();
+    }
+    xpci_AbortCleanDetector(modMask);
+    xpci_clearResetProcess();
+    return ret;
+}
+
 unsigned int get_flagStartExpose (void)
 {
 	return flag_startExpose;
 }
 
+/* close the film rings and wait for the writer threads */
+static void xpci_filmStopWriters(int nbThreads){
+    int k;
+
+    for(k=0;k<ssd_nbStripes;k++)
+        xpci_spscClose(&ssd_ring[k]);
+    for(k=0;k<nbThreads;k++)
+        pthread_join(ssd_writer[k],NULL);
+}
+
+/* ring stats of the film, summed over the stripes */
+static void xpci_filmRingStats(XPCI_SPSC_STATS *stats){
+    XPCI_SPSC_STATS stripe;
+    int             k;
+
+    memset(stats, 0, sizeof(*stats));
+    for(k=0;k<ssd_nbStripes;k++){
+        xpci_spscGetStats(&ssd_ring[k], &stripe);
+        stats->capacity        += stripe.capacity;
+        stats->highWater       += stripe.highWater;
+        stats->produced        += stripe.produced;
+        stats->consumed        += stripe.consumed;
+        stats->dropped         += stripe.dropped;
+        stats->producerStallNs += stripe.producerStallNs;
+        stats->consumerStallNs += stripe.consumerStallNs;
+    }
+}
+
+/* buffer pool use of the film */
+static void xpci_filmPoolStats(XPCI_FILM_POOL_STATS *stats){
+    XPCI_SPSC_STATS ring;
+
+    xpci_filmRingStats(&ring);
+    xpci_poolGetStats(&stats->pool);
+    stats->nbBuffers   = ring.capacity;
+    stats->bufferBytes = ssd_bufBytes;
+    stats->peakInUse   = ring.highWater;
+    stats->peakRatio   = ring.capacity ? (double)ring.highWater/ring.capacity : 0;
+    stats->exhaustedNs = ring.producerStallNs;
+    stats->dropped     = ring.dropped;
+}
+
+/* encoding stats of the film, summed over the stripes */
+static void xpci_filmCodecStats(XPCI_CODEC_STATS *stats){
+    XPCI_CODEC_STATS stripe;
+    int              k;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->codec = ssd_codec;
+    for(k=0;k<ssd_nbStripes;k++){
+        if(ssd_pool[k] == NULL)
+            continue;
+        xpci_codecPoolGetStats(ssd_pool[k], &stripe);
+        stats->nbThreads  += stripe.nbThreads;
+        stats->nbFrames   += stripe.nbFrames;
+        stats->nbStored   += stripe.nbStored;
+        stats->rawBytes   += stripe.rawBytes;
+        stats->codedBytes += stripe.codedBytes;
+        stats->encodeNs   += stripe.encodeNs;
+    }
+    stats->ratio = stats->codedBytes ? (double)stats->rawBytes/stats->codedBytes : 0;
+    stats->mbPerSec = stats->encodeNs ? stats->rawBytes*1000.0/stats->encodeNs : 0;
+}
+
+/* images of the film on disk: every image below the next one expected by a running
+   stripe writer, everything written once all of them are finished */
+static void xpci_filmImageWritten(unsigned *imageNumber, int stripe, int last, int finished, int aborted){
+    unsigned count = 0, bound = ~0u;
+    int      k, all = 1;
+
+    pthread_mutex_lock(&ssd_imageLock);
+    if(last > ssd_stripeLast[stripe])
+        ssd_stripeLast[stripe] = last;
+    ssd_stripeEnd[stripe] |= finished;
+    for(k=0;k<ssd_nbStripes;k++){
+        if(ssd_stripeLast[k] + 1 > (int)count)
+            count = ssd_stripeLast[k] + 1;
+        if(!ssd_stripeEnd[k]){
+            all = 0;
+            if((unsigned)(ssd_stripeLast[k] + 1) < bound)
+                bound = ssd_stripeLast[k] + 1;
+        }
+    }
+    if(!all)
+        count = bound;
+    ssd_imageAborted |= aborted;
+    if(all && ssd_imageAborted)
+        count++;    // last image number + 2 after an abort, as the single file writer did
+    if(count > ssd_imageCount)
+        ssd_imageCount = count;
+    imageNumber[0] = ssd_imageCount;
+    pthread_mutex_unlock(&ssd_imageLock);
+}
+
+// room on the burst directories for a film of nImg images (quota included)
+// needed/available in bytes (may be NULL)
+// returns: 0 the film fits -1 otherwise
+int xpci_checkSSDSpace_imxpad(enum IMG_TYPE type, int modMask, int nImg, int burstNumber,
+                              unsigned long long *needed, unsigned long long *available){
+    int lastMod = xpci_getLastMod(modMask);
+    int imgSize;
+    int ret;
+
+    if(nImg<=0 || lastMod<=0){
+        printf("ERROR: %s() ---> bad nImg %d or modMask 0x%x.\n", __func__, nImg, modMask);
+        return -1;
+    }
+    imgSize = 120*((type==B2) ? 566 : 1126)*lastMod*sizeof(uint16_t);
+    pthread_mutex_lock(&ssd_burstLock);
+    xpci_burstSetCodec(ssd_codec);
+    ret = xpci_burstCheckSpace(burstNumber, imgSize, nImg, needed, available);
+    pthread_mutex_unlock(&ssd_burstLock);
+    return ret;
+}
+
 int xpci_getImgSeq_SSD_imxpad(enum IMG_TYPE type, int modMask, int nImg, int burstNumber){
     int             ret = 0;
     int             i = 0,j = 0;
@@ -6095,14 +7002,16 @@ int xpci_getImgSeq_SSD_imxpad(enum IMG_TYPE type, int modMask, int nImg, int bur
     int             lastMod = xpci_getLastMod(modMask);
     //    uint16_t        *pRawBuff_0,*pRawBuff_1;
     char            fname_0[100];
-    pthread_t       WriteFileThread;
     // Variables for Async Reading
     int              fd;
     unsigned int     *imageNumber;
-    char str[200];    
-    unsigned par[4];
+    unsigned par[XPCI_BURST_MAX_STRIPES][5];
     int ii,jj;    
-    int maxImgBuff = (int) (nImg * 0.025) + 10;
+    int maxImgBuff;
+    int n = 0, slot, k;
+    uint16_t *pImg;
+    XPCI_SPSC *ring;
+    int nbWriters = 0, ringsReady = 0, imgReady = 0, exposed = 0;
     
     
     xpci_clearAbortProcess();
@@ -6117,11 +7026,6 @@ int xpci_getImgSeq_SSD_imxpad(enum IMG_TYPE type, int modMask, int nImg, int bur
         imgSize = 120*1126*lastMod*sizeof(uint16_t);
     }
 
-    par[0] = imgSize;
-    par[1] = burstNumber;
-    par[2] = nImg;
-    par[3] = maxImgBuff;
-    
         // check if detector is available
     if (nImg>65000){
         printf("ERROR: %s() ---> failed numbers of images.\n", __func__);
@@ -6129,11 +7033,18 @@ int xpci_getImgSeq_SSD_imxpad(enum IMG_TYPE type, int modMask, int nImg, int bur
         return -1;
     }
     
-    printf("%s ---> Starting acquisition...  maxImgBuff = %d ", __func__,maxImgBuff);
+    printf("%s ---> Starting acquisition... ", __func__);
     // check if any of the modules enabled
     if ( modMask==0)
         return 0;
 
+    // the film must fit on the disks before the detector is armed
+    if (xpci_checkSSDSpace_imxpad(type, modMask, nImg, burstNumber, NULL, NULL)){
+        printf("ERROR: %s() ---> not enough space for %d images.\n", __func__, nImg);
+        flag_startExpose = -1;
+        return -1;
+    }
+
     // check if detector is available
     if (xpci_modGlobalAskReady(modMask)!=0){
         printf("ERROR: %s() ---> failed sending AskReady.\n", __func__);
@@ -6141,8 +7052,17 @@ int xpci_getImgSeq_SSD_imxpad(enum IMG_TYPE type, int modMask, int nImg, int bur
         return -1;
     }
 
-    sprintf(str,"rm /opt/imXPAD/tmp/burst_%d*.bin",burstNumber);
-    system(str);
+    // the whole film goes into one preallocated file, the previous burst with
+    // this number is recycled by xpci_burstCreate()
+    pthread_mutex_lock(&ssd_burstLock);
+    xpci_burstSetCodec(ssd_codec);
+    ssd_burst = xpci_burstCreate(burstNumber, type, modMask, imgSize, nImg);
+    pthread_mutex_unlock(&ssd_burstLock);
+    if(ssd_burst == NULL){
+        printf("ERROR: %s ---> Can not create the burst file.\n",__func__);
+        flag_startExpose = -1;
+        return -1;
+    }
     
     // configure subchannel registers
     if(type==B2)
@@ -6150,43 +7070,115 @@ int xpci_getImgSeq_SSD_imxpad(enum IMG_TYPE type, int modMask, int nImg, int bur
     else
         xpix_imxpadWriteSubchnlReg(modMask, 2, nImg);
    
-	pRawBuff_ssd = malloc(IMG_SSD * sizeof(uint16_t*));
+    // one writer thread and one ring of buffers per stripe, images go round-robin
+    ssd_nbStripes = xpci_burstStripeCount(ssd_burst);
+
+    // as many buffers as the memory budget holds (no more than images), carved
+    // from the pool mapped by the first film and kept for the next ones
+    if(xpci_poolReset()){
+        printf("ERROR: %s ---> Can not map the buffer pool.\n",__func__);
+        ret = -1;
+        goto filmEnd;
+    }
+    ssd_bufBytes = xpci_burstFrameStride(imgSize);
+    if(ssd_codec != XPCI_CODEC_NONE)
+        ssd_bufBytes += xpci_burstFrameStride(xpci_codecBound(imgSize));
+    maxImgBuff = xpci_poolAvailable() / ssd_bufBytes;
+    if(maxImgBuff > nImg)
+        maxImgBuff = nImg;
+    ssd_stripeBuff = maxImgBuff / ssd_nbStripes;
+    if(ssd_stripeBuff < 2)
+        ssd_stripeBuff = 2;
+    maxImgBuff = ssd_stripeBuff * ssd_nbStripes;
+    printf("%d buffers of %u kB\n", maxImgBuff, ssd_bufBytes>>10);
+
+	pRawBuff_ssd = malloc(maxImgBuff * sizeof(uint16_t*));
 	if(pRawBuff_ssd == NULL ){
         printf("ERROR: %s ---> Can not create data buffer.\n",__func__);
-        flag_startExpose = -1;
-        return -1;
+        ret = -1;
+        goto filmEnd;
     }
 	for(i=0;i<maxImgBuff;i++){
-		pRawBuff_ssd[i] = malloc(imgSize);
+		pRawBuff_ssd[i] = xpci_poolAlloc(imgSize);
 		if(pRawBuff_ssd[i] == NULL ){
-			printf("ERROR: %s ---> Can not create data buffer.\n",__func__);
-			flag_startExpose = -1;
-			return -1;
+			printf("ERROR: %s ---> memory budget too small for %d buffers of %u kB.\n",__func__,maxImgBuff,ssd_bufBytes>>10);
+			ret = -1;
+			goto filmEnd;
 		}
 	}
-  
-    write_pRawBuff_ssd = 0; // init number of image
-    read_pRawBuff_ssd  = 0; // init number of image
-    
-    if (ret = pthread_create(&WriteFileThread,
-                             NULL,
-                             &xpci_writeRawDataToFile,
-                             par) !=0){
-        printf("ERROR: %s ---> Thread creation FAILED.\n", __func__);
-        flag_startExpose = -1;
-        return -1;
+    // encoded films: the pool of each stripe encodes its raw buffers in ssd_coded
+    if(ssd_codec != XPCI_CODEC_NONE){
+        ssd_coded = calloc(maxImgBuff, sizeof(void*));
+        for(i=0;ssd_coded!=NULL && i<maxImgBuff;i++)
+            if((ssd_coded[i] = xpci_poolAlloc(xpci_codecBound(imgSize))) == NULL)
+                break;
+        if(ssd_coded == NULL || i<maxImgBuff){
+            printf("ERROR: %s ---> memory budget too small for %d buffers of %u kB.\n",__func__,maxImgBuff,ssd_bufBytes>>10);
+            ret = -1;
+            goto filmEnd;
+        }
+        for(k=0;k<ssd_nbStripes;k++){
+            ssd_pool[k] = xpci_codecPoolCreate(ssd_codec, ssd_codecThreads > ssd_nbStripes ? ssd_codecThreads/ssd_nbStripes : 1,
+                                               ssd_stripeBuff);
+            if(ssd_pool[k] == NULL){
+                ret = -1;
+                goto filmEnd;
+            }
+        }
     }
-    else {
-        printf("OK: thread write raw data creation is success.\n");
-        pthread_yield(); // let opportunity for thread real start
+
+    // the writers hand these buffers to the kernel without mapping them at each image
+    for(k=0;k<ssd_nbStripes;k++)
+        xpci_burstRegisterFrames(xpci_burstStripe(ssd_burst, k),
+                                 ssd_coded != NULL ? &ssd_coded[k*ssd_stripeBuff] : (void**)&pRawBuff_ssd[k*ssd_stripeBuff],
+                                 ssd_stripeBuff);
+
+    ssd_frameNb = malloc(maxImgBuff * sizeof(int));
+    if(ssd_ringFlags & XPCI_SPSC_DROP)
+        ssd_scratch = malloc(imgSize);
+    if(ssd_frameNb == NULL || ((ssd_ringFlags & XPCI_SPSC_DROP) && ssd_scratch == NULL)){
+        printf("ERROR: %s ---> Can not create data buffer.\n",__func__);
+        ret = -1;
+        goto filmEnd;
+    }
+    pthread_mutex_lock(&ssd_burstLock);
+    for(k=0;k<ssd_nbStripes;k++){
+        xpci_spscInit(&ssd_ring[k], ssd_stripeBuff, ssd_ringFlags);
+        ssd_stripeLast[k] = -1;
+        ssd_stripeEnd[k] = 0;
+    }
+    ssd_imageCount = 0;
+    ssd_imageAborted = 0;
+    ssd_running = 1;
+    ringsReady = 1;
+    pthread_mutex_unlock(&ssd_burstLock);
+
+    for(k=0;k<ssd_nbStripes;k++){
+        par[k][0] = imgSize;
+        par[k][1] = burstNumber;
+        par[k][2] = nImg;
+        par[k][3] = ssd_stripeBuff;
+        par[k][4] = k;
+        if (ret = pthread_create(&ssd_writer[k],
+                                 NULL,
+                                 &xpci_writeRawDataToFile,
+                                 par[k]) !=0){
+            printf("ERROR: %s ---> Thread creation FAILED.\n", __func__);
+            ret = -1;
+            goto filmEnd;
+        }
+        nbWriters++;
     }
+    printf("OK: %d thread(s) write raw data creation is success.\n", ssd_nbStripes);
+    pthread_yield(); // let opportunity for thread real start
 
     // initialize image structure
     if(xpci_readImageInit(type, modMask, 7)==-1){
         printf("ERROR %s() ---> Image acquisition init FAILED.\n", __func__);
-        flag_startExpose = -1;
-        return -1;
+        ret = -1;
+        goto filmEnd;
     }
+    imgReady = 1;
 
     // disable timeout hardware (wait forever for the data to arrive)
     xpci_setHardTimeout(HWTIMEOUT_DSBL);
@@ -6204,49 +7196,108 @@ int xpci_getImgSeq_SSD_imxpad(enum IMG_TYPE type, int modMask, int nImg, int bur
     free(msg);
     if (ret){
         printf("ERROR: %s() ---> Sending the request FAILED\n", __func__);
-        flag_startExpose = -1;
-        return -1;
+        ret = -1;
+        goto filmEnd;
     }
     flag_startExpose = 1;
+    exposed = 1;
     
     xpci_timerStart(3);
     for (i=0; i<nImg; i++){
-		while(read_pRawBuff_ssd > (write_pRawBuff_ssd + maxImgBuff - 1)); // wait data write to file
-		if(xpci_readImgBuff( pRawBuff_ssd[i%maxImgBuff], 0)==-1 ){
+        // wait for a free buffer: the disk writer of the stripe applies the backpressure
+        ring = &ssd_ring[i % ssd_nbStripes];
+        while((n = xpci_spscWaitFree(ring, 100)) == 0 && !(ssd_ringFlags & XPCI_SPSC_DROP) &&
+              !xpci_getAbortProcess() && !xpci_getResetProcess());
+        if(n < 0){
+            printf("ERROR %s(): ---> disk writer stopped, last acquired image = %d.\n", __func__, i-1);
+            ret = -1;
+            break;
+        }
+        if(n > 0){
+            slot = (i % ssd_nbStripes) * ssd_stripeBuff + xpci_spscWritePos(ring) % ssd_stripeBuff;
+            ssd_frameNb[slot] = i;
+            pImg = pRawBuff_ssd[slot];
+        }
+        else if(ssd_ringFlags & XPCI_SPSC_DROP)
+            pImg = ssd_scratch;   // ring full: the image is read out and dropped
+        else{
+            printf("%s() ---> Last Acquired Image = %d.\n",__func__, i-1);
+            break;
+        }
+		if(xpci_readImgBuff(pImg, 0)==-1 ){
 			printf("ERROR %s(): ---> image %d reading FAILED.\n", __func__, i);
 			ret =-1;
 		}
-		read_pRawBuff_ssd++;    
-		//printf("read_pRawBuff_ssd = %d\n",read_pRawBuff_ssd); 
+        if(n > 0)
+            xpci_spscPublish(ring, 1);
         if(xpci_getAbortProcess()){
-			read_pRawBuff_ssd++; 
             printf("%s() ---> Last Acquired Image = %d.\n",__func__, i);
             break;
         }
-        //printf("read_pRawBuff_ssd = %d\n",read_pRawBuff_ssd); 
         if(xpci_getResetProcess()){
-			read_pRawBuff_ssd++; 
             printf("%s() ---> Last Acquired Image = %d.\n",__func__, i);
             break;
         }        
     }
     xpci_timerStop(3);
+    // no more image: the writers empty their ring and stop
     printf("%s() ---> Waiting thread.\n", __func__);
-    pthread_join (WriteFileThread,NULL);
 
-	for(i=0;i<maxImgBuff;i++)
-		free(pRawBuff_ssd[i]);
+    // the failures after the creation of the burst end here too
+filmEnd:
+    if(ringsReady)
+        xpci_filmStopWriters(nbWriters);
+
+    pthread_mutex_lock(&ssd_burstLock);
+    if(ringsReady){
+        xpci_filmRingStats(&ssd_lastRingStats);
+        xpci_filmCodecStats(&ssd_lastCodecStats);
+        xpci_filmPoolStats(&ssd_lastPoolStats);
+        for(k=0;k<ssd_nbStripes;k++)
+            xpci_spscDestroy(&ssd_ring[k]);
+    }
+    ssd_running = 0;
+    for(k=0;k<ssd_nbStripes;k++){
+        xpci_codecPoolDestroy(ssd_pool[k]);
+        ssd_pool[k] = NULL;
+    }
+    pthread_mutex_unlock(&ssd_burstLock);
+    free(ssd_frameNb);
+    ssd_frameNb = NULL;
+    free(ssd_scratch);
+    ssd_scratch = NULL;
+
+    // the buffers stay in the pool for the next film
 	free(pRawBuff_ssd);
+    pRawBuff_ssd = NULL;
+    free(ssd_coded);
+    ssd_coded = NULL;
+    if(ringsReady)
+        printf("%s() ---> buffers: peak %u/%u (%.0f%%), readout waited %llu ms for a free one.\n", __func__,
+               ssd_lastPoolStats.peakInUse, ssd_lastPoolStats.nbBuffers, 100*ssd_lastPoolStats.peakRatio,
+               ssd_lastPoolStats.exhaustedNs/1000000);
+    pthread_mutex_lock(&ssd_burstLock);
+    xpci_burstGetStats(ssd_burst, &ssd_lastStats);
+    if(xpci_burstClose(ssd_burst))
+        ret = -1;
+    ssd_burst = NULL;
+    pthread_mutex_unlock(&ssd_burstLock);
 
-    // restore short hw timeout
-    xpci_setHardTimeout(HWTIMEOUT_1SEC);
-    xpci_getImageClose();
-    if(!xpci_getAbortProcess()){
+    if(imgReady){
+        // restore short hw timeout
+        xpci_setHardTimeout(HWTIMEOUT_1SEC);
+        xpci_getImageClose();
+    }
+    if(exposed && !xpci_getAbortProcess()){
         xpci_modAbortExposure();
         xpci_clearAbortProcess();
     }
     xpci_AbortCleanDetector(modMask);
     xpci_clearResetProcess();
+    if(!exposed){
+        flag_startExpose = -1;
+        return ret;
+    }
     printf("%s() ---> Expose finished.\n", __func__);
     flag_startExpose = 0;
     return ret;
@@ -6521,14 +7572,23 @@ int xpci_sendIPIParam(unsigned modMask, unsigned IPI_ena, unsigned IPI_nr){
 
 void* xpci_writeRawDataToFile(unsigned int *par)
 {
-    int i;
-    char fname_0[200];
-    FILE *fd_img_0=NULL;    
-    int max=0;    
+    int queued = 0, submitted = 0;
+    int done = 0, retired, avail, slot, n, ret = 0;
+    int last = -1, aborted = 0;
+    int report = 1000;
+    XPCI_BURST_STATS stats;
+    XPCI_SPSC_STATS ringStats;    
+    XPCI_CODEC_STATS codecStats;
     unsigned imgSize = par[0];
     unsigned burst   = par[1];
-    unsigned nbimage_theard = par[2];
-    int maxImgBuff = par[3];
+    int maxImgBuff = par[3];        // buffers of the stripe
+    int stripe = par[4];
+    XPCI_SPSC *ring = &ssd_ring[stripe];
+    XPCI_BURST *file = xpci_burstStripe(ssd_burst, stripe);
+    uint16_t **pRaw = &pRawBuff_ssd[stripe * maxImgBuff];
+    int *frameNb = &ssd_frameNb[stripe * maxImgBuff];
+    XPCI_CODEC_POOL *pool = ssd_pool[stripe];
+    void **coded = ssd_coded != NULL ? &ssd_coded[stripe * maxImgBuff] : NULL;
 
     // Variables for Async Reading
     int              fd;
@@ -6541,6 +7601,7 @@ void* xpci_writeRawDataToFile(unsigned int *par)
     if( fd == -1 ) {
         fprintf( stderr, "Open failed [imageNumber %s()]:%s\n",__func__,
                  strerror( errno ) );
+        xpci_spscClose(ring);
         return -1;
     }
 
@@ -6548,6 +7609,7 @@ void* xpci_writeRawDataToFile(unsigned int *par)
     if( ftruncate( fd, sizeof( *imageNumber ) ) == -1 ) {
         fprintf( stderr, "ftruncate [imageNumber %s()]:%s\n",__func__,
                  strerror( errno ) );
+        xpci_spscClose(ring);
         return -1;
     }
 
@@ -6558,49 +7620,186 @@ void* xpci_writeRawDataToFile(unsigned int *par)
     if( imageNumber == MAP_FAILED ) {
         fprintf( stderr, "imageNumber mmap failed [imageNumber %s()]:%s\n",__func__,
                  strerror( errno ) );
+        xpci_spscClose(ring);
         return -1;
     }
 
     close(fd);
 
    //**************** End of async variable set ****************
-    imageNumber[0] = 0;
+    xpci_filmImageWritten(imageNumber, stripe, -1, 0, 0);
+
+    for (;;){
+        // images published by the readout and not yet released (encoding and in flight included)
+        avail = xpci_spscWaitFull(ring, queued > done ? 0 : 100);
+        if(avail < 0)
+            break;      // readout finished and everything is on disk
+
+        // encoded film: the new images go to the encoding pool first
+        while (queued < done + avail && xpci_getAbortProcess()==0 && xpci_getResetProcess()==0){
+            slot = queued % maxImgBuff;
+            if(pool != NULL && xpci_codecPoolSubmit(pool, pRaw[slot], imgSize, coded[slot], xpci_codecBound(imgSize)))
+                break;
+            queued++;
+        }
+        // queue every image ready, in ring order, they reach the disk in one batch
+        while (submitted < queued && ret == 0 && xpci_getAbortProcess()==0 && xpci_getResetProcess()==0){
+            slot = submitted % maxImgBuff;
+            if(pool == NULL)
+                ret = xpci_burstSubmitFrame(file, frameNb[slot], pRaw[slot]);
+            else{
+                // wait for the encoders only when the disk has nothing to do
+                if((n = xpci_codecPoolResult(pool, submitted == done)) == 0)
+                    break;
+                ret = n < 0 ? -1 : xpci_burstSubmitEncoded(file, frameNb[slot], coded[slot], n);
+            }
+            if(ret == 0)
+                submitted++;
+        }
+        // wait for the disk only when there is nothing new to queue
+        retired = ret ? -1 : xpci_burstCompleteFrames(file, submitted > done && queued == done + avail);
+        if(retired < 0){
+            printf("ERROR: %s() ---> images of burst %d can not be written.\n",__func__,burst);
+            xpci_setAbortProcess();
+            xpci_spscClose(ring);
+            break;
+        }
+        if(retired > done){
+            last = frameNb[(retired - 1) % maxImgBuff];
+            xpci_spscRelease(ring, retired - done);
+            done = retired;
+            xpci_filmImageWritten(imageNumber, stripe, last, 0, 0);
+        }
 
-    for (i=0; i<nbimage_theard; i++){
-        sprintf(fname_0,"/opt/imXPAD/tmp/burst_%d_img_%d.bin",burst,i);
-        fd_img_0 = fopen(fname_0,"wb");
-        if(fd_img_0==NULL){
-            printf("ERROR => Can not open file < %s >\n",fname_0);
-            return -1;
+        if(xpci_getAbortProcess() || xpci_getResetProcess()){
+            while(retired >= 0 && retired < submitted)
+                retired = xpci_burstCompleteFrames(file, 1);
+            if(retired > done){
+                last = frameNb[(retired - 1) % maxImgBuff];
+                xpci_spscRelease(ring, retired - done);
+            }
+            xpci_filmImageWritten(imageNumber, stripe, last, 1, 1);
+            aborted = 1;
+            break;
         }
-        while(read_pRawBuff_ssd <= write_pRawBuff_ssd && xpci_getResetProcess()==0);
-        fwrite(pRawBuff_ssd[i%maxImgBuff],imgSize,1,fd_img_0);
-        write_pRawBuff_ssd++;    
-        fflush(fd_img_0);    
-        fclose(fd_img_0);
-      //  printf("write_pRawBuff_ssd = %d\n",write_pRawBuff_ssd);
-        imageNumber[0] = i + 1;
-        if(xpci_getAbortProcess()){
-			 imageNumber[0] = i + 2;
-			 break;
-		 }
-        if(xpci_getResetProcess()){
-			 imageNumber[0] = i + 2;
-			 break;
-		 }
-        
-        if((read_pRawBuff_ssd - write_pRawBuff_ssd) > max)
-			max = read_pRawBuff_ssd - write_pRawBuff_ssd;
 
+        if(debugMsg && last >= report){
+            xpci_burstGetStats(file, &stats);
+            printf("%s() --> %u images written, %.1f MB/s, %u in flight\n",__func__,
+                   stats.nbFrames, stats.mbPerSec, stats.inFlight);
+            if(pool != NULL){
+                xpci_codecPoolGetStats(pool, &codecStats);
+                printf("%s() --> %s ratio %.2f, %u images encoding\n",__func__,
+                       xpci_codecName(codecStats.codec), codecStats.ratio, xpci_codecPoolPending(pool));
+            }
+            report += 1000;
+        }
     }
 
+    if(!aborted)
+        xpci_filmImageWritten(imageNumber, stripe, last, 1, 0);
     munmap(imageNumber,sizeof( *imageNumber ));
     
-    printf("%s() --> Diff ImgRead - ImgWrite max = %d\n",__func__,max);
+    xpci_burstGetStats(file, &stats);
+    xpci_spscGetStats(ring, &ringStats);
+    if(ssd_nbStripes > 1)
+        printf("%s() --> stripe %d/%d\n",__func__,stripe,ssd_nbStripes);
+    printf("%s() --> buffers used max %u/%u, readout stalled %.1f ms, writer idle %.1f ms, %llu images dropped\n",__func__,
+           ringStats.highWater, ringStats.capacity, ringStats.producerStallNs/1e6,
+           ringStats.consumerStallNs/1e6, ringStats.dropped);
+    printf("%s() --> %u images written with %s: %.1f MB/s, queue depth %u (max %u, mean %.1f)\n",__func__,
+           stats.nbFrames, xpci_burstIoModeName(stats.ioMode), stats.mbPerSec,
+           stats.queueDepth, stats.maxInFlight, stats.avgInFlight);
+    if(pool != NULL){
+        xpci_codecPoolGetStats(pool, &codecStats);
+        printf("%s() --> %llu images encoded with %s by %u threads: ratio %.2f, %.1f MB/s per thread, %llu stored raw\n",__func__,
+               codecStats.nbFrames, xpci_codecName(codecStats.codec), codecStats.nbThreads,
+               codecStats.ratio, codecStats.mbPerSec, codecStats.nbStored);
+    }
     
     return NULL;
 }
 
+/* writer stats of the film being acquired, of the last one when none is running */
+void xpci_getFilmWriteStats(XPCI_BURST_STATS *stats){
+    pthread_mutex_lock(&ssd_burstLock);
+    if(ssd_burst != NULL)
+        xpci_burstGetStats(ssd_burst, stats);
+    else
+        *stats = ssd_lastStats;
+    pthread_mutex_unlock(&ssd_burstLock);
+}
+
+/* readout -> writers handoff stats of the film being acquired (or of the last one),
+   summed over the stripes */
+void xpci_getFilmRingStats(XPCI_SPSC_STATS *stats){
+    pthread_mutex_lock(&ssd_burstLock);
+    if(ssd_running)
+        xpci_filmRingStats(stats);
+    else
+        *stats = ssd_lastRingStats;
+    pthread_mutex_unlock(&ssd_burstLock);
+}
+
+/* encoding stats of the film being acquired (or of the last one) */
+void xpci_getFilmCodecStats(XPCI_CODEC_STATS *stats){
+    pthread_mutex_lock(&ssd_burstLock);
+    if(ssd_running)
+        xpci_filmCodecStats(stats);
+    else
+        *stats = ssd_lastCodecStats;
+    pthread_mutex_unlock(&ssd_burstLock);
+}
+
+/* buffer pool use of the film being acquired (or of the last one) */
+void xpci_getFilmPoolStats(XPCI_FILM_POOL_STATS *stats){
+    pthread_mutex_lock(&ssd_burstLock);
+    if(ssd_running)
+        xpci_filmPoolStats(stats);
+    else
+        *stats = ssd_lastPoolStats;
+    pthread_mutex_unlock(&ssd_burstLock);
+}
+
+/* memory of the film buffers: bytes mapped once and kept across the films,
+   hugePages=0 for small pages only. Taken into account by the next film */
+int xpci_setFilmMemoryBudget(unsigned long long bytes, int hugePages){
+    if(ssd_running){
+        printf("ERROR: %s() ---> a film is running.\n",__func__);
+        return -1;
+    }
+    if(xpci_poolSetBudget(bytes))
+        return -1;
+    return xpci_poolSetHugePages(hugePages);
+}
+
+/* frames of the next films encoded with codec (XPCI_CODEC_NONE: raw frames) by
+   nbThreads threads shared by the stripes, before being written */
+int xpci_setFilmCompression(int codec, int nbThreads){
+    if(ssd_running){
+        printf("ERROR: %s() ---> a film is running.\n",__func__);
+        return -1;
+    }
+    if(codec<XPCI_CODEC_NONE || codec>XPCI_CODEC_BITPLANE || nbThreads<1 || nbThreads>XPCI_CODEC_MAX_THREADS){
+        printf("ERROR: %s() ---> invalid codec %d or nb of threads %d.\n",__func__,codec,nbThreads);
+        return -1;
+    }
+    ssd_codec = codec;
+    ssd_codecThreads = nbThreads;
+    return 0;
+}
+
+/* XPCI_SPSC_SLEEP: the readout and the writer sleep instead of spinning on the ring,
+   XPCI_SPSC_DROP: a full ring drops images instead of holding the readout */
+int xpci_setFilmRingMode(int flags){
+    if(ssd_running){
+        printf("ERROR: %s() ---> a film is running.\n",__func__);
+        return -1;
+    }
+    ssd_ringFlags = flags;
+    return 0;
+}
+
 
 
 
@@ -36,6 +36,11 @@ extern "C" {
 #define IMG_POSTPROC_GEOM           0x00000001
 #define IMG_POSTPROC_DEAD           0x00000002
 
+/* GEOMETRICAL CORRECTIONS OUTPUT */
+#define IMG_GEOM_UINT16             0
+#define IMG_GEOM_UINT32             1
+#define IMG_GEOM_FLOAT              2
+
 /*****     CHIP REGISTERS MANAGEMENT CODE      ****/
 /*** see xpci_registers.h and xpci_registers.c  ***/
 /**************************************************/
@@ -64,6 +69,11 @@ extern int xpci_systemChip; // necessary for compilation
 #define MILLISEC_GATE 0x2
 #define SECONDS_GATE  0x3
 
+/* IT WAIT MODES (see xpci_setItWaitMode()) */
+#define XPCI_ITWAIT_SPIN    0  // busy loop, lowest latency (default)
+#define XPCI_ITWAIT_SLEEP   1  // sleep until the IT handler signals
+#define XPCI_ITWAIT_HYBRID  2  // spin for a delay then sleep
+
 enum    DATA_TYPE {IMG, CONFIG};
 enum    IMG_TYPE  {B2,B4};
 
@@ -129,6 +139,10 @@ int   xpci_modPulseConfig(unsigned modMask, unsigned chipMask, unsigned calibID,
 void  xpci_setHardTimeout(int value);
 int   xpci_getHardTimeout();
 
+/* policy used to wait for the end of the DMA transfers */
+int   xpci_setItWaitMode(int mode, int spinUsec);
+int   xpci_getItWaitMode();
+
 /* pure image reading functions without exposition (digital test) */
 int   xpci_readOneImage(enum IMG_TYPE type, int moduleMask, int nbChips, void *data);
 
@@ -138,6 +152,10 @@ int   xpci_getImgSeq(enum IMG_TYPE type, int moduleMask, int nbChips, int nbImg,
                      int gateMode_CPPM, int gateLength_CPPM, int timeUnit_CPPM, int firstTimeout_CPPM);
 /*Streaming*/
 int   xpci_getImgSeq_SSD_imxpad(enum IMG_TYPE type, int modMask, int nImg, int burstNumber);
+int   xpci_checkSSDSpace_imxpad(enum IMG_TYPE type, int modMask, int nImg, int burstNumber,
+                                unsigned long long *needed, unsigned long long *available);
+int   xpci_getImgSeqStream_imxpad(enum IMG_TYPE type, int modMask, int nChips, int nImg, int poolSize,
+                                  int (*cbFunc)(int imgNb, void *frame, void *userPara), void *userPara);
 
 /* function combining expose+read by sofware to get an image */
 int   xpci_getOneImage(enum IMG_TYPE type, int moduleMask, int nbChips, void *data,
@@ -163,6 +181,48 @@ int   xpci_getImgSeqAs(enum IMG_TYPE type, int moduleMask, int nbChips,
                        void *userPara, int nImg);
 int   xpci_getImgSeqAsync(enum IMG_TYPE type, int moduleMask,int nImg, int burstNumber);
 int   xpci_getAsyncImageFromSharedMemory(enum IMG_TYPE type, int modMask, int nChips, int nImg, void *pBuff, int imageToGet, void *pImgCorr, int geomCorr);
+/* reader of the shared memory images kept open: no system call nor copy per image */
+#define XPCI_ASYNC_OK               0
+#define XPCI_ASYNC_NOT_YET          1   // image not acquired yet
+#define XPCI_ASYNC_OVERWRITTEN      2   // image older than the shared memory ring
+#define XPCI_ASYNC_TIMEOUT          3
+#define XPCI_ASYNC_ENDED            4   // sequence finished before the image
+/* consumer policies */
+#define XPCI_ASYNC_BLOCK            0   // every image, holds the acquisition back
+#define XPCI_ASYNC_LATEST           1   // last image, skips the others
+#define XPCI_ASYNC_DROP             2   // every image still in shared memory
+typedef struct XPCI_ASYNC_READER XPCI_ASYNC_READER;
+typedef struct {
+    char                name[32];
+    int                 pid;
+    int                 policy;
+    int                 demoted;        // BLOCK consumer turned to DROP after the block timeout
+    unsigned long long  cursor;         // next image of the consumer
+    unsigned long long  lag;            // images published and not consumed
+    unsigned long long  maxLag;
+    unsigned long long  consumed;
+    unsigned long long  skipped;
+    unsigned long long  dropped;
+    unsigned long long  stalls;         // times the acquisition waited for the consumer
+    unsigned long long  stallMs;
+} XPCI_ASYNC_CONSUMER_STATS;
+XPCI_ASYNC_READER *xpci_asyncReaderOpen();
+int   xpci_asyncReaderInfo(XPCI_ASYNC_READER *rd, enum IMG_TYPE *type, int *width, int *height, int *nbSlots);
+int   xpci_asyncReaderLastImage(XPCI_ASYNC_READER *rd);
+int   xpci_asyncReaderPeek(XPCI_ASYNC_READER *rd, int imageToGet, const void **pImg);
+int   xpci_asyncReaderRelease(XPCI_ASYNC_READER *rd, int imageToGet);
+int   xpci_asyncReaderCopy(XPCI_ASYNC_READER *rd, int imageToGet, void *pImg);
+int   xpci_asyncReaderWait(XPCI_ASYNC_READER *rd, int imageToGet, int timeoutMs);
+int   xpci_asyncReaderSubscribe(XPCI_ASYNC_READER *rd, const char *name, int policy);
+int   xpci_asyncReaderNext(XPCI_ASYNC_READER *rd, int timeoutMs, const void **pImg, int *imageNb);
+int   xpci_asyncReaderDone(XPCI_ASYNC_READER *rd);
+int   xpci_asyncReaderConsumers(XPCI_ASYNC_READER *rd, XPCI_ASYNC_CONSUMER_STATS *stats, int maxStats);
+void  xpci_asyncReaderClose(XPCI_ASYNC_READER *rd);
+void  xpci_PreProcessGeometricalCorrections();
+int   xpci_loadGeometricalCorrections(const char *path);
+int   xpci_getGeometricalCorrectionSize(int *width, int *height);
+int   xpci_setGeometricalCorrectionThreads(int nbThreads);
+int   xpci_applyGeometricalCorrections(enum IMG_TYPE type, int modMask, const void *pImg, void *pImgCorr, int outFormat);
 int   xpci_getAsyncImageFromDisk(enum IMG_TYPE type, int modMask, void *pImg, int imageToGet, int burstNumber);
 int   xpci_getNumberLastAcquiredAsyncImage();
 void  xpci_clearNumberLastAcquiredAsyncImage();
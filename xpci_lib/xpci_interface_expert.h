@@ -2,11 +2,35 @@
 #define XPCI_EXP
 
 #include <stdint.h>
+#include "xpci_burst.h"
+#include "xpci_spsc.h"
+#include "xpci_codec.h"
+#include "xpci_stack.h"
+#include "xpci_pool.h"
 /***********************************************************************************
 //             Structures definition
 ***********************************************************************************/
 typedef struct StatusRegTable StatusRegTable;
 
+/* time spent by the commands sent with xpci_writeCommon() */
+typedef struct {
+    unsigned long      nbCommands;  // commands sent on the 2 channels
+    unsigned long      nbLocks;     // commands that had to lock their own TX buffers
+    unsigned long long setupNs;     // channels reset, buffers setup and message copy
+    unsigned long long dmaNs;       // TX DMA on the 2 channels up to the end IT
+} XPCI_TX_STATS;
+
+/* use of the film buffers carved from the memory pool */
+typedef struct {
+    XPCI_POOL_STATS    pool;
+    unsigned           nbBuffers;    // buffers of the film (all the stripes)
+    unsigned           bufferBytes;  // pool bytes of an image (raw and encoded buffers)
+    unsigned           peakInUse;    // most buffers held at once, summed over the stripes
+    double             peakRatio;    // peakInUse/nbBuffers, 1: the pool ran out
+    unsigned long long exhaustedNs;  // readout waiting for a free buffer
+    unsigned long long dropped;      // images dropped for lack of buffer (XPCI_SPSC_DROP)
+} XPCI_FILM_POOL_STATS;
+
 #if defined(__cplusplus)
     extern "C" {
 #endif
@@ -25,6 +49,10 @@ int   xpci_resetHubLoopMode();
 /* PXIe users are not supposed to use them                                        */
 int   xpci_writeCommon(uint16_t *data, int size);
 int   xpci_writeCommon_S1400(uint16_t *data, int size,unsigned modMask);
+void  xpci_getTxStats(XPCI_TX_STATS *stats);
+void  xpci_clearTxStats();
+void  xpci_setDmaBufferReuse(int flag);
+int   xpci_benchCommandRoundTrip(unsigned modMask, int nbLoops, double *usecLocked, double *usecReused);
 int   xpci_write(int channel, uint16_t *data, int size);
 int   xpci_writeTestPCI(int channel, uint16_t *data, int size);
 int   xpci_read(int channel, uint16_t *data, int size, int timeout);
@@ -45,11 +73,24 @@ int   waitCommandReply(unsigned modMask, char *userFunc, int timeout);
 /* internal function used for combining expose+read managed directly by the detector nloop images */
 int   xpci_startImgSequence(unsigned nloop);
 int   xpci_readImgBuff(void *data, int timeout);
+int   xpci_readImgBuffDecoded(void *img, int timeout);
 void  xpci_getImageClose();
 int   xpci_modImageGet2B(unsigned modMask, unsigned gateMode, unsigned gateLength, unsigned timeUnit);
 int   xpci_modImageGet2B_XPAD32(unsigned modMask, unsigned gateMode, unsigned gateLength, unsigned timeUnit, unsigned nloop);
 int   xpci_modImageGet4B(unsigned modMask, unsigned gateMode, unsigned gateLength, unsigned timeUnit);
 
+/* zero-copy ring of pinned raw image buffers allocated by xpci_readImageInit() */
+int   xpci_setImgRingDepth(int nbSlots);
+int   xpci_getImgRingSlots();
+int   xpci_readImgRing(int *slot, uint16_t **raw, int timeout);
+void  xpci_releaseImgRing(int slot);
+int   xpci_startImgReadAhead(int nbImg, int timeout);
+void  xpci_stopImgReadAhead();
+int   xpci_setDecodeThreads(int nbThreads);
+int   xpci_getDecodeThreads();
+int   xpci_setSharedImageSlots(int nbSlots);
+int   xpci_setSharedImageBlockTimeout(int timeoutMs);
+
 /* CPPM implementation */
 int   xpci_getImgSeq_CPPM(enum IMG_TYPE type, int moduleMask, int nbChips,
 		         int gateMode, int gateLength, int timeUnit,
@@ -62,6 +103,15 @@ int   xpci_getImgSeq_imxpad(enum IMG_TYPE type, int moduleMask, int nbChips,
 		           int nbImg, void **pBuff);
 int   xpci_readOneImage_imxpad(enum IMG_TYPE type, int moduleMask, int nbChips, void *data);
 int   xpci_getModConfig_imxpad(unsigned moduleMask, unsigned nbChips, uint16_t *data);
+void  xpci_getFilmWriteStats(XPCI_BURST_STATS *stats);
+void  xpci_getFilmRingStats(XPCI_SPSC_STATS *stats);
+int   xpci_setFilmRingMode(int flags);
+int   xpci_setFilmCompression(int codec, int nbThreads);
+void  xpci_getFilmCodecStats(XPCI_CODEC_STATS *stats);
+int   xpci_setFilmMemoryBudget(unsigned long long bytes, int hugePages);
+void  xpci_getFilmPoolStats(XPCI_FILM_POOL_STATS *stats);
+// frame stack header of the detector: geometry and last exposure parameters
+int   xpci_getStackHeader(enum IMG_TYPE type, unsigned modMask, int layout, XPCI_STACK_HEADER *hdr);
 int   xpci_imxpadModRebootNIOS();
 int   waitCommandReplyExtended(unsigned modMask, char *userFunc, int timeout, unsigned *detRet);
 int   xpix_imxpadWriteSubchnlReg(unsigned modMask, unsigned msgType, unsigned trloops);
@@ -70,6 +120,11 @@ int   xpix_imxpadWriteSubchnlReg(unsigned modMask, unsigned msgType, unsigned tr
 int xpci_getItCnt();
 int xpci_getTotalItCnt();
 
+/* latency from the IT handler to the wake up of the waiter (log2 usec bins) */
+#define XPCI_ITLAT_BINS 24
+int  xpci_getItLatencyHistogram(unsigned long *hist, int nbBins);
+void xpci_clearItLatencyHistogram();
+
 /*****************************************************************************
 functions to emulate low level access to detector à la usbwrap.h
 *******************************************************************************/
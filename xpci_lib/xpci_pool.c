@@ -0,0 +1,146 @@
+/*******************************************************
+                       xpci_pool.c
+
+ Memory pool of the film buffers, see xpci_pool.h.
+ The region is mapped with MAP_HUGETLB first (2 MB
+ pages reserved by the administrator), then with small
+ pages and MADV_HUGEPAGE. MAP_POPULATE faults the pages
+ in when the region is mapped, not in the frame loop.
+ Buffers are carved with a bump pointer: a burst takes
+ all of its buffers at once and gives them back with
+ the next xpci_poolReset().
+*******************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "xpci_pool.h"
+
+#define XPCI_POOL_HUGE  (2ULL<<20)
+
+static pthread_mutex_t     pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long  pool_budget = XPCI_POOL_DEFAULT_BUDGET;
+static int                 pool_hugePages = 1;
+static char               *pool_base = NULL;
+static XPCI_POOL_STATS     pool_stats;
+
+static unsigned long long xpci_poolRoundUp(unsigned long long size, unsigned long long align){
+    return (size + align - 1) / align * align;
+}
+
+/* pool_lock held */
+static void xpci_poolUnmap(void){
+    if (pool_base!=NULL)
+        munmap(pool_base, pool_stats.size);
+    pool_base = NULL;
+    pool_stats.size = 0;
+    pool_stats.carved = 0;
+}
+
+/* pool_lock held */
+static int xpci_poolMap(void){
+    unsigned long long  size;
+    void               *base = MAP_FAILED;
+
+    if (pool_hugePages){
+        size = xpci_poolRoundUp(pool_budget, XPCI_POOL_HUGE);
+        base = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+        if (base!=MAP_FAILED)
+            pool_stats.pages = XPCI_POOL_PAGES_HUGETLB;
+    }
+    if (base==MAP_FAILED){
+        size = xpci_poolRoundUp(pool_budget, XPCI_POOL_ALIGN);
+        base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (base==MAP_FAILED){
+            printf("ERROR: %s() ---> can not map %llu MB: %s\n", __func__, size>>20, strerror(errno));
+            return -1;
+        }
+        pool_stats.pages = XPCI_POOL_PAGES_SMALL;
+#ifdef MADV_HUGEPAGE
+        if (pool_hugePages && madvise(base, size, MADV_HUGEPAGE)==0)
+            pool_stats.pages = XPCI_POOL_PAGES_THP;
+#endif
+        // faults the pages in now (after madvise so that they can be huge)
+        memset(base, 0, size);
+    }
+    pool_base = base;
+    pool_stats.size = size;
+    pool_stats.carved = 0;
+    pool_stats.nbMaps++;
+    return 0;
+}
+
+int xpci_poolSetBudget(unsigned long long bytes){
+    if (bytes<XPCI_POOL_ALIGN){
+        printf("ERROR: %s() ---> budget of %llu bytes too small.\n", __func__, bytes);
+        return -1;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_budget = bytes;
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+int xpci_poolSetHugePages(int enable){
+    pthread_mutex_lock(&pool_lock);
+    pool_hugePages = (enable!=0);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+int xpci_poolReset(void){
+    int ret = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    // a new budget or page policy takes effect here, between two bursts
+    if (pool_base!=NULL
+        && (pool_stats.size<pool_budget || pool_stats.size>=pool_budget + XPCI_POOL_HUGE
+            || (!pool_hugePages && pool_stats.pages!=XPCI_POOL_PAGES_SMALL)))
+        xpci_poolUnmap();
+    if (pool_base==NULL)
+        ret = xpci_poolMap();
+    pool_stats.carved = 0;
+    pool_stats.nbResets++;
+    pthread_mutex_unlock(&pool_lock);
+    return ret;
+}
+
+void *xpci_poolAlloc(unsigned size){
+    unsigned long long  stride = xpci_poolRoundUp(size, XPCI_POOL_ALIGN);
+    void               *p = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_base!=NULL && pool_stats.carved + stride<=pool_budget && pool_stats.carved + stride<=pool_stats.size){
+        p = pool_base + pool_stats.carved;
+        pool_stats.carved += stride;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return p;
+}
+
+unsigned long long xpci_poolAvailable(void){
+    unsigned long long avail = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_base!=NULL)
+        avail = (pool_budget<pool_stats.size ? pool_budget : pool_stats.size) - pool_stats.carved;
+    pthread_mutex_unlock(&pool_lock);
+    return avail;
+}
+
+void xpci_poolGetStats(XPCI_POOL_STATS *stats){
+    pthread_mutex_lock(&pool_lock);
+    *stats = pool_stats;
+    stats->budget = pool_budget;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void xpci_poolRelease(void){
+    pthread_mutex_lock(&pool_lock);
+    xpci_poolUnmap();
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,52 @@
+/*******************************************************
+                       xpci_pool.h
+
+ Memory pool of the film buffers. One region of the
+ memory budget is mapped (hugepages when the system has
+ some reserved, transparent hugepages otherwise),
+ prefaulted, and kept from one burst to the next: a
+ burst only carves its buffers out of it with
+ xpci_poolAlloc() after xpci_poolReset().
+ Buffers are aligned on XPCI_POOL_ALIGN so that they
+ can be written with O_DIRECT.
+*******************************************************/
+#ifndef XPCI_POOL_MEM
+#define XPCI_POOL_MEM
+
+#define XPCI_POOL_ALIGN          4096
+#define XPCI_POOL_DEFAULT_BUDGET (256ULL<<20)
+
+/* pages backing the region */
+#define XPCI_POOL_PAGES_SMALL    0
+#define XPCI_POOL_PAGES_THP      1   // transparent hugepages asked with madvise()
+#define XPCI_POOL_PAGES_HUGETLB  2   // reserved hugepages
+
+typedef struct {
+    unsigned long long  budget;      // bytes allowed
+    unsigned long long  size;        // bytes mapped (0 before the first burst)
+    int                 pages;       // XPCI_POOL_PAGES_xxx
+    unsigned long long  carved;      // bytes handed out since xpci_poolReset()
+    unsigned            nbMaps;      // times the region was mapped
+    unsigned            nbResets;    // bursts served
+} XPCI_POOL_STATS;
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+/* the region is mapped again at the next reset when the budget changes */
+int       xpci_poolSetBudget(unsigned long long bytes);
+/* 0: small pages only */
+int       xpci_poolSetHugePages(int enable);
+/* maps the region if needed and gives it back whole */
+int       xpci_poolReset(void);
+/* size rounded up to XPCI_POOL_ALIGN, NULL once the budget is used */
+void     *xpci_poolAlloc(unsigned size);
+/* bytes left for xpci_poolAlloc() */
+unsigned long long xpci_poolAvailable(void);
+void      xpci_poolGetStats(XPCI_POOL_STATS *stats);
+/* unmaps the region */
+void      xpci_poolRelease(void);
+#ifdef __cplusplus
+}
+#endif
+#endif
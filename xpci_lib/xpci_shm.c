@@ -0,0 +1,587 @@
+/*******************************************************
+                       xpci_shm.c
+
+ Shared memory ring of the decoded images, see
+ xpci_shm.h for the layout.
+ The writer makes the sequence number of a slot odd
+ before touching the image and even (release) once the
+ image is complete; a reader loads it (acquire) before
+ copying the image and again after: the copy is good
+ when both are the value expected for its image.
+ Readers sleep on the event word of the header with
+ FUTEX_WAIT (shared, the segment is mapped by several
+ processes); the writer increments it and wakes them at
+ each publication and each change of state.
+ Consumers write their cursor in their entry and wake
+ the writer through consumerEvent when it is waiting for
+ a BLOCK consumer; the image slots stay read only in the
+ readers mapping.
+ The segment is unlinked and created again by each
+ writer, a reader still mapping the previous one keeps
+ it until it closes; the old header is marked replaced
+ first so that a reader kept open knows it has to open
+ the name again. The consumers of live processes are
+ carried to the new segment with their cursor at 0.
+*******************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "xpci_shm.h"
+
+struct XPCI_SHM {
+    int               writer;
+    char             *base;
+    size_t            size;
+    XPCI_SHM_HEADER  *hdr;
+    XPCI_SHM_SLOT    *slots;
+    XPCI_SHM_CONSUMER *consumers;
+    char             *data;
+};
+
+static uint64_t xpci_shmRoundUp(uint64_t size, uint64_t align){
+    return (size + align - 1) / align * align;
+}
+
+static uint64_t xpci_shmNow(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void xpci_shmWake(XPCI_SHM_HEADER *hdr){
+    __atomic_add_fetch(&hdr->event, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &hdr->event, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int xpci_shmAlive(uint32_t pid){
+    return kill(pid, 0)==0 || errno==EPERM;
+}
+
+/* relative timeout left before deadline, 0 when it is over */
+static int xpci_shmLeft(const struct timespec *deadline, struct timespec *left){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left->tv_sec  = deadline->tv_sec - now.tv_sec;
+    left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (left->tv_nsec<0){
+        left->tv_sec--;
+        left->tv_nsec += 1000000000L;
+    }
+    return !(left->tv_sec<0 || (left->tv_sec==0 && left->tv_nsec==0));
+}
+
+static void xpci_shmDeadline(struct timespec *deadline, int timeoutMs){
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    if (timeoutMs>0){
+        deadline->tv_sec  += timeoutMs/1000;
+        deadline->tv_nsec += (timeoutMs%1000)*1000000L;
+        if (deadline->tv_nsec>=1000000000L){
+            deadline->tv_sec++;
+            deadline->tv_nsec -= 1000000000L;
+        }
+    }
+}
+
+static XPCI_SHM *xpci_shmMap(int fd, size_t size, int writer){
+    XPCI_SHM  *shm;
+    void      *base;
+
+    shm = calloc(1, sizeof(*shm));
+    if (shm==NULL){
+        printf("ERROR: %s() ---> can not allocate the handle.\n", __func__);
+        return NULL;
+    }
+    base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base==MAP_FAILED){
+        printf("ERROR: %s() ---> mmap of %zu bytes failed: %s\n", __func__, size, strerror(errno));
+        free(shm);
+        return NULL;
+    }
+    shm->writer = writer;
+    shm->base   = base;
+    shm->size   = size;
+    shm->hdr    = base;
+    return shm;
+}
+
+// *******************************************************************************
+// writer
+// *******************************************************************************
+/* marks the segment replaced and keeps the consumers of the processes still alive */
+static int xpci_shmRetire(const char *name, XPCI_SHM_CONSUMER *keep, unsigned *nbKeep){
+    XPCI_SHM_HEADER   *hdr;
+    XPCI_SHM_CONSUMER *cons;
+    struct stat        st;
+    unsigned           i;
+    int                fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd==-1)
+        return 0;   // nothing to replace
+    if (fstat(fd, &st)==0 && (size_t)st.st_size>=sizeof(XPCI_SHM_HEADER)){
+        hdr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if (hdr!=MAP_FAILED){
+            if (memcmp(hdr->magic, XPCI_SHM_MAGIC, sizeof(hdr->magic))==0){
+                __atomic_store_n(&hdr->state, XPCI_SHM_REPLACED, __ATOMIC_RELEASE);
+                xpci_shmWake(hdr);
+                if (keep!=NULL && hdr->version==XPCI_SHM_VERSION && hdr->maxConsumers<=XPCI_SHM_MAX_CONSUMERS
+                    && hdr->consumersOffset + (uint64_t)hdr->maxConsumers*sizeof(XPCI_SHM_CONSUMER)<=(uint64_t)st.st_size){
+                    cons = (XPCI_SHM_CONSUMER*)((char*)hdr + hdr->consumersOffset);
+                    for (i=0; i<hdr->maxConsumers; i++){
+                        if (__atomic_load_n(&cons[i].active, __ATOMIC_ACQUIRE)!=1 || !xpci_shmAlive(cons[i].pid))
+                            continue;
+                        memset(&keep[*nbKeep], 0, sizeof(XPCI_SHM_CONSUMER));
+                        keep[*nbKeep].active = 1;
+                        // a demoted consumer stays DROP: it would stall each new sequence
+                        keep[*nbKeep].policy  = cons[i].policy;
+                        keep[*nbKeep].demoted = cons[i].demoted;
+                        keep[*nbKeep].pid     = cons[i].pid;
+                        keep[*nbKeep].token  = cons[i].token;
+                        memcpy(keep[*nbKeep].name, cons[i].name, sizeof(cons[i].name));
+                        (*nbKeep)++;
+                    }
+                }
+            }
+            munmap(hdr, st.st_size);
+        }
+    }
+    close(fd);
+    if (shm_unlink(name) && errno!=ENOENT){
+        printf("ERROR: %s() ---> can not unlink %s: %s\n", __func__, name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int xpci_shmUnlink(const char *name){
+    return xpci_shmRetire(name, NULL, NULL);
+}
+
+XPCI_SHM *xpci_shmCreate(const char *name, int type, unsigned modMask, unsigned width, unsigned height,
+                         unsigned bytesPerPixel, unsigned nbSlots, uint64_t nbImages){
+    XPCI_SHM         *shm;
+    XPCI_SHM_HEADER   hdr;
+    XPCI_SHM_CONSUMER keep[XPCI_SHM_MAX_CONSUMERS];
+    unsigned          nbKeep = 0;
+    uint64_t          size;
+    int               fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version       = XPCI_SHM_VERSION;
+    hdr.headerSize    = xpci_shmRoundUp(sizeof(XPCI_SHM_HEADER), 64);
+    hdr.imgType       = type;
+    hdr.modMask       = modMask;
+    hdr.width         = width;
+    hdr.height        = height;
+    hdr.bytesPerPixel = bytesPerPixel;
+    hdr.frameSize     = width*height*bytesPerPixel;
+    hdr.frameStride   = xpci_shmRoundUp(hdr.frameSize, XPCI_SHM_ALIGN);
+    hdr.nbSlots       = nbSlots;
+    hdr.consumersOffset = hdr.headerSize + (uint64_t)nbSlots*sizeof(XPCI_SHM_SLOT);
+    hdr.maxConsumers  = XPCI_SHM_MAX_CONSUMERS;
+    hdr.blockTimeoutMs = 5000;
+    hdr.dataOffset    = xpci_shmRoundUp(hdr.consumersOffset + (uint64_t)hdr.maxConsumers*sizeof(XPCI_SHM_CONSUMER),
+                                        XPCI_SHM_ALIGN);
+    hdr.nbImages      = nbImages;
+    hdr.writerPid     = getpid();
+    hdr.state         = XPCI_SHM_RUNNING;
+    if (hdr.frameSize==0 || nbSlots==0){
+        printf("ERROR: %s() ---> %u slots of %u bytes.\n", __func__, nbSlots, hdr.frameSize);
+        return NULL;
+    }
+    size = hdr.dataOffset + (uint64_t)nbSlots*hdr.frameStride;
+
+    // a new segment: readers of the previous sequence keep theirs
+    xpci_shmRetire(name, keep, &nbKeep);
+    fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0777);
+    if (fd==-1){
+        printf("ERROR: %s() ---> can not create %s: %s\n", __func__, name, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, size)==-1){
+        printf("ERROR: %s() ---> can not size %s to %llu bytes: %s\n", __func__, name,
+               (unsigned long long)size, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    shm = xpci_shmMap(fd, size, 1);
+    close(fd);
+    if (shm==NULL){
+        shm_unlink(name);
+        return NULL;
+    }
+    shm->slots = (XPCI_SHM_SLOT*)(shm->base + hdr.headerSize);
+    shm->consumers = (XPCI_SHM_CONSUMER*)(shm->base + hdr.consumersOffset);
+    shm->data  = shm->base + hdr.dataOffset;
+
+    // the slots are zero (no image) after ftruncate, the magic goes last
+    memcpy(shm->hdr, &hdr, sizeof(hdr));
+    memcpy(shm->consumers, keep, nbKeep*sizeof(XPCI_SHM_CONSUMER));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shm->hdr->magic, XPCI_SHM_MAGIC, sizeof(shm->hdr->magic));
+    return shm;
+}
+
+/* waits until the BLOCK consumers have read the image slot k held before image */
+static void xpci_shmWaitConsumers(XPCI_SHM *shm, uint64_t image){
+    XPCI_SHM_HEADER   *hdr = shm->hdr;
+    XPCI_SHM_CONSUMER *c;
+    struct timespec    start, end, deadline, left, tick;
+    uint32_t           event;
+    unsigned           i;
+
+    for (i=0; i<hdr->maxConsumers; i++){
+        c = &shm->consumers[i];
+        if (__atomic_load_n(&c->active, __ATOMIC_ACQUIRE)!=1 || c->policy!=XPCI_SHM_BLOCK
+            || image<__atomic_load_n(&c->cursor, __ATOMIC_ACQUIRE) + hdr->nbSlots)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        xpci_shmDeadline(&deadline, hdr->blockTimeoutMs);
+        for (;;){
+            event = __atomic_load_n(&hdr->consumerEvent, __ATOMIC_ACQUIRE);
+            __atomic_add_fetch(&hdr->writerWaiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&c->active, __ATOMIC_ACQUIRE)!=1 || c->policy!=XPCI_SHM_BLOCK
+                || image<__atomic_load_n(&c->cursor, __ATOMIC_SEQ_CST) + hdr->nbSlots){
+                __atomic_sub_fetch(&hdr->writerWaiting, 1, __ATOMIC_RELEASE);
+                break;
+            }
+            if (!xpci_shmLeft(&deadline, &left)){
+                // the consumer asked to block the acquisition, not to stop it
+                __atomic_sub_fetch(&hdr->writerWaiting, 1, __ATOMIC_RELEASE);
+                c->demoted = 1;
+                __atomic_store_n(&c->policy, XPCI_SHM_DROP, __ATOMIC_RELEASE);
+                printf("WARNING: %s() ---> consumer %.32s late by %llu images, turned to DROP\n", __func__,
+                       c->name, (unsigned long long)(image - c->cursor));
+                break;
+            }
+            // wakes up every 100 ms to see whether the consumer is still alive
+            tick.tv_sec = 0;
+            tick.tv_nsec = 100000000L;
+            if (left.tv_sec>0 || left.tv_nsec>tick.tv_nsec)
+                left = tick;
+            syscall(SYS_futex, &hdr->consumerEvent, FUTEX_WAIT, event, &left, NULL, 0);
+            __atomic_sub_fetch(&hdr->writerWaiting, 1, __ATOMIC_RELEASE);
+            if (!xpci_shmAlive(c->pid)){
+                __atomic_store_n(&c->active, 0, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        __atomic_add_fetch(&c->stalls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->stallNs, (end.tv_sec - start.tv_sec)*1000000000ULL + end.tv_nsec - start.tv_nsec,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+void *xpci_shmBegin(XPCI_SHM *shm, uint64_t image){
+    unsigned k = image % shm->hdr->nbSlots;
+
+    if (image>=shm->hdr->nbSlots)
+        xpci_shmWaitConsumers(shm, image);
+
+    __atomic_store_n(&shm->slots[k].seq, 2*image + 1, __ATOMIC_RELAXED);
+    // readers of the previous image of the slot must see the odd value first
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return shm->data + (size_t)k*shm->hdr->frameStride;
+}
+
+void xpci_shmCommit(XPCI_SHM *shm, uint64_t image){
+    XPCI_SHM_SLOT *slot = &shm->slots[image % shm->hdr->nbSlots];
+
+    slot->image = image;
+    slot->timestampNs = xpci_shmNow();
+    __atomic_store_n(&slot->seq, 2*image + 2, __ATOMIC_RELEASE);
+}
+
+void xpci_shmPublish(XPCI_SHM *shm, uint64_t nbImages){
+    if (nbImages>shm->hdr->published){
+        __atomic_store_n(&shm->hdr->published, nbImages, __ATOMIC_RELEASE);
+        xpci_shmWake(shm->hdr);
+    }
+}
+
+void xpci_shmSetBlockTimeout(XPCI_SHM *shm, unsigned timeoutMs){
+    shm->hdr->blockTimeoutMs = timeoutMs;
+}
+
+void xpci_shmFinish(XPCI_SHM *shm){
+    __atomic_store_n(&shm->hdr->state, XPCI_SHM_FINISHED, __ATOMIC_RELEASE);
+    xpci_shmWake(shm->hdr);
+}
+
+// *******************************************************************************
+// reader
+// *******************************************************************************
+XPCI_SHM *xpci_shmOpen(const char *name){
+    XPCI_SHM         *shm;
+    XPCI_SHM_HEADER  *hdr;
+    struct stat       st;
+    int               fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd==-1){
+        if (errno==ENOENT)
+            return NULL;    // no writer yet, quiet for the readers waiting for it
+        printf("ERROR: %s() ---> can not open %s: %s\n", __func__, name, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) || (size_t)st.st_size<sizeof(XPCI_SHM_HEADER)){
+        printf("ERROR: %s() ---> %s is not an image ring.\n", __func__, name);
+        close(fd);
+        return NULL;
+    }
+    shm = xpci_shmMap(fd, st.st_size, 0);
+    close(fd);
+    if (shm==NULL)
+        return NULL;
+
+    hdr = shm->hdr;
+    if (memcmp(hdr->magic, XPCI_SHM_MAGIC, sizeof(hdr->magic)) || hdr->version!=XPCI_SHM_VERSION
+        || hdr->nbSlots==0 || hdr->frameStride<hdr->frameSize
+        || hdr->headerSize + (uint64_t)hdr->nbSlots*sizeof(XPCI_SHM_SLOT)>hdr->consumersOffset
+        || hdr->maxConsumers>XPCI_SHM_MAX_CONSUMERS
+        || hdr->consumersOffset + (uint64_t)hdr->maxConsumers*sizeof(XPCI_SHM_CONSUMER)>hdr->dataOffset
+        || hdr->dataOffset%XPCI_SHM_ALIGN
+        || hdr->dataOffset + (uint64_t)hdr->nbSlots*hdr->frameStride>(uint64_t)st.st_size){
+        printf("ERROR: %s() ---> %s is not an image ring (older library?).\n", __func__, name);
+        xpci_shmClose(shm);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    shm->slots = (XPCI_SHM_SLOT*)(shm->base + hdr->headerSize);
+    shm->consumers = (XPCI_SHM_CONSUMER*)(shm->base + hdr->consumersOffset);
+    shm->data  = shm->base + hdr->dataOffset;
+    // only the header, the slot table and the consumers are written by the readers
+    mprotect(shm->data, shm->size - hdr->dataOffset, PROT_READ);
+    return shm;
+}
+
+const XPCI_SHM_HEADER *xpci_shmHeader(XPCI_SHM *shm){
+    return shm->hdr;
+}
+
+uint64_t xpci_shmPublished(XPCI_SHM *shm){
+    return __atomic_load_n(&shm->hdr->published, __ATOMIC_ACQUIRE);
+}
+
+int xpci_shmWait(XPCI_SHM *shm, uint64_t image, int timeoutMs){
+    XPCI_SHM_HEADER  *hdr = shm->hdr;
+    struct timespec   deadline, left;
+    uint32_t          event, state;
+
+    xpci_shmDeadline(&deadline, timeoutMs);
+    for (;;){
+        // the event is loaded first: a publication after the checks changes it and the wait returns
+        event = __atomic_load_n(&hdr->event, __ATOMIC_ACQUIRE);
+        state = __atomic_load_n(&hdr->state, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hdr->published, __ATOMIC_ACQUIRE)>image)
+            return XPCI_SHM_OK;
+        if (state!=XPCI_SHM_RUNNING)
+            return XPCI_SHM_ENDED;
+        if (timeoutMs<0){
+            syscall(SYS_futex, &hdr->event, FUTEX_WAIT, event, NULL, NULL, 0);
+            continue;
+        }
+        if (!xpci_shmLeft(&deadline, &left))
+            return XPCI_SHM_TIMEOUT;
+        syscall(SYS_futex, &hdr->event, FUTEX_WAIT, event, &left, NULL, 0);
+    }
+}
+
+int xpci_shmRead(XPCI_SHM *shm, uint64_t image, void *dst, uint64_t *timestampNs){
+    XPCI_SHM_SLOT *slot = &shm->slots[image % shm->hdr->nbSlots];
+    uint64_t       seq, again, stamp;
+
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq<2*image + 2)
+        return XPCI_SHM_NOT_YET;
+    if (seq>2*image + 2)
+        return XPCI_SHM_OVERWRITTEN;
+    memcpy(dst, shm->data + (size_t)(image % shm->hdr->nbSlots)*shm->hdr->frameStride, shm->hdr->frameSize);
+    stamp = slot->timestampNs;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    again = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if (again!=seq)
+        return XPCI_SHM_OVERWRITTEN;
+    if (timestampNs!=NULL)
+        *timestampNs = stamp;
+    return XPCI_SHM_OK;
+}
+
+const void *xpci_shmPeek(XPCI_SHM *shm, uint64_t image, int *status){
+    XPCI_SHM_SLOT *slot = &shm->slots[image % shm->hdr->nbSlots];
+    uint64_t       seq;
+
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq!=2*image + 2){
+        *status = (seq<2*image + 2) ? XPCI_SHM_NOT_YET : XPCI_SHM_OVERWRITTEN;
+        return NULL;
+    }
+    *status = XPCI_SHM_OK;
+    return shm->data + (size_t)(image % shm->hdr->nbSlots)*shm->hdr->frameStride;
+}
+
+int xpci_shmCheck(XPCI_SHM *shm, uint64_t image){
+    XPCI_SHM_SLOT *slot = &shm->slots[image % shm->hdr->nbSlots];
+
+    // the loads of the image come before the second load of the sequence number
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED)!=2*image + 2)
+        return XPCI_SHM_OVERWRITTEN;
+    return XPCI_SHM_OK;
+}
+
+int xpci_shmReplaced(XPCI_SHM *shm){
+    return __atomic_load_n(&shm->hdr->state, __ATOMIC_ACQUIRE)==XPCI_SHM_REPLACED;
+}
+
+// *******************************************************************************
+// consumers
+// *******************************************************************************
+int xpci_shmReattach(XPCI_SHM *shm, uint64_t token){
+    XPCI_SHM_CONSUMER *c;
+    unsigned           i;
+
+    for (i=0; i<shm->hdr->maxConsumers; i++){
+        c = &shm->consumers[i];
+        if (__atomic_load_n(&c->active, __ATOMIC_ACQUIRE)==1 && c->token==token && c->pid==(uint32_t)getpid())
+            return i;
+    }
+    return -1;
+}
+
+int xpci_shmSubscribe(XPCI_SHM *shm, const char *name, int policy, uint64_t token){
+    XPCI_SHM_CONSUMER *c;
+    uint32_t           expected;
+    unsigned           i;
+    int                carried;
+
+    if (policy<XPCI_SHM_BLOCK || policy>XPCI_SHM_DROP){
+        printf("ERROR: %s() ---> unknown policy %d.\n", __func__, policy);
+        return -1;
+    }
+    // entry carried from the previous segment: the explicit subscription lifts the demotion
+    carried = xpci_shmReattach(shm, token);
+    if (carried>=0){
+        c = &shm->consumers[carried];
+        __atomic_store_n(&c->policy, policy, __ATOMIC_RELEASE);
+        __atomic_store_n(&c->demoted, 0, __ATOMIC_RELEASE);
+        return carried;
+    }
+    for (i=0; i<shm->hdr->maxConsumers; i++){
+        c = &shm->consumers[i];
+        expected = 0;
+        if (!__atomic_compare_exchange_n(&c->active, &expected, 2, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+        // 2: taken, not seen by the writer until the cursor is set
+        c->pid = getpid();
+        c->token = token;
+        c->demoted = 0;
+        memset(c->name, 0, sizeof(c->name));
+        strncpy(c->name, name!=NULL ? name : "", sizeof(c->name) - 1);
+        c->consumed = c->skipped = c->dropped = c->maxLag = 0;
+        c->stalls = c->stallNs = 0;
+        c->policy = policy;
+        __atomic_store_n(&c->cursor, xpci_shmPublished(shm), __ATOMIC_RELEASE);
+        __atomic_store_n(&c->active, 1, __ATOMIC_RELEASE);
+        return i;
+    }
+    printf("ERROR: %s() ---> the %u consumers are in use.\n", __func__, shm->hdr->maxConsumers);
+    return -1;
+}
+
+static void xpci_shmWakeWriter(XPCI_SHM *shm){
+    __atomic_add_fetch(&shm->hdr->consumerEvent, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->hdr->writerWaiting, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &shm->hdr->consumerEvent, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void xpci_shmUnsubscribe(XPCI_SHM *shm, int consumer){
+    if (consumer<0 || (unsigned)consumer>=shm->hdr->maxConsumers)
+        return;
+    __atomic_store_n(&shm->consumers[consumer].active, 0, __ATOMIC_RELEASE);
+    xpci_shmWakeWriter(shm);
+}
+
+const XPCI_SHM_CONSUMER *xpci_shmConsumer(XPCI_SHM *shm, int consumer){
+    if (consumer<0 || (unsigned)consumer>=shm->hdr->maxConsumers)
+        return NULL;
+    return &shm->consumers[consumer];
+}
+
+int xpci_shmNext(XPCI_SHM *shm, int consumer, int timeoutMs, const void **img, uint64_t *image){
+    XPCI_SHM_CONSUMER *c = &shm->consumers[consumer];
+    uint64_t           published, cursor, oldest;
+    int                status, ret;
+
+    *img = NULL;
+    for (;;){
+        published = xpci_shmPublished(shm);
+        cursor = c->cursor;
+        if (c->policy==XPCI_SHM_LATEST && published>cursor + 1){
+            c->skipped += published - 1 - cursor;
+            cursor = published - 1;
+            __atomic_store_n(&c->cursor, cursor, __ATOMIC_RELEASE);
+            xpci_shmWakeWriter(shm);
+        }
+        if (published>cursor){
+            if (published - cursor>c->maxLag)
+                c->maxLag = published - cursor;
+            *img = xpci_shmPeek(shm, cursor, &status);
+            if (*img!=NULL){
+                *image = cursor;
+                return XPCI_SHM_OK;
+            }
+            // overwritten: on to the oldest image with half of the ring ahead of the writer
+            oldest = (published>shm->hdr->nbSlots/2) ? published - shm->hdr->nbSlots/2 : 0;
+            if (oldest<=cursor)
+                oldest = cursor + 1;
+            c->dropped += oldest - cursor;
+            __atomic_store_n(&c->cursor, oldest, __ATOMIC_RELEASE);
+            xpci_shmWakeWriter(shm);
+            continue;
+        }
+        ret = xpci_shmWait(shm, cursor, timeoutMs);
+        if (ret!=XPCI_SHM_OK)
+            return ret;
+    }
+}
+
+int xpci_shmDone(XPCI_SHM *shm, int consumer, uint64_t image){
+    XPCI_SHM_CONSUMER *c = &shm->consumers[consumer];
+    int                ret;
+
+    ret = xpci_shmCheck(shm, image);
+    if (ret==XPCI_SHM_OK)
+        c->consumed++;
+    else
+        c->dropped++;
+    if (c->cursor<=image){
+        __atomic_store_n(&c->cursor, image + 1, __ATOMIC_SEQ_CST);
+        xpci_shmWakeWriter(shm);
+    }
+    return ret;
+}
+
+void xpci_shmClose(XPCI_SHM *shm){
+    if (shm==NULL)
+        return;
+    munmap(shm->base, shm->size);
+    free(shm);
+}
@@ -0,0 +1,160 @@
+/*******************************************************
+                       xpci_shm.h
+
+ Shared memory ring of the decoded images (/images):
+
+   [XPCI_SHM_HEADER][nbSlots XPCI_SHM_SLOT][maxConsumers XPCI_SHM_CONSUMER]
+   [slot 0 image][slot 1 image]...
+
+ Image n is written in slot n%nbSlots, so that a
+ sequence of any length takes a fixed amount of memory.
+ Each slot holds a sequence number used as a seqlock:
+ 2n+1 while image n is being written, 2n+2 once it is
+ complete. A reader checks it before and after copying
+ the image: it never returns a torn image and knows
+ when the image it asked for has been overwritten.
+ The header gives the geometry of the images and the
+ number of images published in order; its event word is
+ a futex woken at each publication, so that readers of
+ any process can sleep until an image is there.
+ Consumers registered in the segment have their own
+ cursor, statistics and policy: BLOCK ones hold the
+ writer back before it reuses a slot they did not read
+ yet (bounded by blockTimeoutMs), the others never do.
+*******************************************************/
+#ifndef XPCI_SHM_RING
+#define XPCI_SHM_RING
+
+#include <stdint.h>
+
+#define XPCI_SHM_IMAGES      "/images"
+#define XPCI_SHM_MAGIC       "XPADSHM1"
+#define XPCI_SHM_VERSION     2
+#define XPCI_SHM_MAX_CONSUMERS 16
+#define XPCI_SHM_ALIGN       4096
+
+/* header state */
+#define XPCI_SHM_RUNNING     1
+#define XPCI_SHM_FINISHED    2
+#define XPCI_SHM_REPLACED    3    // unlinked, a reader should open the name again
+
+/* xpci_shmRead() results */
+#define XPCI_SHM_OK          0
+#define XPCI_SHM_NOT_YET     1    // image not written yet
+#define XPCI_SHM_OVERWRITTEN 2    // slot reused by a later image
+/* xpci_shmWait() results */
+#define XPCI_SHM_TIMEOUT     3
+#define XPCI_SHM_ENDED       4    // sequence finished or replaced before the image
+
+/* consumer policies */
+#define XPCI_SHM_BLOCK       0    // every image, the writer waits for the consumer
+#define XPCI_SHM_LATEST      1    // skips to the last image published
+#define XPCI_SHM_DROP        2    // every image still in the ring, the overwritten ones are lost
+
+typedef struct {
+    char               magic[8];
+    uint32_t           version;
+    uint32_t           headerSize;    // bytes before the slot table
+    uint32_t           imgType;       // enum IMG_TYPE: 0 B2, 1 B4
+    uint32_t           modMask;
+    uint32_t           width;         // pixels per row
+    uint32_t           height;        // rows
+    uint32_t           bytesPerPixel;
+    uint32_t           frameSize;     // bytes of an image
+    uint32_t           frameStride;   // bytes between two slots (multiple of XPCI_SHM_ALIGN)
+    uint32_t           nbSlots;
+    uint64_t           dataOffset;    // slot 0 image
+    uint64_t           nbImages;      // images of the sequence, 0 unbounded
+    uint32_t           writerPid;
+    uint32_t           state;         // XPCI_SHM_RUNNING / XPCI_SHM_FINISHED / XPCI_SHM_REPLACED
+    uint64_t           consumersOffset;
+    uint32_t           maxConsumers;
+    uint32_t           blockTimeoutMs; // a BLOCK consumer later than this is turned to DROP
+    uint64_t           pad[5];
+    // written by the acquisition, on its own cache line
+    volatile uint64_t  published;     // images 0..published-1 written, in order
+    volatile uint32_t  event;         // futex, incremented at each publication and state change
+    uint32_t           pad1;
+    uint64_t           pad2[6];
+    // written by the consumers, on its own cache line
+    volatile uint32_t  consumerEvent; // futex, incremented when a consumer moves its cursor
+    volatile uint32_t  writerWaiting; // writer threads sleeping on consumerEvent
+    uint64_t           pad3[7];
+} XPCI_SHM_HEADER;
+
+typedef struct {
+    volatile uint64_t  seq;           // 2n+1 writing image n, 2n+2 image n complete
+    uint64_t           image;
+    uint64_t           timestampNs;   // CLOCK_REALTIME when the image was complete
+    uint64_t           pad[5];
+} XPCI_SHM_SLOT;
+
+typedef struct {
+    volatile uint32_t  active;
+    volatile uint32_t  policy;        // XPCI_SHM_BLOCK / LATEST / DROP
+    uint32_t           pid;
+    uint32_t           demoted;       // BLOCK consumer turned to DROP by the writer, until it subscribes again
+    uint64_t           token;         // identifies the consumer from one segment to the next
+    char               name[32];
+    volatile uint64_t  cursor;        // next image of the consumer
+    uint64_t           consumed;
+    uint64_t           skipped;       // jumped over by LATEST
+    uint64_t           dropped;       // overwritten before being read
+    uint64_t           maxLag;        // images published and not consumed
+    uint64_t           stalls;        // times the writer waited for the consumer
+    uint64_t           stallNs;
+    uint64_t           pad;
+} XPCI_SHM_CONSUMER;
+
+typedef struct XPCI_SHM XPCI_SHM;
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+/* marks the segment name replaced for its readers and unlinks it */
+int         xpci_shmUnlink(const char *name);
+/* writer: replaces the segment name */
+XPCI_SHM   *xpci_shmCreate(const char *name, int type, unsigned modMask, unsigned width, unsigned height,
+                           unsigned bytesPerPixel, unsigned nbSlots, uint64_t nbImages);
+/* slot of image n, marked as being written until xpci_shmCommit() */
+void       *xpci_shmBegin(XPCI_SHM *shm, uint64_t image);
+void        xpci_shmCommit(XPCI_SHM *shm, uint64_t image);
+/* images 0..nbImages-1 are complete (in acquisition order) */
+void        xpci_shmPublish(XPCI_SHM *shm, uint64_t nbImages);
+void        xpci_shmFinish(XPCI_SHM *shm);
+void        xpci_shmSetBlockTimeout(XPCI_SHM *shm, unsigned timeoutMs);
+
+/* reader: NULL with errno ENOENT while there is no segment */
+XPCI_SHM   *xpci_shmOpen(const char *name);
+const XPCI_SHM_HEADER *xpci_shmHeader(XPCI_SHM *shm);
+uint64_t    xpci_shmPublished(XPCI_SHM *shm);
+/* sleeps until image n is published: XPCI_SHM_OK, XPCI_SHM_TIMEOUT or XPCI_SHM_ENDED
+   (timeoutMs<0 waits without limit) */
+int         xpci_shmWait(XPCI_SHM *shm, uint64_t image, int timeoutMs);
+/* copies image n in dst (frameSize bytes): XPCI_SHM_OK, XPCI_SHM_NOT_YET or XPCI_SHM_OVERWRITTEN */
+int         xpci_shmRead(XPCI_SHM *shm, uint64_t image, void *dst, uint64_t *timestampNs);
+/* zero copy: image n in the mapping (NULL and *status not XPCI_SHM_OK when it is not there),
+   xpci_shmCheck() tells after use whether the writer reused the slot meanwhile */
+const void *xpci_shmPeek(XPCI_SHM *shm, uint64_t image, int *status);
+int         xpci_shmCheck(XPCI_SHM *shm, uint64_t image);
+/* the writer unlinked the segment: close it and open the name again */
+int         xpci_shmReplaced(XPCI_SHM *shm);
+
+/* consumer entry index, the entry of the same token (carried from the previous segment) is reused
+   with the requested policy and without its demotion */
+int         xpci_shmSubscribe(XPCI_SHM *shm, const char *name, int policy, uint64_t token);
+/* index of the entry of the token carried from the previous segment, policy and demotion kept,
+   -1 when it was not carried */
+int         xpci_shmReattach(XPCI_SHM *shm, uint64_t token);
+void        xpci_shmUnsubscribe(XPCI_SHM *shm, int consumer);
+const XPCI_SHM_CONSUMER *xpci_shmConsumer(XPCI_SHM *shm, int consumer);
+/* next image of the consumer following its policy: XPCI_SHM_OK, XPCI_SHM_TIMEOUT or XPCI_SHM_ENDED */
+int         xpci_shmNext(XPCI_SHM *shm, int consumer, int timeoutMs, const void **img, uint64_t *image);
+/* the consumer is done with the image: XPCI_SHM_OK or XPCI_SHM_OVERWRITTEN while in use */
+int         xpci_shmDone(XPCI_SHM *shm, int consumer, uint64_t image);
+
+void        xpci_shmClose(XPCI_SHM *shm);
+#ifdef __cplusplus
+}
+#endif
+#endif
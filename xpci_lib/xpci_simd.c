@@ -0,0 +1,389 @@
+/*******************************************************
+                       xpci_simd.c
+
+ Vector kernels used to decode the raw image lines.
+
+ The pixels of a line are contiguous in the raw data
+ (5 words of header then 7 chips x 80 columns) so the
+ decoders only need 4 primitives: a straight copy, a
+ mirrored copy (S140 second module) and the same two
+ operations while building the 32 bits counts of the
+ 4 bytes images from their 2 uint16_t words.
+
+ On a little endian CPU the (low, high) pair of words
+ is already the memory image of the 32 bits count, so
+ the 4 bytes kernels are copies as well. The scalar
+ kernels keep the explicit shift-add used before.
+
+ The geometrical correction adds a gather multiply
+ accumulate (acc[k] += w[k]*src[idx[k]]) over the taps
+ of its weight table; only AVX2 has a gather, the other
+ sets use the scalar loop.
+
+ The kernel set is selected once from the CPU features
+ (SSE4.1/AVX2 on x86, NEON on little endian ARM) and
+ can be forced with xpci_simdSetLevel() for tests and
+ benchmarks.
+*******************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "xpci_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define XPCI_SIMD_X86
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define XPCI_SIMD_ARM
+#include <arm_neon.h>
+#endif
+
+typedef struct {
+    void (*copy16)(uint16_t *dst, const uint16_t *src, int n);
+    void (*mirror16)(uint16_t *dst, const uint16_t *src, int n);
+    void (*merge32)(uint32_t *dst, const uint16_t *src, int n);
+    void (*mirror32)(uint32_t *dst, const uint16_t *src, int n);
+    void (*gather16)(float *acc, const float *w, const uint32_t *idx, const uint16_t *src, int n);
+    void (*gather32)(float *acc, const float *w, const uint32_t *idx, const uint32_t *src, int n);
+} XPCI_SIMD_KERNELS;
+
+/*============================================================================
+                              SCALAR KERNELS
+ ============================================================================*/
+static void copyPix16_scalar(uint16_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k<n; k++)
+        dst[k] = src[k];
+}
+
+static void mirrorPix16_scalar(uint16_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k<n; k++)
+        dst[n-1-k] = src[k];
+}
+
+static void mergePix32_scalar(uint32_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k<n; k++)
+        dst[k] = ((uint32_t)src[2*k+1]<<16) + src[2*k];
+}
+
+static void mirrorPix32_scalar(uint32_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k<n; k++)
+        dst[n-1-k] = ((uint32_t)src[2*k+1]<<16) + src[2*k];
+}
+
+static void gatherMac16_scalar(float *acc, const float *w, const uint32_t *idx, const uint16_t *src, int n){
+    int k;
+    for (k=0; k<n; k++)
+        acc[k] += w[k]*src[idx[k]];
+}
+
+static void gatherMac32_scalar(float *acc, const float *w, const uint32_t *idx, const uint32_t *src, int n){
+    int k;
+    for (k=0; k<n; k++)
+        acc[k] += w[k]*src[idx[k]];
+}
+
+static const XPCI_SIMD_KERNELS scalarKernels = {
+    copyPix16_scalar, mirrorPix16_scalar, mergePix32_scalar, mirrorPix32_scalar,
+    gatherMac16_scalar, gatherMac32_scalar
+};
+
+#ifdef XPCI_SIMD_X86
+/*============================================================================
+                              SSE4.1 KERNELS
+ ============================================================================*/
+__attribute__((target("sse4.1")))
+static void copyPix16_sse4(uint16_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k+8<=n; k+=8)
+        _mm_storeu_si128((__m128i*)(dst+k), _mm_loadu_si128((const __m128i*)(src+k)));
+    for (; k<n; k++)
+        dst[k] = src[k];
+}
+
+__attribute__((target("sse4.1")))
+static void mirrorPix16_sse4(uint16_t *dst, const uint16_t *src, int n){
+    const __m128i rev = _mm_setr_epi8(14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1);
+    int k;
+    for (k=0; k+8<=n; k+=8)
+        _mm_storeu_si128((__m128i*)(dst+n-8-k),
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+k)), rev));
+    for (; k<n; k++)
+        dst[n-1-k] = src[k];
+}
+
+__attribute__((target("sse4.1")))
+static void mergePix32_sse4(uint32_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k+4<=n; k+=4)
+        _mm_storeu_si128((__m128i*)(dst+k), _mm_loadu_si128((const __m128i*)(src+2*k)));
+    for (; k<n; k++)
+        dst[k] = ((uint32_t)src[2*k+1]<<16) + src[2*k];
+}
+
+__attribute__((target("sse4.1")))
+static void mirrorPix32_sse4(uint32_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k+4<=n; k+=4)
+        _mm_storeu_si128((__m128i*)(dst+n-4-k),
+                         _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(src+2*k)), 0x1B));
+    for (; k<n; k++)
+        dst[n-1-k] = ((uint32_t)src[2*k+1]<<16) + src[2*k];
+}
+
+static const XPCI_SIMD_KERNELS sse4Kernels = {
+    copyPix16_sse4, mirrorPix16_sse4, mergePix32_sse4, mirrorPix32_sse4,
+    gatherMac16_scalar, gatherMac32_scalar
+};
+
+/*============================================================================
+                              AVX2 KERNELS
+ ============================================================================*/
+__attribute__((target("avx2")))
+static void copyPix16_avx2(uint16_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k+16<=n; k+=16)
+        _mm256_storeu_si256((__m256i*)(dst+k), _mm256_loadu_si256((const __m256i*)(src+k)));
+    for (; k<n; k++)
+        dst[k] = src[k];
+}
+
+__attribute__((target("avx2")))
+static void mirrorPix16_avx2(uint16_t *dst, const uint16_t *src, int n){
+    const __m256i rev = _mm256_setr_epi8(14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1,
+                                         14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1);
+    __m256i v;
+    int k;
+    for (k=0; k+16<=n; k+=16){
+        // reverse the words in each 128 bits lane then swap the lanes
+        v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src+k)), rev);
+        _mm256_storeu_si256((__m256i*)(dst+n-16-k), _mm256_permute2x128_si256(v, v, 0x01));
+    }
+    for (; k<n; k++)
+        dst[n-1-k] = src[k];
+}
+
+__attribute__((target("avx2")))
+static void mergePix32_avx2(uint32_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k+8<=n; k+=8)
+        _mm256_storeu_si256((__m256i*)(dst+k), _mm256_loadu_si256((const __m256i*)(src+2*k)));
+    for (; k<n; k++)
+        dst[k] = ((uint32_t)src[2*k+1]<<16) + src[2*k];
+}
+
+__attribute__((target("avx2")))
+static void mirrorPix32_avx2(uint32_t *dst, const uint16_t *src, int n){
+    const __m256i rev = _mm256_setr_epi32(7,6,5,4,3,2,1,0);
+    int k;
+    for (k=0; k+8<=n; k+=8)
+        _mm256_storeu_si256((__m256i*)(dst+n-8-k),
+                            _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(src+2*k)), rev));
+    for (; k<n; k++)
+        dst[n-1-k] = ((uint32_t)src[2*k+1]<<16) + src[2*k];
+}
+
+__attribute__((target("avx2")))
+static void gatherMac16_avx2(float *acc, const float *w, const uint32_t *idx, const uint16_t *src, int n){
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i low = _mm256_set1_epi32(0xffff);
+    __m256i i, v;
+    int k;
+    for (k=0; k+8<=n; k+=8){
+        // the 32 bits word holding the pixel, then its low or high half
+        i = _mm256_loadu_si256((const __m256i*)(idx+k));
+        v = _mm256_i32gather_epi32((const int*)src, _mm256_srli_epi32(i, 1), 4);
+        v = _mm256_and_si256(_mm256_srlv_epi32(v, _mm256_slli_epi32(_mm256_and_si256(i, one), 4)), low);
+        _mm256_storeu_ps(acc+k, _mm256_add_ps(_mm256_loadu_ps(acc+k),
+                                              _mm256_mul_ps(_mm256_loadu_ps(w+k), _mm256_cvtepi32_ps(v))));
+    }
+    for (; k<n; k++)
+        acc[k] += w[k]*src[idx[k]];
+}
+
+__attribute__((target("avx2")))
+static void gatherMac32_avx2(float *acc, const float *w, const uint32_t *idx, const uint32_t *src, int n){
+    const __m256i sign = _mm256_set1_epi32(0x7fffffff);
+    const __m256  big  = _mm256_set1_ps(2147483648.0f);
+    __m256i v;
+    __m256  f;
+    int k;
+    for (k=0; k+8<=n; k+=8){
+        v = _mm256_i32gather_epi32((const int*)src, _mm256_loadu_si256((const __m256i*)(idx+k)), 4);
+        // unsigned counts: the top bit is added back as 2^31
+        f = _mm256_cvtepi32_ps(_mm256_and_si256(v, sign));
+        f = _mm256_add_ps(f, _mm256_and_ps(_mm256_castsi256_ps(_mm256_srai_epi32(v, 31)), big));
+        _mm256_storeu_ps(acc+k, _mm256_add_ps(_mm256_loadu_ps(acc+k), _mm256_mul_ps(_mm256_loadu_ps(w+k), f)));
+    }
+    for (; k<n; k++)
+        acc[k] += w[k]*src[idx[k]];
+}
+
+static const XPCI_SIMD_KERNELS avx2Kernels = {
+    copyPix16_avx2, mirrorPix16_avx2, mergePix32_avx2, mirrorPix32_avx2,
+    gatherMac16_avx2, gatherMac32_avx2
+};
+#endif // XPCI_SIMD_X86
+
+#ifdef XPCI_SIMD_ARM
+/*============================================================================
+                              NEON KERNELS
+ ============================================================================*/
+static void copyPix16_neon(uint16_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k+8<=n; k+=8)
+        vst1q_u16(dst+k, vld1q_u16(src+k));
+    for (; k<n; k++)
+        dst[k] = src[k];
+}
+
+static void mirrorPix16_neon(uint16_t *dst, const uint16_t *src, int n){
+    uint16x8_t v;
+    int k;
+    for (k=0; k+8<=n; k+=8){
+        v = vrev64q_u16(vld1q_u16(src+k));
+        vst1q_u16(dst+n-8-k, vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+    }
+    for (; k<n; k++)
+        dst[n-1-k] = src[k];
+}
+
+static void mergePix32_neon(uint32_t *dst, const uint16_t *src, int n){
+    int k;
+    for (k=0; k+4<=n; k+=4)
+        vst1q_u32(dst+k, vreinterpretq_u32_u16(vld1q_u16(src+2*k)));
+    for (; k<n; k++)
+        dst[k] = ((uint32_t)src[2*k+1]<<16) + src[2*k];
+}
+
+static void mirrorPix32_neon(uint32_t *dst, const uint16_t *src, int n){
+    uint32x4_t v;
+    int k;
+    for (k=0; k+4<=n; k+=4){
+        v = vrev64q_u32(vreinterpretq_u32_u16(vld1q_u16(src+2*k)));
+        vst1q_u32(dst+n-4-k, vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+    }
+    for (; k<n; k++)
+        dst[n-1-k] = ((uint32_t)src[2*k+1]<<16) + src[2*k];
+}
+
+static const XPCI_SIMD_KERNELS neonKernels = {
+    copyPix16_neon, mirrorPix16_neon, mergePix32_neon, mirrorPix32_neon,
+    gatherMac16_scalar, gatherMac32_scalar
+};
+#endif // XPCI_SIMD_ARM
+
+/*============================================================================
+                              KERNEL SELECTION
+ ============================================================================*/
+static const XPCI_SIMD_KERNELS *kernels = NULL;
+static int                      simdLevel = XPCI_SIMD_SCALAR;
+
+int xpci_simdSupported(int level){
+    switch(level){
+    case XPCI_SIMD_SCALAR:
+        return 1;
+#ifdef XPCI_SIMD_X86
+    case XPCI_SIMD_SSE4:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.1");
+    case XPCI_SIMD_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+#ifdef XPCI_SIMD_ARM
+    case XPCI_SIMD_NEON:
+        return 1;
+#endif
+    }
+    return 0;
+}
+
+/**************************************************************
+ * Selects the kernels used by the line decoders.
+ * level      : XPCI_SIMD_xxx or XPCI_SIMD_BEST
+ * returns    : the level applied  -1 not supported by the CPU
+ ***************************************************************/
+int xpci_simdSetLevel(int level){
+    if (level == XPCI_SIMD_BEST){
+        if (xpci_simdSupported(XPCI_SIMD_AVX2))
+            level = XPCI_SIMD_AVX2;
+        else if (xpci_simdSupported(XPCI_SIMD_SSE4))
+            level = XPCI_SIMD_SSE4;
+        else if (xpci_simdSupported(XPCI_SIMD_NEON))
+            level = XPCI_SIMD_NEON;
+        else
+            level = XPCI_SIMD_SCALAR;
+    }
+    if (!xpci_simdSupported(level)){
+        printf("ERROR: %s() %s kernels not supported by this CPU\n", __func__, xpci_simdLevelName(level));
+        return -1;
+    }
+    switch(level){
+#ifdef XPCI_SIMD_X86
+    case XPCI_SIMD_SSE4: kernels = &sse4Kernels; break;
+    case XPCI_SIMD_AVX2: kernels = &avx2Kernels; break;
+#endif
+#ifdef XPCI_SIMD_ARM
+    case XPCI_SIMD_NEON: kernels = &neonKernels; break;
+#endif
+    default:             kernels = &scalarKernels; break;
+    }
+    simdLevel = level;
+    return level;
+}
+
+int xpci_simdGetLevel(){
+    if (kernels == NULL)
+        xpci_simdSetLevel(XPCI_SIMD_BEST);
+    return simdLevel;
+}
+
+const char *xpci_simdLevelName(int level){
+    switch(level){
+    case XPCI_SIMD_SCALAR: return "scalar";
+    case XPCI_SIMD_SSE4:   return "SSE4.1";
+    case XPCI_SIMD_AVX2:   return "AVX2";
+    case XPCI_SIMD_NEON:   return "NEON";
+    }
+    return "unknown";
+}
+
+void xpci_copyPix16(uint16_t *dst, const uint16_t *src, int n){
+    if (kernels == NULL)
+        xpci_simdSetLevel(XPCI_SIMD_BEST);
+    kernels->copy16(dst, src, n);
+}
+
+void xpci_mirrorPix16(uint16_t *dst, const uint16_t *src, int n){
+    if (kernels == NULL)
+        xpci_simdSetLevel(XPCI_SIMD_BEST);
+    kernels->mirror16(dst, src, n);
+}
+
+void xpci_mergePix32(uint32_t *dst, const uint16_t *src, int n){
+    if (kernels == NULL)
+        xpci_simdSetLevel(XPCI_SIMD_BEST);
+    kernels->merge32(dst, src, n);
+}
+
+void xpci_mirrorPix32(uint32_t *dst, const uint16_t *src, int n){
+    if (kernels == NULL)
+        xpci_simdSetLevel(XPCI_SIMD_BEST);
+    kernels->mirror32(dst, src, n);
+}
+
+void xpci_gatherMac16(float *acc, const float *w, const uint32_t *idx, const uint16_t *src, int n){
+    if (kernels == NULL)
+        xpci_simdSetLevel(XPCI_SIMD_BEST);
+    kernels->gather16(acc, w, idx, src, n);
+}
+
+void xpci_gatherMac32(float *acc, const float *w, const uint32_t *idx, const uint32_t *src, int n){
+    if (kernels == NULL)
+        xpci_simdSetLevel(XPCI_SIMD_BEST);
+    kernels->gather32(acc, w, idx, src, n);
+}
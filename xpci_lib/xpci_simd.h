@@ -0,0 +1,43 @@
+/*******************************************************
+                       xpci_simd.h
+
+ Vector kernels used to decode the raw image lines and
+ to apply the geometrical correction.
+ The kernel set is selected at run time from the CPU
+ features (see xpci_simdSetLevel()).
+*******************************************************/
+#ifndef XPCI_SIMD
+#define XPCI_SIMD
+
+#include <stdint.h>
+
+/* kernel sets */
+#define XPCI_SIMD_BEST     -1  // best set supported by the CPU
+#define XPCI_SIMD_SCALAR    0
+#define XPCI_SIMD_SSE4      1
+#define XPCI_SIMD_AVX2      2
+#define XPCI_SIMD_NEON      3
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+int         xpci_simdSupported(int level);
+int         xpci_simdSetLevel(int level);
+int         xpci_simdGetLevel();
+const char *xpci_simdLevelName(int level);
+
+/* dst[k] = src[k] */
+void        xpci_copyPix16(uint16_t *dst, const uint16_t *src, int n);
+/* dst[n-1-k] = src[k] */
+void        xpci_mirrorPix16(uint16_t *dst, const uint16_t *src, int n);
+/* dst[k] = (src[2k+1]<<16) + src[2k] */
+void        xpci_mergePix32(uint32_t *dst, const uint16_t *src, int n);
+/* dst[n-1-k] = (src[2k+1]<<16) + src[2k] */
+void        xpci_mirrorPix32(uint32_t *dst, const uint16_t *src, int n);
+/* acc[k] += w[k]*src[idx[k]], src holds an even number of pixels (read by 32 bits words) */
+void        xpci_gatherMac16(float *acc, const float *w, const uint32_t *idx, const uint16_t *src, int n);
+void        xpci_gatherMac32(float *acc, const float *w, const uint32_t *idx, const uint32_t *src, int n);
+#ifdef __cplusplus
+}
+#endif
+#endif
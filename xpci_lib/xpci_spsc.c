@@ -0,0 +1,180 @@
+/*******************************************************
+                       xpci_spsc.c
+
+ Single producer / single consumer ring of buffer
+ indexes, see xpci_spsc.h.
+ Each side only writes its own position: the producer
+ stores head with release ordering after filling the
+ slot, the consumer loads it with acquire ordering
+ before reading the slot (and the other way round for
+ tail). A side about to sleep counts itself in
+ 'waiting' so that the other one signals the condition
+ only when needed.
+*******************************************************/
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+
+#include "xpci_spsc.h"
+#include "xpci_time.h"
+
+#define XPCI_SPSC_SPINS   256   // polls before sleeping or yielding
+
+int xpci_spscInit(XPCI_SPSC *ring, unsigned capacity, int flags){
+    pthread_condattr_t attr;
+
+    if (capacity==0){
+        printf("ERROR: %s() ---> empty ring.\n", __func__);
+        return -1;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->capacity = capacity;
+    ring->flags = flags;
+    ring->stats.capacity = capacity;
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ring->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+void xpci_spscDestroy(XPCI_SPSC *ring){
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->lock);
+}
+
+void xpci_spscClose(XPCI_SPSC *ring){
+    pthread_mutex_lock(&ring->lock);
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* producer side */
+static int xpci_spscFreeSlots(XPCI_SPSC *ring){
+    unsigned tail;
+
+    if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+        return -1;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return ring->capacity - (ring->head - tail);
+}
+
+/* consumer side */
+static int xpci_spscFullSlots(XPCI_SPSC *ring){
+    int      closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+    unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head==ring->tail)
+        return closed ? -1 : 0;
+    return head - ring->tail;
+}
+
+/* signal the other side if it sleeps, pairs with the fence in xpci_spscWait() */
+static void xpci_spscWake(XPCI_SPSC *ring){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED)){
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+static int xpci_spscWait(XPCI_SPSC *ring, int (*check)(XPCI_SPSC*), int timeoutMs,
+                         unsigned long long *stallNs){
+    unsigned long long  t0, deadline;
+    struct timespec     ts;
+    int                 n, i;
+
+    if ((n = check(ring))!=0 || timeoutMs==0)
+        return n;
+
+    t0 = xpci_timeNs();
+    deadline = t0 + (unsigned long long)timeoutMs*1000000;
+    for (i=0; i<XPCI_SPSC_SPINS && (n = check(ring))==0; i++)
+        ;
+
+    if (n==0 && (ring->flags & XPCI_SPSC_SLEEP)){
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec  += timeoutMs/1000;
+        ts.tv_nsec += (timeoutMs%1000)*1000000L;
+        if (ts.tv_nsec>=1000000000L){
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&ring->lock);
+        __atomic_add_fetch(&ring->waiting, 1, __ATOMIC_RELAXED);
+        for (;;){
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if ((n = check(ring))!=0)
+                break;
+            if (timeoutMs<0)
+                pthread_cond_wait(&ring->cond, &ring->lock);
+            else if (pthread_cond_timedwait(&ring->cond, &ring->lock, &ts)==ETIMEDOUT){
+                n = check(ring);
+                break;
+            }
+        }
+        __atomic_sub_fetch(&ring->waiting, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    else{
+        while (n==0 && (timeoutMs<0 || xpci_timeNs()<deadline)){
+            sched_yield();
+            n = check(ring);
+        }
+    }
+
+    *stallNs += xpci_timeNs() - t0;
+    return n;
+}
+
+int xpci_spscWaitFree(XPCI_SPSC *ring, int timeoutMs){
+    int n;
+
+    if (ring->flags & XPCI_SPSC_DROP){
+        n = xpci_spscFreeSlots(ring);
+        if (n==0)
+            ring->stats.dropped++;
+        return n;
+    }
+    return xpci_spscWait(ring, xpci_spscFreeSlots, timeoutMs, &ring->stats.producerStallNs);
+}
+
+void xpci_spscPublish(XPCI_SPSC *ring, unsigned nb){
+    unsigned head = ring->head + nb;
+    unsigned fill = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (fill>ring->stats.highWater)
+        ring->stats.highWater = fill;
+    ring->stats.produced += nb;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    xpci_spscWake(ring);
+}
+
+int xpci_spscWaitFull(XPCI_SPSC *ring, int timeoutMs){
+    return xpci_spscWait(ring, xpci_spscFullSlots, timeoutMs, &ring->stats.consumerStallNs);
+}
+
+void xpci_spscRelease(XPCI_SPSC *ring, unsigned nb){
+    ring->stats.consumed += nb;
+    __atomic_store_n(&ring->tail, ring->tail + nb, __ATOMIC_RELEASE);
+    xpci_spscWake(ring);
+}
+
+unsigned xpci_spscWritePos(XPCI_SPSC *ring){
+    return ring->head;
+}
+
+unsigned xpci_spscReadPos(XPCI_SPSC *ring){
+    return ring->tail;
+}
+
+void xpci_spscGetStats(XPCI_SPSC *ring, XPCI_SPSC_STATS *stats){
+    *stats = ring->stats;
+}
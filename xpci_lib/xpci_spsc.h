@@ -0,0 +1,66 @@
+/*******************************************************
+                       xpci_spsc.h
+
+ Single producer / single consumer ring of buffer
+ indexes. The buffers themselves belong to the caller:
+ the producer fills slot xpci_spscWritePos()%capacity
+ then publishes it, the consumer reads from slot
+ xpci_spscReadPos()%capacity then releases it.
+ Positions are exchanged with acquire/release ordering,
+ waits either spin or sleep (XPCI_SPSC_SLEEP).
+*******************************************************/
+#ifndef XPCI_SPSC_RING
+#define XPCI_SPSC_RING
+
+#include <pthread.h>
+
+/* flags */
+#define XPCI_SPSC_SLEEP   0x1   // sleep on a condition instead of spinning when empty/full
+#define XPCI_SPSC_DROP    0x2   // producer never waits: a full ring drops the frame
+
+typedef struct {
+    unsigned            capacity;
+    unsigned            highWater;       // max frames held by the ring
+    unsigned long long  produced;        // frames published
+    unsigned long long  consumed;        // frames released
+    unsigned long long  dropped;         // frames refused by a full ring (XPCI_SPSC_DROP)
+    unsigned long long  producerStallNs; // producer waiting for a free slot (backpressure)
+    unsigned long long  consumerStallNs; // consumer waiting for a frame
+} XPCI_SPSC_STATS;
+
+typedef struct {
+    unsigned           capacity;
+    int                flags;
+    unsigned           head;             // frames published, written by the producer
+    unsigned           tail;             // frames released, written by the consumer
+    int                closed;
+    int                waiting;          // sides sleeping on cond
+    pthread_mutex_t    lock;
+    pthread_cond_t     cond;
+    XPCI_SPSC_STATS    stats;
+} XPCI_SPSC;
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+int       xpci_spscInit(XPCI_SPSC *ring, unsigned capacity, int flags);
+void      xpci_spscDestroy(XPCI_SPSC *ring);
+/* no more frames: wakes both sides */
+void      xpci_spscClose(XPCI_SPSC *ring);
+
+/* timeoutMs: 0 no wait, -1 forever.
+   xpci_spscWaitFree()  : free slots, 0 on timeout (or drop), -1 once closed
+   xpci_spscWaitFull()  : frames published and not released, 0 on timeout,
+                          -1 once closed and drained */
+int       xpci_spscWaitFree(XPCI_SPSC *ring, int timeoutMs);
+void      xpci_spscPublish(XPCI_SPSC *ring, unsigned nb);
+int       xpci_spscWaitFull(XPCI_SPSC *ring, int timeoutMs);
+void      xpci_spscRelease(XPCI_SPSC *ring, unsigned nb);
+
+unsigned  xpci_spscWritePos(XPCI_SPSC *ring);
+unsigned  xpci_spscReadPos(XPCI_SPSC *ring);
+void      xpci_spscGetStats(XPCI_SPSC *ring, XPCI_SPSC_STATS *stats);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,445 @@
+/*******************************************************
+                       xpci_stack.c
+
+ Frame stack file, see xpci_stack.h for the layout.
+ The writer only appends: the frames are gathered in a
+ chunk buffer and a full chunk is (optionally) encoded
+ and written in one go, so that the acquisition loop
+ never seeks nor rewrites the file. The index and the
+ trailer are appended when the stack is closed.
+ The reader keeps the last chunk it decoded so that
+ frames read in order decode each chunk once.
+*******************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "xpci_stack.h"
+#include "xpci_codec.h"
+
+struct XPCI_STACK {
+    int                fd;
+    int                writer;
+    int                complete;    // reader: index and trailer found
+    XPCI_STACK_HEADER  hdr;
+    uint64_t           end;         // end of the last chunk
+    unsigned           nbFrames;
+    XPCI_STACK_INDEX  *index;
+    unsigned           nbChunks;
+    unsigned           maxChunks;
+    uint64_t          *stamps;      // frames timestamps of the chunk buffer
+    uint8_t           *frames;      // frames of the chunk buffer
+    unsigned           pending;     // writer: frames in the chunk buffer
+    int                failed;      // writer: a chunk could not be written, no more frame
+    uint8_t           *stored;      // bytes of a chunk as in the file
+    unsigned           storedCap;
+    int                cached;      // reader: chunk held by stamps/frames, -1 none
+};
+
+static uint64_t xpci_stackNow(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int xpci_stackWriteAll(XPCI_STACK *stack, const void *data, size_t size){
+    const uint8_t *p = data;
+    ssize_t        n;
+
+    while (size>0){
+        n = write(stack->fd, p, size);
+        if (n<0 && errno==EINTR)
+            continue;
+        if (n<=0){
+            printf("ERROR: %s() ---> write failed: %s\n", __func__, strerror(errno));
+            return -1;
+        }
+        p += n;
+        size -= n;
+        stack->end += n;
+    }
+    return 0;
+}
+
+static int xpci_stackReadAll(XPCI_STACK *stack, void *data, size_t size, uint64_t offset){
+    uint8_t  *p = data;
+    ssize_t   n;
+
+    while (size>0){
+        n = pread(stack->fd, p, size, offset);
+        if (n<0 && errno==EINTR)
+            continue;
+        if (n<=0)
+            return -1;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int xpci_stackAddChunk(XPCI_STACK *stack, uint64_t offset, unsigned nbFrames){
+    XPCI_STACK_INDEX  *index;
+
+    if (stack->nbChunks==stack->maxChunks){
+        index = realloc(stack->index, (stack->maxChunks ? 2*stack->maxChunks : 64)*sizeof(*index));
+        if (index==NULL){
+            printf("ERROR: %s() ---> can not grow the chunk index.\n", __func__);
+            return -1;
+        }
+        stack->index = index;
+        stack->maxChunks = stack->maxChunks ? 2*stack->maxChunks : 64;
+    }
+    stack->index[stack->nbChunks].offset     = offset;
+    stack->index[stack->nbChunks].firstFrame = stack->nbFrames;
+    stack->index[stack->nbChunks].nbFrames   = nbFrames;
+    stack->nbChunks++;
+    stack->nbFrames += nbFrames;
+    return 0;
+}
+
+/* buffers of a chunk of framesPerChunk frames */
+static int xpci_stackAllocChunk(XPCI_STACK *stack){
+    unsigned long long  rawSize = (unsigned long long)stack->hdr.frameSize*stack->hdr.framesPerChunk;
+
+    if (rawSize>0xffffffffULL - 64*1024){
+        printf("ERROR: %s() ---> chunks of %u frames of %u bytes are too large.\n",
+               __func__, stack->hdr.framesPerChunk, stack->hdr.frameSize);
+        return -1;
+    }
+    stack->storedCap = stack->hdr.framesPerChunk*sizeof(uint64_t) + xpci_codecBound(rawSize);
+    stack->stamps = malloc(stack->hdr.framesPerChunk*sizeof(uint64_t));
+    stack->frames = malloc(rawSize);
+    stack->stored = malloc(stack->storedCap);
+    if (stack->stamps==NULL || stack->frames==NULL || stack->stored==NULL){
+        printf("ERROR: %s() ---> can not allocate the chunk buffers.\n", __func__);
+        return -1;
+    }
+    return 0;
+}
+
+static void xpci_stackFree(XPCI_STACK *stack){
+    if (stack->fd>=0)
+        close(stack->fd);
+    free(stack->index);
+    free(stack->stamps);
+    free(stack->frames);
+    free(stack->stored);
+    free(stack);
+}
+
+// *******************************************************************************
+// writer
+// *******************************************************************************
+XPCI_STACK *xpci_stackCreate(const char *fname, const XPCI_STACK_HEADER *hdr){
+    XPCI_STACK  *stack;
+
+    if (hdr->frameSize==0 || hdr->framesPerChunk==0){
+        printf("ERROR: %s() ---> %u frames of %u bytes per chunk.\n", __func__, hdr->framesPerChunk, hdr->frameSize);
+        return NULL;
+    }
+    if (hdr->codec!=XPCI_CODEC_NONE && hdr->codec!=XPCI_CODEC_SPARSE && hdr->codec!=XPCI_CODEC_BITPLANE){
+        printf("ERROR: %s() ---> unknown codec %u.\n", __func__, hdr->codec);
+        return NULL;
+    }
+    stack = calloc(1, sizeof(*stack));
+    if (stack==NULL){
+        printf("ERROR: %s() ---> can not allocate the stack.\n", __func__);
+        return NULL;
+    }
+    stack->writer = 1;
+    stack->cached = -1;
+    stack->hdr = *hdr;
+    memcpy(stack->hdr.magic, XPCI_STACK_MAGIC, sizeof(stack->hdr.magic));
+    stack->hdr.version     = XPCI_STACK_VERSION;
+    stack->hdr.headerSize  = sizeof(XPCI_STACK_HEADER);
+    stack->hdr.startTimeNs = xpci_stackNow();
+
+    stack->fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (stack->fd<0){
+        printf("ERROR: %s() ---> can not create %s: %s\n", __func__, fname, strerror(errno));
+        xpci_stackFree(stack);
+        return NULL;
+    }
+    if (xpci_stackAllocChunk(stack) || xpci_stackWriteAll(stack, &stack->hdr, sizeof(stack->hdr))){
+        xpci_stackFree(stack);
+        unlink(fname);
+        return NULL;
+    }
+    return stack;
+}
+
+int xpci_stackFlush(XPCI_STACK *stack){
+    XPCI_STACK_CHUNK   chunk;
+    XPCI_CODEC_FRAME   coded;
+    const void        *data = stack->frames;
+    uint64_t           offset = stack->end;
+    unsigned           stampSize = stack->pending*sizeof(uint64_t);
+    int                size;
+
+    if (!stack->writer || stack->pending==0)
+        return 0;
+    if (stack->failed)
+        return -1;
+
+    chunk.magic      = XPCI_STACK_CHUNK_MAGIC;
+    chunk.codec      = XPCI_CODEC_NONE;
+    chunk.firstFrame = stack->nbFrames;
+    chunk.nbFrames   = stack->pending;
+    chunk.rawSize    = stack->pending*stack->hdr.frameSize;
+    size = chunk.rawSize;
+    if (stack->hdr.codec!=XPCI_CODEC_NONE){
+        size = xpci_codecEncode(stack->hdr.codec, stack->frames, chunk.rawSize,
+                                stack->stored, stack->storedCap);
+        if (size<0){
+            stack->failed = 1;
+            return -1;
+        }
+        memcpy(&coded, stack->stored, sizeof(coded));
+        if (coded.codec!=XPCI_CODEC_NONE){
+            // chunk stored as a xpci_codec frame, header included
+            chunk.codec = coded.codec;
+            data = stack->stored;
+        }
+        else
+            size = chunk.rawSize;
+    }
+    chunk.storedSize = stampSize + size;
+
+    if (xpci_stackWriteAll(stack, &chunk, sizeof(chunk))
+        || xpci_stackWriteAll(stack, stack->stamps, stampSize)
+        || xpci_stackWriteAll(stack, data, size)
+        || xpci_stackAddChunk(stack, offset, stack->pending)){
+        // the chunk buffer stays full and the file is cut in the middle of a chunk
+        stack->failed = 1;
+        return -1;
+    }
+    stack->pending = 0;
+    return 0;
+}
+
+int xpci_stackAppend(XPCI_STACK *stack, const void *frame, uint64_t timestampNs){
+    if (!stack->writer){
+        printf("ERROR: %s() ---> stack opened for reading.\n", __func__);
+        return -1;
+    }
+    if (stack->failed){
+        printf("ERROR: %s() ---> a previous chunk could not be written.\n", __func__);
+        return -1;
+    }
+    memcpy(stack->frames + (size_t)stack->pending*stack->hdr.frameSize, frame, stack->hdr.frameSize);
+    stack->stamps[stack->pending] = timestampNs ? timestampNs : xpci_stackNow();
+    stack->pending++;
+    if (stack->pending==stack->hdr.framesPerChunk)
+        return xpci_stackFlush(stack);
+    return 0;
+}
+
+// *******************************************************************************
+// reader
+// *******************************************************************************
+
+/* index and trailer of a closed stack, 0 if found */
+static int xpci_stackReadIndex(XPCI_STACK *stack, uint64_t fileSize){
+    XPCI_STACK_TRAILER  trailer;
+    unsigned            k, nbFrames = 0;
+
+    if (fileSize<stack->hdr.headerSize + sizeof(trailer)
+        || xpci_stackReadAll(stack, &trailer, sizeof(trailer), fileSize - sizeof(trailer))
+        || memcmp(trailer.magic, XPCI_STACK_END_MAGIC, sizeof(trailer.magic))
+        || trailer.indexOffset + (uint64_t)trailer.nbChunks*sizeof(XPCI_STACK_INDEX) != fileSize - sizeof(trailer))
+        return -1;
+    stack->index = malloc((trailer.nbChunks ? trailer.nbChunks : 1)*sizeof(XPCI_STACK_INDEX));
+    if (stack->index==NULL
+        || xpci_stackReadAll(stack, stack->index, trailer.nbChunks*sizeof(XPCI_STACK_INDEX), trailer.indexOffset))
+        return -1;
+    for (k=0; k<trailer.nbChunks; k++){
+        if (stack->index[k].firstFrame!=nbFrames || stack->index[k].nbFrames>stack->hdr.framesPerChunk)
+            return -1;
+        nbFrames += stack->index[k].nbFrames;
+    }
+    if (nbFrames!=trailer.nbFrames)
+        return -1;
+    stack->nbChunks = stack->maxChunks = trailer.nbChunks;
+    stack->nbFrames = nbFrames;
+    stack->end = trailer.indexOffset;
+    stack->complete = 1;
+    return 0;
+}
+
+XPCI_STACK *xpci_stackOpen(const char *fname){
+    XPCI_STACK  *stack;
+    struct stat  st;
+
+    stack = calloc(1, sizeof(*stack));
+    if (stack==NULL){
+        printf("ERROR: %s() ---> can not allocate the stack.\n", __func__);
+        return NULL;
+    }
+    stack->cached = -1;
+    stack->fd = open(fname, O_RDONLY);
+    if (stack->fd<0){
+        printf("ERROR: %s() ---> can not open %s: %s\n", __func__, fname, strerror(errno));
+        xpci_stackFree(stack);
+        return NULL;
+    }
+    if (xpci_stackReadAll(stack, &stack->hdr, sizeof(stack->hdr), 0)
+        || memcmp(stack->hdr.magic, XPCI_STACK_MAGIC, sizeof(stack->hdr.magic))
+        || stack->hdr.headerSize<sizeof(stack->hdr)
+        || stack->hdr.frameSize==0 || stack->hdr.framesPerChunk==0){
+        printf("ERROR: %s() ---> %s is not a frame stack.\n", __func__, fname);
+        xpci_stackFree(stack);
+        return NULL;
+    }
+    if (stack->hdr.version>XPCI_STACK_VERSION){
+        printf("ERROR: %s() ---> %s has the unknown version %u.\n", __func__, fname, stack->hdr.version);
+        xpci_stackFree(stack);
+        return NULL;
+    }
+    if (xpci_stackAllocChunk(stack) || fstat(stack->fd, &st)){
+        xpci_stackFree(stack);
+        return NULL;
+    }
+
+    if (xpci_stackReadIndex(stack, st.st_size)){
+        // still being written or not closed: walk the chunks
+        free(stack->index);
+        stack->index = NULL;
+        stack->nbChunks = stack->maxChunks = 0;
+        stack->nbFrames = 0;
+        stack->end = stack->hdr.headerSize;
+        if (xpci_stackUpdate(stack)<0){
+            xpci_stackFree(stack);
+            return NULL;
+        }
+    }
+    return stack;
+}
+
+int xpci_stackUpdate(XPCI_STACK *stack){
+    XPCI_STACK_CHUNK  chunk;
+    struct stat       st;
+
+    if (stack->writer || stack->complete)
+        return stack->nbFrames;
+    if (fstat(stack->fd, &st))
+        return -1;
+    while (stack->end + sizeof(chunk)<=(uint64_t)st.st_size){
+        if (xpci_stackReadAll(stack, &chunk, sizeof(chunk), stack->end)
+            || chunk.magic!=XPCI_STACK_CHUNK_MAGIC
+            || stack->end + sizeof(chunk) + chunk.storedSize>(uint64_t)st.st_size)
+            break;      // index of a closed stack or chunk not fully written yet
+        if (chunk.firstFrame!=stack->nbFrames || chunk.nbFrames==0
+            || chunk.nbFrames>stack->hdr.framesPerChunk
+            || chunk.rawSize!=chunk.nbFrames*stack->hdr.frameSize){
+            printf("ERROR: %s() ---> corrupted chunk at offset %llu.\n", __func__, (unsigned long long)stack->end);
+            break;
+        }
+        if (xpci_stackAddChunk(stack, stack->end, chunk.nbFrames))
+            return -1;
+        stack->end += sizeof(chunk) + chunk.storedSize;
+    }
+    return stack->nbFrames;
+}
+
+const XPCI_STACK_HEADER *xpci_stackHeader(XPCI_STACK *stack){
+    return &stack->hdr;
+}
+
+unsigned xpci_stackNbFrames(XPCI_STACK *stack){
+    return stack->nbFrames;
+}
+
+/* chunk k in stamps/frames */
+static int xpci_stackLoadChunk(XPCI_STACK *stack, unsigned k){
+    XPCI_STACK_CHUNK  chunk;
+    unsigned          stampSize;
+
+    if (stack->cached==(int)k)
+        return 0;
+    stack->cached = -1;
+    if (xpci_stackReadAll(stack, &chunk, sizeof(chunk), stack->index[k].offset)
+        || chunk.magic!=XPCI_STACK_CHUNK_MAGIC
+        || chunk.nbFrames!=stack->index[k].nbFrames
+        || chunk.rawSize!=chunk.nbFrames*stack->hdr.frameSize
+        || chunk.storedSize>stack->storedCap)
+        goto corrupted;
+    stampSize = chunk.nbFrames*sizeof(uint64_t);
+    if (chunk.storedSize<stampSize
+        || xpci_stackReadAll(stack, stack->stored, chunk.storedSize, stack->index[k].offset + sizeof(chunk)))
+        goto corrupted;
+    memcpy(stack->stamps, stack->stored, stampSize);
+    if (chunk.codec==XPCI_CODEC_NONE){
+        if (chunk.storedSize - stampSize!=chunk.rawSize)
+            goto corrupted;
+        memcpy(stack->frames, stack->stored + stampSize, chunk.rawSize);
+    }
+    else if (xpci_codecDecode(stack->stored + stampSize, chunk.storedSize - stampSize,
+                              stack->frames, chunk.rawSize))
+        goto corrupted;
+    stack->cached = k;
+    return 0;
+
+corrupted:
+    printf("ERROR: %s() ---> chunk %u can not be read.\n", __func__, k);
+    return -1;
+}
+
+int xpci_stackReadFrame(XPCI_STACK *stack, unsigned frame, void *data, uint64_t *timestampNs){
+    unsigned  lo = 0, hi = stack->nbChunks, k;
+
+    if (stack->writer || frame>=stack->nbFrames){
+        printf("ERROR: %s() ---> frame %u not in the stack (%u frames).\n", __func__, frame, stack->nbFrames);
+        return -1;
+    }
+    // last chunk starting at or before the frame
+    while (hi - lo>1){
+        k = (lo + hi)/2;
+        if (stack->index[k].firstFrame<=frame)
+            lo = k;
+        else
+            hi = k;
+    }
+    if (xpci_stackLoadChunk(stack, lo))
+        return -1;
+    frame -= stack->index[lo].firstFrame;
+    memcpy(data, stack->frames + (size_t)frame*stack->hdr.frameSize, stack->hdr.frameSize);
+    if (timestampNs!=NULL)
+        *timestampNs = stack->stamps[frame];
+    return 0;
+}
+
+// *******************************************************************************
+int xpci_stackClose(XPCI_STACK *stack){
+    XPCI_STACK_TRAILER  trailer;
+    int                 ret = 0;
+
+    if (stack->writer){
+        memset(&trailer, 0, sizeof(trailer));
+        ret = xpci_stackFlush(stack);
+        trailer.indexOffset = stack->end;
+        trailer.nbChunks    = stack->nbChunks;
+        trailer.nbFrames    = stack->nbFrames;
+        trailer.stopTimeNs  = xpci_stackNow();
+        memcpy(trailer.magic, XPCI_STACK_END_MAGIC, sizeof(trailer.magic));
+        if (ret==0)
+            ret = xpci_stackWriteAll(stack, stack->index, stack->nbChunks*sizeof(XPCI_STACK_INDEX));
+        if (ret==0)
+            ret = xpci_stackWriteAll(stack, &trailer, sizeof(trailer));
+        if (close(stack->fd)){
+            printf("ERROR: %s() ---> close failed: %s\n", __func__, strerror(errno));
+            ret = -1;
+        }
+        stack->fd = -1;
+    }
+    xpci_stackFree(stack);
+    return ret;
+}
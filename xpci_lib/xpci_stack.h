@@ -0,0 +1,120 @@
+/*******************************************************
+                       xpci_stack.h
+
+ Frame stack file: a self-describing, append-only file
+ holding a sequence of frames of the same size, readable
+ with no other knowledge of the detector than this
+ header. All the fields are little endian.
+
+   [header][chunk 0][chunk 1]...[index][trailer]
+
+ The header (XPCI_STACK_HEADER, headerSize bytes) gives
+ the detector, the frame geometry, the exposure
+ parameters and the start time of the stack.
+ A chunk holds framesPerChunk frames (fewer for the last
+ one or after xpci_stackFlush()):
+
+   [XPCI_STACK_CHUNK][nbFrames uint64 timestamps][frames]
+
+ the frames being stored as is (XPCI_CODEC_NONE) or as
+ one frame of xpci_codec.h (XPCI_CODEC_FRAME header then
+ the encoded bytes of the nbFrames*frameSize block).
+ The index (nbChunks XPCI_STACK_INDEX) and the trailer
+ (XPCI_STACK_TRAILER, last bytes of the file) are only
+ written when the stack is closed: a stack still being
+ written, or cut short, is read by walking its chunks.
+*******************************************************/
+#ifndef XPCI_STACK_FILE
+#define XPCI_STACK_FILE
+
+#include <stdint.h>
+
+#define XPCI_STACK_MAGIC        "XPADSTK1"
+#define XPCI_STACK_END_MAGIC    "XPADSTKE"
+#define XPCI_STACK_CHUNK_MAGIC  0x4b435358   // "XSCK"
+#define XPCI_STACK_VERSION      1
+
+/* frame layouts */
+#define XPCI_STACK_RAW          0   // raw frame as read out (lines with their headers)
+#define XPCI_STACK_IMAGE        1   // decoded image, width pixels per row
+
+typedef struct {
+    uint32_t  Texp;
+    uint32_t  Twait;
+    uint32_t  Tinit;
+    uint32_t  Tshutter;
+    uint32_t  Tovf;
+    uint32_t  mode;
+    uint32_t  nbImages;
+    uint32_t  acqMode;
+} XPCI_STACK_EXPOSURE;
+
+typedef struct {
+    char                 magic[8];
+    uint32_t             version;
+    uint32_t             headerSize;
+    uint32_t             detectorType;   // IMXPAD_Sxxx
+    uint32_t             modMask;
+    uint32_t             imgType;        // enum IMG_TYPE: 0 B2, 1 B4
+    uint32_t             layout;         // XPCI_STACK_RAW or XPCI_STACK_IMAGE
+    uint32_t             width;          // pixels (words for a raw frame) per row
+    uint32_t             height;         // rows
+    uint32_t             bytesPerPixel;
+    uint32_t             frameSize;      // bytes of a frame
+    uint32_t             framesPerChunk;
+    uint32_t             codec;          // XPCI_CODEC_xxx asked for the chunks
+    XPCI_STACK_EXPOSURE  exposure;
+    uint64_t             startTimeNs;    // CLOCK_REALTIME when the stack was created
+    uint32_t             reserved[16];
+} XPCI_STACK_HEADER;
+
+typedef struct {
+    uint32_t  magic;        // XPCI_STACK_CHUNK_MAGIC
+    uint32_t  codec;        // XPCI_CODEC_xxx of the frames of this chunk
+    uint32_t  firstFrame;
+    uint32_t  nbFrames;
+    uint32_t  rawSize;      // bytes of the frames once decoded
+    uint32_t  storedSize;   // bytes following the chunk header (timestamps included)
+} XPCI_STACK_CHUNK;
+
+typedef struct {
+    uint64_t  offset;       // position of the XPCI_STACK_CHUNK
+    uint32_t  firstFrame;
+    uint32_t  nbFrames;
+} XPCI_STACK_INDEX;
+
+typedef struct {
+    uint64_t  indexOffset;
+    uint32_t  nbChunks;
+    uint32_t  nbFrames;
+    uint64_t  stopTimeNs;   // CLOCK_REALTIME when the stack was closed
+    char      magic[8];     // XPCI_STACK_END_MAGIC
+} XPCI_STACK_TRAILER;
+
+typedef struct XPCI_STACK XPCI_STACK;
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+/* writer: magic, version, headerSize and startTimeNs of hdr are filled in */
+XPCI_STACK *xpci_stackCreate(const char *fname, const XPCI_STACK_HEADER *hdr);
+/* timestampNs=0: time of the call. Once a chunk could not be written the frames
+   are refused (-1) and xpci_stackClose() fails */
+int         xpci_stackAppend(XPCI_STACK *stack, const void *frame, uint64_t timestampNs);
+/* writes the frames appended so far as a (short) chunk */
+int         xpci_stackFlush(XPCI_STACK *stack);
+
+/* reader */
+XPCI_STACK *xpci_stackOpen(const char *fname);
+/* picks up the chunks appended since the stack was opened, returns the nb of frames */
+int         xpci_stackUpdate(XPCI_STACK *stack);
+const XPCI_STACK_HEADER *xpci_stackHeader(XPCI_STACK *stack);
+unsigned    xpci_stackNbFrames(XPCI_STACK *stack);
+int         xpci_stackReadFrame(XPCI_STACK *stack, unsigned frame, void *data, uint64_t *timestampNs);
+
+/* the writer writes its index and trailer */
+int         xpci_stackClose(XPCI_STACK *stack);
+#ifdef __cplusplus
+}
+#endif
+#endif
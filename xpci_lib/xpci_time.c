@@ -8,7 +8,9 @@ ATTENTION: Be carefull if used in libs and programs that
 TIPS:      Use index<5 in libs
                index>=5 in progs
 *******************************************************/
+#define _POSIX_C_SOURCE 199309L
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 #include "xpci_time.h"
 
@@ -31,6 +33,13 @@ void xpci_timerStop(int id){
   printf("Elapse from Timer id=%d stop: %d milliseconds\n", id, msec);
 }
 
+/* Monotonic time stamp in nanoseconds to accumulate durations in counters */
+unsigned long long xpci_timeNs(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 #ifdef TEST
 int main(){
   xpci_timerStart(0);
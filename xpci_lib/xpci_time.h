@@ -11,6 +11,7 @@
 #endif
 void xpci_timerStart(int id);
 void xpci_timerStop(int id);
+unsigned long long xpci_timeNs(void);
 #ifdef __cplusplus
 }
 #endif